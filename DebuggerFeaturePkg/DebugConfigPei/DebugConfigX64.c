@@ -15,6 +15,10 @@
 #include <Library/DeviceStateLib.h>
 #include <DebuggerControlHob.h>
 
+// The length of the TSC frequency calibration. The debug agent will prefer the
+// CPUID enumerated frequency when available.
+#define CALIBRATION_TIME_MS  10
+
 /**
   Collects architecture specific debug configuration information
 
@@ -30,8 +34,8 @@ ArchDebugConfig (
   UINT64  StartTick;
 
   // Calculate the performance counter frequency. This cannot be done early DXE/MM.
-  // This does not need to be perfect.
+  // Measure over several milliseconds to reduce the error from the delay overhead.
   StartTick = AsmReadTsc ();
-  MicroSecondDelay (1000);
-  ConfigHob->PerformanceCounterFreq = AsmReadTsc () - StartTick;
+  MicroSecondDelay (CALIBRATION_TIME_MS * 1000);
+  ConfigHob->PerformanceCounterFreq = DivU64x32 (AsmReadTsc () - StartTick, CALIBRATION_TIME_MS);
 }
@@ -0,0 +1,29 @@
+/**
+
+ Definitions for the debug host detection library. Used by a debug agent to
+ check for an attached debugger without waiting for it to respond. Platforms
+ whose transport cannot detect a host use DebugHostDetectLibNull.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef DEBUG_HOST_DETECT_LIB_H_
+#define DEBUG_HOST_DETECT_LIB_H_
+
+/**
+  Checks the debug transport for signs that a debugger host is attached, such
+  as the modem status lines of a serial port.
+
+  @retval   EFI_SUCCESS       A host appears to be attached.
+  @retval   EFI_NOT_FOUND     No host is attached.
+  @retval   EFI_UNSUPPORTED   The transport cannot detect an attached host.
+**/
+EFI_STATUS
+EFIAPI
+DebugHostDetect (
+  VOID
+  );
+
+#endif
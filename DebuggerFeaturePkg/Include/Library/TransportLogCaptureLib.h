@@ -0,0 +1,47 @@
+/**@file TransportLogCaptureLib.h
+
+  This module contains code to capture log output while logging on the debug
+  transport is suspended, so the debugger can forward it to the host. This is
+  optional, platforms that do not capture the output use TransportLogCaptureLibNull.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef TRANSPORT_LOG_CAPTURE_LIB_H_
+#define TRANSPORT_LOG_CAPTURE_LIB_H_
+
+/**
+  Called by the platform log writer before writing log output to the debug
+  transport. While logging is suspended, the output is captured to be forwarded
+  later instead of being written.
+
+  @param[in]  Buffer          The log output.
+  @param[in]  NumberOfBytes   The number of bytes of log output.
+
+  @retval   TRUE    The output was captured and must not be written.
+  @retval   FALSE   Logging is not suspended, the output should be written.
+**/
+BOOLEAN
+TransportLogCapture (
+  IN CONST UINT8  *Buffer,
+  IN UINTN        NumberOfBytes
+  );
+
+/**
+  Reads the log output captured while logging was suspended. Used by the
+  debugger to forward the output to the host.
+
+  @param[out] Buffer      The buffer to read the output to.
+  @param[in]  BufferSize  The size of the buffer.
+
+  @retval   The number of bytes read, 0 if no output is pending.
+**/
+UINTN
+TransportLogRead (
+  OUT UINT8  *Buffer,
+  IN  UINTN  BufferSize
+  );
+
+#endif
@@ -30,6 +30,12 @@
 
 #define DAIF_DEBUG  0x200
 
+// Write not Read bit of the ESR syndrome, zero for instruction aborts.
+#define ESR_WNR  BIT6
+
+// Aff3 and Aff2 to Aff0 of the MPIDR.
+#define MPIDR_AFFINITY_MASK  0xFF00FFFFFFULL
+
 typedef union _DBG_WCR {
   struct {
     UINTN    Enabled : 1;
@@ -60,6 +66,12 @@ UINT32  mArchExceptionTypes[] = {
   MAX_UINT32 // End of list
 };
 
+// Watchpoint exceptions are taken before the access.
+BOOLEAN  mArchWatchpointBeforeAccess = TRUE;
+
+// Hardware management of the access flag and dirty state is not enabled.
+UINT64  mArchPageEntryHardwareBits = 0;
+
 // Structure to more simply access the debug registers.
 typedef
 UINT64
@@ -91,6 +103,10 @@ DEBUG_WATCHPOINT_REGISTERS  DebugWatchpointRegisters[] = {
 // to avoid adding too much assembly wrapper code.
 #define MAX_WATCHPOINTS  (sizeof(DebugWatchpointRegisters) / sizeof(DebugWatchpointRegisters[0]))
 
+// Watchpoints sharing each watchpoint register, such as a watchpoint and a
+// counting watchpoint on the same slot.
+STATIC UINT8  mWatchRegisterRefs[MAX_WATCHPOINTS];
+
 /**
   This routine handles synchronous exceptions.
 
@@ -145,6 +161,8 @@ DebuggerExceptionHandler (
     case 0x25: // Current EL data abort
       ExceptionInfo.ExceptionType    = ExceptionAccessViolation;
       ExceptionInfo.ExceptionAddress = Context->ELR;
+      ExceptionInfo.FaultAddress     = Context->FAR;
+      ExceptionInfo.FaultIsWrite     = (Context->ESR & ESR_WNR) != 0;
       break;
 
     case 0x22: // PC alignment
@@ -154,10 +172,17 @@ DebuggerExceptionHandler (
       ExceptionInfo.ExceptionAddress = Context->ELR;
       break;
 
-    case 0x30: // Lower EL hardware breakpoint
-    case 0x31: // Current EL hardware breakpoint
     case 0x34: // Lower EL Watchpoint break
     case 0x35: // Current EL Watchpoint break
+
+      ExceptionInfo.ExceptionType    = ExceptionWatchpoint;
+      ExceptionInfo.ExceptionAddress = Context->ELR;
+      ExceptionInfo.FaultAddress     = Context->FAR;
+      ExceptionInfo.FaultIsWrite     = (Context->ESR & ESR_WNR) != 0;
+      break;
+
+    case 0x30: // Lower EL hardware breakpoint
+    case 0x31: // Current EL hardware breakpoint
     case 0x3c: // BRK Instruction
 
       ExceptionInfo.ExceptionType    = ExceptionBreakpoint;
@@ -233,26 +258,83 @@ AddSingleStep (
 }
 
 /**
-  Gets the performance counter in milliseconds.
+  Reads the performance counter.
 
-  @retval   Current performance count converted to milliseconds.
+  @retval   The current performance counter value.
 **/
 UINT64
-DebugGetTimeMs (
+DebugArchReadTicks (
   VOID
   )
 {
-  UINT64  Freq;
+  return GetPerformanceCounter ();
+}
 
+/**
+  Gets the frequency of the performance counter.
+
+  @retval   The performance counter frequency in hertz.
+**/
+UINT64
+DebugArchGetTickFrequency (
+  VOID
+  )
+{
   //
   // ARM64 has discoverable timer frequency, so the timer lib should be immediately,
   // available. Direct access to the CNT registers can be added if needed.
   //
 
-  Freq = GetPerformanceCounterProperties (NULL, NULL);
-  ASSERT (Freq >= 1000);
-  Freq /= 1000;
-  return GetPerformanceCounter () / Freq;
+  return GetPerformanceCounterProperties (NULL, NULL);
+}
+
+/**
+  Finds the context interrupted by the timer that is dispatching the current
+  event notification. The exception vectors save the context in a layout that
+  cannot be reliably located from the stack, so this is not supported.
+
+  @param[out]  Pc             Not used.
+  @param[out]  FramePointer   Not used.
+
+  @retval   FALSE always.
+**/
+BOOLEAN
+DebugArchGetInterruptedFrame (
+  OUT UINTN  *Pc,
+  OUT UINTN  *FramePointer
+  )
+{
+  // NOT SUPPORTED.
+  return FALSE;
+}
+
+/**
+  Gets the ID of the current processor, the affinity fields of the MPIDR. This
+  matches the processor ID reported by the MP services.
+
+  @retval   The MPIDR affinity of the current processor.
+**/
+UINT64
+DebugArchGetProcessorId (
+  VOID
+  )
+{
+  return DebugReadMpidr () & MPIDR_AFFINITY_MASK;
+}
+
+/**
+  Halts the other processors. Sending an SGI requires knowledge of the
+  interrupt controller, so this is not supported.
+
+  @retval   FALSE always.
+**/
+BOOLEAN
+DebugArchHaltProcessors (
+  VOID
+  )
+{
+  // NOT SUPPORTED.
+  return FALSE;
 }
 
 /**
@@ -428,6 +510,55 @@ CheckPageAccess (
   }
 }
 
+/**
+  Finds the level 3 page descriptor that maps an address. The descriptor is
+  returned even if it is not valid, as long as the tables leading to it are.
+
+  @param[in]  Address     The virtual address.
+
+  @retval     The page descriptor, or NULL if the address is not mapped by a
+              4K page.
+**/
+UINT64 *
+DebugArchGetPageEntry (
+  IN UINTN  Address
+  )
+{
+  UINT64  *TranslationTable;
+  UINT64  Entry;
+  INTN    TableLevel;
+  UINTN   T0SZ;
+
+  TranslationTable = (UINT64 *)DebugGetTTBR0BaseAddress ();
+  T0SZ             = DebugGetTCR () & TCR_T0SZ_MASK;
+  TableLevel       = (T0SZ < MIN_T0SZ) ? -1 : (INTN)(T0SZ - MIN_T0SZ) / BITS_PER_LEVEL;
+
+  for ( ; TableLevel < 3; TableLevel++) {
+    Entry = *(UINT64 *)TT_GET_ENTRY_FOR_ADDRESS (TranslationTable, TableLevel, Address);
+    if ((Entry & TT_TYPE_MASK) != TT_TYPE_TABLE_ENTRY) {
+      return NULL;
+    }
+
+    TranslationTable = (UINT64 *)(UINTN)(Entry & TT_ADDRESS_MASK_DESCRIPTION_TABLE);
+  }
+
+  return (UINT64 *)TT_GET_ENTRY_FOR_ADDRESS (TranslationTable, 3, Address);
+}
+
+/**
+  Invalidates the translation of a page cached by the current processor.
+
+  @param[in]  Address     The virtual address in the page.
+
+**/
+VOID
+DebugArchFlushPage (
+  IN UINTN  Address
+  )
+{
+  DebugInvalidateTlbEntry (Address);
+}
+
 /**
   Checks if a given virtual address is readable.
 
@@ -461,7 +592,68 @@ IsPageWritable (
 }
 
 /**
-  Adds a AARCH64 hardware watch point.
+  Builds the watchpoint control register value for a slot. Slots larger than
+  8 bytes use the address mask, smaller ones the byte address select.
+
+  @param[in]  Slot    The slot to watch.
+  @param[in]  Lsc     The load/store control.
+
+  @retval   The control register value.
+**/
+STATIC
+UINTN
+SlotToWatchControl (
+  IN CONST WATCH_SLOT  *Slot,
+  IN UINTN             Lsc
+  )
+{
+  DBG_WCR  DbgWcr;
+
+  DbgWcr.UintN        = 0;
+  DbgWcr.Bits.Enabled = 1;
+  DbgWcr.Bits.Lsc     = Lsc;
+  DbgWcr.Bits.Bas     = Slot->ByteMask;
+  DbgWcr.Bits.Mask    = (Slot->Size > 8) ? (UINTN)HighBitSet64 (Slot->Size) : 0;
+
+  // These are required to trap at all level in the normal world. Refer to
+  // table D2-13 in the ARM A profile reference manual.
+  DbgWcr.Bits.Hmc = 1;
+  DbgWcr.Bits.Ssc = 0b01;
+  DbgWcr.Bits.Pac = 0b11;
+  return DbgWcr.UintN;
+}
+
+/**
+  Finds the watchpoint register programmed for a slot.
+
+  @param[in]  Address   The address of the slot.
+  @param[in]  Control   The control register value of the slot.
+
+  @retval   The index of the register, or MAX_WATCHPOINTS if not found.
+**/
+STATIC
+UINTN
+FindWatchRegister (
+  IN UINTN  Address,
+  IN UINTN  Control
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < MAX_WATCHPOINTS; Index++) {
+    if ((DebugWatchpointRegisters[Index].ReadControl () == Control) &&
+        (DebugWatchpointRegisters[Index].ReadValue () == Address))
+    {
+      return Index;
+    }
+  }
+
+  return MAX_WATCHPOINTS;
+}
+
+/**
+  Adds a AARCH64 hardware watch point. Ranges that do not fit a single register
+  are split across several.
 
   @param[in]  Address   The address of the data watch point.
   @param[in]  Length    The length of the data watch point.
@@ -479,53 +671,70 @@ AddWatchpoint (
   IN BOOLEAN  Write
   )
 {
-  UINTN    Index;
-  UINTN    Bas;
-  UINTN    Lsc;
-  DBG_WCR  DbgWcr;
-
-  if (Length == 0) {
+  WATCH_SLOT  Slots[MAX_WATCHPOINTS];
+  UINTN       Controls[MAX_WATCHPOINTS];
+  UINTN       Count;
+  UINTN       Slot;
+  UINTN       Index;
+  UINTN       Needed;
+  UINTN       Free;
+  UINTN       Lsc;
+  DBG_WCR     DbgWcr;
+
+  // The address mask covers aligned blocks of up to 2GB.
+  Count = DbgPlanWatchpoint (Address, Length, SIZE_2GB, TRUE, Slots, MAX_WATCHPOINTS);
+  if (Count == 0) {
     return FALSE;
   }
 
-  // Byte Address Select is a bitmap where each bit in Address + N up to +7.
-  // shift away full 8 by (8 - count) to get this.
-  Bas = RShiftU64 (0xFF, (8 - MIN (Length, 8)));
   Lsc = (Read ? BIT0 : 0) | (Write ? BIT1 : 0);
 
-  // Check for duplicates.
-  for (Index = 0; Index < MAX_WATCHPOINTS; Index++) {
-    DbgWcr.UintN = DebugWatchpointRegisters[Index].ReadControl ();
-    if (DbgWcr.Bits.Enabled && (DbgWcr.Bits.Bas == Bas) && (DbgWcr.Bits.Lsc == Lsc) && (DebugWatchpointRegisters[Index].ReadValue () == Address)) {
-      return TRUE;
+  // Skip the slots that are already set and make sure the rest fit before
+  // programming any of them.
+  Needed = 0;
+  for (Slot = 0; Slot < Count; Slot++) {
+    Controls[Slot] = SlotToWatchControl (&Slots[Slot], Lsc);
+    if (FindWatchRegister (Slots[Slot].Address, Controls[Slot]) == MAX_WATCHPOINTS) {
+      Needed++;
     }
   }
 
-  // Find an empty spot and fill it.
+  Free = 0;
   for (Index = 0; Index < MAX_WATCHPOINTS; Index++) {
     DbgWcr.UintN = DebugWatchpointRegisters[Index].ReadControl ();
     if (!DbgWcr.Bits.Enabled) {
-      DbgWcr.UintN        = 0;
-      DbgWcr.Bits.Enabled = 1;
-      DbgWcr.Bits.Lsc     = Lsc;
-      DbgWcr.Bits.Bas     = Bas;
-
-      // These are required to trap at all level in the normal world. Refer to
-      // table D2-13 in the ARM A profile reference manual.
-      DbgWcr.Bits.Hmc = 1;
-      DbgWcr.Bits.Ssc = 0b01;
-      DbgWcr.Bits.Pac = 0b11;
-      DebugWatchpointRegisters[Index].WriteValue (Address);
-      DebugWatchpointRegisters[Index].WriteControl (DbgWcr.UintN);
-      return TRUE;
+      Free++;
     }
   }
 
-  return FALSE;
+  if (Needed > Free) {
+    return FALSE;
+  }
+
+  for (Slot = 0; Slot < Count; Slot++) {
+    Index = FindWatchRegister (Slots[Slot].Address, Controls[Slot]);
+    if (Index != MAX_WATCHPOINTS) {
+      mWatchRegisterRefs[Index]++;
+      continue;
+    }
+
+    for (Index = 0; Index < MAX_WATCHPOINTS; Index++) {
+      DbgWcr.UintN = DebugWatchpointRegisters[Index].ReadControl ();
+      if (!DbgWcr.Bits.Enabled) {
+        mWatchRegisterRefs[Index] = 1;
+        DebugWatchpointRegisters[Index].WriteValue (Slots[Slot].Address);
+        DebugWatchpointRegisters[Index].WriteControl (Controls[Slot]);
+        break;
+      }
+    }
+  }
+
+  return TRUE;
 }
 
 /**
-  Removes a AARCH64 hardware watch point.
+  Removes a AARCH64 hardware watch point. Registers shared with another
+  watchpoint stay enabled.
 
   @param[in]  Address   The address of the data watch point.
   @param[in]  Length    The length of the data watch point.
@@ -543,25 +752,68 @@ RemoveWatchpoint (
   IN BOOLEAN  Write
   )
 {
-  UINTN    Index;
-  UINTN    Bas;
-  UINTN    Lsc;
-  DBG_WCR  DbgWcr;
-
-  if (Length == 0) {
+  WATCH_SLOT  Slots[MAX_WATCHPOINTS];
+  UINTN       Indices[MAX_WATCHPOINTS];
+  UINTN       Count;
+  UINTN       Slot;
+  UINTN       Lsc;
+
+  Count = DbgPlanWatchpoint (Address, Length, SIZE_2GB, TRUE, Slots, MAX_WATCHPOINTS);
+  if (Count == 0) {
     return FALSE;
   }
 
-  // Byte Address Select is a bitmap where each bit in Address + N up to +7.
-  // shift away full 8 by (8 - count) to get this.
-  Bas = RShiftU64 (0xFF, (8 - MIN (Length, 8)));
   Lsc = (Read ? BIT0 : 0) | (Write ? BIT1 : 0);
+  for (Slot = 0; Slot < Count; Slot++) {
+    Indices[Slot] = FindWatchRegister (Slots[Slot].Address, SlotToWatchControl (&Slots[Slot], Lsc));
+    if (Indices[Slot] == MAX_WATCHPOINTS) {
+      return FALSE;
+    }
+  }
 
-  // Check for duplicates.
-  for (Index = 0; Index < MAX_WATCHPOINTS; Index++) {
-    DbgWcr.UintN = DebugWatchpointRegisters[Index].ReadControl ();
-    if (DbgWcr.Bits.Enabled && (DbgWcr.Bits.Bas == Bas) && (DbgWcr.Bits.Lsc == Lsc) && (DebugWatchpointRegisters[Index].ReadValue () == Address)) {
-      DebugWatchpointRegisters[Index].WriteControl (0);
+  for (Slot = 0; Slot < Count; Slot++) {
+    if (mWatchRegisterRefs[Indices[Slot]] > 0) {
+      mWatchRegisterRefs[Indices[Slot]]--;
+    }
+
+    if (mWatchRegisterRefs[Indices[Slot]] == 0) {
+      DebugWatchpointRegisters[Indices[Slot]].WriteControl (0);
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+  Checks if a AARCH64 hardware watch point shares a register with another.
+
+  @param[in]  Address   The address of the data watch point.
+  @param[in]  Length    The length of the data watch point.
+  @param[in]  Read      Boolean indicated break on read.
+  @param[in]  Write     Boolean indicated break on write.
+
+  @retval  TRUE   A register of the watch point is also used by another.
+  @retval  FALSE  The watch point is not shared or does not exist.
+**/
+BOOLEAN
+IsWatchpointShared (
+  IN UINTN    Address,
+  IN UINTN    Length,
+  IN BOOLEAN  Read,
+  IN BOOLEAN  Write
+  )
+{
+  WATCH_SLOT  Slots[MAX_WATCHPOINTS];
+  UINTN       Count;
+  UINTN       Slot;
+  UINTN       Index;
+  UINTN       Lsc;
+
+  Count = DbgPlanWatchpoint (Address, Length, SIZE_2GB, TRUE, Slots, MAX_WATCHPOINTS);
+  Lsc   = (Read ? BIT0 : 0) | (Write ? BIT1 : 0);
+  for (Slot = 0; Slot < Count; Slot++) {
+    Index = FindWatchRegister (Slots[Slot].Address, SlotToWatchControl (&Slots[Slot], Lsc));
+    if ((Index != MAX_WATCHPOINTS) && (mWatchRegisterRefs[Index] > 1)) {
       return TRUE;
     }
   }
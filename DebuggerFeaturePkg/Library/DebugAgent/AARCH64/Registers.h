@@ -29,6 +29,21 @@ DebugWriteDaif (
   IN UINT64  Value
   );
 
+UINT64
+DebugReadFpcr (
+  VOID
+  );
+
+VOID
+DebugWriteFpcr (
+  IN UINT64  Value
+  );
+
+UINT64
+DebugReadMpidr (
+  VOID
+  );
+
 UINT64
 DebugReadOslsrEl1 (
   VOID
@@ -49,6 +64,11 @@ DebugGetTTBR0BaseAddress (
   VOID
   );
 
+VOID
+DebugInvalidateTlbEntry (
+  IN UINTN  Address
+  );
+
 UINT64
 DebugReadDbgWvr0El1 (
   VOID
@@ -0,0 +1,62 @@
+/** @file
+  Unwinds AArch64 stacks in the debugger so a full backtrace can be returned to
+  the debugger in one response. The X29 frame record chain is followed, so
+  frames of code built without frame pointers are skipped.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+#include <Protocol/DebugSupport.h>
+
+#include "DebugAgent.h"
+
+/**
+  Unwinds the stack of an AArch64 context. The SP of each caller frame is the
+  address just above the frame record, as the rest of the frame is unknown.
+
+  @param[in]   SystemContext  The context to unwind from.
+  @param[out]  Frames         The frames, starting with the context itself.
+  @param[in]   MaxFrames      The maximum number of frames to return.
+
+  @retval   The number of frames returned.
+**/
+UINTN
+DebugArchUnwindStack (
+  IN  EFI_SYSTEM_CONTEXT  SystemContext,
+  OUT STACK_FRAME         *Frames,
+  IN  UINTN               MaxFrames
+  )
+{
+  EFI_SYSTEM_CONTEXT_AARCH64  *AArch64;
+  UINT64                      Record[2];
+  UINT64                      FramePointer;
+  UINT64                      Sp;
+  UINT64                      Pc;
+  UINTN                       Count;
+
+  AArch64      = SystemContext.SystemContextAArch64;
+  Pc           = AArch64->ELR;
+  Sp           = AArch64->SP;
+  FramePointer = AArch64->FP;
+  for (Count = 0; (Count < MaxFrames) && (Pc != 0); Count++) {
+    Frames[Count].Pc = Pc;
+    Frames[Count].Sp = Sp;
+
+    // Each frame record holds the caller's X29 followed by the return address.
+    if ((FramePointer < Sp) || ((FramePointer & (sizeof (UINT64) - 1)) != 0) ||
+        !DbgReadMemory ((UINTN)FramePointer, Record, sizeof (Record)))
+    {
+      Count++;
+      break;
+    }
+
+    Pc           = Record[1];
+    Sp           = FramePointer + sizeof (Record);
+    FramePointer = Record[0];
+  }
+
+  return Count;
+}
@@ -0,0 +1,202 @@
+/**@file CoreDump.c
+
+  Collects the memory written to a core dump. The system memory described by
+  the resource descriptor HOBs is split into segments, each a run of pages with
+  data followed by a run of zero pages that are left out of the file.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+#include <Pi/PiMultiPhase.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/HobLib.h>
+
+#include "DebugAgent.h"
+
+STATIC CORE_SEGMENT  mCoreSegments[MAX_CORE_SEGMENTS];
+STATIC UINTN         mCoreSegmentCount = 0;
+
+// Page being checked for data.
+STATIC UINT64  mCorePage[EFI_PAGE_SIZE / sizeof (UINT64)];
+
+/**
+  Gets the number of bytes merging two segments adds to the file.
+
+  @param[in]  Segment   The segment to merge into.
+  @param[in]  Next      The segment following it in the table.
+
+  @retval   The bytes added to the file, or MAX_UINT64 if the segments can not
+            be merged.
+**/
+STATIC
+UINT64
+GetMergeCost (
+  IN CONST CORE_SEGMENT  *Segment,
+  IN CONST CORE_SEGMENT  *Next
+  )
+{
+  if (Next->Address < Segment->Address + Segment->Size) {
+    return MAX_UINT64;
+  }
+
+  // Zero pages directly after the segment only extend its zero run.
+  if ((Next->FileSize == 0) && (Next->Address == Segment->Address + Segment->Size)) {
+    return 0;
+  }
+
+  return Next->Address - (Segment->Address + Segment->FileSize);
+}
+
+/**
+  Frees a table entry by merging the pair of segments that adds the least to
+  the file.
+
+  @retval   TRUE    An entry was freed.
+  @retval   FALSE   No segments could be merged.
+**/
+STATIC
+BOOLEAN
+MergeCoreSegments (
+  VOID
+  )
+{
+  CORE_SEGMENT  *Segment;
+  CORE_SEGMENT  *Next;
+  UINTN         Index;
+  UINTN         Best;
+  UINT64        Cost;
+  UINT64        BestCost;
+
+  Best     = 0;
+  BestCost = MAX_UINT64;
+  for (Index = 0; Index + 1 < mCoreSegmentCount; Index++) {
+    Cost = GetMergeCost (&mCoreSegments[Index], &mCoreSegments[Index + 1]);
+    if (Cost < BestCost) {
+      Best     = Index;
+      BestCost = Cost;
+    }
+  }
+
+  if (BestCost == MAX_UINT64) {
+    return FALSE;
+  }
+
+  Segment = &mCoreSegments[Best];
+  Next    = &mCoreSegments[Best + 1];
+  if ((Next->FileSize != 0) || (Next->Address != Segment->Address + Segment->Size)) {
+    Segment->FileSize = Next->Address + Next->FileSize - Segment->Address;
+  }
+
+  Segment->Size = Next->Address + Next->Size - Segment->Address;
+  CopyMem (Next, Next + 1, (mCoreSegmentCount - Best - 2) * sizeof (CORE_SEGMENT));
+  mCoreSegmentCount--;
+  return TRUE;
+}
+
+/**
+  Adds a readable page to the segments.
+
+  @param[in]  Address   The address of the page.
+  @param[in]  Zero      The page only contains zeros.
+
+**/
+STATIC
+VOID
+AddCorePage (
+  IN UINT64   Address,
+  IN BOOLEAN  Zero
+  )
+{
+  CORE_SEGMENT  *Last;
+
+  while (TRUE) {
+    // Extend the last segment, data can only be added before its zero run.
+    if (mCoreSegmentCount > 0) {
+      Last = &mCoreSegments[mCoreSegmentCount - 1];
+      if ((Last->Address + Last->Size == Address) && (Zero || (Last->FileSize == Last->Size))) {
+        Last->Size += EFI_PAGE_SIZE;
+        if (!Zero) {
+          Last->FileSize += EFI_PAGE_SIZE;
+        }
+
+        return;
+      }
+    }
+
+    if (mCoreSegmentCount < MAX_CORE_SEGMENTS) {
+      break;
+    }
+
+    if (!MergeCoreSegments ()) {
+      return;
+    }
+  }
+
+  mCoreSegments[mCoreSegmentCount].Address  = Address;
+  mCoreSegments[mCoreSegmentCount].Size     = EFI_PAGE_SIZE;
+  mCoreSegments[mCoreSegmentCount].FileSize = Zero ? 0 : EFI_PAGE_SIZE;
+  mCoreSegmentCount++;
+}
+
+/**
+  Builds the segments of a core dump from the system memory in the resource
+  descriptor HOBs. Pages that can not be read are left out, and the segments
+  are merged as needed to fit in the table.
+
+  @retval   The number of segments.
+**/
+UINTN
+DbgBuildCoreSegments (
+  VOID
+  )
+{
+  EFI_PEI_HOB_POINTERS  Hob;
+  UINT64                Address;
+  UINT64                End;
+
+  mCoreSegmentCount = 0;
+  for (Hob.Raw = GetFirstHob (EFI_HOB_TYPE_RESOURCE_DESCRIPTOR);
+       Hob.Raw != NULL;
+       Hob.Raw = GetNextHob (EFI_HOB_TYPE_RESOURCE_DESCRIPTOR, GET_NEXT_HOB (Hob)))
+  {
+    if (Hob.ResourceDescriptor->ResourceType != EFI_RESOURCE_SYSTEM_MEMORY) {
+      continue;
+    }
+
+    Address = ALIGN_VALUE (Hob.ResourceDescriptor->PhysicalStart, EFI_PAGE_SIZE);
+    End     = (Hob.ResourceDescriptor->PhysicalStart + Hob.ResourceDescriptor->ResourceLength) & ~(UINT64)EFI_PAGE_MASK;
+    for ( ; Address < End; Address += EFI_PAGE_SIZE) {
+      if (!DbgReadMemory ((UINTN)Address, &mCorePage[0], EFI_PAGE_SIZE)) {
+        continue;
+      }
+
+      AddCorePage (Address, IsZeroBuffer (&mCorePage[0], EFI_PAGE_SIZE));
+    }
+  }
+
+  return mCoreSegmentCount;
+}
+
+/**
+  Gets a segment of the core dump.
+
+  @param[in]  Index   The index of the segment.
+
+  @retval   The segment, or NULL if the index is past the last segment.
+**/
+CONST CORE_SEGMENT *
+DbgGetCoreSegment (
+  IN UINTN  Index
+  )
+{
+  if (Index >= mCoreSegmentCount) {
+    return NULL;
+  }
+
+  return &mCoreSegments[Index];
+}
@@ -0,0 +1,267 @@
+/**@file CrashDump.c
+
+  Saves a compact record of a fault taken while no debugger is connected to a
+  buffer reserved by the platform. When the buffer survives a reset, the record
+  is reported by the next boot and can be read by the next debugger to connect.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/CacheMaintenanceLib.h>
+#include <Library/DebugLib.h>
+
+#include "DebugAgent.h"
+
+STATIC CRASH_DUMP_HEADER  *mCrashDump    = NULL;
+STATIC UINTN              mCrashDumpSize = 0;
+
+/**
+  Reserves space at the end of the crash dump.
+
+  @param[in]  Size  The number of bytes to reserve.
+
+  @retval   The reserved space, or NULL if the buffer is full.
+**/
+STATIC
+VOID *
+CrashDumpAllocate (
+  IN UINTN  Size
+  )
+{
+  VOID  *Space;
+
+  if (mCrashDump->Size + Size > mCrashDumpSize) {
+    mCrashDump->Truncated = TRUE;
+    return NULL;
+  }
+
+  Space             = (UINT8 *)mCrashDump + mCrashDump->Size;
+  mCrashDump->Size += (UINT32)Size;
+  return Space;
+}
+
+/**
+  Sets up the crash dump buffer and reports a crash saved by a previous boot.
+
+  @param[in]  Buffer  The buffer reserved by the platform, NULL to disable.
+  @param[in]  Size    The size of the buffer.
+
+**/
+VOID
+DbgCrashDumpInit (
+  IN VOID   *Buffer,
+  IN UINTN  Size
+  )
+{
+  if ((Buffer == NULL) || (Size < sizeof (CRASH_DUMP_HEADER)) || (Size > MAX_UINT32)) {
+    return;
+  }
+
+  mCrashDump     = Buffer;
+  mCrashDumpSize = Size;
+  if ((DbgGetCrashDump () != NULL) && !mCrashDump->Reported) {
+    DEBUG ((
+      DEBUG_ERROR,
+      "%a: Crash saved by a previous boot. Exception %d at 0x%llx, fault address 0x%llx.\n",
+      __func__,
+      mCrashDump->ExceptionType,
+      mCrashDump->ExceptionAddress,
+      mCrashDump->FaultAddress
+      ));
+  }
+}
+
+/**
+  Starts a new crash dump, replacing any previous one.
+
+  @param[in]  ExceptionInfo   The fault being saved.
+  @param[in]  Machine         The ELF machine type of the registers.
+  @param[in]  RegisterCount   The number of registers saved for each processor.
+
+  @retval   TRUE    The crash dump was started.
+  @retval   FALSE   Crash capture is not enabled.
+**/
+BOOLEAN
+DbgCrashDumpBegin (
+  IN CONST EXCEPTION_INFO  *ExceptionInfo,
+  IN UINT16                Machine,
+  IN UINT32                RegisterCount
+  )
+{
+  if ((mCrashDump == NULL) || (RegisterCount > CRASH_MAX_REGISTERS)) {
+    return FALSE;
+  }
+
+  // The signature is only written once the dump is complete.
+  ZeroMem (mCrashDump, sizeof (CRASH_DUMP_HEADER));
+  mCrashDump->Version           = CRASH_DUMP_VERSION;
+  mCrashDump->Size              = sizeof (CRASH_DUMP_HEADER);
+  mCrashDump->Machine           = Machine;
+  mCrashDump->TimeUs            = DebugGetTimeUs ();
+  mCrashDump->ExceptionType     = ExceptionInfo->ExceptionType;
+  mCrashDump->RegisterCount     = RegisterCount;
+  mCrashDump->ArchExceptionCode = ExceptionInfo->ArchExceptionCode;
+  mCrashDump->ExceptionAddress  = ExceptionInfo->ExceptionAddress;
+  mCrashDump->FaultAddress      = ExceptionInfo->FaultAddress;
+  mCrashDump->FaultIsWrite      = ExceptionInfo->FaultIsWrite;
+  mCrashDump->StackSize         = CRASH_STACK_SIZE;
+  return TRUE;
+}
+
+/**
+  Adds a processor to the crash dump with its registers, backtrace and the top
+  of its stack. All processors must be added before DbgCrashDumpEnd.
+
+  @param[in]  ThreadId        The GDB thread ID of the processor.
+  @param[in]  SystemContext   The context of the processor.
+  @param[in]  Registers       The registers of the processor.
+
+**/
+VOID
+DbgCrashDumpAddProcessor (
+  IN UINT32              ThreadId,
+  IN EFI_SYSTEM_CONTEXT  SystemContext,
+  IN CONST UINT64        *Registers
+  )
+{
+  CRASH_PROCESSOR  *Processor;
+  UINTN            Length;
+  UINTN            Chunk;
+
+  Processor = CrashDumpAllocate (sizeof (CRASH_PROCESSOR) + mCrashDump->RegisterCount * sizeof (UINT64));
+  if (Processor == NULL) {
+    return;
+  }
+
+  ZeroMem (Processor, sizeof (CRASH_PROCESSOR));
+  Processor->ThreadId   = ThreadId;
+  Processor->FrameCount = (UINT32)DebugArchUnwindStack (SystemContext, &Processor->Frames[0], CRASH_FRAME_COUNT);
+  if (Processor->FrameCount != 0) {
+    Processor->StackPointer = Processor->Frames[0].Sp;
+
+    // Read a page at a time and stop at the first page that can not be read.
+    Length = 0;
+    while (Length < CRASH_STACK_SIZE) {
+      Chunk = MIN (CRASH_STACK_SIZE - Length, EFI_PAGE_SIZE - ((Processor->StackPointer + Length) & EFI_PAGE_MASK));
+      if (!DbgReadMemory ((UINTN)Processor->StackPointer + Length, &Processor->Stack[Length], Chunk)) {
+        break;
+      }
+
+      Length += Chunk;
+    }
+
+    Processor->StackLength = (UINT32)Length;
+  }
+
+  CopyMem (Processor + 1, Registers, mCrashDump->RegisterCount * sizeof (UINT64));
+  mCrashDump->ProcessorCount++;
+}
+
+/**
+  Adds the loaded images to the crash dump and marks it complete.
+
+**/
+VOID
+DbgCrashDumpEnd (
+  VOID
+  )
+{
+  CONST LOADED_IMAGE_ENTRY  *Image;
+  CRASH_IMAGE               *Entry;
+  CHAR8                     Name[256];
+  CONST CHAR8               *FileName;
+  UINTN                     Index;
+  UINTN                     NameIndex;
+
+  for (Index = 0; (Image = DbgGetLoadedImage (Index)) != NULL; Index++) {
+    Entry = CrashDumpAllocate (sizeof (CRASH_IMAGE));
+    if (Entry == NULL) {
+      break;
+    }
+
+    ZeroMem (Entry, sizeof (CRASH_IMAGE));
+    Entry->ImageBase = Image->ImageBase;
+    Entry->ImageSize = Image->ImageSize;
+    if ((Image->PdbAddress != 0) && DbgReadString (Image->PdbAddress, &Name[0], sizeof (Name))) {
+      // Only keep the file name, the build path rarely fits.
+      FileName = &Name[0];
+      for (NameIndex = 0; Name[NameIndex] != 0; NameIndex++) {
+        if ((Name[NameIndex] == '/') || (Name[NameIndex] == '\\')) {
+          FileName = &Name[NameIndex + 1];
+        }
+      }
+
+      AsciiStrnCpyS (Entry->Name, CRASH_IMAGE_NAME_SIZE, FileName, CRASH_IMAGE_NAME_SIZE - 1);
+    }
+
+    mCrashDump->ImageCount++;
+  }
+
+  mCrashDump->Signature = CRASH_DUMP_SIGNATURE;
+  WriteBackDataCacheRange (mCrashDump, mCrashDump->Size);
+}
+
+/**
+  Gets the crash dump in the buffer. The buffer may hold anything after a
+  reset, so the counts are checked against the size used.
+
+  @retval   The crash dump, or NULL if there is no complete crash dump.
+**/
+CONST CRASH_DUMP_HEADER *
+DbgGetCrashDump (
+  VOID
+  )
+{
+  UINT64  Size;
+
+  if ((mCrashDump == NULL) ||
+      (mCrashDump->Signature != CRASH_DUMP_SIGNATURE) ||
+      (mCrashDump->Version != CRASH_DUMP_VERSION) ||
+      (mCrashDump->Size < sizeof (CRASH_DUMP_HEADER)) ||
+      (mCrashDump->Size > mCrashDumpSize) ||
+      (mCrashDump->StackSize != CRASH_STACK_SIZE) ||
+      (mCrashDump->RegisterCount > CRASH_MAX_REGISTERS))
+  {
+    return NULL;
+  }
+
+  // The counts are 32-bit and the records small, so this can not overflow.
+  Size = sizeof (CRASH_DUMP_HEADER) +
+         MultU64x32 (sizeof (CRASH_PROCESSOR) + mCrashDump->RegisterCount * sizeof (UINT64), mCrashDump->ProcessorCount) +
+         MultU64x32 (sizeof (CRASH_IMAGE), mCrashDump->ImageCount);
+  if (Size > mCrashDump->Size) {
+    return NULL;
+  }
+
+  return mCrashDump;
+}
+
+/**
+  Marks the crash dump as reported to a debugger, or discards it.
+
+  @param[in]  Discard   Discard the crash dump.
+
+**/
+VOID
+DbgCrashDumpReported (
+  IN BOOLEAN  Discard
+  )
+{
+  if (DbgGetCrashDump () == NULL) {
+    return;
+  }
+
+  if (Discard) {
+    mCrashDump->Signature = 0;
+  } else {
+    mCrashDump->Reported = TRUE;
+  }
+
+  WriteBackDataCacheRange (mCrashDump, sizeof (CRASH_DUMP_HEADER));
+}
@@ -52,7 +52,8 @@ typedef enum _EXCEPTION_TYPE {
   ExceptionGenericFault,
   ExceptionInvalidOp,
   ExceptionAlignment,
-  ExceptionAccessViolation
+  ExceptionAccessViolation,
+  ExceptionWatchpoint
 } EXCEPTION_TYPE;
 
 typedef struct _EXCEPTION_INFO {
@@ -60,7 +61,12 @@ typedef struct _EXCEPTION_INFO {
   UINT64            ExceptionAddress;
   UINT64            ArchExceptionCode;
 
-  // TODO: Add union with information like PF address.
+  // Data address and access of an access violation or watchpoint.
+  UINT64            FaultAddress;
+  BOOLEAN           FaultIsWrite;
+
+  // A single step completed with the watchpoint hit.
+  BOOLEAN           StepComplete;
 } EXCEPTION_INFO;
 
 //
@@ -71,6 +77,12 @@ extern UINT8   mArchBreakpointInstruction[];
 extern UINTN   mArchBreakpointInstructionSize;
 extern UINT32  mArchExceptionTypes[];
 
+// Watchpoints trap before the access completes and must be stepped over.
+extern BOOLEAN  mArchWatchpointBeforeAccess;
+
+// Page table entry bits the processor may change on its own.
+extern UINT64  mArchPageEntryHardwareBits;
+
 //
 // Global used to track debugger invoked breakpoint.
 //
@@ -80,6 +92,7 @@ typedef enum _BREAKPOINT_REASON {
   BreakpointReasonInitial,
   BreakpointReasonModuleLoad,
   BreakpointReasonDebuggerBreak,
+  BreakpointReasonImageLoad,
 } BREAKPOINT_REASON;
 
 extern BREAKPOINT_REASON  DebuggerBreakpointReason;
@@ -90,6 +103,27 @@ extern BREAKPOINT_REASON  DebuggerBreakpointReason;
 
 extern CONST CHAR8  *gDebuggerInfo;
 
+//
+// Counters for the break-in polling.
+//
+
+typedef struct _DEBUGGER_POLL_STATS {
+  UINT64    PollCount;
+  UINT64    TotalPollTimeUs;
+  UINT64    MaxPollTimeUs;
+  UINT64    BreakInCount;
+  UINT64    LastBreakInLatencyUs;
+  UINT64    MaxBreakInLatencyUs;
+  UINT32    PollIntervalMs; // Current or minimum poll interval, zero if not time based.
+
+  // MM only, SMI entries and the time the agent added to them.
+  UINT64    SmiCount;
+  UINT64    TotalSmiOverheadUs;
+  UINT64    MaxSmiOverheadUs;
+} DEBUGGER_POLL_STATS;
+
+extern DEBUGGER_POLL_STATS  gDebuggerPollStats;
+
 VOID
 EFIAPI
 DebuggerExceptionHandler (
@@ -114,6 +148,11 @@ DbgSetBreakOnModuleLoad (
   IN CHAR8  *Module
   );
 
+BOOLEAN
+DbgRemoveBreakOnModuleLoad (
+  IN CHAR8  *Module
+  );
+
 //
 // Address check routines
 //
@@ -146,6 +185,452 @@ DbgWriteMemory (
   IN UINTN  Length
   );
 
+BOOLEAN
+DbgGetPageAttributes (
+  IN  UINTN   Address,
+  OUT UINT64  *Attributes
+  );
+
+BOOLEAN
+DbgSetPageAttributes (
+  IN UINTN   Address,
+  IN UINT64  Attributes
+  );
+
+BOOLEAN
+DbgClearPageAttributes (
+  IN UINTN   Address,
+  IN UINT64  Attributes
+  );
+
+//
+// Image routines
+//
+
+typedef struct _LOADED_IMAGE_ENTRY {
+  UINTN    ImageBase;
+  UINTN    ImageSize;
+  UINTN    TextAddress;
+  UINTN    PdbAddress;
+} LOADED_IMAGE_ENTRY;
+
+BOOLEAN
+DbgFindImage (
+  IN  UINTN  Address,
+  IN  UINTN  Step,
+  IN  UINTN  MaxRange,
+  OUT UINTN  *ImageBase,
+  OUT UINTN  *ImageSize
+  );
+
+BOOLEAN
+DbgFindLoadedImage (
+  IN  UINTN  Address,
+  OUT UINTN  *ImageBase,
+  OUT UINTN  *ImageSize
+  );
+
+BOOLEAN
+DbgGetImageDirectory (
+  IN  UINTN  ImageBase,
+  IN  UINTN  Index,
+  OUT UINTN  *Address,
+  OUT UINTN  *Size
+  );
+
+BOOLEAN
+DbgGetImagePdbName (
+  IN  UINTN  ImageBase,
+  OUT CHAR8  *PdbName,
+  IN  UINTN  PdbNameSize
+  );
+
+BOOLEAN
+DbgGetImageSectionAddress (
+  IN  UINTN        ImageBase,
+  IN  CONST CHAR8  *Name,
+  OUT UINTN        *Address
+  );
+
+BOOLEAN
+DbgReadString (
+  IN  UINTN  Address,
+  OUT CHAR8  *Buffer,
+  IN  UINTN  BufferSize
+  );
+
+BOOLEAN
+DbgRegisterImage (
+  IN UINTN  ImageBase,
+  IN UINTN  ImageSize
+  );
+
+BOOLEAN
+DbgUnregisterImage (
+  IN UINTN  ImageBase
+  );
+
+CONST LOADED_IMAGE_ENTRY *
+DbgGetLoadedImage (
+  IN UINTN  Index
+  );
+
+//
+// Timeline routines. The event layout is reported to the debugger as is and
+// must not change.
+//
+
+typedef enum _TIMELINE_EVENT_TYPE {
+  TimelineNone = 0,
+  TimelineImageLoad,        // Data is the image base.
+  TimelineProtocolNotify,   // Info is the TIMELINE_PROTOCOL_* value.
+  TimelineException,        // Info is the EXCEPTION_TYPE, Data is the address.
+  TimelineResume,
+  TimelineExitBootServices,
+} TIMELINE_EVENT_TYPE;
+
+#define TIMELINE_PROTOCOL_CPU_ARCH          1
+#define TIMELINE_PROTOCOL_TIMER_ARCH        2
+#define TIMELINE_PROTOCOL_MEMORY_ATTRIBUTE  3
+#define TIMELINE_PROTOCOL_MP_SERVICES       4
+
+typedef struct _TIMELINE_EVENT {
+  UINT64    TimeUs;
+  UINT64    Data;
+  UINT32    Sequence;
+  UINT16    Type;
+  UINT16    Info;
+} TIMELINE_EVENT;
+
+VOID
+DbgTimelineRecord (
+  IN TIMELINE_EVENT_TYPE  Type,
+  IN UINT16               Info,
+  IN UINT64               Data
+  );
+
+CONST TIMELINE_EVENT *
+DbgGetTimelineEvent (
+  IN UINTN  Index
+  );
+
+UINTN
+DbgGetTimelineCount (
+  VOID
+  );
+
+UINTN
+DbgGetTimelineDropped (
+  VOID
+  );
+
+VOID
+DbgClearTimeline (
+  VOID
+  );
+
+//
+// Profiler routines. The header and samples are reported to the debugger as
+// is and must not change.
+//
+
+typedef struct _PROFILE_HEADER {
+  UINT32    Depth;        // Addresses per sample, the first is the interrupted PC.
+  UINT32    IntervalUs;
+  UINT32    SampleCount;
+  UINT32    Missed;       // Samples lost to a full buffer or unknown context.
+} PROFILE_HEADER;
+
+VOID
+DbgProfileInit (
+  IN UINT64  *Buffer,
+  IN UINT32  MaxSamples,
+  IN UINT32  Depth,
+  IN UINT32  IntervalUs
+  );
+
+VOID
+DbgProfileSample (
+  VOID
+  );
+
+BOOLEAN
+DbgProfileEnable (
+  IN BOOLEAN  Enable
+  );
+
+VOID
+DbgProfileShutdown (
+  VOID
+  );
+
+BOOLEAN
+DbgProfileIsEnabled (
+  VOID
+  );
+
+CONST PROFILE_HEADER *
+DbgGetProfileHeader (
+  VOID
+  );
+
+CONST UINT64 *
+DbgGetProfileSample (
+  IN UINTN  Index
+  );
+
+VOID
+DbgClearProfile (
+  VOID
+  );
+
+//
+// Stack unwinding. The frame layout is reported to the debugger as is and must
+// not change.
+//
+
+// Maximum number of frames reported for a stack.
+#define MAX_STACK_FRAMES  64
+
+typedef struct _STACK_FRAME {
+  UINT64    Pc;
+  UINT64    Sp;
+} STACK_FRAME;
+
+//
+// Multi-processor support. Processors are numbered in the order they become
+// known to the agent and are reported to the debugger as thread (index + 1).
+//
+
+#define MAX_DEBUG_PROCESSORS  256
+
+typedef enum _PROCESSOR_STATE {
+  ProcessorRunning = 0,
+  ProcessorStopped,       // Owns the debugger.
+  ProcessorWaiting,       // Stopped on its own exception, waiting for its turn.
+  ProcessorHalted,        // Halted by the processor that owns the debugger.
+} PROCESSOR_STATE;
+
+typedef struct _DEBUG_PROCESSOR {
+  UINT64                Key;              // Processor ID + 1, 0 if the slot is free.
+  volatile UINT32       State;
+  UINT32                HaltGeneration;   // Last halt request handled.
+  EFI_SYSTEM_CONTEXT    Context;          // Valid while not running.
+  EXCEPTION_INFO        *ExceptionInfo;   // NULL if halted.
+} DEBUG_PROCESSOR;
+
+VOID
+DbgRegisterProcessor (
+  IN UINT64  ProcessorId
+  );
+
+VOID
+DbgSetProcessorCount (
+  IN UINTN  Count
+  );
+
+BOOLEAN
+DbgProcessorAcquire (
+  IN  EXCEPTION_INFO      *ExceptionInfo,
+  IN  EFI_SYSTEM_CONTEXT  SystemContext,
+  OUT UINTN               *Index
+  );
+
+VOID
+DbgProcessorRelease (
+  IN BOOLEAN  KeepHalted
+  );
+
+BOOLEAN
+DbgProcessorHalt (
+  IN EFI_SYSTEM_CONTEXT  SystemContext
+  );
+
+UINTN
+DbgGetProcessorCount (
+  VOID
+  );
+
+CONST DEBUG_PROCESSOR *
+DbgGetProcessor (
+  IN UINTN  Index
+  );
+
+EFI_SYSTEM_CONTEXT *
+DbgGetProcessorContext (
+  IN UINTN  Index
+  );
+
+UINTN
+DbgGetCurrentProcessor (
+  VOID
+  );
+
+BOOLEAN
+DbgProcessorIsStepping (
+  IN UINTN  Index
+  );
+
+//
+// Implemented by each phase.
+//
+
+BOOLEAN
+DbgPhaseCanBroadcastHalt (
+  VOID
+  );
+
+VOID
+DbgPhaseUpdateImages (
+  VOID
+  );
+
+//
+// Page watchpoints, used for ranges the debug registers cannot cover.
+//
+
+BOOLEAN
+DbgAddPageWatch (
+  IN UINTN    Address,
+  IN UINTN    Length,
+  IN BOOLEAN  Read,
+  IN BOOLEAN  Write
+  );
+
+BOOLEAN
+DbgRemovePageWatch (
+  IN UINTN    Address,
+  IN UINTN    Length,
+  IN BOOLEAN  Read,
+  IN BOOLEAN  Write
+  );
+
+VOID
+DbgPageWatchArm (
+  VOID
+  );
+
+VOID
+DbgPageWatchDisarm (
+  VOID
+  );
+
+BOOLEAN
+DbgPageWatchFilter (
+  IN OUT EXCEPTION_INFO      *ExceptionInfo,
+  IN OUT EFI_SYSTEM_CONTEXT  SystemContext
+  );
+
+//
+// Core dump. Each segment is written to the file up to FileSize and the rest
+// of it is known to be zero.
+//
+
+#define MAX_CORE_SEGMENTS  256
+
+typedef struct _CORE_SEGMENT {
+  UINT64    Address;
+  UINT64    Size;
+  UINT64    FileSize;
+} CORE_SEGMENT;
+
+UINTN
+DbgBuildCoreSegments (
+  VOID
+  );
+
+CONST CORE_SEGMENT *
+DbgGetCoreSegment (
+  IN UINTN  Index
+  );
+
+//
+// Crash capture. A fault taken before a debugger connects is saved to a buffer
+// reserved by the platform. The layout is reported to the debugger as is and
+// must not change.
+//
+
+#define CRASH_DUMP_SIGNATURE   SIGNATURE_64 ('D', 'B', 'G', 'C', 'R', 'A', 'S', 'H')
+#define CRASH_DUMP_VERSION     1
+#define CRASH_STACK_SIZE       0x400
+#define CRASH_FRAME_COUNT      16
+#define CRASH_IMAGE_NAME_SIZE  48
+#define CRASH_MAX_REGISTERS    64
+
+// Followed by the processors and then the loaded images.
+typedef struct _CRASH_DUMP_HEADER {
+  UINT64    Signature;
+  UINT32    Version;            // CRASH_DUMP_VERSION.
+  UINT32    Size;               // Bytes used, including this header.
+  UINT16    Machine;            // ELF machine type of the registers.
+  UINT8     Reported;           // Read by a debugger.
+  UINT8     Truncated;          // Not everything fit in the buffer.
+  UINT32    RegisterCount;      // Registers saved for each processor.
+  UINT64    TimeUs;
+  UINT32    ExceptionType;
+  UINT32    FaultIsWrite;
+  UINT64    ArchExceptionCode;
+  UINT64    ExceptionAddress;
+  UINT64    FaultAddress;
+  UINT32    ProcessorCount;
+  UINT32    ImageCount;
+  UINT32    StackSize;          // Size of the stack buffer of each processor.
+  UINT32    Reserved;
+} CRASH_DUMP_HEADER;
+
+// Followed by RegisterCount 64-bit registers in the order of the ELF core
+// NT_PRSTATUS note.
+typedef struct _CRASH_PROCESSOR {
+  UINT32         ThreadId;
+  UINT32         FrameCount;
+  UINT64         StackPointer;
+  UINT32         StackLength;   // Bytes of the stack that could be read.
+  UINT32         Reserved;
+  STACK_FRAME    Frames[CRASH_FRAME_COUNT];
+  UINT8          Stack[CRASH_STACK_SIZE];
+} CRASH_PROCESSOR;
+
+typedef struct _CRASH_IMAGE {
+  UINT64    ImageBase;
+  UINT64    ImageSize;
+  CHAR8     Name[CRASH_IMAGE_NAME_SIZE];
+} CRASH_IMAGE;
+
+VOID
+DbgCrashDumpInit (
+  IN VOID   *Buffer,
+  IN UINTN  Size
+  );
+
+BOOLEAN
+DbgCrashDumpBegin (
+  IN CONST EXCEPTION_INFO  *ExceptionInfo,
+  IN UINT16                Machine,
+  IN UINT32                RegisterCount
+  );
+
+VOID
+DbgCrashDumpAddProcessor (
+  IN UINT32              ThreadId,
+  IN EFI_SYSTEM_CONTEXT  SystemContext,
+  IN CONST UINT64        *Registers
+  );
+
+VOID
+DbgCrashDumpEnd (
+  VOID
+  );
+
+CONST CRASH_DUMP_HEADER *
+DbgGetCrashDump (
+  VOID
+  );
+
+VOID
+DbgCrashDumpReported (
+  IN BOOLEAN  Discard
+  );
+
 //
 // IO process module
 //
@@ -156,16 +641,26 @@ ReportEntryToDebugger (
   IN OUT EFI_SYSTEM_CONTEXT  SystemContext
   );
 
-VOID
+BOOLEAN
 DebuggerPollInput (
   VOID
   );
 
+BOOLEAN
+DebuggerHostConnected (
+  VOID
+  );
+
 VOID
 DebuggerInitialBreakpoint (
   IN UINT64  Timeout
   );
 
+BOOLEAN
+DebuggerNotifyImageLoad (
+  VOID
+  );
+
 //
 // Breakpoints.
 //
@@ -185,6 +680,94 @@ DebuggerBreak (
   IN BREAKPOINT_REASON  Reason
   );
 
+//
+// Watchpoints. A watched range is split into slots that each fit a single
+// debug register.
+//
+
+typedef struct _WATCH_SLOT {
+  UINTN    Address;     // Aligned to the slot size.
+  UINTN    Size;        // A power of two.
+  UINT8    ByteMask;    // Bytes watched in the first 8 bytes, bit 0 is Address.
+} WATCH_SLOT;
+
+UINTN
+DbgPlanWatchpoint (
+  IN  UINTN       Address,
+  IN  UINTN       Length,
+  IN  UINTN       MaxSize,
+  IN  BOOLEAN     ByteSelect,
+  OUT WATCH_SLOT  *Slots,
+  IN  UINTN       MaxSlots
+  );
+
+//
+// Counting watchpoints resume after each hit instead of stopping.
+//
+
+#define MAX_COUNTING_WATCHES  4
+#define WATCH_PC_COUNT        8
+
+typedef struct _COUNTING_WATCH {
+  BOOLEAN    Active;
+  BOOLEAN    Read;
+  BOOLEAN    Write;
+  BOOLEAN    RecordPc;
+  UINTN      Address;
+  UINTN      Length;
+  UINT64     HitCount;
+  UINT64     Pcs[WATCH_PC_COUNT];  // Ring of recent hits, indexed by HitCount.
+} COUNTING_WATCH;
+
+BOOLEAN
+DbgAddCountingWatch (
+  IN UINTN    Address,
+  IN UINTN    Length,
+  IN BOOLEAN  Read,
+  IN BOOLEAN  Write,
+  IN BOOLEAN  RecordPc
+  );
+
+BOOLEAN
+DbgRemoveCountingWatch (
+  IN UINTN  Address
+  );
+
+VOID
+DbgClearWatchCounts (
+  VOID
+  );
+
+CONST COUNTING_WATCH *
+DbgGetCountingWatch (
+  IN UINTN  Index
+  );
+
+BOOLEAN
+DbgWatchpointFilter (
+  IN     EXCEPTION_INFO      *ExceptionInfo,
+  IN OUT EFI_SYSTEM_CONTEXT  SystemContext
+  );
+
+//
+// Time base
+//
+
+VOID
+DebugTimeBaseInit (
+  VOID
+  );
+
+UINT64
+DebugGetTimeMs (
+  VOID
+  );
+
+UINT64
+DebugGetTimeUs (
+  VOID
+  );
+
 //
 // Architecture specific
 //
@@ -195,10 +778,48 @@ AddSingleStep (
   );
 
 UINT64
-DebugGetTimeMs (
+DebugArchReadTicks (
+  VOID
+  );
+
+UINT64
+DebugArchGetTickFrequency (
+  VOID
+  );
+
+BOOLEAN
+DebugArchGetInterruptedFrame (
+  OUT UINTN  *Pc,
+  OUT UINTN  *FramePointer
+  );
+
+UINTN
+DebugArchUnwindStack (
+  IN  EFI_SYSTEM_CONTEXT  SystemContext,
+  OUT STACK_FRAME         *Frames,
+  IN  UINTN               MaxFrames
+  );
+
+UINT64
+DebugArchGetProcessorId (
+  VOID
+  );
+
+BOOLEAN
+DebugArchHaltProcessors (
   VOID
   );
 
+UINT64 *
+DebugArchGetPageEntry (
+  IN UINTN  Address
+  );
+
+VOID
+DebugArchFlushPage (
+  IN UINTN  Address
+  );
+
 VOID
 DebugArchInit (
   IN DEBUGGER_CONTROL_HOB  *DebugConfig
@@ -220,4 +841,12 @@ RemoveWatchpoint (
   IN BOOLEAN  Write
   );
 
+BOOLEAN
+IsWatchpointShared (
+  IN UINTN    Address,
+  IN UINTN    Length,
+  IN BOOLEAN  Read,
+  IN BOOLEAN  Write
+  );
+
 #endif
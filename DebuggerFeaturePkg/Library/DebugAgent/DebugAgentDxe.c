@@ -12,6 +12,8 @@
 #include <Protocol/Timer.h>
 #include <Protocol/LoadedImage.h>
 #include <Protocol/MemoryAttribute.h>
+#include <Protocol/MpService.h>
+#include <Guid/DebugImageInfoTable.h>
 
 #include <Library/DebugLib.h>
 #include <Library/BaseMemoryLib.h>
@@ -34,6 +36,13 @@ extern EFI_RUNTIME_SERVICES     *gDxeCoreRT;
 
 STATIC EFI_MEMORY_ATTRIBUTE_PROTOCOL  *mMemoryAttributeProtocol = NULL;
 
+// The DXE core lists loaded images in the debug image info table and removes
+// them when they are unloaded. The table is used to find unloaded images.
+#define MAX_DEBUG_TABLE_IMAGES  512
+
+STATIC EFI_DEBUG_IMAGE_INFO_TABLE_HEADER  *mDebugImageInfoTable = NULL;
+STATIC UINTN                              mDebugTableBases[MAX_DEBUG_TABLE_IMAGES];
+
 CONST CHAR8  *gDebuggerInfo = "DXE UEFI Debugger";
 
 //
@@ -58,16 +67,43 @@ STATIC VOID       *mCpuRegistration              = NULL;
 STATIC VOID       *mTimerRegistration            = NULL;
 STATIC VOID       *mLoadedImageRegistration      = NULL;
 STATIC VOID       *mMemoryAttributesRegistration = NULL;
+STATIC VOID       *mMpServicesRegistration       = NULL;
 STATIC EFI_EVENT  mTimerEvent;
+STATIC EFI_EVENT  mProfileEvent;
 STATIC EFI_EVENT  mCpuArchEvent;
 STATIC EFI_EVENT  mLoadedImageEvent;
+STATIC EFI_EVENT  mMpServicesEvent;
 STATIC EFI_EVENT  mExitBootServicesEvent;
 STATIC BOOLEAN    mDebuggerInitialized;
 STATIC BOOLEAN    mDisablePolling;
-STATIC CHAR8      mDbgBreakOnModuleLoadString[64] = { 0 };
+STATIC UINT32     mPollIntervalMs;
+
+//
+// Set of modules to break on when loaded. Exact names are kept in a hash table
+// so the per-image cost does not grow with the number of entries, patterns
+// containing wildcards are checked individually.
+//
+
+#define MAX_MODULE_BREAKS       32
+#define MODULE_BREAK_NAME_SIZE  64
+#define MODULE_BREAK_BUCKETS    16
+
+typedef struct _MODULE_BREAK_ENTRY {
+  BOOLEAN    InUse;
+  BOOLEAN    IsPattern;
+  UINT8      Next;    // Index + 1 of the next entry in the hash bucket.
+  CHAR8      Name[MODULE_BREAK_NAME_SIZE];
+} MODULE_BREAK_ENTRY;
+
+STATIC MODULE_BREAK_ENTRY  mModuleBreaks[MAX_MODULE_BREAKS];
+STATIC UINT8               mModuleBreakBuckets[MODULE_BREAK_BUCKETS]; // Index + 1 of the first entry.
+STATIC UINTN               mModuleBreakCount        = 0;
+STATIC UINTN               mModuleBreakPatternCount = 0;
 
 /**
-  This routine handles timer events.
+  This routine handles timer events. The poll interval is reset to the minimum
+  while input is received or the debugger was recently active, otherwise it is doubled
+  up to the maximum so an idle system spends little time polling.
 
   @param  Event            Not used.
   @param  Context          Not used.
@@ -79,12 +115,24 @@ DebugAgentTimerRoutine (
   VOID       *Context
   )
 {
-  DebuggerPollInput ();
+  UINT32  MinIntervalMs;
+  UINT32  MaxIntervalMs;
+
+  MinIntervalMs = MAX (PcdGet32 (PcdDebuggerPollIntervalMinMs), 1);
+  MaxIntervalMs = MAX (PcdGet32 (PcdDebuggerPollIntervalMaxMs), MinIntervalMs);
+  if (DebuggerPollInput () || DebuggerHostConnected ()) {
+    mPollIntervalMs = MinIntervalMs;
+  } else {
+    mPollIntervalMs = MIN (mPollIntervalMs * 2, MaxIntervalMs);
+  }
+
+  gDebuggerPollStats.PollIntervalMs = mPollIntervalMs;
+  gBS->SetTimer (mTimerEvent, TimerRelative, EFI_TIMER_PERIOD_MILLISECONDS (mPollIntervalMs));
 }
 
 /**
-  This routine initializes timer events to check every second for a possible
-  request to break in.
+  This routine initializes timer events to check for a possible request to
+  break in. The timer is re-armed by each poll with the adaptive interval.
 
   N.B. Any failures in this routine are intentionally ignored.  Control-C
        functionality will not work without timers, but exception handling will
@@ -106,10 +154,13 @@ DebugAgentInitializeTimer (
                   );
 
   if (EFI_ERROR (Status) == FALSE) {
+    mPollIntervalMs                   = MAX (PcdGet32 (PcdDebuggerPollIntervalMinMs), 1);
+    gDebuggerPollStats.PollIntervalMs = mPollIntervalMs;
+
     Status = gBS->SetTimer (
                     mTimerEvent,
-                    TimerPeriodic,
-                    EFI_TIMER_PERIOD_SECONDS (1)
+                    TimerRelative,
+                    EFI_TIMER_PERIOD_MILLISECONDS (mPollIntervalMs)
                     );
 
     DEBUG ((DEBUG_INFO, "%a: Setting Timer Event. Code=%r\n", __FUNCTION__, Status));
@@ -133,6 +184,101 @@ DebugAgentTimerDestroy (
   return;
 }
 
+/**
+  This routine handles profiler timer events by sampling the interrupted context.
+
+  @param  Event            Not used.
+  @param  Context          Not used.
+**/
+VOID
+EFIAPI
+DebugAgentProfileRoutine (
+  EFI_EVENT  Event,
+  VOID       *Context
+  )
+{
+  DbgProfileSample ();
+}
+
+/**
+  This routine allocates the profiler buffer and starts the periodic profiler
+  timer if the profiler is enabled. The event is notified at TPL_NOTIFY so it
+  samples all code running below that level.
+
+  N.B. Any failures in this routine are intentionally ignored. The profiler
+       simply reports that it is not enabled.
+
+**/
+VOID
+DebugAgentInitializeProfiler (
+  )
+{
+  EFI_STATUS            Status;
+  UINT32                Samples;
+  UINT32                Depth;
+  UINT32                IntervalUs;
+  EFI_PHYSICAL_ADDRESS  Buffer;
+
+  Samples    = PcdGet32 (PcdDebuggerProfileSamples);
+  Depth      = MAX (PcdGet32 (PcdDebuggerProfileDepth), 1);
+  IntervalUs = MAX (PcdGet32 (PcdDebuggerProfileIntervalUs), 1);
+  if (Samples == 0) {
+    return;
+  }
+
+  Status = gBS->AllocatePages (
+                  AllocateAnyPages,
+                  EfiBootServicesData,
+                  EFI_SIZE_TO_PAGES ((UINTN)Samples * Depth * sizeof (UINT64)),
+                  &Buffer
+                  );
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a: Failed to allocate profile buffer. Code=%r\n", __FUNCTION__, Status));
+    return;
+  }
+
+  Status = gBS->CreateEvent (
+                  EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                  TPL_NOTIFY,
+                  DebugAgentProfileRoutine,
+                  NULL,
+                  &mProfileEvent
+                  );
+
+  if (EFI_ERROR (Status) == FALSE) {
+    DbgProfileInit ((UINT64 *)(UINTN)Buffer, Samples, Depth, IntervalUs);
+    DbgProfileEnable (TRUE);
+    Status = gBS->SetTimer (
+                    mProfileEvent,
+                    TimerPeriodic,
+                    EFI_TIMER_PERIOD_MICROSECONDS (IntervalUs)
+                    );
+
+    DEBUG ((DEBUG_INFO, "%a: Setting Profile Timer Event. Code=%r\n", __FUNCTION__, Status));
+  }
+
+  return;
+}
+
+/**
+  This routine terminates the profiler timer event. The profile buffer is boot
+  services memory, so the profiler also stops serving it to the debugger.
+
+**/
+VOID
+DebugAgentProfilerDestroy (
+  )
+{
+  DbgProfileShutdown ();
+  if (mProfileEvent != NULL) {
+    gBS->CloseEvent (mProfileEvent);
+    mProfileEvent = NULL;
+  }
+
+  return;
+}
+
 /**
   This routine handles the EXIT_BOOT_SERVICES notification, and terminates
   the debugger
@@ -148,7 +294,9 @@ OnExitBootServices (
   VOID       *Context
   )
 {
+  DbgTimelineRecord (TimelineExitBootServices, 0, 0);
   DebugAgentTimerDestroy ();
+  DebugAgentProfilerDestroy ();
   DebugAgentExceptionDestroy ();
   return;
 }
@@ -178,6 +326,8 @@ OnCpuArchProtocolNotification (
     return;
   }
 
+  DbgTimelineRecord (TimelineProtocolNotify, TIMELINE_PROTOCOL_CPU_ARCH, 0);
+
   //
   // Initialize Exception Handling.
   //
@@ -216,7 +366,12 @@ OnTimerArchProtocolNotification (
     return;
   }
 
-  DebugAgentInitializeTimer ();
+  DbgTimelineRecord (TimelineProtocolNotify, TIMELINE_PROTOCOL_TIMER_ARCH, 0);
+  if (!mDisablePolling) {
+    DebugAgentInitializeTimer ();
+  }
+
+  DebugAgentInitializeProfiler ();
 }
 
 /**
@@ -248,6 +403,191 @@ OnMemoryAttributeProtocolNotification (
   if (EFI_ERROR (Status)) {
     return;
   }
+
+  DbgTimelineRecord (TimelineProtocolNotify, TIMELINE_PROTOCOL_MEMORY_ATTRIBUTE, 0);
+}
+
+/**
+    MP Services Protocol notification.
+
+    @param    Event           Not Used.
+    @param    Context         Not Used.
+
+    @retval   none
+
+    Registers the processors so they are numbered the same as the MP services.
+
+ **/
+VOID
+EFIAPI
+OnMpServicesProtocolNotification (
+  IN EFI_EVENT  Event,
+  IN VOID       *Context
+  )
+{
+  EFI_STATUS                 Status;
+  EFI_MP_SERVICES_PROTOCOL   *MpServices;
+  EFI_PROCESSOR_INFORMATION  ProcessorInfo;
+  UINTN                      NumberOfProcessors;
+  UINTN                      NumberOfEnabledProcessors;
+  UINTN                      Index;
+
+  Status = gBS->LocateProtocol (&gEfiMpServiceProtocolGuid, NULL, (VOID **)&MpServices);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  Status = MpServices->GetNumberOfProcessors (MpServices, &NumberOfProcessors, &NumberOfEnabledProcessors);
+  if (EFI_ERROR (Status)) {
+    return;
+  }
+
+  DbgTimelineRecord (TimelineProtocolNotify, TIMELINE_PROTOCOL_MP_SERVICES, 0);
+
+  for (Index = 0; Index < NumberOfProcessors; Index++) {
+    Status = MpServices->GetProcessorInfo (MpServices, Index, &ProcessorInfo);
+    if (!EFI_ERROR (Status) && ((ProcessorInfo.StatusFlag & PROCESSOR_ENABLED_BIT) != 0)) {
+      DbgRegisterProcessor (ProcessorInfo.ProcessorId);
+    }
+  }
+
+  DbgSetProcessorCount (NumberOfEnabledProcessors);
+}
+
+/**
+  Computes the hash of an upper case module name.
+
+  @param[in]  Name  The NULL terminated module name.
+
+  @retval   The hash of the name.
+**/
+STATIC
+UINT32
+ModuleNameHash (
+  IN CONST CHAR8  *Name
+  )
+{
+  UINT32  Hash;
+
+  // FNV-1a
+  Hash = 2166136261;
+  while (*Name != 0) {
+    Hash = (Hash ^ (UINT8)*Name) * 16777619;
+    Name++;
+  }
+
+  return Hash;
+}
+
+/**
+  Matches an upper case name against an upper case pattern where '*' matches
+  any number of characters and '?' matches any one character.
+
+  @param[in]  Pattern  The NULL terminated pattern.
+  @param[in]  Name     The NULL terminated name.
+
+  @retval  TRUE   The name matches the pattern.
+  @retval  FALSE  The name does not match the pattern.
+**/
+STATIC
+BOOLEAN
+ModuleNameGlobMatch (
+  IN CONST CHAR8  *Pattern,
+  IN CONST CHAR8  *Name
+  )
+{
+  CONST CHAR8  *StarPattern;
+  CONST CHAR8  *StarName;
+
+  StarPattern = NULL;
+  StarName    = NULL;
+  while (*Name != 0) {
+    if ((*Pattern == '?') || ((*Pattern == *Name) && (*Pattern != '*'))) {
+      Pattern++;
+      Name++;
+    } else if (*Pattern == '*') {
+      // Record the star so the match can be retried consuming more of the name.
+      StarPattern = Pattern++;
+      StarName    = Name;
+    } else if (StarPattern != NULL) {
+      Pattern = StarPattern + 1;
+      Name    = ++StarName;
+    } else {
+      return FALSE;
+    }
+  }
+
+  while (*Pattern == '*') {
+    Pattern++;
+  }
+
+  return (*Pattern == 0);
+}
+
+/**
+  Checks if a loaded module should cause a break.
+
+  @param[in]  PdbPath  The PDB path of the loaded module.
+
+  @retval  TRUE   The module is in the break on load set.
+  @retval  FALSE  The module is not in the break on load set.
+**/
+STATIC
+BOOLEAN
+ModuleBreakMatch (
+  IN CONST CHAR8  *PdbPath
+  )
+{
+  CONST CHAR8  *Start;
+  CONST CHAR8  *Extension;
+  CONST CHAR8  *Char;
+  CHAR8        Name[MODULE_BREAK_NAME_SIZE];
+  UINTN        Length;
+  UINTN        Index;
+
+  // Find the name without directories or extension in a single pass.
+  Start     = PdbPath;
+  Extension = NULL;
+  for (Char = PdbPath; *Char != 0; Char++) {
+    if ((*Char == '\\') || (*Char == '/')) {
+      Start     = Char + 1;
+      Extension = NULL;
+    } else if ((*Char == '.') && (Extension == NULL)) {
+      Extension = Char;
+    }
+  }
+
+  Length = ((Extension != NULL) ? Extension : Char) - Start;
+  if (Length >= sizeof (Name)) {
+    return FALSE;
+  }
+
+  for (Index = 0; Index < Length; Index++) {
+    Name[Index] = AsciiCharToUpper (Start[Index]);
+  }
+
+  Name[Length] = 0;
+
+  Index = mModuleBreakBuckets[ModuleNameHash (Name) % MODULE_BREAK_BUCKETS];
+  while (Index != 0) {
+    if (AsciiStrCmp (mModuleBreaks[Index - 1].Name, Name) == 0) {
+      return TRUE;
+    }
+
+    Index = mModuleBreaks[Index - 1].Next;
+  }
+
+  if (mModuleBreakPatternCount != 0) {
+    for (Index = 0; Index < MAX_MODULE_BREAKS; Index++) {
+      if (mModuleBreaks[Index].InUse && mModuleBreaks[Index].IsPattern &&
+          ModuleNameGlobMatch (mModuleBreaks[Index].Name, Name))
+      {
+        return TRUE;
+      }
+    }
+  }
+
+  return FALSE;
 }
 
 /**
@@ -258,7 +598,7 @@ OnMemoryAttributeProtocolNotification (
 
     @retval   none
 
-    Initialize Debugger Polling.
+    Record new images for the debugger and check for break on module load.
 
  **/
 VOID
@@ -273,17 +613,13 @@ OnLoadedImageNotification (
   EFI_LOADED_IMAGE_PROTOCOL  *LoadedImage;
   EFI_STATUS                 Status;
   CHAR8                      *PdbPointer;
-  CHAR8                      Name[64];
-  CHAR8                      *NameEnd;
-  UINTN                      Index;
-
-  BufferSize = sizeof (EFI_HANDLE);
 
-  // If there is no break requested, then quick escape.
-  if (AsciiStrLen (&mDbgBreakOnModuleLoadString[0]) == 0) {
-    return;
+  if (mDebugImageInfoTable == NULL) {
+    EfiGetSystemConfigurationTable (&gEfiDebugImageInfoTableGuid, (VOID **)&mDebugImageInfoTable);
   }
 
+  BufferSize = sizeof (EFI_HANDLE);
+
   while (TRUE) {
     Status = gBS->LocateHandle (
                     ByRegisterNotify,
@@ -308,31 +644,27 @@ OnLoadedImageNotification (
       break;
     }
 
-    PdbPointer = PeCoffLoaderGetPdbPointer (LoadedImage->ImageBase);
-    if (PdbPointer == NULL) {
+    DbgTimelineRecord (TimelineImageLoad, 0, (UINTN)LoadedImage->ImageBase);
+    if (!DbgRegisterImage ((UINTN)LoadedImage->ImageBase, (UINTN)LoadedImage->ImageSize)) {
+      DEBUG ((DEBUG_WARN, "%a: Failed to record image at %p\n", __FUNCTION__, LoadedImage->ImageBase));
+    } else if (DebuggerNotifyImageLoad ()) {
+      // The debugger already stopped for this image, a module break would
+      // stop a second time at the same place.
       continue;
     }
 
-    // Strip of the directories.
-    for (Index = AsciiStrLen (PdbPointer); Index > 0; Index--) {
-      if ((PdbPointer[Index - 1] == '\\') || (PdbPointer[Index - 1] == '/')) {
-        PdbPointer = &PdbPointer[Index];
-        break;
-      }
+    // If there is no break requested, then move on to the next image.
+    if (mModuleBreakCount == 0) {
+      continue;
     }
 
-    ASSERT (AsciiStrLen (PdbPointer) < sizeof (Name));
-    CopyMem (&Name[0], PdbPointer, AsciiStrLen (PdbPointer) + 1);
-    NameEnd = ScanMem8 (Name, AsciiStrLen (Name), '.');
-    if (NameEnd != NULL) {
-      *NameEnd = 0;
+    PdbPointer = PeCoffLoaderGetPdbPointer (LoadedImage->ImageBase);
+    if (PdbPointer == NULL) {
+      continue;
     }
 
-    if (AsciiStrLen (Name) == AsciiStrLen (mDbgBreakOnModuleLoadString)) {
-      if (AsciiStriCmp (mDbgBreakOnModuleLoadString, Name) == 0) {
-        DebuggerBreak (BreakpointReasonModuleLoad);
-        break;
-      }
+    if (ModuleBreakMatch (PdbPointer)) {
+      DebuggerBreak (BreakpointReasonModuleLoad);
     }
   }
 
@@ -513,6 +845,95 @@ AccessMemory (
   return TRUE;
 }
 
+/**
+  Reports whether the other processors may be halted with a broadcast NMI.
+
+  In DXE all processors run with the firmware exception handlers installed.
+
+  @retval   TRUE    The other processors may be halted.
+  @retval   FALSE   The other processors must not be sent an NMI.
+**/
+BOOLEAN
+DbgPhaseCanBroadcastHalt (
+  VOID
+  )
+{
+  return TRUE;
+}
+
+/**
+  Removes images that have been unloaded from the table of loaded images, by
+  checking each against the debug image info table kept by the DXE core.
+
+  N.B. Nothing is removed if the table is being updated or cannot be fully
+       read, an image that is still loaded must never be dropped.
+
+**/
+VOID
+DbgPhaseUpdateImages (
+  VOID
+  )
+{
+  EFI_DEBUG_IMAGE_INFO         Slot;
+  EFI_DEBUG_IMAGE_INFO_NORMAL  Normal;
+  EFI_LOADED_IMAGE_PROTOCOL    LoadedImage;
+  CONST LOADED_IMAGE_ENTRY     *Image;
+  UINTN                        TableSize;
+  UINTN                        Count;
+  UINTN                        Index;
+  UINTN                        Base;
+
+  if ((mDebugImageInfoTable == NULL) ||
+      ((mDebugImageInfoTable->UpdateStatus & EFI_DEBUG_IMAGE_INFO_UPDATE_IN_PROGRESS) != 0))
+  {
+    return;
+  }
+
+  TableSize = mDebugImageInfoTable->TableSize;
+  if (TableSize > MAX_DEBUG_TABLE_IMAGES) {
+    return;
+  }
+
+  // Removed entries are left NULL, so the table is read until TableSize images
+  // have been found.
+  Count = 0;
+  for (Index = 0; Count < TableSize; Index++) {
+    if ((Index >= 2 * MAX_DEBUG_TABLE_IMAGES) ||
+        !DbgReadMemory ((UINTN)&mDebugImageInfoTable->EfiDebugImageInfoTable[Index], &Slot, sizeof (Slot)))
+    {
+      return;
+    }
+
+    if (Slot.NormalImage == NULL) {
+      continue;
+    }
+
+    if (!DbgReadMemory ((UINTN)Slot.NormalImage, &Normal, sizeof (Normal)) ||
+        !DbgReadMemory ((UINTN)Normal.LoadedImageProtocolInstance, &LoadedImage, sizeof (LoadedImage)))
+    {
+      return;
+    }
+
+    mDebugTableBases[Count++] = (UINTN)LoadedImage.ImageBase;
+  }
+
+  Index = 0;
+  while ((Image = DbgGetLoadedImage (Index)) != NULL) {
+    Base = Image->ImageBase;
+    for (Count = 0; Count < TableSize; Count++) {
+      if (mDebugTableBases[Count] == Base) {
+        break;
+      }
+    }
+
+    if (Count == TableSize) {
+      DbgUnregisterImage (Base);
+    } else {
+      Index++;
+    }
+  }
+}
+
 /**
   Read system memory.
 
@@ -554,7 +975,152 @@ DbgWriteMemory (
 }
 
 /**
-  Setup the debugger to break when a particular module is loaded.
+  Gets the attributes of a page.
+
+  @param[in]   Address      The address in the page.
+  @param[out]  Attributes   The EFI_MEMORY_* attributes of the page.
+
+  @retval  TRUE   The attributes were retrieved.
+  @retval  FALSE  The attributes could not be retrieved.
+**/
+BOOLEAN
+DbgGetPageAttributes (
+  IN  UINTN   Address,
+  OUT UINT64  *Attributes
+  )
+{
+  EFI_STATUS  Status;
+
+  if (mMemoryAttributeProtocol == NULL) {
+    return FALSE;
+  }
+
+  Status = mMemoryAttributeProtocol->GetMemoryAttributes (
+                                       mMemoryAttributeProtocol,
+                                       Address & ~EFI_PAGE_MASK,
+                                       EFI_PAGE_SIZE,
+                                       Attributes
+                                       );
+  return !EFI_ERROR (Status);
+}
+
+/**
+  Sets attributes on a page.
+
+  @param[in]  Address      The address in the page.
+  @param[in]  Attributes   The EFI_MEMORY_* attributes to set.
+
+  @retval  TRUE   The attributes were set.
+  @retval  FALSE  The attributes could not be set.
+**/
+BOOLEAN
+DbgSetPageAttributes (
+  IN UINTN   Address,
+  IN UINT64  Attributes
+  )
+{
+  EFI_STATUS  Status;
+
+  if (mMemoryAttributeProtocol == NULL) {
+    return FALSE;
+  }
+
+  Status = mMemoryAttributeProtocol->SetMemoryAttributes (
+                                       mMemoryAttributeProtocol,
+                                       Address & ~EFI_PAGE_MASK,
+                                       EFI_PAGE_SIZE,
+                                       Attributes
+                                       );
+  return !EFI_ERROR (Status);
+}
+
+/**
+  Clears attributes from a page.
+
+  @param[in]  Address      The address in the page.
+  @param[in]  Attributes   The EFI_MEMORY_* attributes to clear.
+
+  @retval  TRUE   The attributes were cleared.
+  @retval  FALSE  The attributes could not be cleared.
+**/
+BOOLEAN
+DbgClearPageAttributes (
+  IN UINTN   Address,
+  IN UINT64  Attributes
+  )
+{
+  EFI_STATUS  Status;
+
+  if (mMemoryAttributeProtocol == NULL) {
+    return FALSE;
+  }
+
+  Status = mMemoryAttributeProtocol->ClearMemoryAttributes (
+                                       mMemoryAttributeProtocol,
+                                       Address & ~EFI_PAGE_MASK,
+                                       EFI_PAGE_SIZE,
+                                       Attributes
+                                       );
+  return !EFI_ERROR (Status);
+}
+
+/**
+  Finds an entry in the break on load set.
+
+  @param[in]  Module  The upper case module name or pattern.
+
+  @retval   The index of the entry, or MAX_UINTN if not found.
+**/
+STATIC
+UINTN
+FindModuleBreak (
+  IN CONST CHAR8  *Module
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < MAX_MODULE_BREAKS; Index++) {
+    if (mModuleBreaks[Index].InUse && (AsciiStrCmp (mModuleBreaks[Index].Name, Module) == 0)) {
+      return Index;
+    }
+  }
+
+  return MAX_UINTN;
+}
+
+/**
+  Converts a module name or pattern to upper case for the break on load set.
+
+  @param[in]   Module  The module name or pattern.
+  @param[out]  Name    The buffer for the upper case name.
+
+  @retval  TRUE   The name was converted.
+  @retval  FALSE  The name is empty or too long.
+**/
+STATIC
+BOOLEAN
+ModuleBreakName (
+  IN  CONST CHAR8  *Module,
+  OUT CHAR8        Name[MODULE_BREAK_NAME_SIZE]
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Module[Index] != 0; Index++) {
+    if (Index >= MODULE_BREAK_NAME_SIZE - 1) {
+      return FALSE;
+    }
+
+    Name[Index] = AsciiCharToUpper (Module[Index]);
+  }
+
+  Name[Index] = 0;
+  return (Index != 0);
+}
+
+/**
+  Setup the debugger to break when a particular module is loaded. The module
+  name is case insensitive and may contain '*' and '?' wildcards.
 
   @param[in]  Module   The name of the module.
 
@@ -567,14 +1133,100 @@ DbgSetBreakOnModuleLoad (
   IN CHAR8  *Module
   )
 {
-  UINTN  Len;
+  MODULE_BREAK_ENTRY  *Entry;
+  CHAR8               Name[MODULE_BREAK_NAME_SIZE];
+  UINTN               Index;
+  UINTN               Bucket;
 
-  Len = AsciiStrLen (Module);
-  if (Len >= sizeof (mDbgBreakOnModuleLoadString)) {
+  if (!ModuleBreakName (Module, Name)) {
     return FALSE;
   }
 
-  CopyMem (&mDbgBreakOnModuleLoadString[0], Module, Len + 1);
+  if (FindModuleBreak (Name) != MAX_UINTN) {
+    return TRUE;
+  }
+
+  for (Index = 0; Index < MAX_MODULE_BREAKS; Index++) {
+    if (!mModuleBreaks[Index].InUse) {
+      break;
+    }
+  }
+
+  if (Index == MAX_MODULE_BREAKS) {
+    return FALSE;
+  }
+
+  Entry = &mModuleBreaks[Index];
+  CopyMem (Entry->Name, Name, sizeof (Name));
+  Entry->IsPattern = (ScanMem8 (Name, AsciiStrLen (Name), '*') != NULL) ||
+                     (ScanMem8 (Name, AsciiStrLen (Name), '?') != NULL);
+
+  if (Entry->IsPattern) {
+    Entry->Next = 0;
+    mModuleBreakPatternCount++;
+  } else {
+    Bucket                       = ModuleNameHash (Name) % MODULE_BREAK_BUCKETS;
+    Entry->Next                  = mModuleBreakBuckets[Bucket];
+    mModuleBreakBuckets[Bucket] = (UINT8)(Index + 1);
+  }
+
+  Entry->InUse = TRUE;
+  mModuleBreakCount++;
+  return TRUE;
+}
+
+/**
+  Removes a module from the break on load set.
+
+  @param[in]  Module   The name of the module as it was set. If empty, all
+                       modules are removed.
+
+  @retval  TRUE   The break on module was removed.
+  @retval  FALSE  The break on module was not found.
+
+**/
+BOOLEAN
+DbgRemoveBreakOnModuleLoad (
+  IN CHAR8  *Module
+  )
+{
+  MODULE_BREAK_ENTRY  *Entry;
+  CHAR8               Name[MODULE_BREAK_NAME_SIZE];
+  UINTN               Index;
+  UINT8               *Link;
+
+  if (Module[0] == 0) {
+    ZeroMem (mModuleBreaks, sizeof (mModuleBreaks));
+    ZeroMem (mModuleBreakBuckets, sizeof (mModuleBreakBuckets));
+    mModuleBreakCount        = 0;
+    mModuleBreakPatternCount = 0;
+    return TRUE;
+  }
+
+  if (!ModuleBreakName (Module, Name)) {
+    return FALSE;
+  }
+
+  Index = FindModuleBreak (Name);
+  if (Index == MAX_UINTN) {
+    return FALSE;
+  }
+
+  Entry = &mModuleBreaks[Index];
+  if (Entry->IsPattern) {
+    mModuleBreakPatternCount--;
+  } else {
+    // Unlink the entry from its hash bucket.
+    Link = &mModuleBreakBuckets[ModuleNameHash (Name) % MODULE_BREAK_BUCKETS];
+    while (*Link != Index + 1) {
+      Link = &mModuleBreaks[*Link - 1].Next;
+    }
+
+    *Link = Entry->Next;
+  }
+
+  ZeroMem (Entry, sizeof (*Entry));
+  mModuleBreakCount--;
   return TRUE;
 }
 
@@ -605,7 +1257,7 @@ DxeDebugSetupCallbacks (
     }
   }
 
-  if (!mDisablePolling && (gTimer == NULL)) {
+  if ((!mDisablePolling || (PcdGet32 (PcdDebuggerProfileSamples) != 0)) && (gTimer == NULL)) {
     DEBUG ((DEBUG_INFO, "%a: Timer Arch protocol not installed. Registering for notification\n", __FUNCTION__));
     mTimerEvent = EfiCreateProtocolNotifyEvent (
                     &gEfiTimerArchProtocolGuid,
@@ -644,6 +1296,18 @@ DxeDebugSetupCallbacks (
     DEBUG ((DEBUG_ERROR, "%a: failed to create Loaded Image Protocol Notify callback\n", __FUNCTION__));
   }
 
+  mMpServicesEvent = EfiCreateProtocolNotifyEvent (
+                       &gEfiMpServiceProtocolGuid,
+                       TPL_CALLBACK,
+                       OnMpServicesProtocolNotification,
+                       NULL,
+                       &mMpServicesRegistration
+                       );
+
+  if (mMpServicesEvent == NULL) {
+    DEBUG ((DEBUG_ERROR, "%a: failed to create MP Services Protocol Notify callback\n", __FUNCTION__));
+  }
+
   //
   // Register for EXIT_BOOT_SERVICES notification.
   //
@@ -691,6 +1355,8 @@ InitializeDebugAgent (
   EFI_HOB_GUID_TYPE     *GuidHob;
   DEBUGGER_CONTROL_HOB  *DebugHob;
   EFI_STATUS            Status;
+  UINTN                 ImageBase;
+  UINTN                 ImageSize;
 
   DEBUG ((DEBUG_INFO, "%a: Entry.\n", __FUNCTION__));
 
@@ -725,6 +1391,13 @@ InitializeDebugAgent (
     }
 
     DebugArchInit (DebugHob);
+    DbgCrashDumpInit ((VOID *)(UINTN)PcdGet64 (PcdDebuggerCrashDumpAddress), PcdGet32 (PcdDebuggerCrashDumpSize));
+
+    // The DXE core is loaded before the loaded image notification, record it now.
+    if (DbgFindImage ((UINTN)InitializeDebugAgent, 0, 0, &ImageBase, &ImageSize)) {
+      DbgTimelineRecord (TimelineImageLoad, 0, ImageBase);
+      DbgRegisterImage (ImageBase, ImageSize);
+    }
 
     Status = DebugAgentExceptionInitialize ();
     if (EFI_ERROR (Status)) {
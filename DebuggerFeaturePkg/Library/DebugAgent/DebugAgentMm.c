@@ -67,6 +67,8 @@ SmmClearMemoryAttributes (
 // Global variables used to track state and pointers.
 //
 STATIC BOOLEAN  mDebuggerInitialized;
+STATIC UINT64   mLastPollTimeUs = 0;
+STATIC UINT32   mSmisSincePoll  = 0;
 
 /**
   This routine removes the KdDxe exception handling support.
@@ -214,6 +216,36 @@ AccessMemory (
   return TRUE;
 }
 
+/**
+  Reports whether the other processors may be halted with a broadcast NMI.
+
+  In MM the other processors may be outside MM and would take the NMI in the
+  OS handler, so they are never halted.
+
+  @retval   TRUE    The other processors may be halted.
+  @retval   FALSE   The other processors must not be sent an NMI.
+**/
+BOOLEAN
+DbgPhaseCanBroadcastHalt (
+  VOID
+  )
+{
+  return FALSE;
+}
+
+/**
+  Removes images that have been unloaded from the table of loaded images.
+
+  MM drivers are never unloaded, so there is nothing to remove.
+
+**/
+VOID
+DbgPhaseUpdateImages (
+  VOID
+  )
+{
+}
+
 /**
   Read system memory.
 
@@ -254,6 +286,60 @@ DbgWriteMemory (
   return AccessMemory (Address, Data, Length, TRUE);
 }
 
+/**
+  Gets the attributes of a page.
+
+  @param[in]   Address      The address in the page.
+  @param[out]  Attributes   The EFI_MEMORY_* attributes of the page.
+
+  @retval  TRUE   The attributes were retrieved.
+  @retval  FALSE  The attributes could not be retrieved.
+**/
+BOOLEAN
+DbgGetPageAttributes (
+  IN  UINTN   Address,
+  OUT UINT64  *Attributes
+  )
+{
+  return !EFI_ERROR (SmmGetMemoryAttributes (Address & ~EFI_PAGE_MASK, EFI_PAGE_SIZE, Attributes));
+}
+
+/**
+  Sets attributes on a page.
+
+  @param[in]  Address      The address in the page.
+  @param[in]  Attributes   The EFI_MEMORY_* attributes to set.
+
+  @retval  TRUE   The attributes were set.
+  @retval  FALSE  The attributes could not be set.
+**/
+BOOLEAN
+DbgSetPageAttributes (
+  IN UINTN   Address,
+  IN UINT64  Attributes
+  )
+{
+  return !EFI_ERROR (SmmSetMemoryAttributes (Address & ~EFI_PAGE_MASK, EFI_PAGE_SIZE, Attributes));
+}
+
+/**
+  Clears attributes from a page.
+
+  @param[in]  Address      The address in the page.
+  @param[in]  Attributes   The EFI_MEMORY_* attributes to clear.
+
+  @retval  TRUE   The attributes were cleared.
+  @retval  FALSE  The attributes could not be cleared.
+**/
+BOOLEAN
+DbgClearPageAttributes (
+  IN UINTN   Address,
+  IN UINT64  Attributes
+  )
+{
+  return !EFI_ERROR (SmmClearMemoryAttributes (Address & ~EFI_PAGE_MASK, EFI_PAGE_SIZE, Attributes));
+}
+
 /**
   Setup the debugger to break when a particular module is loaded.
 
@@ -272,6 +358,68 @@ DbgSetBreakOnModuleLoad (
   return FALSE;
 }
 
+/**
+  Removes a module from the break on load set.
+
+  @param[in]  Module   The name of the module as it was set. If empty, all
+                       modules are removed.
+
+  @retval  TRUE   The break on module was removed.
+  @retval  FALSE  The break on module was not found.
+
+**/
+BOOLEAN
+DbgRemoveBreakOnModuleLoad (
+  IN CHAR8  *Module
+  )
+{
+  // NOT SUPPORTED.
+  return FALSE;
+}
+
+/**
+  Handles SMI entry. Polls for a break-in request if either the time or SMI
+  count throttle has expired, or on every SMI if both are disabled.
+
+**/
+STATIC
+VOID
+DebugAgentEnterSmi (
+  VOID
+  )
+{
+  UINT32   Interval;
+  UINT32   SmiCount;
+  UINT64   StartTime;
+  UINT64   Overhead;
+  UINT64   BreakInCount;
+  BOOLEAN  Poll;
+
+  Interval  = PcdGet32 (PcdMmDebuggerPollIntervalMs);
+  SmiCount  = PcdGet32 (PcdMmDebuggerPollSmiCount);
+  StartTime = DebugGetTimeUs ();
+  mSmisSincePoll++;
+
+  Poll = ((Interval == 0) && (SmiCount == 0)) ||
+         ((SmiCount != 0) && (mSmisSincePoll >= SmiCount)) ||
+         ((Interval != 0) && ((StartTime - mLastPollTimeUs) >= MultU64x32 (Interval, 1000)));
+
+  BreakInCount = gDebuggerPollStats.BreakInCount;
+  if (Poll) {
+    mSmisSincePoll  = 0;
+    mLastPollTimeUs = StartTime;
+    DebuggerPollInput ();
+  }
+
+  // Time spent broken in is not overhead.
+  gDebuggerPollStats.SmiCount++;
+  if (BreakInCount == gDebuggerPollStats.BreakInCount) {
+    Overhead                               = DebugGetTimeUs () - StartTime;
+    gDebuggerPollStats.TotalSmiOverheadUs += Overhead;
+    gDebuggerPollStats.MaxSmiOverheadUs    = MAX (gDebuggerPollStats.MaxSmiOverheadUs, Overhead);
+  }
+}
+
 /**
   Initialize debug agent.
 
@@ -325,13 +473,15 @@ InitializeDebugAgent (
     }
 
     DebugArchInit (DebugHob);
+    DbgCrashDumpInit ((VOID *)(UINTN)PcdGet64 (PcdDebuggerCrashDumpAddress), PcdGet32 (PcdDebuggerCrashDumpSize));
 
     Status = DebugAgentExceptionInitialize ();
     if (EFI_ERROR (Status)) {
       return;
     }
 
-    mDebuggerInitialized = TRUE;
+    mDebuggerInitialized              = TRUE;
+    gDebuggerPollStats.PollIntervalMs = PcdGet32 (PcdMmDebuggerPollIntervalMs);
 
     //
     // If requested, call the initial breakpoint.
@@ -342,7 +492,7 @@ InitializeDebugAgent (
     }
   } else if (InitFlag == DEBUG_AGENT_INIT_ENTER_SMI) {
     if (mDebuggerInitialized) {
-      DebuggerPollInput ();
+      DebugAgentEnterSmi ();
     }
   } else if (InitFlag == 0) {
     // Special case for DebugApp to indicate DebugApp is terminating.
@@ -108,6 +108,36 @@ DebugReboot (
   return;
 }
 
+/**
+  Reports whether the other processors may be halted with a broadcast NMI.
+
+  In PEI any processor running PEI code shares the exception handlers, and
+  processors waiting for a SIPI hold the NMI until they are started.
+
+  @retval   TRUE    The other processors may be halted.
+  @retval   FALSE   The other processors must not be sent an NMI.
+**/
+BOOLEAN
+DbgPhaseCanBroadcastHalt (
+  VOID
+  )
+{
+  return TRUE;
+}
+
+/**
+  Removes images that have been unloaded from the table of loaded images.
+
+  PEIMs are not unloaded, so there is nothing to remove.
+
+**/
+VOID
+DbgPhaseUpdateImages (
+  VOID
+  )
+{
+}
+
 /**
   Read system memory. In PEI post-mem, all memory is directly accessible.
 
@@ -158,6 +188,63 @@ DbgWriteMemory (
   return TRUE;
 }
 
+/**
+  Gets the attributes of a page.
+
+  @param[in]   Address      The address in the page.
+  @param[out]  Attributes   The EFI_MEMORY_* attributes of the page.
+
+  @retval  TRUE   The attributes were retrieved.
+  @retval  FALSE  The attributes could not be retrieved.
+**/
+BOOLEAN
+DbgGetPageAttributes (
+  IN  UINTN   Address,
+  OUT UINT64  *Attributes
+  )
+{
+  // NOT SUPPORTED in PEI.
+  return FALSE;
+}
+
+/**
+  Sets attributes on a page.
+
+  @param[in]  Address      The address in the page.
+  @param[in]  Attributes   The EFI_MEMORY_* attributes to set.
+
+  @retval  TRUE   The attributes were set.
+  @retval  FALSE  The attributes could not be set.
+**/
+BOOLEAN
+DbgSetPageAttributes (
+  IN UINTN   Address,
+  IN UINT64  Attributes
+  )
+{
+  // NOT SUPPORTED in PEI.
+  return FALSE;
+}
+
+/**
+  Clears attributes from a page.
+
+  @param[in]  Address      The address in the page.
+  @param[in]  Attributes   The EFI_MEMORY_* attributes to clear.
+
+  @retval  TRUE   The attributes were cleared.
+  @retval  FALSE  The attributes could not be cleared.
+**/
+BOOLEAN
+DbgClearPageAttributes (
+  IN UINTN   Address,
+  IN UINT64  Attributes
+  )
+{
+  // NOT SUPPORTED in PEI.
+  return FALSE;
+}
+
 /**
   Setup the debugger to break when a particular module is loaded.
 
@@ -176,6 +263,25 @@ DbgSetBreakOnModuleLoad (
   return FALSE;
 }
 
+/**
+  Removes a module from the break on load set.
+
+  @param[in]  Module   The name of the module as it was set. If empty, all
+                       modules are removed.
+
+  @retval  TRUE   The break on module was removed.
+  @retval  FALSE  The break on module was not found.
+
+**/
+BOOLEAN
+DbgRemoveBreakOnModuleLoad (
+  IN CHAR8  *Module
+  )
+{
+  // NOT SUPPORTED in PEI.
+  return FALSE;
+}
+
 /**
   Initialize debug agent.
 
@@ -211,6 +317,7 @@ InitializeDebugAgent (
   }
 
   DebugArchInit (&DefaultPeiDebugConfig);
+  DbgCrashDumpInit ((VOID *)(UINTN)PcdGet64 (PcdDebuggerCrashDumpAddress), PcdGet32 (PcdDebuggerCrashDumpSize));
 
   Status = DebugAgentExceptionInitialize ();
   if (EFI_ERROR (Status)) {
@@ -16,7 +16,9 @@
 #include <Library/BaseMemoryLib.h>
 #include <Library/DebugLib.h>
 #include <Library/DebugTransportLib.h>
+#include <Library/DebugHostDetectLib.h>
 #include <Library/TransportLogControlLib.h>
+#include <Library/TransportLogCaptureLib.h>
 
 #include <Library/UefiLib.h>
 #include <Library/PrintLib.h>
@@ -32,6 +34,18 @@
 #define MAX_RESPONSE_SIZE  0x1000
 #define SCRATCH_SIZE       1024
 
+// Maximum length of a qSearch:memory pattern after unescaping.
+#define MAX_SEARCH_PATTERN_SIZE  256
+
+// Size of the cached target description, enough for the largest register table.
+#define TARGET_XML_SIZE  SIZE_8KB
+
+// Maximum number of register features in a target description.
+#define MAX_REGISTER_FEATURES  4
+
+// Time after the last packet the debugger is still considered active.
+#define HOST_ACTIVITY_WINDOW_MS  5000
+
 // Used for quick translation of numbers into HEX.
 STATIC CONST UINT8  HexChars[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
 
@@ -41,14 +55,27 @@ STATIC CONST CHAR8  *EXCEPTION_TYPE_STRINGS[] = {
   "ExceptionGenericFault",
   "ExceptionInvalidOp",
   "ExceptionAlignment",
-  "ExceptionAccessViolation"
+  "ExceptionAccessViolation",
+  "ExceptionWatchpoint"
+};
+
+// Signal reported in a core file for each exception type, matching efi crash.
+STATIC CONST UINT16  EXCEPTION_TYPE_SIGNALS[] = {
+  5,  // SIGTRAP
+  5,  // SIGTRAP
+  11, // SIGSEGV
+  4,  // SIGILL
+  7,  // SIGBUS
+  11, // SIGSEGV
+  5   // SIGTRAP
 };
 
 STATIC CONST CHAR8  *BREAK_REASON_STRINGS[] = {
   "N/A",
   "Initial Breakpoint",
   "Module Load",
-  "Debugger Break"
+  "Debugger Break",
+  "Image Load"
 };
 
 //
@@ -60,6 +87,9 @@ EXCEPTION_INFO      *gExceptionInfo   = NULL;
 BOOLEAN             gRunning          = TRUE;
 BOOLEAN             mRebootOnContinue = FALSE;
 
+// Counters for the break-in polling, the interval is maintained by the phase.
+DEBUGGER_POLL_STATS  gDebuggerPollStats = { 0 };
+
 //
 // Buffers for GDB packets. Memory allocation are not available at first, so these
 // must be static.
@@ -78,6 +108,40 @@ STATIC CHAR8  *mResponse = &mResponseFull[1];
 // Used for storing data temporarily.
 STATIC CHAR8  mScratch[SCRATCH_SIZE];
 
+// Used by memory searches to hold a page of target memory plus the tail of the
+// previous page so that matches spanning pages are not missed.
+STATIC UINT8  mSearchWindow[EFI_PAGE_SIZE + MAX_SEARCH_PATTERN_SIZE];
+
+// Bad character shift table for memory searches.
+STATIC UINTN  mSearchShift[256];
+
+// Frames of the backtrace unwound by the agent.
+STATIC STACK_FRAME  mStackFrames[MAX_STACK_FRAMES];
+
+// The target description does not change, so it is built once and then served
+// from here. The documents are stored back to back, target.xml first and then
+// one per register feature, and each entry of mTargetXmlOffsets is the start of a
+// document with the final entry marking the end of the last. Features the
+// processor does not support are left empty.
+STATIC CHAR8    mTargetXml[TARGET_XML_SIZE];
+STATIC UINTN    mTargetXmlOffsets[MAX_REGISTER_FEATURES + 2];
+STATIC BOOLEAN  mRegisterInfoReady = FALSE;
+
+// Number of registers in the 'g' packet. Registers after the last one held in the
+// system context are omitted and GDB reads them with 'p' if needed, so stops that
+// never look at them do not pay for saving the extended state.
+STATIC UINTN  mGeneralRegisterCount;
+
+// Tracks the requested window of a qXfer read while the document is generated.
+typedef struct _XFER_WINDOW {
+  UINTN      Offset;
+  UINTN      Length;
+  UINTN      Position;
+  UINTN      Consumed;
+  UINTN      Written;
+  BOOLEAN    Full;
+} XFER_WINDOW;
+
 // Tracks if the previous response was acknowledged by the debugger.
 STATIC BOOLEAN  mResponseAcknowledged = FALSE;
 
@@ -87,6 +151,29 @@ STATIC volatile UINT64  mNextBreakpointTimeout = 0;
 // Tracks if successful communication has occurred with a debugger.
 STATIC BOOLEAN  mConnectionOccurred;
 
+// Time of the last valid packet, 0 after the debugger detached.
+STATIC volatile UINT64  mLastPacketTime = 0;
+
+// Indicates the debugger should be notified of every image load.
+STATIC BOOLEAN  mImageLoadStops = FALSE;
+
+// Indicates the stop reply was already sent by the host presence probe.
+STATIC BOOLEAN  mStopReplySent = FALSE;
+
+// Time of the last break-in poll, used to bound the break-in latency.
+STATIC UINT64  mLastPollTimeUs = 0;
+
+// The processor that owns the debugger and its context. gSystemContext points
+// either here or to the slot of the thread selected with 'Hg'.
+STATIC UINTN               mStopProcessor;
+STATIC EFI_SYSTEM_CONTEXT  *mStopContext;
+
+// Set when the debugger single steps the stopped processor.
+STATIC BOOLEAN  mStepping;
+
+// Set once the core dump segments are built during the current stop.
+STATIC BOOLEAN  mCoreReady = FALSE;
+
 /**
   Read a byte from the debug transport.
 
@@ -172,26 +259,27 @@ GdbNotifyLog (
 */
 
 /**
-  Sends a checksummed GDB packet response.
+  Sends a checksummed GDB packet response of the given length. The response
+  may contain binary data.
 
-  @param[in] Response   The NULL terminated string of the response. The NULL,
-                        will resend last packet.
+  @param[in] Response        The response data. NULL will resend last packet.
+  @param[in] ResponseLength  The length of the response data.
 **/
 STATIC
 VOID
-SendGdbResponse (
-  CHAR8  *Response
+SendGdbBinaryResponse (
+  CHAR8  *Response,
+  UINTN  ResponseLength
   )
 {
   UINT8         Checksum;
-  STATIC UINTN  ResponseLength = 0;
+  STATIC UINTN  PacketLength = 0;
 
   if (Response == NULL) {
     // This is requesting a resend.
     ASSERT (!mResponseAcknowledged);
-    ASSERT (ResponseLength >= 4);
+    ASSERT (PacketLength >= 4);
   } else {
-    ResponseLength = AsciiStrLen (Response);
     ASSERT (ResponseLength <= MAX_RESPONSE_SIZE);
     Checksum = CalculateSum8 ((UINT8 *)Response, ResponseLength);
 
@@ -206,12 +294,27 @@ SendGdbResponse (
     mResponseFull[ResponseLength + 2] = HexChars[Checksum >> 4];
     mResponseFull[ResponseLength + 3] = HexChars[Checksum & 0xF];
     mResponseFull[ResponseLength + 4] = 0;
-    ResponseLength                   += 4;
+    PacketLength                      = ResponseLength + 4;
   }
 
   mResponseAcknowledged = FALSE;
   // DEBUG ((DEBUG_INFO, "Response '%a' \n", ResponseFull));
-  DebugTransportWrite ((UINT8 *)&mResponseFull[0], ResponseLength);
+  DebugTransportWrite ((UINT8 *)&mResponseFull[0], PacketLength);
+}
+
+/**
+  Sends a checksummed GDB packet response.
+
+  @param[in] Response   The NULL terminated string of the response. The NULL,
+                        will resend last packet.
+**/
+STATIC
+VOID
+SendGdbResponse (
+  CHAR8  *Response
+  )
+{
+  SendGdbBinaryResponse (Response, (Response == NULL) ? 0 : AsciiStrLen (Response));
 }
 
 /**
@@ -308,11 +411,163 @@ VOID
 SendStopReply (
   )
 {
+  // Image loads are reported as a library change so the debugger will reload
+  // the library list, and resume if not configured to stop on library events.
+  if (DebuggerBreakpointReason == BreakpointReasonImageLoad) {
+    AsciiSPrint (mResponse, MAX_RESPONSE_SIZE, "T05library:;thread:%x;", (UINT32)(mStopProcessor + 1));
+    SendGdbResponse (mResponse);
+    return;
+  }
+
   switch (gExceptionInfo->ExceptionType) {
+    case ExceptionWatchpoint:
+      AsciiSPrint (
+        mResponse,
+        MAX_RESPONSE_SIZE,
+        "T05%a:%llx;thread:%x;",
+        gExceptionInfo->FaultIsWrite ? "watch" : "awatch",
+        gExceptionInfo->FaultAddress,
+        (UINT32)(mStopProcessor + 1)
+        );
+      SendGdbResponse (mResponse);
+      break;
+
     // TODO add more specific stop reasons for GDB support.
     default:
-      SendGdbResponse ("T05thread:01;");
+      AsciiSPrint (mResponse, MAX_RESPONSE_SIZE, "T05thread:%x;", (UINT32)(mStopProcessor + 1));
+      SendGdbResponse (mResponse);
+  }
+}
+
+/**
+  Parses a GDB thread ID.
+
+  @param[in]  String  The thread ID string.
+
+  @retval   The thread ID, 0 for any thread and MAX_UINTN for all threads.
+**/
+STATIC
+UINTN
+ParseThreadId (
+  IN CHAR8  *String
+  )
+{
+  if (String[0] == '-') {
+    return MAX_UINTN;
+  }
+
+  return AsciiStrHexToUintn (String);
+}
+
+/**
+  Gets the context of a thread. Thread IDs are the processor index plus one.
+
+  @param[in]  ThreadId  The GDB thread ID.
+
+  @retval   The context of the thread, or NULL if the processor is not stopped.
+**/
+STATIC
+EFI_SYSTEM_CONTEXT *
+GetThreadContext (
+  IN UINTN  ThreadId
+  )
+{
+  if ((ThreadId == 0) || (ThreadId == MAX_UINTN) || (ThreadId == mStopProcessor + 1)) {
+    return mStopContext;
+  }
+
+  return DbgGetProcessorContext (ThreadId - 1);
+}
+
+/**
+  Processes the 'H' packet. Register accesses use the thread selected with 'Hg',
+  while continuing and stepping always apply to the processor that stopped and
+  resume the others with it.
+
+  @param[in]  Command   The command following the 'H'.
+
+**/
+STATIC
+VOID
+ProcessSetThread (
+  IN CHAR8  *Command
+  )
+{
+  EFI_SYSTEM_CONTEXT  *Context;
+
+  Context = GetThreadContext (ParseThreadId (&Command[1]));
+  if (Context == NULL) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  if (Command[0] == 'g') {
+    gSystemContext = Context;
+  }
+
+  SendGdbResponse ("OK");
+}
+
+/**
+  Sends the list of threads, one for each processor stopped in the debugger
+  starting with the one that owns it.
+
+**/
+STATIC
+VOID
+SendThreadList (
+  VOID
+  )
+{
+  CONST DEBUG_PROCESSOR  *Processor;
+  UINTN                  Index;
+  UINTN                  Length;
+
+  Length = AsciiSPrint (mResponse, MAX_RESPONSE_SIZE, "m%x", (UINT32)(mStopProcessor + 1));
+  for (Index = 0; Index < DbgGetProcessorCount (); Index++) {
+    Processor = DbgGetProcessor (Index);
+    if ((Index == mStopProcessor) || (Processor->State == ProcessorRunning)) {
+      continue;
+    }
+
+    Length += AsciiSPrint (&mResponse[Length], MAX_RESPONSE_SIZE - Length, ",%x", (UINT32)(Index + 1));
   }
+
+  SendGdbResponse (mResponse);
+}
+
+/**
+  Sends the description of a thread shown by the debugger.
+
+  @param[in]  Command   The thread ID.
+
+**/
+STATIC
+VOID
+SendThreadExtraInfo (
+  IN CHAR8  *Command
+  )
+{
+  CONST DEBUG_PROCESSOR  *Processor;
+  UINTN                  ThreadId;
+
+  ThreadId  = ParseThreadId (Command);
+  Processor = ((ThreadId == 0) || (ThreadId == MAX_UINTN)) ? NULL : DbgGetProcessor (ThreadId - 1);
+  if (Processor == NULL) {
+    AsciiSPrint (mScratch, SCRATCH_SIZE, "Processor");
+  } else {
+    AsciiSPrint (
+      mScratch,
+      SCRATCH_SIZE,
+      "Processor %d, ID 0x%llx%a",
+      (UINT32)(ThreadId - 1),
+      Processor->Key - 1,
+      (Processor->State == ProcessorHalted) ? ", halted" : ""
+      );
+  }
+
+  ConvertResponseToHex (&mScratch[0], &mResponse[0], MAX_RESPONSE_SIZE);
+  SendGdbResponse (mResponse);
 }
 
 /**
@@ -350,9 +605,10 @@ ProcessVCommand (
         gRunning = TRUE;
         return;
       } else if ((Command[DelimiterIndex + 1] == 's')) {
-        // step
-        AddSingleStep (gSystemContext);
-        gRunning = TRUE;
+        // step, the other processors stay halted.
+        AddSingleStep (mStopContext);
+        mStepping = TRUE;
+        gRunning  = TRUE;
         return;
       }
     } else if (OriginalDelimiter == '?') {
@@ -486,215 +742,1653 @@ ProcessMemoryCommand (
 }
 
 /**
-  Processes a custom qRcmd,#### command. These commands are specific to the UEFI
-  debugger and may be expanded with functionality as needed.
+  Searches a buffer for a pattern using the Boyer-Moore-Horspool algorithm. The
+  mSearchShift table must already be initialized for the pattern.
+
+  @param[in]  Buffer         The buffer to search.
+  @param[in]  BufferLength   The length of the buffer.
+  @param[in]  Pattern        The pattern to search for.
+  @param[in]  PatternLength  The length of the pattern, must be non-zero.
+
+  @retval   The offset of the first match in the buffer, or MAX_UINTN if not found.
+**/
+STATIC
+UINTN
+SearchBuffer (
+  IN CONST UINT8  *Buffer,
+  IN UINTN        BufferLength,
+  IN CONST UINT8  *Pattern,
+  IN UINTN        PatternLength
+  )
+{
+  UINTN  Offset;
+  UINTN  Index;
+  UINT8  Last;
+
+  Last   = Pattern[PatternLength - 1];
+  Offset = 0;
+  while (Offset + PatternLength <= BufferLength) {
+    if (Buffer[Offset + PatternLength - 1] == Last) {
+      for (Index = 0; Index < PatternLength - 1; Index++) {
+        if (Buffer[Offset + Index] != Pattern[Index]) {
+          break;
+        }
+      }
+
+      if (Index == PatternLength - 1) {
+        return Offset;
+      }
+    }
+
+    Offset += mSearchShift[Buffer[Offset + PatternLength - 1]];
+  }
+
+  return MAX_UINTN;
+}
+
+/**
+  Processes a qSearch:memory command and sends the response. The command is in
+  the form of "address;length;search-pattern" where the search pattern is escaped
+  binary data. Pages which can not be read are skipped.
+
+  @param[in]  Command         The search command after the "Search:memory:" prefix.
+  @param[in]  CommandLength   The length of the search command.
+
+**/
+STATIC
+VOID
+ProcessSearchMemory (
+  CHAR8   *Command,
+  UINT32  CommandLength
+  )
+{
+  CHAR8       *LengthString;
+  CHAR8       *PatternString;
+  UINT8       *Pattern;
+  UINTN       PatternLength;
+  UINTN       Index;
+  UINT64      Address;
+  UINT64      Length;
+  UINTN       ChunkLength;
+  UINTN       WindowLength;
+  UINTN       Carry;
+  UINTN       Match;
+  EFI_STATUS  Status;
+
+  LengthString = ScanMem8 (&Command[0], CommandLength, ';');
+  if (LengthString == NULL) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  *LengthString = 0;
+  LengthString += 1;
+
+  PatternString = ScanMem8 (LengthString, CommandLength - (LengthString - Command), ';');
+  if (PatternString == NULL) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  *PatternString = 0;
+  PatternString += 1;
+
+  Status = AsciiStrHexToUint64S (&Command[0], NULL, &Address);
+  if (EFI_ERROR (Status)) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  Status = AsciiStrHexToUint64S (LengthString, NULL, &Length);
+  if (EFI_ERROR (Status)) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  //
+  // The pattern is binary data where '#', '$', '}' and '*' are escaped by '}'
+  // and the character XOR 0x20. Unescape in place as the result can only shrink.
+  //
+
+  Pattern       = (UINT8 *)PatternString;
+  PatternLength = 0;
+  for (Index = PatternString - Command; Index < CommandLength; Index++) {
+    if ((Command[Index] == '}') && (Index + 1 < CommandLength)) {
+      Index++;
+      Pattern[PatternLength++] = Command[Index] ^ 0x20;
+    } else {
+      Pattern[PatternLength++] = Command[Index];
+    }
+  }
+
+  if ((PatternLength == 0) || (PatternLength > MAX_SEARCH_PATTERN_SIZE)) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  // Don't search past the end of the address space.
+  if (Length > (MAX_UINT64 - Address)) {
+    Length = MAX_UINT64 - Address;
+  }
+
+  for (Index = 0; Index < ARRAY_SIZE (mSearchShift); Index++) {
+    mSearchShift[Index] = PatternLength;
+  }
+
+  for (Index = 0; Index < PatternLength - 1; Index++) {
+    mSearchShift[Pattern[Index]] = PatternLength - 1 - Index;
+  }
+
+  //
+  // Search a page at a time, keeping the last PatternLength - 1 bytes of the
+  // previous page at the start of the window so matches across pages are found.
+  //
+
+  Carry = 0;
+  while (Length > 0) {
+    ChunkLength = (UINTN)MIN (Length, EFI_PAGE_SIZE - (Address & EFI_PAGE_MASK));
+    if (!DbgReadMemory ((UINTN)Address, &mSearchWindow[Carry], ChunkLength)) {
+      // No match can span an unreadable page.
+      Carry = 0;
+    } else {
+      WindowLength = Carry + ChunkLength;
+      Match        = SearchBuffer (&mSearchWindow[0], WindowLength, Pattern, PatternLength);
+      if (Match != MAX_UINTN) {
+        AsciiSPrint (mResponse, MAX_RESPONSE_SIZE, "1,%llx", Address - Carry + Match);
+        SendGdbResponse (mResponse);
+        return;
+      }
+
+      Carry = MIN (PatternLength - 1, WindowLength);
+      CopyMem (&mSearchWindow[0], &mSearchWindow[WindowLength - Carry], Carry);
+    }
+
+    Address += ChunkLength;
+    Length  -= ChunkLength;
+  }
+
+  SendGdbResponse ("0");
+}
+
+/**
+  Adds or removes modules from the break on load set. Modules are separated by
+  spaces or commas and may contain '*' and '?' wildcards. The results are
+  written to the scratch buffer.
+
+  @param[in]  Arguments  The monitor command arguments.
+
+**/
+STATIC
+VOID
+ProcessModuleBreakCmd (
+  IN CHAR8  *Arguments
+  )
+{
+  BOOLEAN  Remove;
+  CHAR8    *Module;
+  UINTN    Length;
+
+  Remove = (*Arguments == '-');
+  if (Remove) {
+    Arguments++;
+  }
+
+  Length = 0;
+  while ((*Arguments == ' ') || (*Arguments == ',')) {
+    Arguments++;
+  }
+
+  if (*Arguments == 0) {
+    if (Remove) {
+      DbgRemoveBreakOnModuleLoad ("");
+      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Cleared all break on load modules\n\r");
+    } else {
+      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "No module specified\n\r");
+    }
+
+    return;
+  }
+
+  while (*Arguments != 0) {
+    Module = Arguments;
+    while ((*Arguments != 0) && (*Arguments != ' ') && (*Arguments != ',')) {
+      Arguments++;
+    }
+
+    if (*Arguments != 0) {
+      *Arguments = 0;
+      Arguments++;
+    }
+
+    if (*Module != 0) {
+      if (Remove) {
+        Length += AsciiSPrint (
+                    &mScratch[Length],
+                    SCRATCH_SIZE - Length,
+                    DbgRemoveBreakOnModuleLoad (Module) ? "Removed break on load for %a\n\r" : "No break on load set for %a\n\r",
+                    Module
+                    );
+      } else {
+        Length += AsciiSPrint (
+                    &mScratch[Length],
+                    SCRATCH_SIZE - Length,
+                    DbgSetBreakOnModuleLoad (Module) ? "Will break on load for %a\n\r" : "FAILED to set break on load for %a\n\r",
+                    Module
+                    );
+      }
+    }
+  }
+}
+
+/**
+  Processes the backtrace monitor command, writing the frames to the scratch
+  buffer. Frames that do not fit in the scratch buffer are not shown.
+
+  @param[in]  Argument  The command after the 'k', the number of frames in HEX.
+                        Defaults to 16 frames.
+
+**/
+STATIC
+VOID
+ProcessBacktraceCmd (
+  IN CHAR8  *Argument
+  )
+{
+  UINTN  Count;
+  UINTN  Index;
+  UINTN  Length;
+
+  if ((*Argument == 0) || EFI_ERROR (AsciiStrHexToUintnS (Argument, NULL, &Count)) || (Count == 0)) {
+    Count = 16;
+  }
+
+  Count  = DebugArchUnwindStack (*gSystemContext, &mStackFrames[0], MIN (Count, MAX_STACK_FRAMES));
+  Length = AsciiSPrint (&mScratch[0], SCRATCH_SIZE, " # Pc                 Sp\n\r");
+  for (Index = 0; Index < Count; Index++) {
+    Length += AsciiSPrint (
+                &mScratch[Length],
+                SCRATCH_SIZE - Length,
+                "%2d 0x%016llx 0x%016llx\n\r",
+                (UINT32)Index,
+                mStackFrames[Index].Pc,
+                mStackFrames[Index].Sp
+                );
+  }
+}
+
+/**
+  Processes the counting watchpoint monitor command, writing the result to the
+  scratch buffer.
+
+  @param[in]  Argument  The command after the 'w'. '+<Address>,<Length>[,<Flags>]'
+                        adds a watchpoint where the flags are 'r', 'w' or 'a'
+                        for the access and 'p' to record the PCs of the hits.
+                        '-[<Address>]' removes one or all watchpoints and 'c'
+                        resets the counts. The statistics are always printed.
+
+**/
+STATIC
+VOID
+ProcessWatchCmd (
+  IN CHAR8  *Argument
+  )
+{
+  CONST COUNTING_WATCH  *Watch;
+  UINTN                 Address;
+  UINTN                 Length;
+  UINTN                 Offset;
+  UINTN                 Index;
+  UINTN                 Pc;
+  BOOLEAN               Read;
+  BOOLEAN               Write;
+  BOOLEAN               RecordPc;
+
+  Offset = 0;
+  switch (Argument[0]) {
+    case '+':
+      if (EFI_ERROR (AsciiStrHexToUintnS (&Argument[1], &Argument, &Address)) ||
+          (*Argument != ',') ||
+          EFI_ERROR (AsciiStrHexToUintnS (Argument + 1, &Argument, &Length)))
+      {
+        Offset += AsciiSPrint (&mScratch[Offset], SCRATCH_SIZE - Offset, "Invalid watchpoint\n\r");
+        break;
+      }
+
+      Read     = FALSE;
+      Write    = FALSE;
+      RecordPc = FALSE;
+      for ( ; *Argument != 0; Argument++) {
+        Read     |= (*Argument == 'r') || (*Argument == 'a');
+        Write    |= (*Argument == 'w') || (*Argument == 'a');
+        RecordPc |= (*Argument == 'p');
+      }
+
+      // Writes are counted by default.
+      if (!Read && !Write) {
+        Write = TRUE;
+      }
+
+      if (!DbgAddCountingWatch (Address, Length, Read, Write, RecordPc)) {
+        Offset += AsciiSPrint (&mScratch[Offset], SCRATCH_SIZE - Offset, "FAILED to add watchpoint\n\r");
+      }
+
+      break;
+    case '-':
+      Address = MAX_UINTN;
+      if (Argument[1] != 0) {
+        Address = AsciiStrHexToUintn (&Argument[1]);
+      }
+
+      if (!DbgRemoveCountingWatch (Address)) {
+        Offset += AsciiSPrint (&mScratch[Offset], SCRATCH_SIZE - Offset, "No watchpoint found\n\r");
+      }
+
+      break;
+    case 'c':
+      DbgClearWatchCounts ();
+      break;
+    default:
+      break;
+  }
+
+  for (Index = 0; Index < MAX_COUNTING_WATCHES; Index++) {
+    Watch = DbgGetCountingWatch (Index);
+    if (Watch == NULL) {
+      continue;
+    }
+
+    Offset += AsciiSPrint (
+                &mScratch[Offset],
+                SCRATCH_SIZE - Offset,
+                "0x%llx+0x%llx %a%a: %lld hits\n\r",
+                (UINT64)Watch->Address,
+                (UINT64)Watch->Length,
+                Watch->Read ? "r" : "",
+                Watch->Write ? "w" : "",
+                Watch->HitCount
+                );
+
+    // Most recent first.
+    for (Pc = 0; Watch->RecordPc && (Pc < MIN (Watch->HitCount, WATCH_PC_COUNT)); Pc++) {
+      Offset += AsciiSPrint (
+                  &mScratch[Offset],
+                  SCRATCH_SIZE - Offset,
+                  "  PC 0x%llx\n\r",
+                  Watch->Pcs[(Watch->HitCount - 1 - Pc) % WATCH_PC_COUNT]
+                  );
+    }
+  }
+
+  if (Offset == 0) {
+    AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "No counting watchpoints\n\r");
+  }
+}
+
+/**
+  Processes the profiler monitor command, writing the result to the scratch buffer.
+
+  @param[in]  Argument  The command after the 'p'. '+' starts sampling, '-'
+                        stops sampling and 'c' discards the samples.
+
+**/
+STATIC
+VOID
+ProcessProfileCmd (
+  IN CHAR8  *Argument
+  )
+{
+  CONST PROFILE_HEADER  *Header;
+
+  Header = DbgGetProfileHeader ();
+  if (Header == NULL) {
+    AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Profiler not enabled.\n\r");
+    return;
+  }
+
+  switch (Argument[0]) {
+    case '+':
+      DbgProfileEnable (TRUE);
+      break;
+    case '-':
+      DbgProfileEnable (FALSE);
+      break;
+    case 'c':
+      DbgClearProfile ();
+      break;
+    default:
+      break;
+  }
+
+  AsciiSPrint (
+    &mScratch[0],
+    SCRATCH_SIZE,
+    "Profiler: %a\n\r"
+    "Interval: %d us\n\r"
+    "Depth: %d\n\r"
+    "Samples: %d\n\r"
+    "Missed: %d\n\r",
+    DbgProfileIsEnabled () ? "running" : "stopped",
+    Header->IntervalUs,
+    Header->Depth,
+    Header->SampleCount,
+    Header->Missed
+    );
+}
+
+/**
+  Processes the core dump monitor command, writing the result to the scratch
+  buffer. The memory is split into segments that are kept until execution
+  resumes, and the core file is then read with qXfer:uefi-core:read.
+
+**/
+STATIC
+VOID
+ProcessCoreDumpCmd (
+  VOID
+  )
+{
+  CONST CORE_SEGMENT  *Segment;
+  UINTN               Index;
+  UINT64              MemorySize;
+  UINT64              FileSize;
+
+  DbgBuildCoreSegments ();
+  mCoreReady = TRUE;
+
+  MemorySize = 0;
+  FileSize   = 0;
+  for (Index = 0; (Segment = DbgGetCoreSegment (Index)) != NULL; Index++) {
+    MemorySize += Segment->Size;
+    FileSize   += Segment->FileSize;
+  }
+
+  AsciiSPrint (
+    &mScratch[0],
+    SCRATCH_SIZE,
+    "Core dump ready.\n\r"
+    "Segments: %d\n\r"
+    "Memory: 0x%llx bytes\n\r"
+    "Data: 0x%llx bytes\n\r"
+    "Zero pages left out: 0x%llx bytes\n\r",
+    (UINT32)Index,
+    MemorySize,
+    FileSize,
+    MemorySize - FileSize
+    );
+}
+
+/**
+  Prints the crash saved before a debugger connected. The first processor is
+  the one that took the fault, and its backtrace is shown against the images
+  that were loaded at the time.
+
+  @param[in]  Argument  The command argument, "-" to discard the crash dump.
+
+**/
+STATIC
+VOID
+ProcessCrashCmd (
+  IN CHAR8  *Argument
+  )
+{
+  CONST CRASH_DUMP_HEADER  *Crash;
+  CONST CRASH_PROCESSOR    *Processor;
+  CONST CRASH_IMAGE        *Images;
+  CONST CHAR8              *Exception;
+  UINTN                    Length;
+  UINTN                    Index;
+  UINTN                    ImageIndex;
+  UINT64                   Pc;
+
+  Crash = DbgGetCrashDump ();
+  if (Crash == NULL) {
+    AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "No crash dump.\n\r");
+    return;
+  }
+
+  if (*Argument == '-') {
+    DbgCrashDumpReported (TRUE);
+    AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Crash dump discarded.\n\r");
+    return;
+  }
+
+  if (Crash->ExceptionType < ARRAY_SIZE (EXCEPTION_TYPE_STRINGS)) {
+    Exception = EXCEPTION_TYPE_STRINGS[Crash->ExceptionType];
+  } else {
+    Exception = "Unknown";
+  }
+
+  Length = AsciiSPrint (
+             &mScratch[0],
+             SCRATCH_SIZE,
+             "Exception Type: %a (%d)\n\r"
+             "Exception Address: %llx\n\r"
+             "Architecture Exception Code: 0x%llx\n\r"
+             "Fault Address: %llx (%a)\n\r"
+             "Time: %lld us\n\r"
+             "Processors: %d Images: %d%a\n\r",
+             Exception,
+             Crash->ExceptionType,
+             Crash->ExceptionAddress,
+             Crash->ArchExceptionCode,
+             Crash->FaultAddress,
+             Crash->FaultIsWrite ? "write" : "read",
+             Crash->TimeUs,
+             Crash->ProcessorCount,
+             Crash->ImageCount,
+             Crash->Truncated ? " (truncated)" : ""
+             );
+
+  if (Crash->ProcessorCount != 0) {
+    Processor = (CONST CRASH_PROCESSOR *)(Crash + 1);
+    Images    = (CONST CRASH_IMAGE *)((UINT8 *)Processor + Crash->ProcessorCount * (sizeof (CRASH_PROCESSOR) + Crash->RegisterCount * sizeof (UINT64)));
+    for (Index = 0; Index < MIN (Processor->FrameCount, CRASH_FRAME_COUNT); Index++) {
+      Pc = Processor->Frames[Index].Pc;
+      for (ImageIndex = 0; ImageIndex < Crash->ImageCount; ImageIndex++) {
+        if ((Pc >= Images[ImageIndex].ImageBase) && (Pc - Images[ImageIndex].ImageBase < Images[ImageIndex].ImageSize)) {
+          break;
+        }
+      }
+
+      if (ImageIndex < Crash->ImageCount) {
+        Length += AsciiSPrint (
+                    &mScratch[Length],
+                    SCRATCH_SIZE - Length,
+                    "%2d %llx %.*a+0x%llx\n\r",
+                    (UINT32)Index,
+                    Pc,
+                    (UINTN)CRASH_IMAGE_NAME_SIZE,
+                    Images[ImageIndex].Name,
+                    Pc - Images[ImageIndex].ImageBase
+                    );
+      } else {
+        Length += AsciiSPrint (&mScratch[Length], SCRATCH_SIZE - Length, "%2d %llx\n\r", (UINT32)Index, Pc);
+      }
+    }
+  }
+
+  DbgCrashDumpReported (FALSE);
+}
+
+/**
+  Processes a custom qRcmd,#### command. These commands are specific to the UEFI
+  debugger and may be expanded with functionality as needed.
+
+  @param[in]  CommandHex  The HEX encoded string of the command.
+
+**/
+VOID
+ProcessMonitorCmd (
+  CHAR8  *CommandHex
+  )
+{
+  UINTN  Index;
+  UINTN  CommandLen;
+  CHAR8  Command[128];
+  CHAR8  *Argument;
+  UINTN  Address;
+  UINTN  Step;
+  UINTN  Range;
+  UINTN  ImageBase;
+  UINTN  ImageSize;
+  CHAR8  PdbName[256];
+
+  // The command comes in hex encoded, convert it to a byte array.
+  CommandLen = AsciiStrLen (CommandHex);
+  if (((CommandLen % 2) != 0) || ((CommandLen / 2) >= sizeof (Command))) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  CommandLen /= 2;
+  for (Index = 0; Index < CommandLen; Index++) {
+    Command[Index] = HexToByte (&CommandHex[Index * 2]);
+  }
+
+  Command[Index] = 0;
+
+  //
+  // Interpret the command. This is specific to the UEFI debugger and not
+  // from the GDB specifications. Treat the first byte as the command.
+  //
+
+  mScratch[0] = 0;
+  switch (Command[0]) {
+    case '?': // Get UEFI debugger info.
+      AsciiSPrint (
+        &mScratch[0],
+        SCRATCH_SIZE,
+        "%a\n\r"
+        "Exception Type: %a (%d)\n\r"
+        "Exception Address: %llx\n\r"
+        "Architecture Exception Code: 0x%llx\n\r"
+        "Break Reason: %a\n\r",
+        gDebuggerInfo,
+        EXCEPTION_TYPE_STRINGS[gExceptionInfo->ExceptionType],
+        gExceptionInfo->ExceptionType,
+        gExceptionInfo->ExceptionAddress,
+        gExceptionInfo->ArchExceptionCode,
+        BREAK_REASON_STRINGS[DebuggerBreakpointReason]
+        );
+
+      if ((DbgGetCrashDump () != NULL) && !DbgGetCrashDump ()->Reported) {
+        AsciiStrCatS (&mScratch[0], SCRATCH_SIZE, "A crash was saved before the debugger connected, see 'monitor x'.\n\r");
+      }
+
+      break;
+
+    case 'i': // Dump system registers
+      GdbDumpSystemRegisters (&Command[1], &mScratch[0], SCRATCH_SIZE);
+      break;
+
+    case 'v': // Variable Read
+      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "TODO\n\r");
+      break;
+
+    case 'V': // Variable Write
+      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "TODO\n\r");
+      break;
+
+    case 'm': // MSR Read
+      GdbReadMsr (&Command[1], &mScratch[0], SCRATCH_SIZE);
+      break;
+
+    case 'M': // MSR Write
+      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "TODO\n\r");
+      break;
+
+    case 'R': // Set Reboot on Continue
+      mRebootOnContinue = TRUE;
+      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Will reboot on continue.\n\r");
+      break;
+
+    case 'b': // Module Break. b<Module>[ <Module>...] to add, b-<Module>[ <Module>...] to remove, b- to clear.
+      ProcessModuleBreakCmd (&Command[1]);
+      break;
+
+    case 's': // Break-in polling statistics.
+      AsciiSPrint (
+        &mScratch[0],
+        SCRATCH_SIZE,
+        "Poll Interval: %d ms\n\r"
+        "Polls: %lld\n\r"
+        "Average Poll Time: %lld us\n\r"
+        "Max Poll Time: %lld us\n\r"
+        "Break-ins: %lld\n\r"
+        "Last Break-in Latency: %lld us\n\r"
+        "Max Break-in Latency: %lld us\n\r",
+        gDebuggerPollStats.PollIntervalMs,
+        gDebuggerPollStats.PollCount,
+        (gDebuggerPollStats.PollCount == 0) ? 0 : DivU64x64Remainder (gDebuggerPollStats.TotalPollTimeUs, gDebuggerPollStats.PollCount, NULL),
+        gDebuggerPollStats.MaxPollTimeUs,
+        gDebuggerPollStats.BreakInCount,
+        gDebuggerPollStats.LastBreakInLatencyUs,
+        gDebuggerPollStats.MaxBreakInLatencyUs
+        );
+
+      if (gDebuggerPollStats.SmiCount != 0) {
+        Index = AsciiStrLen (&mScratch[0]);
+        AsciiSPrint (
+          &mScratch[Index],
+          SCRATCH_SIZE - Index,
+          "SMIs: %lld\n\r"
+          "Average SMI Overhead: %lld us\n\r"
+          "Max SMI Overhead: %lld us\n\r",
+          gDebuggerPollStats.SmiCount,
+          DivU64x64Remainder (gDebuggerPollStats.TotalSmiOverheadUs, gDebuggerPollStats.SmiCount, NULL),
+          gDebuggerPollStats.MaxSmiOverheadUs
+          );
+      }
+
+      break;
+
+    case 't': // Timeline summary, t- to clear.
+      AsciiSPrint (
+        &mScratch[0],
+        SCRATCH_SIZE,
+        "Timeline Events: %d\n\r"
+        "Dropped Events: %d\n\r"
+        "Current Time: %lld us\n\r",
+        (UINT32)DbgGetTimelineCount (),
+        (UINT32)DbgGetTimelineDropped (),
+        DebugGetTimeUs ()
+        );
+
+      if (Command[1] == '-') {
+        DbgClearTimeline ();
+        Index = AsciiStrLen (&mScratch[0]);
+        AsciiSPrint (&mScratch[Index], SCRATCH_SIZE - Index, "Timeline cleared.\n\r");
+      }
+
+      break;
+
+    case 'k': // Stack backtrace. k[<Frames>] with the frame count in HEX.
+      ProcessBacktraceCmd (&Command[1]);
+      break;
+
+    case 'w': // Counting watchpoints. w+<Address>,<Length>[,<Flags>] to add, w-[<Address>] to remove, wc to reset.
+      ProcessWatchCmd (&Command[1]);
+      break;
+
+    case 'p': // Profiler status, p+ to start, p- to stop, pc to clear.
+      ProcessProfileCmd (&Command[1]);
+      break;
+
+    case 'd': // Prepare a core dump to read with qXfer:uefi-core:read.
+      ProcessCoreDumpCmd ();
+      break;
+
+    case 'x': // Show the crash saved before a debugger connected, x- to discard it.
+      ProcessCrashCmd (&Command[1]);
+      break;
+
+    case 'l': // Toggle stopping on image loads.
+      mImageLoadStops = !mImageLoadStops;
+      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Image load stops %a.\n\r", mImageLoadStops ? "enabled" : "disabled");
+      break;
+
+    case 'f': // Find the image containing an address. f<Address>[,<Step>[,<Range>]]
+      Step  = 0;
+      Range = 0;
+      if (EFI_ERROR (AsciiStrHexToUintnS (&Command[1], &Argument, &Address))) {
+        AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Invalid address '%a'\n\r", &Command[1]);
+        break;
+      }
+
+      if ((*Argument == ',') && !EFI_ERROR (AsciiStrHexToUintnS (Argument + 1, &Argument, &Step))) {
+        if (*Argument == ',') {
+          AsciiStrHexToUintnS (Argument + 1, &Argument, &Range);
+        }
+      }
+
+      if (!DbgFindImage (Address, Step, Range, &ImageBase, &ImageSize)) {
+        AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "No image found for 0x%llx\n\r", (UINT64)Address);
+        break;
+      }
+
+      if (!DbgGetImagePdbName (ImageBase, &PdbName[0], sizeof (PdbName))) {
+        PdbName[0] = 0;
+      }
+
+      AsciiSPrint (
+        &mScratch[0],
+        SCRATCH_SIZE,
+        "ImageBase: 0x%llx\n\r"
+        "ImageSize: 0x%llx\n\r"
+        "Pdb: %a\n\r",
+        (UINT64)ImageBase,
+        (UINT64)ImageSize,
+        PdbName
+        );
+
+      break;
+
+    default:
+      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Unknown command '%a'\n\r", Command);
+      break;
+  }
+
+  // Respond with a intermediate packet, "O[HEX]" follow by an empty "OK" packet
+  // where the [HEX] is the hex encoding of the response string. The spec is
+  // vague on the need for this, but this is to be consistent with other GDB stub
+  // implementations and Windbg expectations.
+  mResponse[0] = 'O';
+  ConvertResponseToHex (&mScratch[0], &mResponse[1], MAX_RESPONSE_SIZE - 1);
+  SendGdbResponse (mResponse);
+  SendGdbResponse ("OK");
+}
+
+/**
+  Initializes a window for a qXfer read from the "offset,length" parameters of
+  the request. The document is then generated in full through the XferAppend
+  routines and only the requested window is written to the response.
+
+  @param[out]  Window      The window to initialize.
+  @param[in]   Parameters  The "offset,length" string of the qXfer request.
+
+  @retval   TRUE   The window was initialized.
+  @retval   FALSE  The parameters were not valid.
+**/
+STATIC
+BOOLEAN
+XferWindowInit (
+  OUT XFER_WINDOW  *Window,
+  IN  CHAR8        *Parameters
+  )
+{
+  CHAR8   *LengthString;
+  UINT64  Value;
+
+  ZeroMem (Window, sizeof (*Window));
+  if (EFI_ERROR (AsciiStrHexToUint64S (Parameters, &LengthString, &Value)) || (*LengthString != ',')) {
+    return FALSE;
+  }
+
+  Window->Offset = (UINTN)Value;
+  if (EFI_ERROR (AsciiStrHexToUint64S (LengthString + 1, NULL, &Value)) || (Value == 0)) {
+    return FALSE;
+  }
+
+  // Leave room for the 'm' or 'l' prefix.
+  Window->Length = (UINTN)MIN (Value, MAX_RESPONSE_SIZE - 1);
+  return TRUE;
+}
+
+/**
+  Appends data to a qXfer document. Only the data within the requested window
+  is written to the response, escaped as binary data.
+
+  @param[in,out]  Window  The qXfer window.
+  @param[in]      Data    The data to append to the document.
+  @param[in]      Length  The length of the data.
+
+**/
+STATIC
+VOID
+XferAppend (
+  IN OUT XFER_WINDOW  *Window,
+  IN CONST VOID       *Data,
+  IN UINTN            Length
+  )
+{
+  CONST UINT8  *Bytes;
+  UINTN        Index;
+  UINTN        EscapeSize;
+  UINT8        Byte;
+
+  // Data before the window only moves the position.
+  Bytes = Data;
+  Index = 0;
+  if (Window->Position < Window->Offset) {
+    Index             = MIN (Length, Window->Offset - Window->Position);
+    Window->Position += Index;
+  }
+
+  for ( ; (Index < Length) && !Window->Full; Index++, Window->Position++) {
+    Byte       = Bytes[Index];
+    EscapeSize = ((Byte == '#') || (Byte == '$') || (Byte == '}') || (Byte == '*')) ? 1 : 0;
+    if (Window->Written + EscapeSize + 1 > Window->Length) {
+      Window->Full = TRUE;
+      break;
+    }
+
+    if (EscapeSize != 0) {
+      mResponse[1 + Window->Written++] = '}';
+      Byte                            ^= 0x20;
+    }
+
+    mResponse[1 + Window->Written++] = Byte;
+    Window->Consumed++;
+  }
+
+  // So does data after the window is full.
+  Window->Position += Length - Index;
+}
+
+/**
+  Appends a formatted string to a qXfer document.
+
+  @param[in,out]  Window        The qXfer window.
+  @param[in]      FormatString  The format string.
+  @param[in]      ...           Arguments for the format string.
+
+**/
+STATIC
+VOID
+XferPrint (
+  IN OUT XFER_WINDOW  *Window,
+  IN CONST CHAR8      *FormatString,
+  ...
+  )
+{
+  VA_LIST  Marker;
+  UINTN    Length;
+
+  VA_START (Marker, FormatString);
+  Length = AsciiVSPrint (&mScratch[0], SCRATCH_SIZE, FormatString, Marker);
+  VA_END (Marker);
+
+  XferAppend (Window, &mScratch[0], Length);
+}
+
+/**
+  Appends a range of memory to a qXfer document. Only the memory within the
+  requested window is read, and memory that can not be read is sent as zeros.
+
+  @param[in,out]  Window  The qXfer window.
+  @param[in]      Address The address of the memory.
+  @param[in]      Length  The length of the memory.
+
+**/
+STATIC
+VOID
+XferAppendMemory (
+  IN OUT XFER_WINDOW  *Window,
+  IN UINT64           Address,
+  IN UINT64           Length
+  )
+{
+  UINT64  Skip;
+  UINTN   Chunk;
+
+  if (Window->Position < Window->Offset) {
+    Skip              = MIN (Length, Window->Offset - Window->Position);
+    Window->Position += (UINTN)Skip;
+    Address          += Skip;
+    Length           -= Skip;
+  }
+
+  // Chunks stop at page boundaries so an unreadable page does not zero the
+  // readable data that shares its chunk.
+  while ((Length > 0) && !Window->Full) {
+    Chunk = (UINTN)MIN (Length, SCRATCH_SIZE);
+    Chunk = MIN (Chunk, EFI_PAGE_SIZE - ((UINTN)Address & EFI_PAGE_MASK));
+    if (!DbgReadMemory ((UINTN)Address, &mScratch[0], Chunk)) {
+      ZeroMem (&mScratch[0], Chunk);
+    }
+
+    XferAppend (Window, &mScratch[0], Chunk);
+    Address += Chunk;
+    Length  -= Chunk;
+  }
+
+  Window->Position += (UINTN)Length;
+}
+
+/**
+  Sends the response for a qXfer read. The response is prefixed with 'l' if the
+  window reached the end of the document, or 'm' if there is more data.
+
+  @param[in]  Window  The qXfer window.
+
+**/
+STATIC
+VOID
+XferSend (
+  IN XFER_WINDOW  *Window
+  )
+{
+  if (Window->Offset + Window->Consumed >= Window->Position) {
+    mResponse[0] = 'l';
+  } else {
+    mResponse[0] = 'm';
+  }
+
+  SendGdbBinaryResponse (mResponse, Window->Written + 1);
+}
+
+/**
+  Builds the target description and counts the registers reported in the 'g'
+  packet. This is only done on the first call.
+
+**/
+STATIC
+VOID
+InitializeRegisterInfo (
+  VOID
+  )
+{
+  CONST GDB_REGISTER_FEATURE  *Feature;
+  BOOLEAN                     Supported[MAX_REGISTER_FEATURES];
+  UINTN                       Length;
+  UINTN                       Index;
+  UINTN                       RegNumber;
+  UINTN                       LastRegister;
+
+  if (mRegisterInfoReady) {
+    return;
+  }
+
+  ASSERT (GdbTargetInfo.FeatureCount <= MAX_REGISTER_FEATURES);
+
+  mGeneralRegisterCount = 0;
+  for (RegNumber = 0; RegNumber < gRegisterCount; RegNumber++) {
+    if ((gRegisterOffsets[RegNumber].Offset & REG_EXTENDED_STATE) == 0) {
+      mGeneralRegisterCount = RegNumber + 1;
+    }
+  }
+
+  for (Index = 0; Index < GdbTargetInfo.FeatureCount; Index++) {
+    Feature          = &GdbTargetInfo.Features[Index];
+    Supported[Index] = (Feature->IsSupported == NULL) || Feature->IsSupported ();
+  }
+
+  Length = AsciiSPrint (
+             &mTargetXml[0],
+             TARGET_XML_SIZE,
+             "<?xml version=\"1.0\"?>"
+             "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+             "<target>"
+             "<architecture>%a</architecture>",
+             GdbTargetInfo.TargetArch
+             );
+
+  for (Index = 0; Index < GdbTargetInfo.FeatureCount; Index++) {
+    if (Supported[Index]) {
+      Length += AsciiSPrint (
+                  &mTargetXml[Length],
+                  TARGET_XML_SIZE - Length,
+                  "<xi:include href=\"%a\"/>",
+                  GdbTargetInfo.Features[Index].Annex
+                  );
+    }
+  }
+
+  Length += AsciiSPrint (&mTargetXml[Length], TARGET_XML_SIZE - Length, "</target>");
+
+  for (Index = 0; Index < GdbTargetInfo.FeatureCount; Index++) {
+    mTargetXmlOffsets[Index + 1] = Length;
+    if (!Supported[Index]) {
+      continue;
+    }
+
+    Feature = &GdbTargetInfo.Features[Index];
+    Length += AsciiSPrint (
+                &mTargetXml[Length],
+                TARGET_XML_SIZE - Length,
+                "<?xml version=\"1.0\"?><!DOCTYPE feature SYSTEM \"gdb-target.dtd\"><feature name=\"%a\">%a",
+                Feature->Name,
+                (Feature->Types != NULL) ? Feature->Types : ""
+                );
+
+    if (Index + 1 < GdbTargetInfo.FeatureCount) {
+      LastRegister = GdbTargetInfo.Features[Index + 1].FirstRegister;
+    } else {
+      LastRegister = gRegisterCount;
+    }
+
+    for (RegNumber = Feature->FirstRegister; RegNumber < LastRegister; RegNumber++) {
+      if (gRegisterOffsets[RegNumber].Name == NULL) {
+        continue;
+      }
+
+      Length += AsciiSPrint (
+                  &mTargetXml[Length],
+                  TARGET_XML_SIZE - Length,
+                  "<reg name=\"%a\" bitsize=\"%d\" type=\"%a\" regnum=\"%d\"/>",
+                  gRegisterOffsets[RegNumber].Name,
+                  gRegisterOffsets[RegNumber].Size * 8,
+                  gRegisterOffsets[RegNumber].Type,
+                  RegNumber
+                  );
+    }
+
+    Length += AsciiSPrint (&mTargetXml[Length], TARGET_XML_SIZE - Length, "</feature>");
+  }
+
+  mTargetXmlOffsets[GdbTargetInfo.FeatureCount + 1] = Length;
+
+  // A full buffer means the description was truncated.
+  ASSERT (Length < TARGET_XML_SIZE - 1);
+  mRegisterInfoReady = TRUE;
+}
+
+/**
+  Sends a document of the target description, either target.xml or one of the
+  register features it includes.
+
+  @param[in]  Annex   The "annex:offset,length" string of the qXfer request.
+
+**/
+STATIC
+VOID
+ReadTargetFeature (
+  IN CHAR8  *Annex
+  )
+{
+  XFER_WINDOW  Window;
+  CHAR8        *Parameters;
+  UINTN        Document;
+  UINTN        Index;
+
+  Parameters = AsciiStrStr (Annex, ":");
+  if (Parameters == NULL) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  *Parameters = 0;
+  Parameters++;
+
+  if (!XferWindowInit (&Window, Parameters)) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  InitializeRegisterInfo ();
+  Document = MAX_UINTN;
+  if (AsciiStrCmp (Annex, "target.xml") == 0) {
+    Document = 0;
+  } else {
+    for (Index = 0; Index < GdbTargetInfo.FeatureCount; Index++) {
+      if ((AsciiStrCmp (Annex, GdbTargetInfo.Features[Index].Annex) == 0) &&
+          (mTargetXmlOffsets[Index + 2] != mTargetXmlOffsets[Index + 1]))
+      {
+        Document = Index + 1;
+        break;
+      }
+    }
+  }
+
+  if (Document == MAX_UINTN) {
+    SendGdbError (GDB_ERROR_UNSUPPORTED);
+    return;
+  }
+
+  XferAppend (
+    &Window,
+    &mTargetXml[mTargetXmlOffsets[Document]],
+    mTargetXmlOffsets[Document + 1] - mTargetXmlOffsets[Document]
+    );
+
+  XferSend (&Window);
+}
+
+/**
+  Sends the timeline events, oldest first, as an array of TIMELINE_EVENT.
+
+  @param[in]  Parameters  The "offset,length" string of the qXfer request.
+
+**/
+STATIC
+VOID
+ReadTimeline (
+  IN CHAR8  *Parameters
+  )
+{
+  XFER_WINDOW           Window;
+  CONST TIMELINE_EVENT  *Event;
+  UINTN                 Index;
+
+  if (!XferWindowInit (&Window, Parameters)) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  // Skip whole events before the window without copying them.
+  Index           = Window.Offset / sizeof (TIMELINE_EVENT);
+  Window.Position = Index * sizeof (TIMELINE_EVENT);
+  for ( ; (Event = DbgGetTimelineEvent (Index)) != NULL; Index++) {
+    XferAppend (&Window, Event, sizeof (TIMELINE_EVENT));
+    if (Window.Full) {
+      break;
+    }
+  }
+
+  // Account for any remaining events so the response is not marked as the end.
+  Window.Position = MAX (Window.Position, DbgGetTimelineCount () * sizeof (TIMELINE_EVENT));
+  XferSend (&Window);
+}
+
+/**
+  Sends the profile as a PROFILE_HEADER followed by the samples, each Depth
+  64-bit addresses.
+
+  @param[in]  Parameters  The "offset,length" string of the qXfer request.
+
+**/
+STATIC
+VOID
+ReadProfile (
+  IN CHAR8  *Parameters
+  )
+{
+  XFER_WINDOW           Window;
+  CONST PROFILE_HEADER  *Header;
+  CONST UINT64          *Sample;
+  UINTN                 SampleSize;
+  UINTN                 Index;
+
+  Header = DbgGetProfileHeader ();
+  if (Header == NULL) {
+    SendGdbError (GDB_ERROR_UNSUPPORTED);
+    return;
+  }
+
+  if (!XferWindowInit (&Window, Parameters)) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  XferAppend (&Window, Header, sizeof (PROFILE_HEADER));
+
+  // Skip whole samples before the window without copying them.
+  SampleSize = Header->Depth * sizeof (UINT64);
+  Index      = 0;
+  if (Window.Offset > Window.Position) {
+    Index           = (Window.Offset - Window.Position) / SampleSize;
+    Window.Position = Window.Position + Index * SampleSize;
+  }
+
+  for ( ; (Sample = DbgGetProfileSample (Index)) != NULL; Index++) {
+    XferAppend (&Window, Sample, SampleSize);
+    if (Window.Full) {
+      break;
+    }
+  }
+
+  // Account for any remaining samples so the response is not marked as the end.
+  Window.Position = MAX (Window.Position, sizeof (PROFILE_HEADER) + Header->SampleCount * SampleSize);
+  XferSend (&Window);
+}
+
+/**
+  Sends the backtrace of the current context as an array of STACK_FRAME,
+  innermost frame first.
+
+  @param[in]  Parameters  The "offset,length" string of the qXfer request.
+
+**/
+STATIC
+VOID
+ReadStackFrames (
+  IN CHAR8  *Parameters
+  )
+{
+  XFER_WINDOW  Window;
+  UINTN        Count;
+
+  if (!XferWindowInit (&Window, Parameters)) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  Count = DebugArchUnwindStack (*gSystemContext, &mStackFrames[0], MAX_STACK_FRAMES);
+  XferAppend (&Window, &mStackFrames[0], Count * sizeof (STACK_FRAME));
+  XferSend (&Window);
+}
+
+/**
+  Sends the list of loaded images as the GDB library list XML.
+
+  @param[in]  Parameters  The "offset,length" string of the qXfer request.
+
+**/
+STATIC
+VOID
+ReadLibraries (
+  IN CHAR8  *Parameters
+  )
+{
+  XFER_WINDOW               Window;
+  CONST LOADED_IMAGE_ENTRY  *Image;
+  UINTN                     Index;
+  UINTN                     NameIndex;
+  CHAR8                     Name[256];
+  CONST CHAR8               *Escape;
+
+  if (!XferWindowInit (&Window, Parameters)) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
+
+  XferPrint (&Window, "<library-list>");
+  for (Index = 0; (Image = DbgGetLoadedImage (Index)) != NULL; Index++) {
+    if ((Image->PdbAddress == 0) || !DbgReadString (Image->PdbAddress, &Name[0], sizeof (Name))) {
+      continue;
+    }
+
+    XferPrint (&Window, "<library name=\"");
+    for (NameIndex = 0; Name[NameIndex] != 0; NameIndex++) {
+      switch (Name[NameIndex]) {
+        case '&':
+          Escape = "&amp;";
+          break;
+        case '<':
+          Escape = "&lt;";
+          break;
+        case '>':
+          Escape = "&gt;";
+          break;
+        case '"':
+          Escape = "&quot;";
+          break;
+        default:
+          Escape = NULL;
+          break;
+      }
+
+      if (Escape != NULL) {
+        XferAppend (&Window, Escape, AsciiStrLen (Escape));
+      } else {
+        XferAppend (&Window, &Name[NameIndex], 1);
+      }
+    }
+
+    XferPrint (&Window, "\"><segment address=\"0x%llx\"/></library>", (UINT64)Image->TextAddress);
+  }
+
+  XferPrint (&Window, "</library-list>");
+  XferSend (&Window);
+}
+
+/**
+  Gets the registers of a processor in the order of the core file NT_PRSTATUS
+  note.
+
+  @param[in]  Context     The context of the processor.
+  @param[out] Registers   The GdbCoreInfo.RegisterCount register values.
+
+**/
+STATIC
+VOID
+GetCoreRegisters (
+  IN  EFI_SYSTEM_CONTEXT  *Context,
+  OUT UINT64              *Registers
+  )
+{
+  UINT8  Register;
+  UINTN  Offset;
+  UINTN  Index;
+
+  // Use SystemContextX64 generically, This is a union of all pointers.
+  for (Index = 0; Index < GdbCoreInfo.RegisterCount; Index++) {
+    Registers[Index] = 0;
+    Register         = GdbCoreInfo.Registers[Index];
+    if (Register != CORE_REG_ZERO) {
+      Offset = gRegisterOffsets[Register].Offset;
+      ASSERT ((Offset & REG_EXTENDED_STATE) == 0);
+      if (Offset != REG_NOT_PRESENT) {
+        CopyMem (&Registers[Index], (UINT8 *)Context->SystemContextX64 + Offset, MIN (gRegisterOffsets[Register].Size, sizeof (UINT64)));
+      }
+    }
+  }
+}
+
+/**
+  Appends the NT_PRSTATUS note of a processor to the core file.
+
+  @param[in,out]  Window    The qXfer window.
+  @param[in]      ThreadId  The GDB thread ID of the processor.
+  @param[in]      Context   The context of the processor.
+  @param[in]      Signal    The signal reported for the processor.
+
+**/
+STATIC
+VOID
+AppendCoreNote (
+  IN OUT XFER_WINDOW     *Window,
+  IN UINTN               ThreadId,
+  IN EFI_SYSTEM_CONTEXT  *Context,
+  IN UINT16              Signal
+  )
+{
+  ELF_NOTE_HEADER  Note;
+  ELF_PRSTATUS     Status;
+  UINT64           Registers[MAX_CORE_REGISTERS + 1];
+
+  Note.NameSize       = sizeof ("CORE");
+  Note.DescriptorSize = (UINT32)(sizeof (ELF_PRSTATUS) + (GdbCoreInfo.RegisterCount + 1) * sizeof (UINT64));
+  Note.Type           = ELF_NT_PRSTATUS;
+  XferAppend (Window, &Note, sizeof (Note));
+  XferAppend (Window, "CORE\0\0\0", 8);
+
+  ZeroMem (&Status, sizeof (Status));
+  Status.SignalInfo[0] = Signal;
+  Status.CurrentSignal = Signal;
+  Status.Pid           = (UINT32)ThreadId;
+  XferAppend (Window, &Status, sizeof (Status));
+
+  // The FP registers are not included.
+  GetCoreRegisters (Context, &Registers[0]);
+  Registers[GdbCoreInfo.RegisterCount] = 0;
+  XferAppend (Window, &Registers[0], (GdbCoreInfo.RegisterCount + 1) * sizeof (UINT64));
+}
+
+/**
+  Sends the ELF core file prepared with the 'd' monitor command. The file has a
+  PT_NOTE segment with the registers of each stopped processor, starting with
+  the one that owns the debugger, followed by a PT_LOAD segment for each core
+  dump segment. The zero pages at the end of each segment are not in the file.
 
-  @param[in]  CommandHex  The HEX encoded string of the command.
+  @param[in]  Parameters  The "offset,length" string of the qXfer request.
 
 **/
+STATIC
 VOID
-ProcessMonitorCmd (
-  CHAR8  *CommandHex
+ReadCore (
+  IN CHAR8  *Parameters
   )
 {
-  UINTN  Index;
-  UINTN  CommandLen;
-  CHAR8  Command[128];
+  XFER_WINDOW         Window;
+  ELF_HEADER          Header;
+  ELF_PROGRAM_HEADER  Program;
+  CONST CORE_SEGMENT  *Segment;
+  EFI_SYSTEM_CONTEXT  *Context;
+  UINTN               SegmentCount;
+  UINTN               ThreadCount;
+  UINTN               NoteSize;
+  UINT64              Offset;
+  UINTN               Index;
+  UINT16              Signal;
+
+  if (!mCoreReady) {
+    SendGdbError (GDB_ERROR_UNSUPPORTED);
+    return;
+  }
 
-  // The command comes in hex encoded, convert it to a byte array.
-  CommandLen = AsciiStrLen (CommandHex);
-  if (((CommandLen % 2) != 0) || ((CommandLen / 2) >= sizeof (Command))) {
+  if (!XferWindowInit (&Window, Parameters)) {
     SendGdbError (GDB_ERROR_BAD_REQUEST);
     return;
   }
 
-  CommandLen /= 2;
-  for (Index = 0; Index < CommandLen; Index++) {
-    Command[Index] = HexToByte (&CommandHex[Index * 2]);
+  for (SegmentCount = 0; DbgGetCoreSegment (SegmentCount) != NULL; SegmentCount++) {
   }
 
-  Command[Index] = 0;
+  ThreadCount = 1;
+  for (Index = 0; Index < DbgGetProcessorCount (); Index++) {
+    if ((Index != mStopProcessor) && (DbgGetProcessorContext (Index) != NULL)) {
+      ThreadCount++;
+    }
+  }
 
-  //
-  // Interpret the command. This is specific to the UEFI debugger and not
-  // from the GDB specifications. Treat the first byte as the command.
-  //
+  NoteSize = sizeof (ELF_NOTE_HEADER) + 8 + sizeof (ELF_PRSTATUS) + (GdbCoreInfo.RegisterCount + 1) * sizeof (UINT64);
+
+  ZeroMem (&Header, sizeof (Header));
+  CopyMem (&Header.Ident[0], "\x7f" "ELF", 4);
+  Header.Ident[4]    = 2; // ELFCLASS64
+  Header.Ident[5]    = 1; // ELFDATA2LSB
+  Header.Ident[6]    = 1; // EV_CURRENT
+  Header.Type        = ELF_ET_CORE;
+  Header.Machine     = GdbCoreInfo.Machine;
+  Header.Version     = 1;
+  Header.PhOffset    = sizeof (ELF_HEADER);
+  Header.HeaderSize  = sizeof (ELF_HEADER);
+  Header.PhEntrySize = sizeof (ELF_PROGRAM_HEADER);
+  Header.PhCount     = (UINT16)(SegmentCount + 1);
+  XferAppend (&Window, &Header, sizeof (Header));
+
+  ZeroMem (&Program, sizeof (Program));
+  Program.Type     = ELF_PT_NOTE;
+  Program.Offset   = sizeof (ELF_HEADER) + (SegmentCount + 1) * sizeof (ELF_PROGRAM_HEADER);
+  Program.FileSize = ThreadCount * NoteSize;
+  Program.Align    = 4;
+  XferAppend (&Window, &Program, sizeof (Program));
+
+  // Memory starts on the page after the notes.
+  Offset = ALIGN_VALUE (Program.Offset + Program.FileSize, EFI_PAGE_SIZE);
+  for (Index = 0; Index < SegmentCount; Index++) {
+    Segment                 = DbgGetCoreSegment (Index);
+    Program.Type            = ELF_PT_LOAD;
+    Program.Flags           = ELF_PF_RWX;
+    Program.Offset          = Offset;
+    Program.VirtualAddress  = Segment->Address;
+    Program.PhysicalAddress = Segment->Address;
+    Program.FileSize        = Segment->FileSize;
+    Program.MemorySize      = Segment->Size;
+    Program.Align           = EFI_PAGE_SIZE;
+    XferAppend (&Window, &Program, sizeof (Program));
+    Offset += Segment->FileSize;
+  }
 
-  mScratch[0] = 0;
-  switch (Command[0]) {
-    case '?': // Get UEFI debugger info.
-      AsciiSPrint (
-        &mScratch[0],
-        SCRATCH_SIZE,
-        "%a\n\r"
-        "Exception Type: %a (%d)\n\r"
-        "Exception Address: %llx\n\r"
-        "Architecture Exception Code: 0x%llx\n\r"
-        "Break Reason: %a\n\r",
-        gDebuggerInfo,
-        EXCEPTION_TYPE_STRINGS[gExceptionInfo->ExceptionType],
-        gExceptionInfo->ExceptionType,
-        gExceptionInfo->ExceptionAddress,
-        gExceptionInfo->ArchExceptionCode,
-        BREAK_REASON_STRINGS[DebuggerBreakpointReason]
-        );
+  Signal = 5; // SIGTRAP
+  if ((gExceptionInfo != NULL) && (gExceptionInfo->ExceptionType < ARRAY_SIZE (EXCEPTION_TYPE_SIGNALS))) {
+    Signal = EXCEPTION_TYPE_SIGNALS[gExceptionInfo->ExceptionType];
+  }
 
-      break;
+  AppendCoreNote (&Window, mStopProcessor + 1, mStopContext, Signal);
+  for (Index = 0; Index < DbgGetProcessorCount (); Index++) {
+    Context = DbgGetProcessorContext (Index);
+    if ((Index != mStopProcessor) && (Context != NULL)) {
+      AppendCoreNote (&Window, Index + 1, Context, 0);
+    }
+  }
 
-    case 'i': // Dump system registers
-      GdbDumpSystemRegisters (&Command[1], &mScratch[0], SCRATCH_SIZE);
-      break;
+  ZeroMem (&mScratch[0], SCRATCH_SIZE);
+  while (!Window.Full && ((Window.Position & EFI_PAGE_MASK) != 0)) {
+    XferAppend (&Window, &mScratch[0], MIN (SCRATCH_SIZE, EFI_PAGE_SIZE - (Window.Position & EFI_PAGE_MASK)));
+  }
 
-    case 'v': // Variable Read
-      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "TODO\n\r");
-      break;
+  for (Index = 0; (Index < SegmentCount) && !Window.Full; Index++) {
+    Segment = DbgGetCoreSegment (Index);
+    XferAppendMemory (&Window, Segment->Address, Segment->FileSize);
+  }
 
-    case 'V': // Variable Write
-      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "TODO\n\r");
-      break;
+  // Account for the rest of the file so the response is not marked as the end.
+  Window.Position = MAX (Window.Position, (UINTN)Offset);
+  XferSend (&Window);
+}
 
-    case 'm': // MSR Read
-      GdbReadMsr (&Command[1], &mScratch[0], SCRATCH_SIZE);
-      break;
+/**
+  Sends the crash dump saved before a debugger connected, as it is in the
+  buffer. The crash dump is marked as reported once it is read to the end.
 
-    case 'M': // MSR Write
-      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "TODO\n\r");
-      break;
+  @param[in]  Parameters  The "offset,length" string of the qXfer request.
 
-    case 'R': // Set Reboot on Continue
-      mRebootOnContinue = TRUE;
-      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Will reboot on continue.\n\r");
-      break;
+**/
+STATIC
+VOID
+ReadCrashDump (
+  IN CHAR8  *Parameters
+  )
+{
+  XFER_WINDOW              Window;
+  CONST CRASH_DUMP_HEADER  *Crash;
 
-    case 'b': // Module Break
-      if (DbgSetBreakOnModuleLoad (&Command[1])) {
-        AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Will break on load for %a\n\r", &Command[1]);
-      } else {
-        AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "FAILED to set break on load for %a\n\r", &Command[1]);
-      }
+  Crash = DbgGetCrashDump ();
+  if (Crash == NULL) {
+    SendGdbError (GDB_ERROR_UNSUPPORTED);
+    return;
+  }
 
-      break;
+  if (!XferWindowInit (&Window, Parameters)) {
+    SendGdbError (GDB_ERROR_BAD_REQUEST);
+    return;
+  }
 
-    default:
-      AsciiSPrint (&mScratch[0], SCRATCH_SIZE, "Unknown command '%a'\n\r", Command);
-      break;
+  XferAppend (&Window, Crash, Crash->Size);
+  if (Window.Offset + Window.Consumed >= Window.Position) {
+    DbgCrashDumpReported (FALSE);
   }
 
-  // Respond with a intermediate packet, "O[HEX]" follow by an empty "OK" packet
-  // where the [HEX] is the hex encoding of the response string. The spec is
-  // vague on the need for this, but this is to be consistent with other GDB stub
-  // implementations and Windbg expectations.
-  mResponse[0] = 'O';
-  ConvertResponseToHex (&mScratch[0], &mResponse[1], MAX_RESPONSE_SIZE - 1);
-  SendGdbResponse (mResponse);
-  SendGdbResponse ("OK");
+  XferSend (&Window);
 }
 
 /**
-  Sends the target description XML.
+  Sends the log output captured while stopped to the debugger as console output
+  packets. GDB accepts these while it waits for the stop reply, so this must
+  only be called once execution is resuming.
 
 **/
+STATIC
 VOID
-ReadTargetDescription (
+ForwardLogToDebugger (
   VOID
   )
 {
-  AsciiSPrint (
-    mResponse,
-    MAX_RESPONSE_SIZE,
-    "l<?xml version=\"1.0\"?>"
-    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
-    "<target>"
-    "<architecture>%a</architecture>"
-    "<xi:include href=\"registers.xml\"/>"
-    "</target>",
-    GdbTargetInfo.TargetArch
-    );
+  UINTN  Length;
+  UINTN  Index;
+  UINT8  Byte;
 
-  SendGdbResponse (mResponse);
+  while ((Length = TransportLogRead ((UINT8 *)&mScratch[0], SCRATCH_SIZE)) != 0) {
+    mResponse[0] = 'O';
+    for (Index = 0; Index < Length; Index++) {
+      Byte                       = (UINT8)mScratch[Index];
+      mResponse[(Index * 2) + 1] = HexChars[Byte >> 4];
+      mResponse[(Index * 2) + 2] = HexChars[Byte & 0xF];
+    }
+
+    SendGdbBinaryResponse (mResponse, (Length * 2) + 1);
+  }
 }
 
 /**
-  Sends the register offset information target XML file.
+  Saves the fault, the processors that stopped with it and the loaded images to
+  the crash dump buffer, if one is configured.
+
+  @param[in]  ExceptionInfo   The fault being reported.
 
 **/
+STATIC
 VOID
-ReadTargetRegisters (
-  VOID
+CaptureCrash (
+  IN EXCEPTION_INFO  *ExceptionInfo
   )
 {
-  CHAR8  *End;
-  UINTN  Written;
-  UINTN  RegNumber;
-  UINTN  Remaining;
-
-  End       = mResponse;
-  Remaining = MAX_RESPONSE_SIZE;
-  Written   = AsciiSPrint (
-                End,
-                Remaining,
-                "l<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\"><feature name=\"%a\">",
-                GdbTargetInfo.RegistersFeature
-                );
-  Remaining -= Written;
-  End       += Written;
-
-  for (RegNumber = 0; RegNumber < gRegisterCount; RegNumber++) {
-    if (gRegisterOffsets[RegNumber].Name == NULL) {
-      continue;
-    }
-
-    Written = AsciiSPrint (
-                End,
-                Remaining,
-                "<reg name=\"%a\" bitsize=\"%d\" type=\"%a\" regnum=\"%d\"/>",
-                gRegisterOffsets[RegNumber].Name,
-                gRegisterOffsets[RegNumber].Size * 8,
-                gRegisterOffsets[RegNumber].Type,
-                RegNumber
-                );
+  UINT64              Registers[MAX_CORE_REGISTERS];
+  EFI_SYSTEM_CONTEXT  *Context;
+  UINTN               Index;
 
-    Remaining -= Written;
-    End       += Written;
+  if (!DbgCrashDumpBegin (ExceptionInfo, GdbCoreInfo.Machine, (UINT32)GdbCoreInfo.RegisterCount)) {
+    return;
   }
 
-  Written    = AsciiSPrint (End, Remaining, "</feature>");
-  Remaining -= Written;
-  End       += Written;
-
-  // Check if we ran out of space.
-  if (Remaining == 0) {
-    SendGdbError (GDB_ERROR_RESPONSE_TOO_LONG);
-  } else {
-    SendGdbResponse (mResponse);
+  GetCoreRegisters (mStopContext, &Registers[0]);
+  DbgCrashDumpAddProcessor ((UINT32)(mStopProcessor + 1), *mStopContext, &Registers[0]);
+  for (Index = 0; Index < DbgGetProcessorCount (); Index++) {
+    Context = DbgGetProcessorContext (Index);
+    if ((Index != mStopProcessor) && (Context != NULL)) {
+      GetCoreRegisters (Context, &Registers[0]);
+      DbgCrashDumpAddProcessor ((UINT32)(Index + 1), *Context, &Registers[0]);
+    }
   }
+
+  DbgCrashDumpEnd ();
 }
 
 /**
   Parses a general query command.
 
-  @param[in] Command  The general query command.
+  @param[in] Command        The general query command.
+  @param[in] CommandLength  The length of the general query command.
 
 **/
 VOID
 ProcessQuery (
-  CHAR8  *Command
+  CHAR8   *Command,
+  UINT32  CommandLength
   )
 {
   if (AsciiStrnCmp (Command, "Supported", 9) == 0) {
-    SendGdbResponse ("PacketSize=1000;qXfer:features:read+;vContSupported+");
+    SendGdbResponse ("PacketSize=1000;qXfer:features:read+;qXfer:libraries:read+;qXfer:uefi-timeline:read+;qXfer:uefi-profile:read+;qXfer:uefi-stack:read+;qXfer:uefi-core:read+;qXfer:uefi-crash:read+;vContSupported+");
   } else if (AsciiStrnCmp (Command, "fThreadInfo", 11) == 0) {
-    // Only supports 1 thread for now.
-    SendGdbResponse ("m01");
+    SendThreadList ();
   } else if (AsciiStrnCmp (Command, "sThreadInfo", 11) == 0) {
-    // Only supports 1 thread for now.
+    // All threads fit in the first reply.
     SendGdbResponse ("l");
-  } else if (AsciiStrnCmp (Command, "Xfer:features:read:target.xml", 29) == 0) {
-    ReadTargetDescription ();
-  } else if (AsciiStrnCmp (Command, "Xfer:features:read:registers.xml", 29) == 0) {
-    ReadTargetRegisters ();
+  } else if (AsciiStrnCmp (Command, "ThreadExtraInfo,", 16) == 0) {
+    SendThreadExtraInfo (Command + 16);
+  } else if ((Command[0] == 'C') && (Command[1] == 0)) {
+    AsciiSPrint (mResponse, MAX_RESPONSE_SIZE, "QC%x", (UINT32)(mStopProcessor + 1));
+    SendGdbResponse (mResponse);
+  } else if (AsciiStrnCmp (Command, "Xfer:features:read:", 19) == 0) {
+    ReadTargetFeature (&Command[19]);
+  } else if (AsciiStrnCmp (Command, "Xfer:libraries:read::", 21) == 0) {
+    ReadLibraries (Command + 21);
+  } else if (AsciiStrnCmp (Command, "Xfer:uefi-timeline:read::", 25) == 0) {
+    ReadTimeline (Command + 25);
+  } else if (AsciiStrnCmp (Command, "Xfer:uefi-profile:read::", 24) == 0) {
+    ReadProfile (Command + 24);
+  } else if (AsciiStrnCmp (Command, "Xfer:uefi-stack:read::", 22) == 0) {
+    ReadStackFrames (Command + 22);
+  } else if (AsciiStrnCmp (Command, "Xfer:uefi-core:read::", 21) == 0) {
+    ReadCore (Command + 21);
+  } else if (AsciiStrnCmp (Command, "Xfer:uefi-crash:read::", 22) == 0) {
+    ReadCrashDump (Command + 22);
   } else if (AsciiStrnCmp (Command, "Rcmd,", 5) == 0) {
     ProcessMonitorCmd (Command + 5);
+  } else if (AsciiStrnCmp (Command, "Search:memory:", 14) == 0) {
+    ProcessSearchMemory (Command + 14, CommandLength - 14);
   } else if (AsciiStrnCmp (Command, "Attached", 8) == 0) {
     // Indicates we are attached to an existing process.
     SendGdbResponse ("1");
@@ -704,6 +2398,50 @@ ProcessQuery (
   }
 }
 
+/**
+  Gets the location of a register, either in the saved context or in the
+  extended state save area.
+
+  @param[in]  Registers  The pointer to the saved register context.
+  @param[in]  RegNumber  The index of the GDB exposed register.
+  @param[in]  Write      Indicates the register is going to be written.
+
+  @retval   A pointer to the register, or NULL if the register is not present.
+**/
+STATIC
+UINT8 *
+GetRegisterPointer (
+  IN  UINT8    *Registers,
+  IN  UINTN    RegNumber,
+  IN  BOOLEAN  Write
+  )
+{
+  UINTN  Offset;
+  UINT8  *ExtendedState;
+
+  Offset = gRegisterOffsets[RegNumber].Offset;
+  if (Offset == REG_NOT_PRESENT) {
+    return NULL;
+  }
+
+  if ((Offset & REG_EXTENDED_STATE) != 0) {
+    // The extended state is read from the processor itself, which is only
+    // possible for the one running the debugger.
+    if (gSystemContext != mStopContext) {
+      return NULL;
+    }
+
+    ExtendedState = GdbGetExtendedState (*gSystemContext, Write);
+    if (ExtendedState == NULL) {
+      return NULL;
+    }
+
+    return ExtendedState + (Offset & ~REG_EXTENDED_STATE);
+  }
+
+  return Registers + Offset;
+}
+
 /**
   Read a register to the saved context at the specified register index.
 
@@ -723,9 +2461,8 @@ ReadRegisterFromContext (
   UINT8  *RegPtr;
   UINTN  i;
 
-  if (gRegisterOffsets[RegNumber].Offset != REG_NOT_PRESENT) {
-    RegPtr = Registers + gRegisterOffsets[RegNumber].Offset;
-
+  RegPtr = GetRegisterPointer (Registers, RegNumber, FALSE);
+  if (RegPtr != NULL) {
     // Parse one byte at a time.
     for (i = 0; i < gRegisterOffsets[RegNumber].Size; i++) {
       Output[i * 2]       = HexChars[RegPtr[i] >> 4];
@@ -758,7 +2495,7 @@ WriteRegisterToContext (
   )
 {
   UINT8  *RegPtr;
-  UINT8  Value[10];
+  UINT8  Value[16];
   UINTN  Index;
 
   ASSERT (gRegisterOffsets[RegNumber].Size <= sizeof (Value));
@@ -768,8 +2505,8 @@ WriteRegisterToContext (
     return NULL;
   }
 
-  if (gRegisterOffsets[RegNumber].Offset != REG_NOT_PRESENT) {
-    RegPtr = Registers + gRegisterOffsets[RegNumber].Offset;
+  RegPtr = GetRegisterPointer (Registers, RegNumber, TRUE);
+  if (RegPtr != NULL) {
     ZeroMem (&Value[0], sizeof (Value));
     for (Index = 0; Index < gRegisterOffsets[RegNumber].Size; Index += 1) {
       Value[Index] = HexToByte (Input);
@@ -796,8 +2533,15 @@ WriteGeneralRegisters (
   CHAR8  *Ptr;
   UINTN  i;
 
+  // GDB sizes the 'G' packet from the 'g' reply, so the trailing registers that
+  // are not present may be missing.
+  InitializeRegisterInfo ();
   Ptr = &Data[0];
   for (i = 0; i < gRegisterCount; i++) {
+    if ((*Ptr == 0) && (i >= mGeneralRegisterCount)) {
+      break;
+    }
+
     // Use SystemContextX64 generically, This is a union of all pointers.
     Ptr = WriteRegisterToContext ((UINT8 *)gSystemContext->SystemContextX64, i, Ptr);
     if (Ptr == NULL) {
@@ -820,8 +2564,9 @@ ReadGeneralRegisters (
   CHAR8  *Ptr;
   UINTN  i;
 
+  InitializeRegisterInfo ();
   Ptr = &mResponse[0];
-  for (i = 0; i < gRegisterCount; i++) {
+  for (i = 0; i < mGeneralRegisterCount; i++) {
     // Use SystemContextX64 generically, This is a union of all pointers.
     Ptr = ReadRegisterFromContext ((UINT8 *)gSystemContext->SystemContextX64, i, Ptr);
   }
@@ -957,10 +2702,13 @@ ProcessBreakpoint (
     Read  = (Type == 3) || (Type == 4);
     Write = (Type == 2) || (Type == 4);
 
+    // Ranges the debug registers cannot cover are watched by page protection.
     if (Remove) {
-      Result = RemoveWatchpoint (Address, Length, Read, Write);
+      Result = RemoveWatchpoint (Address, Length, Read, Write) ||
+               DbgRemovePageWatch (Address, Length, Read, Write);
     } else {
-      Result = AddWatchpoint (Address, Length, Read, Write);
+      Result = AddWatchpoint (Address, Length, Read, Write) ||
+               DbgAddPageWatch (Address, Length, Read, Write);
     }
   } else {
     SendGdbError (GDB_ERROR_UNSUPPORTED);
@@ -1020,12 +2768,20 @@ ExecuteGdbCommand (
       break;
 
     case 'q': // General query command
-      ProcessQuery (&GdbCommand[1]);
+      ProcessQuery (&GdbCommand[1], GdbCommandLength - 1);
       break;
 
     case 'H': // Switch to thread ID
-      // Nothing to do, respond OK.
-      SendGdbResponse ("OK");
+      ProcessSetThread (&GdbCommand[1]);
+      break;
+
+    case 'T': // Thread alive
+      if (GetThreadContext (ParseThreadId (&GdbCommand[1])) != NULL) {
+        SendGdbResponse ("OK");
+      } else {
+        SendGdbError (GDB_ERROR_BAD_REQUEST);
+      }
+
       break;
 
     case '?': // Stop reason request
@@ -1044,6 +2800,12 @@ ExecuteGdbCommand (
       ProcessBreakpoint (TRUE, &GdbCommand[1]);
       break;
 
+    case 'D': // Detach, the system resumes without a debugger.
+      mLastPacketTime = 0;
+      SendGdbResponse ("OK");
+      gRunning = TRUE;
+      break;
+
     case 'r': // Reboot
     case 'R': // Reboot
       DebugReboot ();
@@ -1110,6 +2872,7 @@ ProcessGdbPacket (
 
   SendGdbAck (TRUE);
   mConnectionOccurred = TRUE;
+  mLastPacketTime     = MAX (DebugGetTimeMs (), 1);
 
   //
   // Validated, now hand off to the parser.
@@ -1179,24 +2942,127 @@ ErrorExit:
 /**
   Polls for input from the debugger.
 
+  @retval  TRUE   Input was received from the debugger.
+  @retval  FALSE  No input was received.
+
 **/
-VOID
+BOOLEAN
 DebuggerPollInput (
   VOID
   )
 {
-  UINT8  Character;
+  UINT8    Character;
+  BOOLEAN  InputReceived;
+  BOOLEAN  BreakRequested;
+  UINT64   StartTime;
+  UINT64   Elapsed;
+
+  InputReceived  = FALSE;
+  BreakRequested = FALSE;
+  StartTime      = DebugGetTimeUs ();
 
   while (DebugTransportPoll ()) {
     if (!DebugReadByte (&Character, 10)) {
       break;
     }
 
+    InputReceived = TRUE;
+
     // Check for the break character CTRL-C.
     if (Character == 0x3) {
-      DebuggerBreak (BreakpointReasonDebuggerBreak);
+      BreakRequested = TRUE;
+      break;
+    }
+  }
+
+  Elapsed = DebugGetTimeUs () - StartTime;
+  gDebuggerPollStats.PollCount++;
+  gDebuggerPollStats.TotalPollTimeUs += Elapsed;
+  gDebuggerPollStats.MaxPollTimeUs    = MAX (gDebuggerPollStats.MaxPollTimeUs, Elapsed);
+
+  if (BreakRequested) {
+    // The break character arrived at some point since the previous poll.
+    if (mLastPollTimeUs != 0) {
+      gDebuggerPollStats.LastBreakInLatencyUs = StartTime - mLastPollTimeUs + Elapsed;
+      gDebuggerPollStats.MaxBreakInLatencyUs  = MAX (gDebuggerPollStats.MaxBreakInLatencyUs, gDebuggerPollStats.LastBreakInLatencyUs);
     }
+
+    gDebuggerPollStats.BreakInCount++;
+    DebuggerBreak (BreakpointReasonDebuggerBreak);
+  }
+
+  // Don't count the time spent broken in against the next poll.
+  mLastPollTimeUs = BreakRequested ? DebugGetTimeUs () : StartTime;
+  return InputReceived;
+}
+
+/**
+  Checks if a debugger has recently communicated with the agent.
+
+  @retval  TRUE   A debugger sent a packet within the activity window.
+  @retval  FALSE  No debugger is active or it detached.
+
+**/
+BOOLEAN
+DebuggerHostConnected (
+  VOID
+  )
+{
+  UINT64  LastPacketTime;
+
+  LastPacketTime = mLastPacketTime;
+  return (LastPacketTime != 0) && (DebugGetTimeMs () - LastPacketTime < HOST_ACTIVITY_WINDOW_MS);
+}
+
+/**
+  Checks if a debugger host is attached before waiting on the initial breakpoint.
+  The transport is asked first, then the initial stop reply is sent and any
+  response within the probe window is taken as a host being present.
+
+  @retval  TRUE   No host is attached.
+  @retval  FALSE  A host is attached or the result is ambiguous.
+
+**/
+STATIC
+BOOLEAN
+DebuggerHostAbsent (
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+  UINT64      EndTime;
+
+  Status = DebugHostDetect ();
+  if (Status == EFI_NOT_FOUND) {
+    return TRUE;
+  } else if (!EFI_ERROR (Status) || (PcdGet32 (PcdInitialBreakpointProbeMs) == 0)) {
+    return FALSE;
   }
+
+  // Any pending input may be the debugger, leave it for the session.
+  if (DebugTransportPoll ()) {
+    return FALSE;
+  }
+
+  // The initial breakpoint is taken on this processor, send its stop reply now
+  // and have ReportEntryToDebugger skip it. Any reply, including noise, is
+  // treated as a host being present so the full timeout is used.
+  mStopProcessor = DbgGetCurrentProcessor ();
+  AsciiSPrint (mResponse, MAX_RESPONSE_SIZE, "T05thread:%x;", (UINT32)(mStopProcessor + 1));
+  SendGdbResponse (mResponse);
+  mStopReplySent = TRUE;
+
+  EndTime = DebugGetTimeMs () + PcdGet32 (PcdInitialBreakpointProbeMs);
+  do {
+    if (DebugTransportPoll ()) {
+      return FALSE;
+    }
+
+    CpuPause ();
+  } while (DebugGetTimeMs () < EndTime);
+
+  mStopReplySent = FALSE;
+  return TRUE;
 }
 
 /**
@@ -1211,10 +3077,37 @@ DebuggerInitialBreakpoint (
   UINT64  Timeout
   )
 {
+  // Only skip initial breakpoints that would have timed out anyways.
+  if ((Timeout != 0) && DebuggerHostAbsent ()) {
+    DEBUG ((DEBUG_INFO, "%a: No debugger detected, skipping initial breakpoint.\n", __FUNCTION__));
+    return;
+  }
+
   mNextBreakpointTimeout = Timeout;
   DebuggerBreak (BreakpointReasonInitial);
 }
 
+/**
+  Notifies the debugger of a new image if image load stops are enabled and a
+  debugger is connected. The image should already be in the loaded image table.
+
+  @retval  TRUE   The debugger was stopped for the image.
+  @retval  FALSE  The debugger was not notified.
+
+**/
+BOOLEAN
+DebuggerNotifyImageLoad (
+  VOID
+  )
+{
+  if (!mImageLoadStops || !mConnectionOccurred) {
+    return FALSE;
+  }
+
+  DebuggerBreak (BreakpointReasonImageLoad);
+  return TRUE;
+}
+
 /**
   Starts the debugger stub from within the exception handler. Will notify the
   debugger and await debug commands.
@@ -1230,13 +3123,67 @@ ReportEntryToDebugger (
   IN OUT EFI_SYSTEM_CONTEXT  SystemContext
   )
 {
-  UINT64  EndTime;
+  EXCEPTION_INFO  StepInfo;
+  UINT64          EndTime;
+
+  // A watchpoint hit on the instruction that completes a step reports both.
+  // Finish the steps the agent took over a watched access first.
+  if ((ExceptionInfo->ExceptionType == ExceptionWatchpoint) && ExceptionInfo->StepComplete) {
+    CopyMem (&StepInfo, ExceptionInfo, sizeof (EXCEPTION_INFO));
+    StepInfo.ExceptionType = ExceptionDebugStep;
+    DbgWatchpointFilter (&StepInfo, SystemContext);
+    DbgPageWatchFilter (&StepInfo, SystemContext);
+  }
+
+  // Counting watchpoint hits and page watchpoint faults outside the watched
+  // range resume without stopping, unless the debugger is stepping.
+  if (DbgWatchpointFilter (ExceptionInfo, SystemContext)) {
+    if (!ExceptionInfo->StepComplete || !DbgProcessorIsStepping (DbgGetCurrentProcessor ())) {
+      return;
+    }
+
+    ExceptionInfo->ExceptionType = ExceptionDebugStep;
+  } else if (DbgPageWatchFilter (ExceptionInfo, SystemContext)) {
+    return;
+  }
+
+  // Wait for any other processor in the debugger and halt the rest.
+  if (!DbgProcessorAcquire (ExceptionInfo, SystemContext, &mStopProcessor)) {
+    return;
+  }
+
+  // The watched pages are accessible while stopped.
+  DbgPageWatchDisarm ();
 
   EndTime        = 0;
+  mCoreReady     = FALSE;
+  mStopContext   = &SystemContext;
   gSystemContext = &SystemContext;
   gExceptionInfo = ExceptionInfo;
   gRunning       = FALSE;
 
+  // Stepping would fill the timeline, only the stops before and after a run
+  // of steps are recorded.
+  if (!mStepping) {
+    DbgTimelineRecord (TimelineException, (UINT16)ExceptionInfo->ExceptionType, ExceptionInfo->ExceptionAddress);
+  }
+
+  mStepping = FALSE;
+
+  // Drop images unloaded since the last stop before they are reported.
+  DbgPhaseUpdateImages ();
+
+  // Save faults taken with no debugger attached, the system may be reset
+  // before one connects.
+  if (!mConnectionOccurred &&
+      ((ExceptionInfo->ExceptionType == ExceptionGenericFault) ||
+       (ExceptionInfo->ExceptionType == ExceptionInvalidOp) ||
+       (ExceptionInfo->ExceptionType == ExceptionAlignment) ||
+       (ExceptionInfo->ExceptionType == ExceptionAccessViolation)))
+  {
+    CaptureCrash (ExceptionInfo);
+  }
+
   // Squelch logging output, it can confuse the debugger.
   TransportLogSuspend ();
 
@@ -1248,8 +3195,12 @@ ReportEntryToDebugger (
     mNextBreakpointTimeout = 0;
   }
 
-  // Notify the debugger of the break.
-  SendStopReply ();
+  // Notify the debugger of the break, unless the probe already did.
+  if (mStopReplySent) {
+    mStopReplySent = FALSE;
+  } else {
+    SendStopReply ();
+  }
 
   // Keep reading requests until one resumes execution.
   while (!gRunning) {
@@ -1264,10 +3215,26 @@ ReportEntryToDebugger (
     }
   }
 
+  // Put back any extended state the debugger changed.
+  GdbRestoreExtendedState (SystemContext);
+
   if (mRebootOnContinue) {
     DebugReboot ();
   }
 
+  // Send the output logged while stopped to the debugger console, anything left
+  // is written when logging resumes.
+  if (mConnectionOccurred) {
+    ForwardLogToDebugger ();
+  }
+
   // Re-enable logging prints.
   TransportLogResume ();
+  if (!mStepping) {
+    DbgTimelineRecord (TimelineResume, 0, 0);
+  }
+
+  // Resume the other processors, unless stepping.
+  DbgPageWatchArm ();
+  DbgProcessorRelease (mStepping);
 }
@@ -38,16 +38,110 @@ typedef struct _GDB_REGISTER_OFFSET_DATA {
 // in all 0's and writes will be ignored.
 #define REG_NOT_PRESENT  (0xFFFFFFFF)
 
+// Indicates the register is held in the architecture's extended state save area
+// instead of the system context. The remaining bits are the offset in that area.
+#define REG_EXTENDED_STATE  (0x80000000)
+
 extern GDB_REGISTER_OFFSET_DATA  gRegisterOffsets[];
 extern UINTN                     gRegisterCount;
 
+// Describes a target description feature, covering the registers from
+// FirstRegister up to the next feature's first register.
+typedef struct _GDB_REGISTER_FEATURE {
+  CONST CHAR8    *Name;
+  CONST CHAR8    *Annex;
+  CONST CHAR8    *Types;
+  UINTN          FirstRegister;
+  BOOLEAN        (*IsSupported)(
+    VOID
+    );
+} GDB_REGISTER_FEATURE;
+
 typedef struct _GDB_TARGET_INFO {
-  CONST CHAR8    *TargetArch;
-  CONST CHAR8    *RegistersFeature;
+  CONST CHAR8                   *TargetArch;
+  CONST GDB_REGISTER_FEATURE    *Features;
+  UINTN                         FeatureCount;
 } GDB_TARGET_INFO;
 
 extern CONST GDB_TARGET_INFO  GdbTargetInfo;
 
+// Describes the registers in the NT_PRSTATUS notes of a core file, in order,
+// by their GDB register number. CORE_REG_ZERO marks registers that are not
+// tracked and are written as zero.
+typedef struct _GDB_CORE_INFO {
+  UINT16         Machine;
+  CONST UINT8    *Registers;
+  UINTN          RegisterCount;
+} GDB_CORE_INFO;
+
+#define CORE_REG_ZERO       (0xFF)
+#define MAX_CORE_REGISTERS  64
+
+extern CONST GDB_CORE_INFO  GdbCoreInfo;
+
+//
+// ELF core file structures.
+//
+
+#define ELF_PT_LOAD      1
+#define ELF_PT_NOTE      4
+#define ELF_NT_PRSTATUS  1
+#define ELF_PF_RWX       7
+#define ELF_ET_CORE      4
+
+#pragma pack(1)
+
+typedef struct _ELF_HEADER {
+  UINT8     Ident[16];
+  UINT16    Type;
+  UINT16    Machine;
+  UINT32    Version;
+  UINT64    Entry;
+  UINT64    PhOffset;
+  UINT64    ShOffset;
+  UINT32    Flags;
+  UINT16    HeaderSize;
+  UINT16    PhEntrySize;
+  UINT16    PhCount;
+  UINT16    ShEntrySize;
+  UINT16    ShCount;
+  UINT16    ShStringIndex;
+} ELF_HEADER;
+
+typedef struct _ELF_PROGRAM_HEADER {
+  UINT32    Type;
+  UINT32    Flags;
+  UINT64    Offset;
+  UINT64    VirtualAddress;
+  UINT64    PhysicalAddress;
+  UINT64    FileSize;
+  UINT64    MemorySize;
+  UINT64    Align;
+} ELF_PROGRAM_HEADER;
+
+typedef struct _ELF_NOTE_HEADER {
+  UINT32    NameSize;
+  UINT32    DescriptorSize;
+  UINT32    Type;
+} ELF_NOTE_HEADER;
+
+// The start of the Linux elf_prstatus, followed by the registers and the
+// 64-bit FP registers valid flag.
+typedef struct _ELF_PRSTATUS {
+  UINT32    SignalInfo[3];
+  UINT16    CurrentSignal;
+  UINT16    Reserved;
+  UINT64    SignalsPending;
+  UINT64    SignalsHeld;
+  UINT32    Pid;
+  UINT32    ParentPid;
+  UINT32    Group;
+  UINT32    Session;
+  UINT64    Times[8];
+} ELF_PRSTATUS;
+
+#pragma pack()
+
 //
 // Routine implemented per architecture.
 //
@@ -66,4 +160,15 @@ GdbDumpSystemRegisters (
   IN UINTN   BufferLength
   );
 
+UINT8 *
+GdbGetExtendedState (
+  IN EFI_SYSTEM_CONTEXT  SystemContext,
+  IN BOOLEAN             Write
+  );
+
+VOID
+GdbRestoreExtendedState (
+  IN EFI_SYSTEM_CONTEXT  SystemContext
+  );
+
 #endif
@@ -1,5 +1,5 @@
 /** @file
-  X64 implementations of GDB Stub.
+  AArch64 implementations of GDB Stub.
 
   Copyright (c) Microsoft Corporation.
   SPDX-License-Identifier: BSD-2-Clause-Patent
@@ -18,52 +18,222 @@
 #include <Library/UefiLib.h>
 #include "DebugAgent.h"
 #include "GdbStub.h"
+#include "Registers.h"
+
+//
+// The SIMD/FP registers as presented to GDB. The vector registers and FPSR are
+// copied from the system context and FPCR is read from the processor. This is
+// only filled in when the debugger first accesses one of these registers during
+// a stop.
+//
+
+typedef struct {
+  UINT8     V[32][16];
+  UINT32    Fpsr;
+  UINT32    Fpcr;
+} AARCH64_EXTENDED_STATE;
+
+#define EXTENDED_REG(Field)  (REG_EXTENDED_STATE | OFFSET_OF (AARCH64_EXTENDED_STATE, Field))
+
+// Index of the first SIMD/FP register in gRegisterOffsets.
+#define FIRST_FPU_REGISTER  34
 
 GDB_REGISTER_OFFSET_DATA  gRegisterOffsets[] = {
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X0),   8, "x0",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X1),   8, "x1",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X2),   8, "x2",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X3),   8, "x3",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X4),   8, "x4",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X5),   8, "x5",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X6),   8, "x6",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X7),   8, "x7",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X8),   8, "x8",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X9),   8, "x9",   "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X10),  8, "x10",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X11),  8, "x11",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X12),  8, "x12",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X13),  8, "x13",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X14),  8, "x14",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X15),  8, "x15",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X16),  8, "x16",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X17),  8, "x17",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X18),  8, "x18",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X19),  8, "x19",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X20),  8, "x20",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X21),  8, "x21",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X22),  8, "x22",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X23),  8, "x23",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X24),  8, "x24",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X25),  8, "x25",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X26),  8, "x26",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X27),  8, "x27",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X28),  8, "x28",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, FP),   8, "x29",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, LR),   8, "x30",  "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, SP),   8, "sp",   "data_ptr" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, ELR),  8, "pc",   "code_ptr" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, FPSR), 8, "fpcr", "int64"    },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, SPSR), 4, "cpsr", "int32"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X0),   8,  "x0",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X1),   8,  "x1",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X2),   8,  "x2",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X3),   8,  "x3",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X4),   8,  "x4",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X5),   8,  "x5",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X6),   8,  "x6",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X7),   8,  "x7",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X8),   8,  "x8",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X9),   8,  "x9",   "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X10),  8,  "x10",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X11),  8,  "x11",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X12),  8,  "x12",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X13),  8,  "x13",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X14),  8,  "x14",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X15),  8,  "x15",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X16),  8,  "x16",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X17),  8,  "x17",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X18),  8,  "x18",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X19),  8,  "x19",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X20),  8,  "x20",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X21),  8,  "x21",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X22),  8,  "x22",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X23),  8,  "x23",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X24),  8,  "x24",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X25),  8,  "x25",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X26),  8,  "x26",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X27),  8,  "x27",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, X28),  8,  "x28",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, FP),   8,  "x29",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, LR),   8,  "x30",  "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, SP),   8,  "sp",   "data_ptr" },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, ELR),  8,  "pc",   "code_ptr" },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_AARCH64, SPSR), 4,  "cpsr", "int32"    },
+  { EXTENDED_REG (V[0]),                          16, "v0",   "aarch64v" },
+  { EXTENDED_REG (V[1]),                          16, "v1",   "aarch64v" },
+  { EXTENDED_REG (V[2]),                          16, "v2",   "aarch64v" },
+  { EXTENDED_REG (V[3]),                          16, "v3",   "aarch64v" },
+  { EXTENDED_REG (V[4]),                          16, "v4",   "aarch64v" },
+  { EXTENDED_REG (V[5]),                          16, "v5",   "aarch64v" },
+  { EXTENDED_REG (V[6]),                          16, "v6",   "aarch64v" },
+  { EXTENDED_REG (V[7]),                          16, "v7",   "aarch64v" },
+  { EXTENDED_REG (V[8]),                          16, "v8",   "aarch64v" },
+  { EXTENDED_REG (V[9]),                          16, "v9",   "aarch64v" },
+  { EXTENDED_REG (V[10]),                         16, "v10",  "aarch64v" },
+  { EXTENDED_REG (V[11]),                         16, "v11",  "aarch64v" },
+  { EXTENDED_REG (V[12]),                         16, "v12",  "aarch64v" },
+  { EXTENDED_REG (V[13]),                         16, "v13",  "aarch64v" },
+  { EXTENDED_REG (V[14]),                         16, "v14",  "aarch64v" },
+  { EXTENDED_REG (V[15]),                         16, "v15",  "aarch64v" },
+  { EXTENDED_REG (V[16]),                         16, "v16",  "aarch64v" },
+  { EXTENDED_REG (V[17]),                         16, "v17",  "aarch64v" },
+  { EXTENDED_REG (V[18]),                         16, "v18",  "aarch64v" },
+  { EXTENDED_REG (V[19]),                         16, "v19",  "aarch64v" },
+  { EXTENDED_REG (V[20]),                         16, "v20",  "aarch64v" },
+  { EXTENDED_REG (V[21]),                         16, "v21",  "aarch64v" },
+  { EXTENDED_REG (V[22]),                         16, "v22",  "aarch64v" },
+  { EXTENDED_REG (V[23]),                         16, "v23",  "aarch64v" },
+  { EXTENDED_REG (V[24]),                         16, "v24",  "aarch64v" },
+  { EXTENDED_REG (V[25]),                         16, "v25",  "aarch64v" },
+  { EXTENDED_REG (V[26]),                         16, "v26",  "aarch64v" },
+  { EXTENDED_REG (V[27]),                         16, "v27",  "aarch64v" },
+  { EXTENDED_REG (V[28]),                         16, "v28",  "aarch64v" },
+  { EXTENDED_REG (V[29]),                         16, "v29",  "aarch64v" },
+  { EXTENDED_REG (V[30]),                         16, "v30",  "aarch64v" },
+  { EXTENDED_REG (V[31]),                         16, "v31",  "aarch64v" },
+  { EXTENDED_REG (Fpsr),                          4,  "fpsr", "int"      },
+  { EXTENDED_REG (Fpcr),                          4,  "fpcr", "int"      },
 };
 
 UINTN  gRegisterCount = (sizeof (gRegisterOffsets) / sizeof (GDB_REGISTER_OFFSET_DATA));
 
+STATIC CONST GDB_REGISTER_FEATURE  mRegisterFeatures[] = {
+  {
+    "org.gnu.gdb.aarch64.core",
+    "registers.xml",
+    NULL,
+    0,
+    NULL
+  },
+  {
+    "org.gnu.gdb.aarch64.fpu",
+    "fpu.xml",
+    "<vector id=\"v2d\" type=\"ieee_double\" count=\"2\"/>"
+    "<vector id=\"v2u\" type=\"uint64\" count=\"2\"/>"
+    "<vector id=\"v2i\" type=\"int64\" count=\"2\"/>"
+    "<vector id=\"v4f\" type=\"ieee_single\" count=\"4\"/>"
+    "<vector id=\"v4u\" type=\"uint32\" count=\"4\"/>"
+    "<vector id=\"v4i\" type=\"int32\" count=\"4\"/>"
+    "<vector id=\"v8u\" type=\"uint16\" count=\"8\"/>"
+    "<vector id=\"v8i\" type=\"int16\" count=\"8\"/>"
+    "<vector id=\"v16u\" type=\"uint8\" count=\"16\"/>"
+    "<vector id=\"v16i\" type=\"int8\" count=\"16\"/>"
+    "<vector id=\"v1u\" type=\"uint128\" count=\"1\"/>"
+    "<vector id=\"v1i\" type=\"int128\" count=\"1\"/>"
+    "<union id=\"vnd\"><field name=\"f\" type=\"v2d\"/><field name=\"u\" type=\"v2u\"/><field name=\"s\" type=\"v2i\"/></union>"
+    "<union id=\"vns\"><field name=\"f\" type=\"v4f\"/><field name=\"u\" type=\"v4u\"/><field name=\"s\" type=\"v4i\"/></union>"
+    "<union id=\"vnh\"><field name=\"u\" type=\"v8u\"/><field name=\"s\" type=\"v8i\"/></union>"
+    "<union id=\"vnb\"><field name=\"u\" type=\"v16u\"/><field name=\"s\" type=\"v16i\"/></union>"
+    "<union id=\"vnq\"><field name=\"u\" type=\"v1u\"/><field name=\"s\" type=\"v1i\"/></union>"
+    "<union id=\"aarch64v\">"
+    "<field name=\"d\" type=\"vnd\"/>"
+    "<field name=\"s\" type=\"vns\"/>"
+    "<field name=\"h\" type=\"vnh\"/>"
+    "<field name=\"b\" type=\"vnb\"/>"
+    "<field name=\"q\" type=\"vnq\"/>"
+    "</union>",
+    FIRST_FPU_REGISTER,
+    NULL
+  }
+};
+
 CONST GDB_TARGET_INFO  GdbTargetInfo = {
   "aarch64",
-  "org.gnu.gdb.aarch64.core"
+  mRegisterFeatures,
+  ARRAY_SIZE (mRegisterFeatures)
+};
+
+// Registers in the order of the AArch64 user_pt_regs, which matches the GDB
+// register numbers: x0-x30, sp, pc and pstate.
+STATIC CONST UINT8  mCoreRegisters[] = {
+  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15, 16,
+  17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33
 };
 
+CONST GDB_CORE_INFO  GdbCoreInfo = {
+  183,  // EM_AARCH64
+  mCoreRegisters,
+  ARRAY_SIZE (mCoreRegisters)
+};
+
+STATIC AARCH64_EXTENDED_STATE  mExtendedState;
+STATIC BOOLEAN                 mExtendedStateSaved = FALSE;
+STATIC BOOLEAN                 mExtendedStateDirty = FALSE;
+
+/**
+  Gets the extended state save area, saving the state on the first access during
+  a stop.
+
+  @param[in]  SystemContext   The system context of the stop.
+  @param[in]  Write           Indicates the state will be modified and needs to
+                              be restored on resume.
+
+  @retval   The AARCH64_EXTENDED_STATE save area.
+**/
+UINT8 *
+GdbGetExtendedState (
+  IN EFI_SYSTEM_CONTEXT  SystemContext,
+  IN BOOLEAN             Write
+  )
+{
+  EFI_SYSTEM_CONTEXT_AARCH64  *Context;
+
+  if (!mExtendedStateSaved) {
+    Context = SystemContext.SystemContextAArch64;
+    CopyMem (&mExtendedState.V[0][0], &Context->V0, sizeof (mExtendedState.V));
+    mExtendedState.Fpsr = (UINT32)Context->FPSR;
+    mExtendedState.Fpcr = (UINT32)DebugReadFpcr ();
+    mExtendedStateSaved = TRUE;
+  }
+
+  if (Write) {
+    mExtendedStateDirty = TRUE;
+  }
+
+  return (UINT8 *)&mExtendedState;
+}
+
+/**
+  Restores the extended state if it was modified by the debugger and discards
+  the saved copy so the next stop saves it again.
+
+  @param[in]  SystemContext   The system context of the stop.
+
+**/
+VOID
+GdbRestoreExtendedState (
+  IN EFI_SYSTEM_CONTEXT  SystemContext
+  )
+{
+  EFI_SYSTEM_CONTEXT_AARCH64  *Context;
+
+  if (mExtendedStateSaved && mExtendedStateDirty) {
+    // The exception handler loads the vector registers and FPSR from the context
+    // on return, FPCR is not part of the context.
+    Context = SystemContext.SystemContextAArch64;
+    CopyMem (&Context->V0, &mExtendedState.V[0][0], sizeof (mExtendedState.V));
+    Context->FPSR = mExtendedState.Fpsr;
+    DebugWriteFpcr (mExtendedState.Fpcr);
+  }
+
+  mExtendedStateSaved = FALSE;
+  mExtendedStateDirty = FALSE;
+}
+
 /**
   Read MSR into a string response.
 
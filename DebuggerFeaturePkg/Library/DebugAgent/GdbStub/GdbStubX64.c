@@ -18,66 +18,409 @@
 #include <Library/PrintLib.h>
 #include "DebugAgent.h"
 #include "GdbStub.h"
+#include "ExtendedState.h"
 
-// NOTE: REG_NOT_PRESENT is used because GDB requires these registers even though
-//       they are not accessible in the system context, and are not likely to be
-//       important for UEFI debugging.
+//
+// The x87, SSE and AVX registers as presented to GDB. The x87 and SSE state comes
+// from the FXSAVE image the exception handler stores in the system context, and
+// the upper halves of the YMM registers are saved with XSAVE. This is only filled
+// in when the debugger first accesses one of these registers during a stop.
+//
+
+typedef struct {
+  UINT32    Fctrl;
+  UINT32    Fstat;
+  UINT32    Ftag;
+  UINT32    Fiseg;
+  UINT32    Fioff;
+  UINT32    Foseg;
+  UINT32    Fooff;
+  UINT32    Fop;
+  UINT8     St[8][10];
+  UINT8     Xmm[16][16];
+  UINT32    Mxcsr;
+  UINT8     YmmHigh[16][16];
+} X64_EXTENDED_STATE;
+
+#define EXTENDED_REG(Field)  (REG_EXTENDED_STATE | OFFSET_OF (X64_EXTENDED_STATE, Field))
+
+// Layout of the XSAVE standard format used for the AVX state.
+#define XSAVE_HEADER_OFFSET  512
+#define XSAVE_AVX_OFFSET     576
+#define XSAVE_AREA_SIZE      (XSAVE_AVX_OFFSET + (16 * 16))
+#define XSAVE_ALIGNMENT      64
+
+#define XSTATE_SSE  BIT1
+#define XSTATE_AVX  BIT2
 
 GDB_REGISTER_OFFSET_DATA  gRegisterOffsets[] = {
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rax),    8,       "rax",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rbx),    8,       "rbx",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rcx),    8,       "rcx",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rdx),    8,       "rdx",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rsi),    8,       "rsi",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rdi),    8,       "rdi",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rbp),    8,       "rbp",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rsp),    8,       "rsp",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R8),     8,       "r8",     "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R9),     8,       "r9",     "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R10),    8,       "r10",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R11),    8,       "r11",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R12),    8,       "r12",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R13),    8,       "r13",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R14),    8,       "r14",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R15),    8,       "r15",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rip),    8,       "rip",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rflags), 8,       "eflags", "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cs),     4,       "cs",     "int32" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Ss),     4,       "ss",     "int32" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Ds),     4,       "ds",     "int32" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Es),     4,       "es",     "int32" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Fs),     4,       "fs",     "int32" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Gs),     4,       "gs",     "int32" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr0),    8,       "cr0",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr2),    8,       "cr2",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr3),    8,       "cr3",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr4),    8,       "cr4",    "int64" },
-  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr8),    8,       "cr8",    "int64" },
-  { REG_NOT_PRESENT,                   4,       "fctrl", "int" },
-  { REG_NOT_PRESENT,                   4,       "fstat", "int" },
-  { REG_NOT_PRESENT,                   4,       "ftag",  "int" },
-  { REG_NOT_PRESENT,                   4,       "fiseg", "int" },
-  { REG_NOT_PRESENT,                   4,       "fioff", "int" },
-  { REG_NOT_PRESENT,                   4,       "foseg", "int" },
-  { REG_NOT_PRESENT,                   4,       "fooff", "int" },
-  { REG_NOT_PRESENT,                   10,      "fop",   "i387_ext" },
-  { REG_NOT_PRESENT,                   10,      "st0",   "i387_ext" },
-  { REG_NOT_PRESENT,                   10,      "st1",   "i387_ext" },
-  { REG_NOT_PRESENT,                   10,      "st2",   "i387_ext" },
-  { REG_NOT_PRESENT,                   10,      "st3",   "i387_ext" },
-  { REG_NOT_PRESENT,                   10,      "st4",   "i387_ext" },
-  { REG_NOT_PRESENT,                   10,      "st5",   "i387_ext" },
-  { REG_NOT_PRESENT,                   10,      "st6",   "i387_ext" },
-  { REG_NOT_PRESENT,                   10,      "st7",   "i387_ext" }
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rax),    8,       "rax",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rbx),    8,       "rbx",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rcx),    8,       "rcx",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rdx),    8,       "rdx",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rsi),    8,       "rsi",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rdi),    8,       "rdi",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rbp),    8,       "rbp",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rsp),    8,       "rsp",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R8),     8,       "r8",     "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R9),     8,       "r9",     "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R10),    8,       "r10",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R11),    8,       "r11",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R12),    8,       "r12",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R13),    8,       "r13",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R14),    8,       "r14",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, R15),    8,       "r15",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rip),    8,       "rip",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Rflags), 8,       "eflags", "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cs),     4,       "cs",     "int32"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Ss),     4,       "ss",     "int32"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Ds),     4,       "ds",     "int32"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Es),     4,       "es",     "int32"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Fs),     4,       "fs",     "int32"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Gs),     4,       "gs",     "int32"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr0),    8,       "cr0",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr2),    8,       "cr2",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr3),    8,       "cr3",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr4),    8,       "cr4",    "int64"    },
+  { OFFSET_OF (EFI_SYSTEM_CONTEXT_X64, Cr8),    8,       "cr8",    "int64"    },
+  { EXTENDED_REG (Fctrl),                       4,       "fctrl",  "int"      },
+  { EXTENDED_REG (Fstat),                       4,       "fstat",  "int"      },
+  { EXTENDED_REG (Ftag),                        4,       "ftag",   "int"      },
+  { EXTENDED_REG (Fiseg),                       4,       "fiseg",  "int"      },
+  { EXTENDED_REG (Fioff),                       4,       "fioff",  "int"      },
+  { EXTENDED_REG (Foseg),                       4,       "foseg",  "int"      },
+  { EXTENDED_REG (Fooff),                       4,       "fooff",  "int"      },
+  { EXTENDED_REG (Fop),                         4,       "fop",    "int"      },
+  { EXTENDED_REG (St[0]),                       10,      "st0",    "i387_ext" },
+  { EXTENDED_REG (St[1]),                       10,      "st1",    "i387_ext" },
+  { EXTENDED_REG (St[2]),                       10,      "st2",    "i387_ext" },
+  { EXTENDED_REG (St[3]),                       10,      "st3",    "i387_ext" },
+  { EXTENDED_REG (St[4]),                       10,      "st4",    "i387_ext" },
+  { EXTENDED_REG (St[5]),                       10,      "st5",    "i387_ext" },
+  { EXTENDED_REG (St[6]),                       10,      "st6",    "i387_ext" },
+  { EXTENDED_REG (St[7]),                       10,      "st7",    "i387_ext" },
+  { EXTENDED_REG (Xmm[0]),                      16,      "xmm0",   "vec128"   },
+  { EXTENDED_REG (Xmm[1]),                      16,      "xmm1",   "vec128"   },
+  { EXTENDED_REG (Xmm[2]),                      16,      "xmm2",   "vec128"   },
+  { EXTENDED_REG (Xmm[3]),                      16,      "xmm3",   "vec128"   },
+  { EXTENDED_REG (Xmm[4]),                      16,      "xmm4",   "vec128"   },
+  { EXTENDED_REG (Xmm[5]),                      16,      "xmm5",   "vec128"   },
+  { EXTENDED_REG (Xmm[6]),                      16,      "xmm6",   "vec128"   },
+  { EXTENDED_REG (Xmm[7]),                      16,      "xmm7",   "vec128"   },
+  { EXTENDED_REG (Xmm[8]),                      16,      "xmm8",   "vec128"   },
+  { EXTENDED_REG (Xmm[9]),                      16,      "xmm9",   "vec128"   },
+  { EXTENDED_REG (Xmm[10]),                     16,      "xmm10",  "vec128"   },
+  { EXTENDED_REG (Xmm[11]),                     16,      "xmm11",  "vec128"   },
+  { EXTENDED_REG (Xmm[12]),                     16,      "xmm12",  "vec128"   },
+  { EXTENDED_REG (Xmm[13]),                     16,      "xmm13",  "vec128"   },
+  { EXTENDED_REG (Xmm[14]),                     16,      "xmm14",  "vec128"   },
+  { EXTENDED_REG (Xmm[15]),                     16,      "xmm15",  "vec128"   },
+  { EXTENDED_REG (Mxcsr),                       4,       "mxcsr",  "int"      },
+  { EXTENDED_REG (YmmHigh[0]),                  16,      "ymm0h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[1]),                  16,      "ymm1h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[2]),                  16,      "ymm2h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[3]),                  16,      "ymm3h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[4]),                  16,      "ymm4h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[5]),                  16,      "ymm5h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[6]),                  16,      "ymm6h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[7]),                  16,      "ymm7h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[8]),                  16,      "ymm8h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[9]),                  16,      "ymm9h",  "uint128"  },
+  { EXTENDED_REG (YmmHigh[10]),                 16,      "ymm10h", "uint128"  },
+  { EXTENDED_REG (YmmHigh[11]),                 16,      "ymm11h", "uint128"  },
+  { EXTENDED_REG (YmmHigh[12]),                 16,      "ymm12h", "uint128"  },
+  { EXTENDED_REG (YmmHigh[13]),                 16,      "ymm13h", "uint128"  },
+  { EXTENDED_REG (YmmHigh[14]),                 16,      "ymm14h", "uint128"  },
+  { EXTENDED_REG (YmmHigh[15]),                 16,      "ymm15h", "uint128"  }
 };
 
 UINTN  gRegisterCount = (sizeof (gRegisterOffsets) / sizeof (GDB_REGISTER_OFFSET_DATA));
 
+// Index of the first SSE and AVX registers in gRegisterOffsets.
+#define FIRST_SSE_REGISTER  45
+#define FIRST_AVX_REGISTER  62
+
+STATIC
+BOOLEAN
+IsAvxEnabled (
+  VOID
+  );
+
+STATIC CONST GDB_REGISTER_FEATURE  mRegisterFeatures[] = {
+  {
+    "org.gnu.gdb.i386.core",
+    "registers.xml",
+    NULL,
+    0,
+    NULL
+  },
+  {
+    "org.gnu.gdb.i386.sse",
+    "sse.xml",
+    "<vector id=\"v4f\" type=\"ieee_single\" count=\"4\"/>"
+    "<vector id=\"v2d\" type=\"ieee_double\" count=\"2\"/>"
+    "<vector id=\"v16i8\" type=\"int8\" count=\"16\"/>"
+    "<vector id=\"v8i16\" type=\"int16\" count=\"8\"/>"
+    "<vector id=\"v4i32\" type=\"int32\" count=\"4\"/>"
+    "<vector id=\"v2i64\" type=\"int64\" count=\"2\"/>"
+    "<union id=\"vec128\">"
+    "<field name=\"v4_float\" type=\"v4f\"/>"
+    "<field name=\"v2_double\" type=\"v2d\"/>"
+    "<field name=\"v16_int8\" type=\"v16i8\"/>"
+    "<field name=\"v8_int16\" type=\"v8i16\"/>"
+    "<field name=\"v4_int32\" type=\"v4i32\"/>"
+    "<field name=\"v2_int64\" type=\"v2i64\"/>"
+    "<field name=\"uint128\" type=\"uint128\"/>"
+    "</union>",
+    FIRST_SSE_REGISTER,
+    NULL
+  },
+  {
+    "org.gnu.gdb.i386.avx",
+    "avx.xml",
+    NULL,
+    FIRST_AVX_REGISTER,
+    IsAvxEnabled
+  }
+};
+
 CONST GDB_TARGET_INFO  GdbTargetInfo = {
   "i386:x86-64",
-  "org.gnu.gdb.i386.core"
+  mRegisterFeatures,
+  ARRAY_SIZE (mRegisterFeatures)
 };
 
+// Registers in the order of the x86-64 user_regs_struct. orig_rax, fs_base
+// and gs_base are not tracked.
+STATIC CONST UINT8  mCoreRegisters[] = {
+  15,            // r15
+  14,            // r14
+  13,            // r13
+  12,            // r12
+  6,             // rbp
+  1,             // rbx
+  11,            // r11
+  10,            // r10
+  9,             // r9
+  8,             // r8
+  0,             // rax
+  2,             // rcx
+  3,             // rdx
+  4,             // rsi
+  5,             // rdi
+  CORE_REG_ZERO, // orig_rax
+  16,            // rip
+  18,            // cs
+  17,            // eflags
+  7,             // rsp
+  19,            // ss
+  CORE_REG_ZERO, // fs_base
+  CORE_REG_ZERO, // gs_base
+  20,            // ds
+  21,            // es
+  22,            // fs
+  23             // gs
+};
+
+CONST GDB_CORE_INFO  GdbCoreInfo = {
+  62,   // EM_X86_64
+  mCoreRegisters,
+  ARRAY_SIZE (mCoreRegisters)
+};
+
+STATIC X64_EXTENDED_STATE  mExtendedState;
+STATIC BOOLEAN             mExtendedStateSaved = FALSE;
+STATIC BOOLEAN             mExtendedStateDirty = FALSE;
+
+// XSAVE requires a 64 byte aligned area, so the area is aligned within this buffer.
+STATIC UINT8  mXSaveBuffer[XSAVE_AREA_SIZE + XSAVE_ALIGNMENT];
+
+/**
+  Checks if the AVX state is enabled and can be saved with XSAVE.
+
+  @retval   TRUE if the AVX state is enabled.
+**/
+STATIC
+BOOLEAN
+IsAvxEnabled (
+  VOID
+  )
+{
+  UINT32  Ecx;
+
+  // CPUID.01H:ECX.OSXSAVE[bit 27] indicates XGETBV is available.
+  AsmCpuid (1, NULL, NULL, &Ecx, NULL);
+  if ((Ecx & BIT27) == 0) {
+    return FALSE;
+  }
+
+  return (AsmXGetBv (0) & (XSTATE_SSE | XSTATE_AVX)) == (XSTATE_SSE | XSTATE_AVX);
+}
+
+/**
+  Builds the full x87 tag word from the abridged tag word of an FXSAVE image,
+  classifying each valid register by its contents.
+
+  @param[in]  FxSave  The FXSAVE image.
+
+  @retval   The full x87 tag word.
+**/
+STATIC
+UINT32
+GetFullTagWord (
+  IN EFI_FX_SAVE_STATE_X64  *FxSave
+  )
+{
+  UINT8   *Register;
+  UINT16  Exponent;
+  UINT64  Mantissa;
+  UINT32  TagWord;
+  UINT32  Tag;
+  UINTN   Top;
+  UINTN   Physical;
+
+  // The tags are indexed by physical register while the image is in stack order.
+  Top     = (FxSave->Fsw >> 11) & 0x7;
+  TagWord = 0;
+  for (Physical = 0; Physical < 8; Physical++) {
+    if ((FxSave->Ftw & (1 << Physical)) == 0) {
+      Tag = 3;
+    } else {
+      Register = &FxSave->St0Mm0[0] + (((Physical - Top) & 0x7) * 16);
+      Mantissa = ReadUnaligned64 ((UINT64 *)Register);
+      Exponent = ReadUnaligned16 ((UINT16 *)(Register + 8)) & 0x7FFF;
+      if (Exponent == 0x7FFF) {
+        Tag = 2;
+      } else if (Exponent == 0) {
+        Tag = (Mantissa == 0) ? 1 : 2;
+      } else {
+        Tag = ((Mantissa & BIT63) != 0) ? 0 : 2;
+      }
+    }
+
+    TagWord |= Tag << (Physical * 2);
+  }
+
+  return TagWord;
+}
+
+/**
+  Gets the extended state save area, saving the state on the first access during
+  a stop.
+
+  @param[in]  SystemContext   The system context of the stop.
+  @param[in]  Write           Indicates the state will be modified and needs to
+                              be restored on resume.
+
+  @retval   The X64_EXTENDED_STATE save area.
+**/
+UINT8 *
+GdbGetExtendedState (
+  IN EFI_SYSTEM_CONTEXT  SystemContext,
+  IN BOOLEAN             Write
+  )
+{
+  EFI_FX_SAVE_STATE_X64  *FxSave;
+  UINT8                  *XSaveArea;
+  UINTN                  Index;
+
+  if (!mExtendedStateSaved) {
+    FxSave = &SystemContext.SystemContextX64->FxSaveState;
+    ZeroMem (&mExtendedState, sizeof (mExtendedState));
+    mExtendedState.Fctrl = FxSave->Fcw;
+    mExtendedState.Fstat = FxSave->Fsw;
+    mExtendedState.Ftag  = GetFullTagWord (FxSave);
+    mExtendedState.Fioff = (UINT32)FxSave->Rip;
+    mExtendedState.Fiseg = (UINT32)RShiftU64 (FxSave->Rip, 32);
+    mExtendedState.Fooff = (UINT32)FxSave->DataOffset;
+    mExtendedState.Foseg = (UINT32)RShiftU64 (FxSave->DataOffset, 32);
+    mExtendedState.Fop   = FxSave->Opcode;
+
+    // MXCSR is held in the first reserved field of the image.
+    mExtendedState.Mxcsr = ReadUnaligned32 ((UINT32 *)&FxSave->Reserved1[0]);
+
+    for (Index = 0; Index < 8; Index++) {
+      CopyMem (&mExtendedState.St[Index][0], &FxSave->St0Mm0[0] + (Index * 16), 10);
+    }
+
+    CopyMem (&mExtendedState.Xmm[0][0], &FxSave->Xmm0[0], sizeof (mExtendedState.Xmm));
+
+    // The agent does not use AVX, so the upper halves are still those of the
+    // interrupted code.
+    if (IsAvxEnabled ()) {
+      XSaveArea = ALIGN_POINTER (&mXSaveBuffer[0], XSAVE_ALIGNMENT);
+      ZeroMem (XSaveArea, XSAVE_AREA_SIZE);
+      DebugXSave (XSaveArea, XSTATE_AVX);
+      CopyMem (&mExtendedState.YmmHigh[0][0], XSaveArea + XSAVE_AVX_OFFSET, sizeof (mExtendedState.YmmHigh));
+    }
+
+    mExtendedStateSaved = TRUE;
+  }
+
+  if (Write) {
+    mExtendedStateDirty = TRUE;
+  }
+
+  return (UINT8 *)&mExtendedState;
+}
+
+/**
+  Restores the extended state if it was modified by the debugger and discards
+  the saved copy so the next stop saves it again.
+
+  @param[in]  SystemContext   The system context of the stop.
+
+**/
+VOID
+GdbRestoreExtendedState (
+  IN EFI_SYSTEM_CONTEXT  SystemContext
+  )
+{
+  EFI_FX_SAVE_STATE_X64  *FxSave;
+  UINT8                  *XSaveArea;
+  UINT16                 AbridgedTag;
+  UINTN                  Index;
+
+  if (mExtendedStateSaved && mExtendedStateDirty) {
+    // The exception handler loads the FXSAVE image on return.
+    FxSave             = &SystemContext.SystemContextX64->FxSaveState;
+    FxSave->Fcw        = (UINT16)mExtendedState.Fctrl;
+    FxSave->Fsw        = (UINT16)mExtendedState.Fstat;
+    FxSave->Rip        = LShiftU64 (mExtendedState.Fiseg, 32) | mExtendedState.Fioff;
+    FxSave->DataOffset = LShiftU64 (mExtendedState.Foseg, 32) | mExtendedState.Fooff;
+    FxSave->Opcode     = (UINT16)mExtendedState.Fop;
+    WriteUnaligned32 ((UINT32 *)&FxSave->Reserved1[0], mExtendedState.Mxcsr);
+
+    AbridgedTag = 0;
+    for (Index = 0; Index < 8; Index++) {
+      if (((mExtendedState.Ftag >> (Index * 2)) & 0x3) != 3) {
+        AbridgedTag |= (UINT16)(1 << Index);
+      }
+
+      CopyMem (&FxSave->St0Mm0[0] + (Index * 16), &mExtendedState.St[Index][0], 10);
+    }
+
+    FxSave->Ftw = AbridgedTag;
+    CopyMem (&FxSave->Xmm0[0], &mExtendedState.Xmm[0][0], sizeof (mExtendedState.Xmm));
+
+    if (IsAvxEnabled ()) {
+      // XRSTOR of the AVX component also loads MXCSR, so save first to start
+      // from the current value.
+      XSaveArea = ALIGN_POINTER (&mXSaveBuffer[0], XSAVE_ALIGNMENT);
+      ZeroMem (XSaveArea, XSAVE_AREA_SIZE);
+      DebugXSave (XSaveArea, XSTATE_AVX);
+      CopyMem (XSaveArea + XSAVE_AVX_OFFSET, &mExtendedState.YmmHigh[0][0], sizeof (mExtendedState.YmmHigh));
+
+      // Mark the component in use, otherwise XRSTOR puts it in its initial state.
+      *(UINT64 *)(XSaveArea + XSAVE_HEADER_OFFSET) |= XSTATE_AVX;
+      DebugXRstor (XSaveArea, XSTATE_AVX);
+    }
+  }
+
+  mExtendedStateSaved = FALSE;
+  mExtendedStateDirty = FALSE;
+}
+
 /**
   Read MSR into a string response.
 
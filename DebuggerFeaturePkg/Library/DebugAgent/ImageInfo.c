@@ -0,0 +1,666 @@
+/** @file
+  Contains routines for locating and parsing PE/COFF and TE images in memory.
+  All image memory is accessed through the debugger memory routines so that
+  corrupt or partially mapped images do not cause faults in the debugger.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "DebugAgent.h"
+
+#include <IndustryStandard/PeImage.h>
+
+// Default stride and range of the backward image header search.
+#define IMAGE_SEARCH_DEFAULT_STEP   SIZE_4KB
+#define IMAGE_SEARCH_DEFAULT_RANGE  SIZE_2MB
+
+// Maximum number of loaded images tracked by the debugger.
+#define MAX_LOADED_IMAGES  512
+
+// Used to scan a page of memory at a time for image headers.
+STATIC UINT8  mImagePage[EFI_PAGE_SIZE];
+
+// Table of images loaded in this phase. Memory allocation is not available at
+// first so this must be static.
+STATIC LOADED_IMAGE_ENTRY  mLoadedImages[MAX_LOADED_IMAGES];
+STATIC UINTN               mLoadedImageCount = 0;
+
+/**
+  Reads the image headers for an image in memory.
+
+  @param[in]   ImageBase  The base address of the image.
+  @param[out]  Hdr        The headers of the image.
+  @param[out]  HdrOffset  The offset of the headers from the image base.
+  @param[out]  TeAdjust   The offset to subtract from RVAs to get the offset
+                          from the image base. Non-zero only for TE images.
+
+  @retval   TRUE   The headers were read and are valid.
+  @retval   FALSE  The headers are not valid or could not be read.
+**/
+STATIC
+BOOLEAN
+ReadImageHeaders (
+  IN  UINTN                            ImageBase,
+  OUT EFI_IMAGE_OPTIONAL_HEADER_UNION  *Hdr,
+  OUT UINTN                            *HdrOffset,
+  OUT UINTN                            *TeAdjust
+  )
+{
+  EFI_IMAGE_DOS_HEADER  DosHdr;
+
+  *HdrOffset = 0;
+  *TeAdjust  = 0;
+  if (!DbgReadMemory (ImageBase, &DosHdr, sizeof (DosHdr.e_magic))) {
+    return FALSE;
+  }
+
+  if (DosHdr.e_magic == EFI_TE_IMAGE_HEADER_SIGNATURE) {
+    if (!DbgReadMemory (ImageBase, &Hdr->Te, sizeof (Hdr->Te))) {
+      return FALSE;
+    }
+
+    if ((Hdr->Te.NumberOfSections == 0) || (Hdr->Te.StrippedSize < sizeof (EFI_TE_IMAGE_HEADER))) {
+      return FALSE;
+    }
+
+    *TeAdjust = Hdr->Te.StrippedSize - sizeof (EFI_TE_IMAGE_HEADER);
+    return TRUE;
+  }
+
+  if (DosHdr.e_magic != EFI_IMAGE_DOS_SIGNATURE) {
+    return FALSE;
+  }
+
+  if (!DbgReadMemory (ImageBase, &DosHdr, sizeof (DosHdr))) {
+    return FALSE;
+  }
+
+  if ((DosHdr.e_lfanew == 0) || (DosHdr.e_lfanew >= SIZE_64KB)) {
+    return FALSE;
+  }
+
+  if (!DbgReadMemory (ImageBase + DosHdr.e_lfanew, Hdr, sizeof (*Hdr))) {
+    return FALSE;
+  }
+
+  if (Hdr->Pe32.Signature != EFI_IMAGE_NT_SIGNATURE) {
+    return FALSE;
+  }
+
+  *HdrOffset = DosHdr.e_lfanew;
+
+  return (Hdr->Pe32.OptionalHeader.Magic == EFI_IMAGE_NT_OPTIONAL_HDR32_MAGIC) ||
+         (Hdr->Pe32.OptionalHeader.Magic == EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC);
+}
+
+/**
+  Reads a section header from an image in memory.
+
+  @param[in]   ImageBase  The base address of the image.
+  @param[in]   Hdr        The headers of the image.
+  @param[in]   HdrOffset  The offset of the headers from the image base.
+  @param[in]   Index      The index of the section header to read.
+  @param[out]  Section    The section header.
+
+  @retval   TRUE   The section header was read.
+  @retval   FALSE  The index is out of range or the header could not be read.
+**/
+STATIC
+BOOLEAN
+ReadImageSection (
+  IN  UINTN                            ImageBase,
+  IN  EFI_IMAGE_OPTIONAL_HEADER_UNION  *Hdr,
+  IN  UINTN                            HdrOffset,
+  IN  UINTN                            Index,
+  OUT EFI_IMAGE_SECTION_HEADER         *Section
+  )
+{
+  UINTN  SectionOffset;
+
+  if (Hdr->Te.Signature == EFI_TE_IMAGE_HEADER_SIGNATURE) {
+    if (Index >= Hdr->Te.NumberOfSections) {
+      return FALSE;
+    }
+
+    SectionOffset = sizeof (EFI_TE_IMAGE_HEADER);
+  } else {
+    if (Index >= Hdr->Pe32.FileHeader.NumberOfSections) {
+      return FALSE;
+    }
+
+    SectionOffset = HdrOffset + sizeof (UINT32) + sizeof (EFI_IMAGE_FILE_HEADER) +
+                    Hdr->Pe32.FileHeader.SizeOfOptionalHeader;
+  }
+
+  return DbgReadMemory (
+           ImageBase + SectionOffset + (Index * sizeof (*Section)),
+           Section,
+           sizeof (*Section)
+           );
+}
+
+/**
+  Gets the size of an image in memory. For TE images, this is calculated from
+  the end of the last section.
+
+  @param[in]  ImageBase  The base address of the image.
+  @param[in]  Hdr        The headers of the image.
+  @param[in]  HdrOffset  The offset of the headers from the image base.
+  @param[in]  TeAdjust   The TE adjustment of the image.
+
+  @retval   The size of the image, 0 if it could not be determined.
+**/
+STATIC
+UINTN
+GetImageSize (
+  IN UINTN                            ImageBase,
+  IN EFI_IMAGE_OPTIONAL_HEADER_UNION  *Hdr,
+  IN UINTN                            HdrOffset,
+  IN UINTN                            TeAdjust
+  )
+{
+  EFI_IMAGE_SECTION_HEADER  Section;
+  UINTN                     Index;
+  UINTN                     End;
+
+  if (Hdr->Te.Signature != EFI_TE_IMAGE_HEADER_SIGNATURE) {
+    if (Hdr->Pe32.OptionalHeader.Magic == EFI_IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+      return Hdr->Pe32.OptionalHeader.SizeOfImage;
+    }
+
+    return Hdr->Pe32Plus.OptionalHeader.SizeOfImage;
+  }
+
+  End = 0;
+  for (Index = 0; ReadImageSection (ImageBase, Hdr, HdrOffset, Index, &Section); Index++) {
+    End = MAX (End, (UINTN)Section.VirtualAddress + Section.Misc.VirtualSize);
+  }
+
+  return (End > TeAdjust) ? End - TeAdjust : 0;
+}
+
+/**
+  Finds the address of a section in an image in memory.
+
+  @param[in]   ImageBase  The base address of the image.
+  @param[in]   Name       The name of the section, such as ".text".
+  @param[out]  Address    The address of the section.
+
+  @retval   TRUE   The section was found.
+  @retval   FALSE  The section was not found.
+**/
+BOOLEAN
+DbgGetImageSectionAddress (
+  IN  UINTN        ImageBase,
+  IN  CONST CHAR8  *Name,
+  OUT UINTN        *Address
+  )
+{
+  EFI_IMAGE_OPTIONAL_HEADER_UNION  Hdr;
+  EFI_IMAGE_SECTION_HEADER         Section;
+  UINTN                            HdrOffset;
+  UINTN                            TeAdjust;
+  UINTN                            Index;
+  UINTN                            NameLength;
+
+  NameLength = AsciiStrLen (Name);
+  if ((NameLength > EFI_IMAGE_SIZEOF_SHORT_NAME) || !ReadImageHeaders (ImageBase, &Hdr, &HdrOffset, &TeAdjust)) {
+    return FALSE;
+  }
+
+  for (Index = 0; ReadImageSection (ImageBase, &Hdr, HdrOffset, Index, &Section); Index++) {
+    if ((CompareMem (Section.Name, Name, NameLength) == 0) &&
+        ((NameLength == EFI_IMAGE_SIZEOF_SHORT_NAME) || (Section.Name[NameLength] == 0)))
+    {
+      *Address = ImageBase + Section.VirtualAddress - TeAdjust;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+  Searches backwards from an address for the PE/COFF or TE image containing it.
+
+  @param[in]   Address    The address to search from.
+  @param[in]   Step       The alignment of the image headers to check. If 0, the
+                          default of 4KB is used.
+  @param[in]   MaxRange   The maximum distance to search. If 0, the default of
+                          2MB is used.
+  @param[out]  ImageBase  The base address of the image.
+  @param[out]  ImageSize  The size of the image in memory.
+
+  @retval   TRUE   The image was found.
+  @retval   FALSE  No image was found within the range.
+**/
+BOOLEAN
+DbgFindImage (
+  IN  UINTN  Address,
+  IN  UINTN  Step,
+  IN  UINTN  MaxRange,
+  OUT UINTN  *ImageBase,
+  OUT UINTN  *ImageSize
+  )
+{
+  EFI_IMAGE_OPTIONAL_HEADER_UNION  Hdr;
+  UINTN                            HdrOffset;
+  UINTN                            TeAdjust;
+  UINTN                            Candidate;
+  UINTN                            PageBase;
+  UINTN                            Offset;
+  UINTN                            Size;
+  BOOLEAN                          PageValid;
+  UINT16                           Magic;
+
+  if ((Step < 2) || ((Step & (Step - 1)) != 0)) {
+    Step = IMAGE_SEARCH_DEFAULT_STEP;
+  }
+
+  if (MaxRange == 0) {
+    MaxRange = IMAGE_SEARCH_DEFAULT_RANGE;
+  }
+
+  //
+  // Read a page at a time and check each aligned candidate in the page for a
+  // header signature before doing the more expensive header validation.
+  //
+
+  PageBase  = MAX_UINTN;
+  PageValid = FALSE;
+  Candidate = Address & ~(Step - 1);
+  while ((Candidate != 0) && ((Address - Candidate) < MaxRange)) {
+    if ((Candidate & ~(UINTN)EFI_PAGE_MASK) != PageBase) {
+      PageBase  = Candidate & ~(UINTN)EFI_PAGE_MASK;
+      PageValid = DbgReadMemory (PageBase, &mImagePage[0], EFI_PAGE_SIZE);
+    }
+
+    if (!PageValid) {
+      // Skip to the last candidate in the previous page.
+      if (PageBase < Step) {
+        break;
+      }
+
+      Candidate = (PageBase - 1) & ~(Step - 1);
+      continue;
+    }
+
+    Offset = Candidate & EFI_PAGE_MASK;
+    Magic  = (UINT16)(mImagePage[Offset] | (mImagePage[Offset + 1] << 8));
+    if (((Magic == EFI_IMAGE_DOS_SIGNATURE) || (Magic == EFI_TE_IMAGE_HEADER_SIGNATURE)) &&
+        ReadImageHeaders (Candidate, &Hdr, &HdrOffset, &TeAdjust))
+    {
+      // Make sure the address is actually within this image.
+      Size = GetImageSize (Candidate, &Hdr, HdrOffset, TeAdjust);
+      if ((Size == 0) || (Address - Candidate < Size)) {
+        *ImageBase = Candidate;
+        *ImageSize = Size;
+        return TRUE;
+      }
+    }
+
+    if (Candidate < Step) {
+      break;
+    }
+
+    Candidate -= Step;
+  }
+
+  return FALSE;
+}
+
+/**
+  Finds the image containing an address, checking the table of loaded images
+  before searching backwards through memory for the image headers.
+
+  @param[in]   Address    The address to find the image for.
+  @param[out]  ImageBase  The base address of the image.
+  @param[out]  ImageSize  The size of the image in memory.
+
+  @retval   TRUE   The image was found.
+  @retval   FALSE  No image was found.
+**/
+BOOLEAN
+DbgFindLoadedImage (
+  IN  UINTN  Address,
+  OUT UINTN  *ImageBase,
+  OUT UINTN  *ImageSize
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < mLoadedImageCount; Index++) {
+    if ((Address >= mLoadedImages[Index].ImageBase) &&
+        (Address - mLoadedImages[Index].ImageBase < mLoadedImages[Index].ImageSize))
+    {
+      *ImageBase = mLoadedImages[Index].ImageBase;
+      *ImageSize = mLoadedImages[Index].ImageSize;
+      return TRUE;
+    }
+  }
+
+  return DbgFindImage (Address, 0, 0, ImageBase, ImageSize);
+}
+
+/**
+  Gets a data directory of a PE/COFF image in memory. TE images are not
+  supported as they only keep the relocation and debug directories.
+
+  @param[in]   ImageBase  The base address of the image.
+  @param[in]   Index      The EFI_IMAGE_DIRECTORY_ENTRY_* index of the directory.
+  @param[out]  Address    The address of the directory.
+  @param[out]  Size       The size of the directory.
+
+  @retval   TRUE   The directory was found.
+  @retval   FALSE  The image does not have the directory.
+**/
+BOOLEAN
+DbgGetImageDirectory (
+  IN  UINTN  ImageBase,
+  IN  UINTN  Index,
+  OUT UINTN  *Address,
+  OUT UINTN  *Size
+  )
+{
+  EFI_IMAGE_OPTIONAL_HEADER_UNION  Hdr;
+  EFI_IMAGE_DATA_DIRECTORY         *Directory;
+  UINTN                            HdrOffset;
+  UINTN                            TeAdjust;
+
+  if (!ReadImageHeaders (ImageBase, &Hdr, &HdrOffset, &TeAdjust) ||
+      (Hdr.Te.Signature == EFI_TE_IMAGE_HEADER_SIGNATURE))
+  {
+    return FALSE;
+  }
+
+  if (Hdr.Pe32.OptionalHeader.Magic == EFI_IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+    if (Hdr.Pe32.OptionalHeader.NumberOfRvaAndSizes <= Index) {
+      return FALSE;
+    }
+
+    Directory = &Hdr.Pe32.OptionalHeader.DataDirectory[Index];
+  } else {
+    if (Hdr.Pe32Plus.OptionalHeader.NumberOfRvaAndSizes <= Index) {
+      return FALSE;
+    }
+
+    Directory = &Hdr.Pe32Plus.OptionalHeader.DataDirectory[Index];
+  }
+
+  if ((Directory->VirtualAddress == 0) || (Directory->Size == 0)) {
+    return FALSE;
+  }
+
+  *Address = ImageBase + Directory->VirtualAddress;
+  *Size    = Directory->Size;
+  return TRUE;
+}
+
+/**
+  Reads a NULL terminated string from memory. The string is read up to each
+  page boundary so that a string at the end of a mapped region can be read.
+
+  @param[in]   Address     The address of the string.
+  @param[out]  Buffer      The buffer to copy the string into.
+  @param[in]   BufferSize  The size of the buffer. Longer strings are truncated.
+
+  @retval   TRUE   The string was read.
+  @retval   FALSE  The string could not be read.
+**/
+BOOLEAN
+DbgReadString (
+  IN  UINTN  Address,
+  OUT CHAR8  *Buffer,
+  IN  UINTN  BufferSize
+  )
+{
+  UINTN  Length;
+  UINTN  ChunkLength;
+
+  if (BufferSize == 0) {
+    return FALSE;
+  }
+
+  Length = 0;
+  while (Length < BufferSize - 1) {
+    ChunkLength = MIN (BufferSize - 1 - Length, EFI_PAGE_SIZE - ((Address + Length) & EFI_PAGE_MASK));
+    if (!DbgReadMemory (Address + Length, &Buffer[Length], ChunkLength)) {
+      return FALSE;
+    }
+
+    if (ScanMem8 (&Buffer[Length], ChunkLength, 0) != NULL) {
+      return TRUE;
+    }
+
+    Length += ChunkLength;
+  }
+
+  Buffer[Length] = 0;
+  return TRUE;
+}
+
+/**
+  Gets the address of the CodeView PDB file name for an image in memory.
+
+  @param[in]   ImageBase   The base address of the image.
+  @param[out]  PdbAddress  The address of the NULL terminated PDB file name.
+
+  @retval   TRUE   The PDB name was found.
+  @retval   FALSE  The image has no CodeView entry or it could not be read.
+**/
+STATIC
+BOOLEAN
+GetImagePdbAddress (
+  IN  UINTN  ImageBase,
+  OUT UINTN  *PdbAddress
+  )
+{
+  EFI_IMAGE_OPTIONAL_HEADER_UNION  Hdr;
+  EFI_IMAGE_DATA_DIRECTORY         *DebugDir;
+  EFI_IMAGE_DEBUG_DIRECTORY_ENTRY  Entry;
+  UINTN                            HdrOffset;
+  UINTN                            TeAdjust;
+  UINTN                            Index;
+  UINTN                            NameAddress;
+  UINT32                           Signature;
+
+  if (!ReadImageHeaders (ImageBase, &Hdr, &HdrOffset, &TeAdjust)) {
+    return FALSE;
+  }
+
+  if (Hdr.Te.Signature == EFI_TE_IMAGE_HEADER_SIGNATURE) {
+    DebugDir = &Hdr.Te.DataDirectory[EFI_TE_IMAGE_DIRECTORY_ENTRY_DEBUG];
+  } else if (Hdr.Pe32.OptionalHeader.Magic == EFI_IMAGE_NT_OPTIONAL_HDR32_MAGIC) {
+    if (Hdr.Pe32.OptionalHeader.NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_DEBUG) {
+      return FALSE;
+    }
+
+    DebugDir = &Hdr.Pe32.OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_DEBUG];
+  } else {
+    if (Hdr.Pe32Plus.OptionalHeader.NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_DEBUG) {
+      return FALSE;
+    }
+
+    DebugDir = &Hdr.Pe32Plus.OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_DEBUG];
+  }
+
+  if ((DebugDir->VirtualAddress <= TeAdjust) || (DebugDir->Size == 0)) {
+    return FALSE;
+  }
+
+  for (Index = 0; Index < DebugDir->Size / sizeof (Entry); Index++) {
+    if (!DbgReadMemory (
+           ImageBase + DebugDir->VirtualAddress - TeAdjust + (Index * sizeof (Entry)),
+           &Entry,
+           sizeof (Entry)
+           ))
+    {
+      return FALSE;
+    }
+
+    if ((Entry.Type == EFI_IMAGE_DEBUG_TYPE_CODEVIEW) && (Entry.RVA > TeAdjust)) {
+      break;
+    }
+  }
+
+  if (Index == DebugDir->Size / sizeof (Entry)) {
+    return FALSE;
+  }
+
+  NameAddress = ImageBase + Entry.RVA - TeAdjust;
+  if (!DbgReadMemory (NameAddress, &Signature, sizeof (Signature))) {
+    return FALSE;
+  }
+
+  switch (Signature) {
+    case CODEVIEW_SIGNATURE_NB10:
+      *PdbAddress = NameAddress + sizeof (EFI_IMAGE_DEBUG_CODEVIEW_NB10_ENTRY);
+      return TRUE;
+    case CODEVIEW_SIGNATURE_RSDS:
+      *PdbAddress = NameAddress + sizeof (EFI_IMAGE_DEBUG_CODEVIEW_RSDS_ENTRY);
+      return TRUE;
+    case CODEVIEW_SIGNATURE_MTOC:
+      *PdbAddress = NameAddress + sizeof (EFI_IMAGE_DEBUG_CODEVIEW_MTOC_ENTRY);
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+/**
+  Reads the CodeView PDB file name for an image in memory.
+
+  @param[in]   ImageBase    The base address of the image.
+  @param[out]  PdbName      The buffer to write the NULL terminated name into.
+  @param[in]   PdbNameSize  The size of the PdbName buffer.
+
+  @retval   TRUE   The PDB name was found.
+  @retval   FALSE  The image has no CodeView entry or it could not be read.
+**/
+BOOLEAN
+DbgGetImagePdbName (
+  IN  UINTN  ImageBase,
+  OUT CHAR8  *PdbName,
+  IN  UINTN  PdbNameSize
+  )
+{
+  UINTN  PdbAddress;
+
+  if (!GetImagePdbAddress (ImageBase, &PdbAddress)) {
+    return FALSE;
+  }
+
+  return DbgReadString (PdbAddress, PdbName, PdbNameSize);
+}
+
+/**
+  Adds an image to the table of loaded images. If an image is already
+  registered at the same base address, the entry is replaced.
+
+  @param[in]  ImageBase  The base address of the image.
+  @param[in]  ImageSize  The size of the image. If 0, the size is taken from
+                         the image headers.
+
+  @retval   TRUE   The image was added to the table.
+  @retval   FALSE  The image is not valid or the table is full.
+**/
+BOOLEAN
+DbgRegisterImage (
+  IN UINTN  ImageBase,
+  IN UINTN  ImageSize
+  )
+{
+  EFI_IMAGE_OPTIONAL_HEADER_UNION  Hdr;
+  LOADED_IMAGE_ENTRY               *Entry;
+  UINTN                            HdrOffset;
+  UINTN                            TeAdjust;
+  UINTN                            Index;
+
+  if (!ReadImageHeaders (ImageBase, &Hdr, &HdrOffset, &TeAdjust)) {
+    return FALSE;
+  }
+
+  for (Index = 0; Index < mLoadedImageCount; Index++) {
+    if (mLoadedImages[Index].ImageBase == ImageBase) {
+      break;
+    }
+  }
+
+  if (Index >= MAX_LOADED_IMAGES) {
+    return FALSE;
+  }
+
+  Entry            = &mLoadedImages[Index];
+  Entry->ImageBase = ImageBase;
+  Entry->ImageSize = (ImageSize != 0) ? ImageSize : GetImageSize (ImageBase, &Hdr, HdrOffset, TeAdjust);
+  if (!DbgGetImageSectionAddress (ImageBase, ".text", &Entry->TextAddress)) {
+    Entry->TextAddress = ImageBase;
+  }
+
+  if (!GetImagePdbAddress (ImageBase, &Entry->PdbAddress)) {
+    Entry->PdbAddress = 0;
+  }
+
+  if (Index == mLoadedImageCount) {
+    mLoadedImageCount++;
+  }
+
+  return TRUE;
+}
+
+/**
+  Removes an image from the table of loaded images. The remaining entries keep
+  their load order.
+
+  @param[in]  ImageBase  The base address of the image.
+
+  @retval   TRUE   The image was removed from the table.
+  @retval   FALSE  No image is registered at the address.
+**/
+BOOLEAN
+DbgUnregisterImage (
+  IN UINTN  ImageBase
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < mLoadedImageCount; Index++) {
+    if (mLoadedImages[Index].ImageBase == ImageBase) {
+      break;
+    }
+  }
+
+  if (Index >= mLoadedImageCount) {
+    return FALSE;
+  }
+
+  CopyMem (
+    &mLoadedImages[Index],
+    &mLoadedImages[Index + 1],
+    (mLoadedImageCount - Index - 1) * sizeof (LOADED_IMAGE_ENTRY)
+    );
+
+  mLoadedImageCount--;
+  return TRUE;
+}
+
+/**
+  Gets an entry from the table of loaded images.
+
+  @param[in]  Index  The index of the entry.
+
+  @retval   The loaded image entry, NULL if the index is past the end of the table.
+**/
+CONST LOADED_IMAGE_ENTRY *
+DbgGetLoadedImage (
+  IN UINTN  Index
+  )
+{
+  if (Index >= mLoadedImageCount) {
+    return NULL;
+  }
+
+  return &mLoadedImages[Index];
+}
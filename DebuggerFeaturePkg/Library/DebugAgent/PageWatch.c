@@ -0,0 +1,611 @@
+/**@file PageWatch.c
+
+  Software watchpoints for ranges the debug registers cannot cover. The pages
+  of a watched range are made read-only, or not-present when reads are watched,
+  while the system runs. A fault on one of those pages is stepped with the page
+  restored and the page is protected again after the step. Only accesses inside
+  the watched range are reported to the debugger.
+
+  The pages are protected through the phase when the system resumes. The fault
+  and the step can be taken on any processor, so they only toggle the bits of
+  the page table entry found when the page was protected and invalidate the
+  page on the current processor.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+#include "DebugAgent.h"
+
+#define MAX_PAGE_WATCHES   8
+#define MAX_WATCHED_PAGES  64
+
+// Watched pages a single step may fault on. An access may straddle two pages
+// and string instructions have two memory operands.
+#define MAX_STEP_PAGES  4
+
+typedef struct _PAGE_WATCH {
+  BOOLEAN    Active;
+  UINTN      Address;
+  UINTN      Length;
+  BOOLEAN    Read;
+  BOOLEAN    Write;
+} PAGE_WATCH;
+
+typedef struct _WATCHED_PAGE {
+  UINTN     Page;
+  UINT64    Attribute;    // Attribute added by the agent, 0 if already present.
+  UINT64    *Entry;       // Page table entry of the page.
+  UINT64             Mask;      // Entry bits changed by the attribute.
+  UINT64             Protected; // Masked entry bits while the page is protected.
+  volatile UINT32    Steps;     // Processors stepping an access to the page.
+} WATCHED_PAGE;
+
+// A processor stepping an access to watched pages. Each page the step faults
+// on is recorded once and protected again when the step completes.
+typedef struct _PENDING_STEP {
+  BOOLEAN    Hit;
+  BOOLEAN    Write;
+  UINT64     Address;
+  UINTN      PageCount;
+  UINTN      Pages[MAX_STEP_PAGES];
+} PENDING_STEP;
+
+STATIC PAGE_WATCH    mPageWatches[MAX_PAGE_WATCHES];
+STATIC WATCHED_PAGE  mWatchedPages[MAX_WATCHED_PAGES];
+STATIC UINTN         mWatchedPageCount = 0;
+STATIC BOOLEAN       mArmed            = FALSE;
+STATIC PENDING_STEP  mPendingSteps[MAX_DEBUG_PROCESSORS];
+
+/**
+  Gets the number of pages covered by a range.
+
+  @param[in]  Address   The start of the range.
+  @param[in]  Length    The length of the range.
+
+  @retval   The number of pages.
+**/
+STATIC
+UINTN
+RangePageCount (
+  IN UINTN  Address,
+  IN UINTN  Length
+  )
+{
+  return EFI_SIZE_TO_PAGES ((Address & EFI_PAGE_MASK) + Length);
+}
+
+/**
+  Gets the attribute needed to trap the watched accesses on a page. Pages with
+  a read watch are made not-present, pages with only write watches read-only.
+
+  @param[in]  Page    The page address.
+
+  @retval   The attribute, or 0 if the page is not watched.
+**/
+STATIC
+UINT64
+GetPageWatchAttribute (
+  IN UINTN  Page
+  )
+{
+  UINTN   Index;
+  UINT64  Attribute;
+
+  Attribute = 0;
+  for (Index = 0; Index < MAX_PAGE_WATCHES; Index++) {
+    if (!mPageWatches[Index].Active ||
+        (Page + EFI_PAGE_SIZE <= mPageWatches[Index].Address) ||
+        (Page >= mPageWatches[Index].Address + mPageWatches[Index].Length))
+    {
+      continue;
+    }
+
+    if (mPageWatches[Index].Read) {
+      return EFI_MEMORY_RP;
+    }
+
+    Attribute = EFI_MEMORY_RO;
+  }
+
+  return Attribute;
+}
+
+/**
+  Finds a page protected while the system runs.
+
+  @param[in]  Page    The page address.
+
+  @retval   The watched page, or NULL if the page is not protected.
+**/
+STATIC
+WATCHED_PAGE *
+FindWatchedPage (
+  IN UINTN  Page
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < mWatchedPageCount; Index++) {
+    if (mWatchedPages[Index].Page == Page) {
+      return &mWatchedPages[Index];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+  Protects or restores a watched page by changing its page table entry. The
+  other bits of the entry may be changed by the processor at the same time.
+
+  @param[in]  Entry     The watched page.
+  @param[in]  Protect   TRUE to protect the page, FALSE to restore it.
+
+**/
+STATIC
+VOID
+SetWatchedPageEntry (
+  IN WATCHED_PAGE  *Entry,
+  IN BOOLEAN       Protect
+  )
+{
+  UINT64  Old;
+  UINT64  New;
+  UINT64  Bits;
+
+  Bits = Protect ? Entry->Protected : (Entry->Protected ^ Entry->Mask);
+  do {
+    Old = *(volatile UINT64 *)Entry->Entry;
+    New = (Old & ~Entry->Mask) | Bits;
+  } while (InterlockedCompareExchange64 (Entry->Entry, Old, New) != Old);
+
+  DebugArchFlushPage (Entry->Page);
+}
+
+/**
+  Ends a step of an access to a watched page.
+
+  @param[in]  Entry     The watched page.
+
+  @retval   TRUE    No other processor is stepping an access to the page.
+  @retval   FALSE   The page must stay restored for another processor.
+**/
+STATIC
+BOOLEAN
+ReleaseWatchedPage (
+  IN WATCHED_PAGE  *Entry
+  )
+{
+  UINT32  Steps;
+
+  // The pages may have been protected again while the processor was halted
+  // mid step, which resets the count.
+  do {
+    Steps = Entry->Steps;
+    if (Steps == 0) {
+      return TRUE;
+    }
+  } while (InterlockedCompareExchange32 (&Entry->Steps, Steps, Steps - 1) != Steps);
+
+  return Steps == 1;
+}
+
+/**
+  Checks if a range shares a page with memory that must never fault while the
+  system runs. The pages at and below the stack pointer of each stopped
+  processor take the exception frame of the next fault, and the image of the
+  agent holds the code and data used to handle it.
+
+  @param[in]  Address   The start of the range.
+  @param[in]  Length    The length of the range.
+
+  @retval   TRUE    The range cannot be watched by page protection.
+  @retval   FALSE   The range can be watched.
+**/
+STATIC
+BOOLEAN
+IsUnsafeRange (
+  IN UINTN  Address,
+  IN UINTN  Length
+  )
+{
+  EFI_SYSTEM_CONTEXT  *Context;
+  STACK_FRAME         Frame;
+  UINTN               Start;
+  UINTN               End;
+  UINTN               Base;
+  UINTN               Size;
+  UINTN               Index;
+
+  Start = Address & ~EFI_PAGE_MASK;
+  End   = ALIGN_VALUE (Address + Length, EFI_PAGE_SIZE);
+
+  if (DbgFindLoadedImage ((UINTN)IsUnsafeRange, &Base, &Size) &&
+      (Start < Base + Size) && (Base < End))
+  {
+    return TRUE;
+  }
+
+  for (Index = 0; Index < DbgGetProcessorCount (); Index++) {
+    Context = DbgGetProcessorContext (Index);
+    if ((Context == NULL) || (DebugArchUnwindStack (*Context, &Frame, 1) == 0)) {
+      continue;
+    }
+
+    Base = ((UINTN)Frame.Sp & ~EFI_PAGE_MASK) - EFI_PAGE_SIZE;
+    if ((Start < Base + (2 * EFI_PAGE_SIZE)) && (Base < End)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+  Protects a watched page through the phase and records the page table entry
+  bits that the protection changes, so the page can be toggled from the fault.
+
+  @param[in]  Entry     The watched page, with the attribute to add.
+
+  @retval   TRUE    The page is protected.
+  @retval   FALSE   The page cannot be watched and is left unchanged.
+**/
+STATIC
+BOOLEAN
+ProtectWatchedPage (
+  IN WATCHED_PAGE  *Entry
+  )
+{
+  UINT64  Attributes;
+  UINT64  Unprotected;
+
+  // Pages that already fault are left alone, those faults are real.
+  if (!DbgGetPageAttributes (Entry->Page, &Attributes) ||
+      ((Attributes & (Entry->Attribute | EFI_MEMORY_RP)) != 0))
+  {
+    return FALSE;
+  }
+
+  // Protecting the page splits a large page, so the entry is found after.
+  if (!DbgSetPageAttributes (Entry->Page, Entry->Attribute)) {
+    return FALSE;
+  }
+
+  Entry->Entry = DebugArchGetPageEntry (Entry->Page);
+  if (Entry->Entry == NULL) {
+    DbgClearPageAttributes (Entry->Page, Entry->Attribute);
+    return FALSE;
+  }
+
+  Entry->Protected = *Entry->Entry;
+  if (!DbgClearPageAttributes (Entry->Page, Entry->Attribute)) {
+    return FALSE;
+  }
+
+  Unprotected = *Entry->Entry;
+  Entry->Mask = (Entry->Protected ^ Unprotected) & ~mArchPageEntryHardwareBits;
+  if ((Entry->Mask == 0) || (DebugArchGetPageEntry (Entry->Page) != Entry->Entry)) {
+    return FALSE;
+  }
+
+  Entry->Protected &= Entry->Mask;
+  SetWatchedPageEntry (Entry, TRUE);
+  return TRUE;
+}
+
+/**
+  Checks if an access hits a watched range.
+
+  @param[in]  Address   The faulting address.
+  @param[in]  Write     The access was a write.
+
+  @retval   TRUE    The access should be reported.
+  @retval   FALSE   The access is outside the watched ranges.
+**/
+STATIC
+BOOLEAN
+IsWatchedAccess (
+  IN UINT64   Address,
+  IN BOOLEAN  Write
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < MAX_PAGE_WATCHES; Index++) {
+    if (mPageWatches[Index].Active &&
+        (Address >= mPageWatches[Index].Address) &&
+        (Address - mPageWatches[Index].Address < mPageWatches[Index].Length) &&
+        (Write ? mPageWatches[Index].Write : mPageWatches[Index].Read))
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+  Adds a page watchpoint.
+
+  @param[in]  Address   The address of the watched range.
+  @param[in]  Length    The length of the watched range.
+  @param[in]  Read      Boolean indicated break on read.
+  @param[in]  Write     Boolean indicated break on write.
+
+  @retval  TRUE   The watchpoint was added.
+  @retval  FALSE  The watchpoint could not be added.
+**/
+BOOLEAN
+DbgAddPageWatch (
+  IN UINTN    Address,
+  IN UINTN    Length,
+  IN BOOLEAN  Read,
+  IN BOOLEAN  Write
+  )
+{
+  UINTN   Index;
+  UINTN   Free;
+  UINTN   Pages;
+  UINTN   Page;
+  UINT64  Attributes;
+
+  if ((Length == 0) || (Address + Length < Address)) {
+    return FALSE;
+  }
+
+  Free  = MAX_PAGE_WATCHES;
+  Pages = RangePageCount (Address, Length);
+  for (Index = 0; Index < MAX_PAGE_WATCHES; Index++) {
+    if (!mPageWatches[Index].Active) {
+      Free = MIN (Free, Index);
+      continue;
+    }
+
+    if ((mPageWatches[Index].Address == Address) &&
+        (mPageWatches[Index].Length == Length) &&
+        (mPageWatches[Index].Read == Read) &&
+        (mPageWatches[Index].Write == Write))
+    {
+      return TRUE;
+    }
+
+    Pages += RangePageCount (mPageWatches[Index].Address, mPageWatches[Index].Length);
+  }
+
+  if ((Free == MAX_PAGE_WATCHES) || (Pages > MAX_WATCHED_PAGES) || IsUnsafeRange (Address, Length)) {
+    return FALSE;
+  }
+
+  // The phase must be able to change the attributes, and memory that is not
+  // present cannot be watched.
+  for (Page = Address & ~EFI_PAGE_MASK; Page < Address + Length; Page += EFI_PAGE_SIZE) {
+    if (!DbgGetPageAttributes (Page, &Attributes) || ((Attributes & EFI_MEMORY_RP) != 0)) {
+      return FALSE;
+    }
+  }
+
+  mPageWatches[Free].Address = Address;
+  mPageWatches[Free].Length  = Length;
+  mPageWatches[Free].Read    = Read;
+  mPageWatches[Free].Write   = Write;
+  mPageWatches[Free].Active  = TRUE;
+  return TRUE;
+}
+
+/**
+  Removes a page watchpoint.
+
+  @param[in]  Address   The address of the watched range.
+  @param[in]  Length    The length of the watched range.
+  @param[in]  Read      Boolean indicated break on read.
+  @param[in]  Write     Boolean indicated break on write.
+
+  @retval  TRUE   The watchpoint was removed.
+  @retval  FALSE  The watchpoint did not exist.
+**/
+BOOLEAN
+DbgRemovePageWatch (
+  IN UINTN    Address,
+  IN UINTN    Length,
+  IN BOOLEAN  Read,
+  IN BOOLEAN  Write
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < MAX_PAGE_WATCHES; Index++) {
+    if (mPageWatches[Index].Active &&
+        (mPageWatches[Index].Address == Address) &&
+        (mPageWatches[Index].Length == Length) &&
+        (mPageWatches[Index].Read == Read) &&
+        (mPageWatches[Index].Write == Write))
+    {
+      mPageWatches[Index].Active = FALSE;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+  Protects the watched pages before the system resumes. Called by the processor
+  that owns the debugger.
+
+**/
+VOID
+DbgPageWatchArm (
+  VOID
+  )
+{
+  UINTN         Index;
+  UINTN         Page;
+  WATCHED_PAGE  *Entry;
+
+  if (mArmed) {
+    return;
+  }
+
+  mWatchedPageCount = 0;
+  for (Index = 0; Index < MAX_PAGE_WATCHES; Index++) {
+    if (!mPageWatches[Index].Active) {
+      continue;
+    }
+
+    for (Page = mPageWatches[Index].Address & ~EFI_PAGE_MASK;
+         Page < mPageWatches[Index].Address + mPageWatches[Index].Length;
+         Page += EFI_PAGE_SIZE)
+    {
+      if ((FindWatchedPage (Page) != NULL) || (mWatchedPageCount >= MAX_WATCHED_PAGES)) {
+        continue;
+      }
+
+      Entry            = &mWatchedPages[mWatchedPageCount++];
+      Entry->Page      = Page;
+      Entry->Steps     = 0;
+      Entry->Attribute = GetPageWatchAttribute (Page);
+      if (!ProtectWatchedPage (Entry)) {
+        Entry->Attribute = 0;
+      }
+    }
+  }
+
+  MemoryFence ();
+  mArmed = TRUE;
+}
+
+/**
+  Restores the watched pages when the debugger is entered, so the debugger and
+  the agent can access them. Called by the processor that owns the debugger.
+
+**/
+VOID
+DbgPageWatchDisarm (
+  VOID
+  )
+{
+  UINTN  Index;
+
+  if (!mArmed) {
+    return;
+  }
+
+  mArmed = FALSE;
+  MemoryFence ();
+  for (Index = 0; Index < mWatchedPageCount; Index++) {
+    if (mWatchedPages[Index].Attribute != 0) {
+      DbgClearPageAttributes (mWatchedPages[Index].Page, mWatchedPages[Index].Attribute);
+    }
+  }
+
+  mWatchedPageCount = 0;
+}
+
+/**
+  Filters the faults and steps caused by page watchpoints. A fault on a watched
+  page restores the page and steps the access, the step protects the page again.
+  Accesses to the watched range are reported as a watchpoint once the access
+  completes, the same as the debug registers.
+
+  @param[in,out]  ExceptionInfo   The exception, changed to a watchpoint when
+                                  the watched range was accessed.
+  @param[in,out]  SystemContext   The context of the current processor.
+
+  @retval   TRUE    The exception was handled and execution should resume.
+  @retval   FALSE   The exception should be reported to the debugger.
+**/
+BOOLEAN
+DbgPageWatchFilter (
+  IN OUT EXCEPTION_INFO      *ExceptionInfo,
+  IN OUT EFI_SYSTEM_CONTEXT  SystemContext
+  )
+{
+  PENDING_STEP  *Pending;
+  WATCHED_PAGE  *Entry;
+  UINTN         Index;
+  UINTN         Page;
+  UINTN         Slot;
+
+  if ((ExceptionInfo->ExceptionType == ExceptionAccessViolation) && mArmed) {
+    Page  = (UINTN)ExceptionInfo->FaultAddress & ~EFI_PAGE_MASK;
+    Entry = FindWatchedPage (Page);
+    if ((Entry == NULL) || (Entry->Attribute == 0)) {
+      return FALSE;
+    }
+
+    Index = DbgGetCurrentProcessor ();
+    if (Index >= MAX_DEBUG_PROCESSORS) {
+      return FALSE;
+    }
+
+    // A step that straddles pages faults once for each of them.
+    Pending = &mPendingSteps[Index];
+    if (Pending->PageCount == 0) {
+      Pending->Hit = FALSE;
+    }
+
+    for (Slot = 0; Slot < Pending->PageCount; Slot++) {
+      if (Pending->Pages[Slot] == Page) {
+        break;
+      }
+    }
+
+    if (Slot == Pending->PageCount) {
+      if (Slot >= MAX_STEP_PAGES) {
+        return FALSE;
+      }
+
+      Pending->Pages[Pending->PageCount++] = Page;
+      InterlockedIncrement (&Entry->Steps);
+    }
+
+    // Other processors may touch the page unnoticed during the step.
+    SetWatchedPageEntry (Entry, FALSE);
+
+    if (!Pending->Hit && IsWatchedAccess (ExceptionInfo->FaultAddress, ExceptionInfo->FaultIsWrite)) {
+      Pending->Hit     = TRUE;
+      Pending->Address = ExceptionInfo->FaultAddress;
+      Pending->Write   = ExceptionInfo->FaultIsWrite;
+    }
+
+    AddSingleStep (&SystemContext);
+    return TRUE;
+  }
+
+  if (ExceptionInfo->ExceptionType == ExceptionDebugStep) {
+    Index = DbgGetCurrentProcessor ();
+    if ((Index >= MAX_DEBUG_PROCESSORS) || (mPendingSteps[Index].PageCount == 0)) {
+      return FALSE;
+    }
+
+    // The watches may have changed while the processor was halted mid step.
+    Pending = &mPendingSteps[Index];
+    for (Slot = 0; Slot < Pending->PageCount; Slot++) {
+      Entry = mArmed ? FindWatchedPage (Pending->Pages[Slot]) : NULL;
+      if ((Entry != NULL) && (Entry->Attribute != 0) && ReleaseWatchedPage (Entry)) {
+        SetWatchedPageEntry (Entry, TRUE);
+      }
+    }
+
+    Pending->PageCount = 0;
+
+    if (Pending->Hit) {
+      ExceptionInfo->ExceptionType = ExceptionWatchpoint;
+      ExceptionInfo->FaultAddress  = Pending->Address;
+      ExceptionInfo->FaultIsWrite  = Pending->Write;
+      return FALSE;
+    }
+
+    // A step requested by the debugger still needs to be reported.
+    return !DbgProcessorIsStepping (Index);
+  }
+
+  return FALSE;
+}
@@ -0,0 +1,439 @@
+/**@file Processor.c
+
+  Tracks the processors that enter the debugger. Only one processor at a time
+  owns the debugger, the others are halted while it is stopped and are exposed
+  to the debugger as threads.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+#include "DebugAgent.h"
+
+// Value of mOwner when no processor is in the debugger.
+#define NO_OWNER  MAX_UINT32
+
+// How long to wait for the other processors to acknowledge a halt. Processors
+// that do not respond in time, such as those waiting for a startup IPI, are
+// left running and are not reported as threads.
+#define HALT_TIMEOUT_US  10000
+
+// Each processor writes its own slot from its exception handler while the owner
+// reads them, so every slot gets its own cache line to avoid false sharing.
+#define CACHE_LINE_SIZE  64
+
+typedef union _PROCESSOR_SLOT {
+  DEBUG_PROCESSOR    Processor;
+  UINT8              Pad[ALIGN_VALUE (sizeof (DEBUG_PROCESSOR), CACHE_LINE_SIZE)];
+} PROCESSOR_SLOT;
+
+STATIC UINT8            mProcessorBuffer[(sizeof (PROCESSOR_SLOT) * MAX_DEBUG_PROCESSORS) + CACHE_LINE_SIZE];
+STATIC volatile UINT32  mProcessorCount = 0;
+
+#define PROCESSOR(Index)  (&((PROCESSOR_SLOT *)ALIGN_POINTER (&mProcessorBuffer[0], CACHE_LINE_SIZE))[(Index)].Processor)
+
+// Open addressed table from processor ID to index + 1, so finding the slot does
+// not depend on the number of processors. Twice the slot count keeps it sparse.
+#define PROCESSOR_HASH_BITS  9
+#define PROCESSOR_HASH_SIZE  (1 << PROCESSOR_HASH_BITS)
+
+STATIC volatile UINT32  mProcessorHash[PROCESSOR_HASH_SIZE];
+
+// Number of processors in the system as reported by the phase, 0 if unknown.
+STATIC UINTN  mExpectedProcessorCount = 0;
+
+// Index of the processor that owns the debugger. Processors without a slot
+// never own it.
+STATIC volatile UINT32  mOwner = NO_OWNER;
+
+// Incremented for each halt request and each release of the halted processors.
+STATIC volatile UINT32  mHaltGeneration   = 0;
+STATIC volatile UINT32  mResumeGeneration = 0;
+
+/**
+  Finds the slot for a processor, optionally adding it if it is not yet known.
+
+  @param[in]  ProcessorId   The architecture specific processor ID.
+  @param[in]  Add           Add the processor if it is not found.
+
+  @retval   The index of the processor, or MAX_DEBUG_PROCESSORS if the processor
+            is not known and could not be added.
+**/
+STATIC
+UINT32
+FindProcessor (
+  IN UINT64   ProcessorId,
+  IN BOOLEAN  Add
+  )
+{
+  UINT32  Index;
+  UINT32  Bucket;
+  UINT32  Entry;
+
+  Bucket = (((UINT32)ProcessorId ^ (UINT32)RShiftU64 (ProcessorId, 32)) * 0x9E3779B1) >> (32 - PROCESSOR_HASH_BITS);
+  for ( ; ; Bucket = (Bucket + 1) % PROCESSOR_HASH_SIZE) {
+    Entry = mProcessorHash[Bucket];
+    if (Entry == 0) {
+      break;
+    }
+
+    if (PROCESSOR (Entry - 1)->Key == ProcessorId + 1) {
+      return Entry - 1;
+    }
+  }
+
+  if (!Add || (mProcessorCount >= MAX_DEBUG_PROCESSORS)) {
+    return MAX_DEBUG_PROCESSORS;
+  }
+
+  // Processors may be entering at the same time, claim the slot atomically.
+  Index = InterlockedIncrement (&mProcessorCount) - 1;
+  if (Index >= MAX_DEBUG_PROCESSORS) {
+    return MAX_DEBUG_PROCESSORS;
+  }
+
+  // The key must be visible before the slot can be found.
+  PROCESSOR (Index)->Key = ProcessorId + 1;
+  MemoryFence ();
+  while (InterlockedCompareExchange32 (&mProcessorHash[Bucket], 0, Index + 1) != 0) {
+    Bucket = (Bucket + 1) % PROCESSOR_HASH_SIZE;
+  }
+
+  return Index;
+}
+
+/**
+  Halts all other processors and waits for them to stop, or for the timeout.
+
+  @param[in]  Owner   The index of the processor that owns the debugger.
+
+**/
+STATIC
+VOID
+HaltProcessors (
+  IN UINT32  Owner
+  )
+{
+  UINTN   Expected;
+  UINTN   Index;
+  UINT64  EndTime;
+
+  Expected = MAX (mExpectedProcessorCount, MIN (mProcessorCount, MAX_DEBUG_PROCESSORS));
+  if ((Expected <= 1) || !DbgPhaseCanBroadcastHalt ()) {
+    return;
+  }
+
+  mHaltGeneration++;
+  if (Owner < MAX_DEBUG_PROCESSORS) {
+    PROCESSOR (Owner)->HaltGeneration = mHaltGeneration;
+  }
+
+  if (!DebugArchHaltProcessors ()) {
+    return;
+  }
+
+  // The processors halt in parallel and each one only writes its own slot. The
+  // slots are checked in order and a stopped processor stays stopped, so each
+  // slot is only read until it stops rather than rescanning the table.
+  Index   = 0;
+  EndTime = DebugGetTimeUs () + HALT_TIMEOUT_US;
+  while (Index < Expected) {
+    if ((Index < DbgGetProcessorCount ()) && (PROCESSOR (Index)->State != ProcessorRunning)) {
+      Index++;
+      continue;
+    }
+
+    if (DebugGetTimeUs () >= EndTime) {
+      break;
+    }
+
+    CpuPause ();
+  }
+}
+
+/**
+  Registers a processor with the agent, so processors are numbered in the order
+  the phase enumerates them rather than the order they first stop.
+
+  @param[in]  ProcessorId   The architecture specific processor ID.
+
+**/
+VOID
+DbgRegisterProcessor (
+  IN UINT64  ProcessorId
+  )
+{
+  FindProcessor (ProcessorId, TRUE);
+}
+
+/**
+  Sets the number of processors in the system. The debugger will wait for this
+  many processors to halt when one of them stops.
+
+  @param[in]  Count   The number of processors, 0 if unknown.
+
+**/
+VOID
+DbgSetProcessorCount (
+  IN UINTN  Count
+  )
+{
+  mExpectedProcessorCount = Count;
+}
+
+/**
+  Takes ownership of the debugger for the current processor. If another
+  processor owns the debugger, the current processor waits as a stopped thread
+  until it is released. Once owned, all other processors are halted.
+
+  @param[in]  ExceptionInfo   The exception being reported.
+  @param[in]  SystemContext   The context of the current processor.
+  @param[out] Index           The index of the current processor, or
+                              MAX_DEBUG_PROCESSORS if it could not be tracked.
+
+  @retval   TRUE    The current processor owns the debugger.
+  @retval   FALSE   The exception was a breakpoint removed while waiting, or
+                    the processor could not be tracked, and is not reported.
+**/
+BOOLEAN
+DbgProcessorAcquire (
+  IN  EXCEPTION_INFO      *ExceptionInfo,
+  IN  EFI_SYSTEM_CONTEXT  SystemContext,
+  OUT UINTN               *Index
+  )
+{
+  DEBUG_PROCESSOR  *Processor;
+  UINT32           Current;
+  BOOLEAN          Waited;
+
+  Current = FindProcessor (DebugArchGetProcessorId (), TRUE);
+  *Index  = Current;
+
+  // Without a slot the processor cannot be shown as a thread or told apart from
+  // other untracked processors, so it never owns the debugger. It waits while
+  // the debugger is owned and resumes, an exception that repeats, such as a
+  // breakpoint, is taken again.
+  if (Current >= MAX_DEBUG_PROCESSORS) {
+    while (mOwner != NO_OWNER) {
+      CpuPause ();
+    }
+
+    return FALSE;
+  }
+
+  Processor                = PROCESSOR (Current);
+  Processor->Context       = SystemContext;
+  Processor->ExceptionInfo = ExceptionInfo;
+
+  // Re-entered after a single step, the others are still halted.
+  if (mOwner == Current) {
+    Processor->State = ProcessorStopped;
+    return TRUE;
+  }
+
+  Processor->State = ProcessorWaiting;
+  Waited           = FALSE;
+  while (InterlockedCompareExchange32 (&mOwner, NO_OWNER, Current) != NO_OWNER) {
+    Waited = TRUE;
+    while (mOwner != NO_OWNER) {
+      CpuPause ();
+    }
+  }
+
+  Processor->State = ProcessorStopped;
+
+  // Breakpoints are removed while the debugger is stopped, one that is gone by
+  // the time this processor gets its turn is simply executed again.
+  if (Waited &&
+      (ExceptionInfo->ExceptionType == ExceptionBreakpoint) &&
+      (CompareMem ((VOID *)(UINTN)ExceptionInfo->ExceptionAddress, mArchBreakpointInstruction, mArchBreakpointInstructionSize) != 0))
+  {
+    DbgProcessorRelease (FALSE);
+    return FALSE;
+  }
+
+  HaltProcessors (Current);
+  return TRUE;
+}
+
+/**
+  Releases the debugger from the current processor.
+
+  @param[in]  KeepHalted  Keep the other processors halted and the debugger
+                          owned, used when single stepping.
+
+**/
+VOID
+DbgProcessorRelease (
+  IN BOOLEAN  KeepHalted
+  )
+{
+  UINT32  Index;
+
+  if (mOwner < MAX_DEBUG_PROCESSORS) {
+    PROCESSOR (mOwner)->State         = ProcessorRunning;
+    PROCESSOR (mOwner)->ExceptionInfo = NULL;
+  }
+
+  if (KeepHalted) {
+    return;
+  }
+
+  // Processors waiting on their own exception stay stopped until they get
+  // their turn, only the halted processors are resumed.
+  for (Index = 0; Index < DbgGetProcessorCount (); Index++) {
+    if (PROCESSOR (Index)->State == ProcessorHalted) {
+      PROCESSOR (Index)->State = ProcessorRunning;
+    }
+  }
+
+  MemoryFence ();
+  mResumeGeneration++;
+  mOwner = NO_OWNER;
+}
+
+/**
+  Handles a halt request on the current processor, holding it until the
+  processor that owns the debugger releases it.
+
+  @param[in]  SystemContext   The context of the current processor.
+
+  @retval   TRUE    The processor was halted and has been released.
+  @retval   FALSE   No halt was requested, the exception should be handled.
+**/
+BOOLEAN
+DbgProcessorHalt (
+  IN EFI_SYSTEM_CONTEXT  SystemContext
+  )
+{
+  DEBUG_PROCESSOR  *Processor;
+  UINT32           Index;
+  UINT32           Generation;
+
+  Index = FindProcessor (DebugArchGetProcessorId (), TRUE);
+  if (Index >= MAX_DEBUG_PROCESSORS) {
+    // Not tracked, hold it for as long as the debugger is owned.
+    if (mOwner == NO_OWNER) {
+      return FALSE;
+    }
+
+    while (mOwner != NO_OWNER) {
+      CpuPause ();
+    }
+
+    return TRUE;
+  }
+
+  Processor = PROCESSOR (Index);
+  if (Processor->HaltGeneration == mHaltGeneration) {
+    return FALSE;
+  }
+
+  Processor->HaltGeneration = mHaltGeneration;
+
+  // Already stopped in the debugger with its own exception.
+  if (Processor->State != ProcessorRunning) {
+    return TRUE;
+  }
+
+  Generation               = mResumeGeneration;
+  Processor->Context       = SystemContext;
+  Processor->ExceptionInfo = NULL;
+  MemoryFence ();
+  Processor->State = ProcessorHalted;
+
+  while (mResumeGeneration == Generation) {
+    CpuPause ();
+  }
+
+  return TRUE;
+}
+
+/**
+  Gets the number of processors known to the agent.
+
+  @retval   The number of processor slots in use.
+**/
+UINTN
+DbgGetProcessorCount (
+  VOID
+  )
+{
+  return MIN (mProcessorCount, MAX_DEBUG_PROCESSORS);
+}
+
+/**
+  Gets a processor known to the agent.
+
+  @param[in]  Index   The index of the processor.
+
+  @retval   The processor, or NULL if the index is not in use.
+**/
+CONST DEBUG_PROCESSOR *
+DbgGetProcessor (
+  IN UINTN  Index
+  )
+{
+  if (Index >= DbgGetProcessorCount ()) {
+    return NULL;
+  }
+
+  return PROCESSOR (Index);
+}
+
+/**
+  Gets the saved context of a processor stopped in the debugger. The context
+  is the one the processor captured in its own exception handler.
+
+  @param[in]  Index   The index of the processor.
+
+  @retval   The context of the processor, or NULL if it is running.
+**/
+EFI_SYSTEM_CONTEXT *
+DbgGetProcessorContext (
+  IN UINTN  Index
+  )
+{
+  if ((Index >= DbgGetProcessorCount ()) || (PROCESSOR (Index)->State == ProcessorRunning)) {
+    return NULL;
+  }
+
+  return &PROCESSOR (Index)->Context;
+}
+
+/**
+  Gets the index of the current processor, adding it if it is not yet known.
+
+  @retval   The index of the processor, or MAX_DEBUG_PROCESSORS if it could not
+            be tracked.
+**/
+UINTN
+DbgGetCurrentProcessor (
+  VOID
+  )
+{
+  return FindProcessor (DebugArchGetProcessorId (), TRUE);
+}
+
+/**
+  Checks if a processor is single stepping for the debugger. The processor
+  keeps ownership of the debugger while it steps.
+
+  @param[in]  Index   The index of the processor.
+
+  @retval   TRUE    The processor is stepping for the debugger.
+  @retval   FALSE   The processor is not stepping for the debugger.
+**/
+BOOLEAN
+DbgProcessorIsStepping (
+  IN UINTN  Index
+  )
+{
+  return mOwner == Index;
+}
@@ -0,0 +1,211 @@
+/** @file
+  Records samples of the interrupted instruction pointer from a periodic timer
+  so the debugger can report where boot time is spent without stopping the
+  system. The buffer is provided by the phase and sampling stops once it is full.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+
+#include "DebugAgent.h"
+
+// Limit the frame walk so a bad sample is cheap.
+#define MAX_PROFILE_DEPTH  16
+
+STATIC UINT64           *mProfileBuffer = NULL;
+STATIC UINT32           mProfileMaxSamples;
+STATIC BOOLEAN          mProfileEnabled = FALSE;
+STATIC PROFILE_HEADER   mProfileHeader;
+
+// Samples are reserved by incrementing mProfileNext and counted in the header
+// once written, so a sample taken on another processor cannot share a slot.
+STATIC volatile UINT32  mProfileNext = 0;
+
+/**
+  Provides the sample buffer to the profiler.
+
+  @param[in]  Buffer      The buffer, MaxSamples * Depth entries in size.
+  @param[in]  MaxSamples  The number of samples the buffer can hold.
+  @param[in]  Depth       The number of addresses per sample, limited to
+                          MAX_PROFILE_DEPTH.
+  @param[in]  IntervalUs  The sample interval, reported to the debugger.
+
+**/
+VOID
+DbgProfileInit (
+  IN UINT64  *Buffer,
+  IN UINT32  MaxSamples,
+  IN UINT32  Depth,
+  IN UINT32  IntervalUs
+  )
+{
+  mProfileBuffer            = Buffer;
+  mProfileMaxSamples        = MaxSamples;
+  mProfileHeader.Depth      = MIN (MAX (Depth, 1), MAX_PROFILE_DEPTH);
+  mProfileHeader.IntervalUs = IntervalUs;
+  DbgClearProfile ();
+}
+
+/**
+  Records a sample of the context interrupted by the profiler timer. Return
+  addresses are collected by following the frame pointer chain until it fails
+  validation, the rest of the sample is left zero.
+
+**/
+VOID
+DbgProfileSample (
+  VOID
+  )
+{
+  UINT64  *Sample;
+  UINTN   Pc;
+  UINTN   FramePointer;
+  UINTN   Frame[2];
+  UINT32  Index;
+  UINT32  Slot;
+
+  if (!mProfileEnabled) {
+    return;
+  }
+
+  if ((mProfileNext >= mProfileMaxSamples) ||
+      !DebugArchGetInterruptedFrame (&Pc, &FramePointer))
+  {
+    InterlockedIncrement (&mProfileHeader.Missed);
+    return;
+  }
+
+  Slot = InterlockedIncrement (&mProfileNext) - 1;
+  if (Slot >= mProfileMaxSamples) {
+    InterlockedIncrement (&mProfileHeader.Missed);
+    return;
+  }
+
+  Sample = &mProfileBuffer[(UINTN)Slot * mProfileHeader.Depth];
+  ZeroMem (Sample, mProfileHeader.Depth * sizeof (UINT64));
+  Sample[0] = Pc;
+
+  // Each frame record holds the caller's frame pointer followed by the return address.
+  for (Index = 1; Index < mProfileHeader.Depth; Index++) {
+    if ((FramePointer == 0) || ((FramePointer & (sizeof (UINTN) - 1)) != 0)) {
+      break;
+    }
+
+    if (!DbgReadMemory (FramePointer, Frame, sizeof (Frame))) {
+      break;
+    }
+
+    Sample[Index] = Frame[1];
+
+    // Stacks grow down, so a caller's frame must be at a higher address.
+    if (Frame[0] <= FramePointer) {
+      break;
+    }
+
+    FramePointer = Frame[0];
+  }
+
+  InterlockedIncrement (&mProfileHeader.SampleCount);
+}
+
+/**
+  Starts or stops sampling.
+
+  @param[in]  Enable    TRUE to start sampling, FALSE to stop.
+
+  @retval   TRUE    The profiler state was changed.
+  @retval   FALSE   The profiler has no buffer in this phase.
+**/
+BOOLEAN
+DbgProfileEnable (
+  IN BOOLEAN  Enable
+  )
+{
+  if (mProfileBuffer == NULL) {
+    return FALSE;
+  }
+
+  mProfileEnabled = Enable;
+  return TRUE;
+}
+
+/**
+  Stops sampling and forgets the sample buffer, for when the buffer is about
+  to be freed. The profiler then reports that it has no buffer.
+
+**/
+VOID
+DbgProfileShutdown (
+  VOID
+  )
+{
+  mProfileEnabled = FALSE;
+  mProfileBuffer  = NULL;
+}
+
+/**
+  Checks if the profiler is currently sampling.
+
+  @retval   TRUE if the profiler is sampling.
+**/
+BOOLEAN
+DbgProfileIsEnabled (
+  VOID
+  )
+{
+  return mProfileEnabled;
+}
+
+/**
+  Gets the profile header describing the samples.
+
+  @retval   The header, or NULL if the profiler has no buffer in this phase.
+**/
+CONST PROFILE_HEADER *
+DbgGetProfileHeader (
+  VOID
+  )
+{
+  if (mProfileBuffer == NULL) {
+    return NULL;
+  }
+
+  return &mProfileHeader;
+}
+
+/**
+  Gets a sample from the profile.
+
+  @param[in]  Index   The index of the sample.
+
+  @retval   The Depth addresses of the sample, or NULL if the index is past the
+            end of the profile.
+**/
+CONST UINT64 *
+DbgGetProfileSample (
+  IN UINTN  Index
+  )
+{
+  if ((mProfileBuffer == NULL) || (Index >= mProfileHeader.SampleCount)) {
+    return NULL;
+  }
+
+  return &mProfileBuffer[Index * mProfileHeader.Depth];
+}
+
+/**
+  Discards all samples. Sampling continues if it is enabled.
+
+**/
+VOID
+DbgClearProfile (
+  VOID
+  )
+{
+  mProfileHeader.SampleCount = 0;
+  mProfileHeader.Missed      = 0;
+  mProfileNext               = 0;
+}
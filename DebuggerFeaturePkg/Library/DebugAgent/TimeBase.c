@@ -0,0 +1,170 @@
+/** @file
+  Converts architecture counter ticks into milliseconds and microseconds. The
+  counter frequency is queried once and turned into fixed-point reciprocals so
+  that converting a timestamp does not require a division.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include "DebugAgent.h"
+
+// Used if the counter frequency is unknown, so timeouts still expire.
+#define DEFAULT_TICK_FREQUENCY  1000000000
+
+//
+// Scale factor for converting ticks to a unit of time. The result is
+// Ticks * Whole + ((Ticks * Fraction) >> 64).
+//
+
+typedef struct _TIME_SCALE {
+  UINT64    Whole;
+  UINT64    Fraction;
+} TIME_SCALE;
+
+STATIC TIME_SCALE  mMsScale             = { 0, 0 };
+STATIC TIME_SCALE  mUsScale             = { 0, 0 };
+STATIC BOOLEAN     mTimeBaseInitialized = FALSE;
+
+/**
+  Computes the upper 64 bits of the 128 bit product of two 64 bit values.
+
+  @param[in]  A   The first value.
+  @param[in]  B   The second value.
+
+  @retval   The upper 64 bits of A * B.
+**/
+STATIC
+UINT64
+MultU64x64High (
+  IN UINT64  A,
+  IN UINT64  B
+  )
+{
+  UINT64  LowLow;
+  UINT64  HighLow;
+  UINT64  LowHigh;
+  UINT64  HighHigh;
+  UINT64  Cross;
+
+  LowLow   = (A & MAX_UINT32) * (B & MAX_UINT32);
+  HighLow  = (A >> 32) * (B & MAX_UINT32);
+  LowHigh  = (A & MAX_UINT32) * (B >> 32);
+  HighHigh = (A >> 32) * (B >> 32);
+
+  Cross = (LowLow >> 32) + (HighLow & MAX_UINT32) + (LowHigh & MAX_UINT32);
+  return HighHigh + (HighLow >> 32) + (LowHigh >> 32) + (Cross >> 32);
+}
+
+/**
+  Computes the scale factor to convert ticks into units.
+
+  @param[in]   Frequency      The tick frequency in hertz.
+  @param[in]   UnitsPerSecond The number of units per second.
+  @param[out]  Scale          The computed scale factor.
+**/
+STATIC
+VOID
+ComputeTimeScale (
+  IN  UINT64      Frequency,
+  IN  UINT64      UnitsPerSecond,
+  OUT TIME_SCALE  *Scale
+  )
+{
+  UINT64  Remainder;
+  UINT64  Fraction;
+  UINTN   Bit;
+
+  Scale->Whole = DivU64x64Remainder (UnitsPerSecond, Frequency, &Remainder);
+
+  // Long division of (Remainder << 64) by the frequency. Remainder is always
+  // less than the frequency so doubling it is checked without overflowing.
+  Fraction = 0;
+  for (Bit = 0; Bit < 64; Bit++) {
+    Fraction <<= 1;
+    if (Remainder >= Frequency - Remainder) {
+      Remainder -= Frequency - Remainder;
+      Fraction  |= 1;
+    } else {
+      Remainder <<= 1;
+    }
+  }
+
+  Scale->Fraction = Fraction;
+}
+
+/**
+  Converts ticks using a precomputed scale factor.
+
+  @param[in]  Ticks   The number of ticks.
+  @param[in]  Scale   The scale factor.
+
+  @retval   The converted value.
+**/
+STATIC
+UINT64
+ScaleTicks (
+  IN UINT64            Ticks,
+  IN CONST TIME_SCALE  *Scale
+  )
+{
+  return (Ticks * Scale->Whole) + MultU64x64High (Ticks, Scale->Fraction);
+}
+
+/**
+  Calibrates the time base from the architecture counter frequency. May be
+  called again if a more accurate frequency becomes available.
+
+**/
+VOID
+DebugTimeBaseInit (
+  VOID
+  )
+{
+  UINT64  Frequency;
+
+  Frequency = DebugArchGetTickFrequency ();
+  ASSERT (Frequency != 0);
+  if (Frequency == 0) {
+    Frequency = DEFAULT_TICK_FREQUENCY;
+  }
+
+  ComputeTimeScale (Frequency, 1000, &mMsScale);
+  ComputeTimeScale (Frequency, 1000000, &mUsScale);
+  mTimeBaseInitialized = TRUE;
+}
+
+/**
+  Gets the performance counter in milliseconds.
+
+  @retval   Current performance count converted to milliseconds.
+**/
+UINT64
+DebugGetTimeMs (
+  VOID
+  )
+{
+  if (!mTimeBaseInitialized) {
+    DebugTimeBaseInit ();
+  }
+
+  return ScaleTicks (DebugArchReadTicks (), &mMsScale);
+}
+
+/**
+  Gets the performance counter in microseconds.
+
+  @retval   Current performance count converted to microseconds.
+**/
+UINT64
+DebugGetTimeUs (
+  VOID
+  )
+{
+  if (!mTimeBaseInitialized) {
+    DebugTimeBaseInit ();
+  }
+
+  return ScaleTicks (DebugArchReadTicks (), &mUsScale);
+}
@@ -0,0 +1,107 @@
+/** @file
+  Records a timeline of boot events in a ring buffer so the debugger can report
+  when images were loaded and how long the system spent broken in.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Library/BaseLib.h>
+
+#include "DebugAgent.h"
+
+// Number of events kept in the timeline. Older events are overwritten.
+#define MAX_TIMELINE_EVENTS  512
+
+// Memory allocation is not available at first so this must be static. Events
+// may be recorded from several processors, so each takes its slot by
+// incrementing the sequence.
+STATIC TIMELINE_EVENT   mTimeline[MAX_TIMELINE_EVENTS];
+STATIC volatile UINT32  mTimelineSequence = 0;
+STATIC UINT32           mTimelineStart    = 0;
+
+/**
+  Records an event in the timeline.
+
+  @param[in]  Type  The type of the event.
+  @param[in]  Info  Type specific information.
+  @param[in]  Data  Type specific data, usually an address.
+
+**/
+VOID
+DbgTimelineRecord (
+  IN TIMELINE_EVENT_TYPE  Type,
+  IN UINT16               Info,
+  IN UINT64               Data
+  )
+{
+  TIMELINE_EVENT  *Event;
+  UINT32          Sequence;
+
+  Sequence        = InterlockedIncrement (&mTimelineSequence) - 1;
+  Event           = &mTimeline[Sequence % MAX_TIMELINE_EVENTS];
+  Event->TimeUs   = DebugGetTimeUs ();
+  Event->Data     = Data;
+  Event->Sequence = Sequence;
+  Event->Type     = (UINT16)Type;
+  Event->Info     = Info;
+}
+
+/**
+  Gets an event from the timeline.
+
+  @param[in]  Index   The index of the event, starting from the oldest event
+                      still in the timeline.
+
+  @retval   The event, or NULL if the index is past the end of the timeline.
+**/
+CONST TIMELINE_EVENT *
+DbgGetTimelineEvent (
+  IN UINTN  Index
+  )
+{
+  if (Index >= DbgGetTimelineCount ()) {
+    return NULL;
+  }
+
+  return &mTimeline[(mTimelineSequence - DbgGetTimelineCount () + Index) % MAX_TIMELINE_EVENTS];
+}
+
+/**
+  Gets the number of events in the timeline.
+
+  @retval   The number of events that can be retrieved from the timeline.
+**/
+UINTN
+DbgGetTimelineCount (
+  VOID
+  )
+{
+  return MIN (mTimelineSequence - mTimelineStart, MAX_TIMELINE_EVENTS);
+}
+
+/**
+  Gets the number of events lost from the timeline because it was full.
+
+  @retval   The number of overwritten events.
+**/
+UINTN
+DbgGetTimelineDropped (
+  VOID
+  )
+{
+  return mTimelineSequence - mTimelineStart - DbgGetTimelineCount ();
+}
+
+/**
+  Discards all events currently in the timeline.
+
+**/
+VOID
+DbgClearTimeline (
+  VOID
+  )
+{
+  mTimelineStart = mTimelineSequence;
+}
@@ -0,0 +1,275 @@
+/**@file Watchpoint.c
+
+  Architecture agnostic watchpoint routines. Counting watchpoints are kept in
+  the debug registers like any other, but their hits are counted and resumed
+  without stopping in the debugger.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+
+#include <Library/BaseLib.h>
+
+#include "DebugAgent.h"
+
+STATIC COUNTING_WATCH  mCountingWatches[MAX_COUNTING_WATCHES];
+
+// Counting watchpoint being stepped over by each processor, index + 1.
+STATIC UINT8  mPendingWatches[MAX_DEBUG_PROCESSORS];
+
+/**
+  Splits a watched range into the naturally aligned slots the debug registers
+  can watch. Each slot is the largest aligned power of two that fits the rest
+  of the range, which gives the fewest slots that cover exactly the range.
+
+  @param[in]  Address     The address of the watched range.
+  @param[in]  Length      The length of the watched range.
+  @param[in]  MaxSize     The largest slot a register can watch, a power of two.
+  @param[in]  ByteSelect  Registers can watch any run of bytes within an aligned
+                          8 byte slot, as with the AArch64 byte address select.
+  @param[out] Slots       The slots to program.
+  @param[in]  MaxSlots    The number of entries in Slots.
+
+  @retval   The number of slots, or 0 if the range needs more than MaxSlots.
+**/
+UINTN
+DbgPlanWatchpoint (
+  IN  UINTN       Address,
+  IN  UINTN       Length,
+  IN  UINTN       MaxSize,
+  IN  BOOLEAN     ByteSelect,
+  OUT WATCH_SLOT  *Slots,
+  IN  UINTN       MaxSlots
+  )
+{
+  UINTN  Count;
+  UINTN  Size;
+  UINTN  Offset;
+
+  if ((Length == 0) || (Address + (Length - 1) < Address)) {
+    return 0;
+  }
+
+  Count = 0;
+  while (Length > 0) {
+    if (Count >= MaxSlots) {
+      return 0;
+    }
+
+    Size = MaxSize;
+    while ((Size > Length) || ((Address & (Size - 1)) != 0)) {
+      Size >>= 1;
+    }
+
+    if (ByteSelect && (Size < 8)) {
+      Offset                = Address & 7;
+      Size                  = MIN (Length, 8 - Offset);
+      Slots[Count].Address  = Address - Offset;
+      Slots[Count].Size     = 8;
+      Slots[Count].ByteMask = (UINT8)(((1 << Size) - 1) << Offset);
+    } else {
+      Slots[Count].Address  = Address;
+      Slots[Count].Size     = Size;
+      Slots[Count].ByteMask = (UINT8)((1 << MIN (Size, 8)) - 1);
+    }
+
+    Count++;
+    Address += Size;
+    Length  -= Size;
+  }
+
+  return Count;
+}
+
+/**
+  Adds a counting watchpoint.
+
+  @param[in]  Address   The address of the watched range.
+  @param[in]  Length    The length of the watched range.
+  @param[in]  Read      Count reads.
+  @param[in]  Write     Count writes.
+  @param[in]  RecordPc  Record the program counter of recent hits.
+
+  @retval  TRUE   The watchpoint was added.
+  @retval  FALSE  The watchpoint could not be added.
+**/
+BOOLEAN
+DbgAddCountingWatch (
+  IN UINTN    Address,
+  IN UINTN    Length,
+  IN BOOLEAN  Read,
+  IN BOOLEAN  Write,
+  IN BOOLEAN  RecordPc
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < MAX_COUNTING_WATCHES; Index++) {
+    if (!mCountingWatches[Index].Active) {
+      break;
+    }
+  }
+
+  if ((Index == MAX_COUNTING_WATCHES) || !AddWatchpoint (Address, Length, Read, Write)) {
+    return FALSE;
+  }
+
+  ZeroMem (&mCountingWatches[Index], sizeof (COUNTING_WATCH));
+  mCountingWatches[Index].Address  = Address;
+  mCountingWatches[Index].Length   = Length;
+  mCountingWatches[Index].Read     = Read;
+  mCountingWatches[Index].Write    = Write;
+  mCountingWatches[Index].RecordPc = RecordPc;
+  mCountingWatches[Index].Active   = TRUE;
+  return TRUE;
+}
+
+/**
+  Removes counting watchpoints.
+
+  @param[in]  Address   The address of the watched range, or MAX_UINTN to
+                        remove all counting watchpoints.
+
+  @retval  TRUE   A watchpoint was removed.
+  @retval  FALSE  No watchpoint was found.
+**/
+BOOLEAN
+DbgRemoveCountingWatch (
+  IN UINTN  Address
+  )
+{
+  UINTN           Index;
+  BOOLEAN         Found;
+  COUNTING_WATCH  *Watch;
+
+  Found = FALSE;
+  for (Index = 0; Index < MAX_COUNTING_WATCHES; Index++) {
+    Watch = &mCountingWatches[Index];
+    if (Watch->Active && ((Address == MAX_UINTN) || (Watch->Address == Address))) {
+      RemoveWatchpoint (Watch->Address, Watch->Length, Watch->Read, Watch->Write);
+      Watch->Active = FALSE;
+      Found         = TRUE;
+    }
+  }
+
+  return Found;
+}
+
+/**
+  Resets the hit counts and recorded program counters.
+
+**/
+VOID
+DbgClearWatchCounts (
+  VOID
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < MAX_COUNTING_WATCHES; Index++) {
+    mCountingWatches[Index].HitCount = 0;
+    ZeroMem (mCountingWatches[Index].Pcs, sizeof (mCountingWatches[Index].Pcs));
+  }
+}
+
+/**
+  Gets a counting watchpoint.
+
+  @param[in]  Index   The index of the watchpoint.
+
+  @retval   The watchpoint, or NULL if the index is not in use.
+**/
+CONST COUNTING_WATCH *
+DbgGetCountingWatch (
+  IN UINTN  Index
+  )
+{
+  if ((Index >= MAX_COUNTING_WATCHES) || !mCountingWatches[Index].Active) {
+    return NULL;
+  }
+
+  return &mCountingWatches[Index];
+}
+
+/**
+  Counts the hits of counting watchpoints. Architectures that report the hit
+  before the access completes step over the access with the watchpoint removed
+  and put it back after the step.
+
+  @param[in]      ExceptionInfo   The exception being reported.
+  @param[in,out]  SystemContext   The context of the current processor.
+
+  @retval   TRUE    The hit was counted and execution should resume.
+  @retval   FALSE   The exception should be reported to the debugger.
+**/
+BOOLEAN
+DbgWatchpointFilter (
+  IN     EXCEPTION_INFO      *ExceptionInfo,
+  IN OUT EFI_SYSTEM_CONTEXT  SystemContext
+  )
+{
+  COUNTING_WATCH  *Watch;
+  UINTN           Index;
+  UINTN           Processor;
+
+  if (ExceptionInfo->ExceptionType == ExceptionDebugStep) {
+    Processor = DbgGetCurrentProcessor ();
+    if ((Processor >= MAX_DEBUG_PROCESSORS) || (mPendingWatches[Processor] == 0)) {
+      return FALSE;
+    }
+
+    Watch                      = &mCountingWatches[mPendingWatches[Processor] - 1];
+    mPendingWatches[Processor] = 0;
+    if (Watch->Active) {
+      AddWatchpoint (Watch->Address, Watch->Length, Watch->Read, Watch->Write);
+    }
+
+    // A step requested by the debugger still needs to be reported.
+    return !DbgProcessorIsStepping (Processor);
+  }
+
+  if (ExceptionInfo->ExceptionType != ExceptionWatchpoint) {
+    return FALSE;
+  }
+
+  // Slots start at the aligned address below the watched range.
+  for (Index = 0; Index < MAX_COUNTING_WATCHES; Index++) {
+    Watch = &mCountingWatches[Index];
+    if (Watch->Active &&
+        (ExceptionInfo->FaultAddress >= (Watch->Address & ~(UINTN)7)) &&
+        (ExceptionInfo->FaultAddress < Watch->Address + Watch->Length))
+    {
+      break;
+    }
+  }
+
+  if (Index == MAX_COUNTING_WATCHES) {
+    return FALSE;
+  }
+
+  // A watchpoint set by the debugger on the same registers stops as usual.
+  if (IsWatchpointShared (Watch->Address, Watch->Length, Watch->Read, Watch->Write)) {
+    return FALSE;
+  }
+
+  if (mArchWatchpointBeforeAccess) {
+    Processor = DbgGetCurrentProcessor ();
+    if (Processor >= MAX_DEBUG_PROCESSORS) {
+      return FALSE;
+    }
+
+    RemoveWatchpoint (Watch->Address, Watch->Length, Watch->Read, Watch->Write);
+    mPendingWatches[Processor] = (UINT8)(Index + 1);
+    AddSingleStep (&SystemContext);
+  }
+
+  if (Watch->RecordPc) {
+    Watch->Pcs[Watch->HitCount % WATCH_PC_COUNT] = ExceptionInfo->ExceptionAddress;
+  }
+
+  Watch->HitCount++;
+  return TRUE;
+}
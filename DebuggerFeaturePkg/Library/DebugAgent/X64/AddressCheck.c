@@ -14,6 +14,12 @@
 #include "DebugAgent.h"
 #include "VirtualMemory.h"
 
+VOID
+EFIAPI
+DebugInvalidatePage (
+  IN UINTN  Address
+  );
+
 #define ADDRESS_BITS  0x0000000FFFFFF000ull
 //             5         4         3         2         1
 //      7654321098765432109876543210987654321098765432109876543210
@@ -32,6 +38,8 @@
 #define PdeIndex(a)    ((UINT64) ((a & 0x000000003FE00000ull)) >> 21) // 12+9
 #define PteIndex(a)    ((UINT64) ((a & 0x00000000001FF000ull)) >> 12) // 12
 
+#define PAGE_TABLE_INDEX(a, s)  ((UINTN)RShiftU64 ((a), (s)) & 0x1FF)
+
 typedef enum {
   PAGE_IS_NOT_VALID,
   PAGE_IS_READ_ONLY,
@@ -180,3 +188,60 @@ IsPageWritable (
   PageIs = GetPageIs (Address);
   return (PageIs == PAGE_IS_READ_WRITE);
 }
+
+/**
+  Finds the 4K page table entry that maps an address. The entry is returned
+  even if the page is not present, as long as the tables leading to it are.
+
+  @param[in]  Address     The virtual address.
+
+  @retval     The page table entry, or NULL if the address is not mapped by a
+              4K page.
+**/
+UINT64 *
+DebugArchGetPageEntry (
+  IN UINTN  Address
+  )
+{
+  UINT64    *Table;
+  UINT64    Entry;
+  UINTN     Level;
+  IA32_CR4  Cr4;
+
+  Cr4.UintN = AsmReadCr4 ();
+  Table     = (UINT64 *)(UINTN)(AsmReadCr3 () & ADDRESS_BITS);
+  if (Table == NULL) {
+    return NULL;
+  }
+
+  // Levels are numbered by the address shift of their index.
+  for (Level = Cr4.Bits.LA57 ? 48 : 39; Level > 12; Level -= 9) {
+    Entry = Table[PAGE_TABLE_INDEX (Address, Level)];
+    if ((Entry & IA32_PG_P) == 0) {
+      return NULL;
+    }
+
+    // 1GB and 2MB pages.
+    if ((Level <= 30) && ((Entry & IA32_PG_PS) != 0)) {
+      return NULL;
+    }
+
+    Table = (UINT64 *)(UINTN)(Entry & ADDRESS_BITS);
+  }
+
+  return &Table[PAGE_TABLE_INDEX (Address, 12)];
+}
+
+/**
+  Invalidates the translation of a page cached by the current processor.
+
+  @param[in]  Address     The virtual address in the page.
+
+**/
+VOID
+DebugArchFlushPage (
+  IN UINTN  Address
+  )
+{
+  DebugInvalidatePage (Address);
+}
@@ -14,45 +14,69 @@
 #include <Library/SerialPortLib.h>
 #include <Library/WatchdogTimerLib.h>
 
+#include <Register/Intel/ArchitecturalMsr.h>
 #include <Register/Intel/Cpuid.h>
+#include <Register/Intel/LocalApic.h>
 
 #include "DebugAgent.h"
 #include "GdbStub.h"
 
 #define TF_BIT  0x00000100
 
+// Page fault error code bit set for write accesses.
+#define PF_ERROR_WRITE  BIT1
+
 // Debug registers defines.
 #define DR7_ENABLE_MASK  0xFF
 #define DR7_WRITE_ONLY   0b01
 #define DR7_READ_WRITE   0b11
 
-typedef union _X64_DR7 {
-  struct {
-    UINTN    L0         : 1;  // Local breakpoint enable
-    UINTN    G0         : 1;  // Global breakpoint enable
-    UINTN    L1         : 1;  // Local breakpoint enable
-    UINTN    G1         : 1;  // Global breakpoint enable
-    UINTN    L2         : 1;  // Local breakpoint enable
-    UINTN    G2         : 1;  // Global breakpoint enable
-    UINTN    L3         : 1;  // Local breakpoint enable
-    UINTN    G3         : 1;  // Global breakpoint enable
-    UINTN    LE         : 1;  // Local exact breakpoint enable
-    UINTN    GE         : 1;  // Global exact breakpoint enable
-    UINTN    Reserved_1 : 3;  // Reserved
-    UINTN    GD         : 1;  // Global detect enable
-    UINTN    Reserved_2 : 2;  // Reserved
-    UINTN    RW0        : 2;  // Read/Write field
-    UINTN    LEN0       : 2;  // Length field
-    UINTN    RW1        : 2;  // Read/Write field
-    UINTN    LEN1       : 2;  // Length field
-    UINTN    RW2        : 2;  // Read/Write field
-    UINTN    LEN2       : 2;  // Length field
-    UINTN    RW3        : 2;  // Read/Write field
-    UINTN    LEN3       : 2;  // Length field
-    UINTN    Reserved_3 : 32; // Length field
-  } Bits;
-  UINTN    UintN;
-} X64_DR7;
+// DR6 status bits for the debug register hits and single step.
+#define DR6_HIT_MASK     0xF
+#define DR6_SINGLE_STEP  BIT14
+
+// RFLAGS bits used to identify an interrupt frame on the stack.
+#define RFLAGS_RESERVED  0x00000002
+#define RFLAGS_IF        0x00000200
+
+// How far up the stack to look for the interrupt frame when profiling.
+#define PROFILE_STACK_SCAN  SIZE_8KB
+
+// Per register fields of DR7, the local enable bit and the RW and LEN fields.
+#define DR7_LOCAL_ENABLE(Index)   (BIT0 << ((Index) * 2))
+#define DR7_CONTROL_SHIFT(Index)  (16 + ((Index) * 4))
+#define DR7_CONTROL_MASK          ((UINTN)0xF)
+
+#define MAX_WATCHPOINTS  4
+
+// Structure to more simply access the debug address registers.
+typedef
+UINTN
+(EFIAPI *X64_READ_DEBUG_REGISTER)(
+  VOID
+  );
+
+typedef
+UINTN
+(EFIAPI *X64_WRITE_DEBUG_REGISTER)(
+  UINTN  Value
+  );
+
+typedef struct _X64_DEBUG_ADDRESS_REGISTER {
+  X64_READ_DEBUG_REGISTER     Read;
+  X64_WRITE_DEBUG_REGISTER    Write;
+} X64_DEBUG_ADDRESS_REGISTER;
+
+STATIC CONST X64_DEBUG_ADDRESS_REGISTER  mDebugAddressRegisters[MAX_WATCHPOINTS] = {
+  { AsmReadDr0, AsmWriteDr0 },
+  { AsmReadDr1, AsmWriteDr1 },
+  { AsmReadDr2, AsmWriteDr2 },
+  { AsmReadDr3, AsmWriteDr3 }
+};
+
+// Watchpoints sharing each debug register, such as a watchpoint and a
+// counting watchpoint on the same slot.
+STATIC UINT8  mDebugRegisterRefs[MAX_WATCHPOINTS];
 
 extern EFI_CPU_ARCH_PROTOCOL  *gCpu;
 STATIC UINT64                 mPerformanceCounterFreq;
@@ -76,6 +100,12 @@ UINT32  mArchExceptionTypes[] = {
   MAX_UINT32 // End of list
 };
 
+// Data breakpoints trap after the access.
+BOOLEAN  mArchWatchpointBeforeAccess = FALSE;
+
+// Accessed and dirty.
+UINT64  mArchPageEntryHardwareBits = BIT5 | BIT6;
+
 /**
   This routine handles synchronous exceptions.
 
@@ -97,6 +127,16 @@ DebuggerExceptionHandler (
   EFI_SYSTEM_CONTEXT_X64  *Context;
   EXCEPTION_INFO          ExceptionInfo;
   BOOLEAN                 WatchdogState;
+  UINTN                   Dr6;
+  UINTN                   Dr7;
+  UINTN                   Index;
+
+  //
+  // Other processors are halted with an NMI when one enters the debugger.
+  //
+  if ((InterruptType == EXCEPT_X64_NMI) && DbgProcessorHalt (SystemContext)) {
+    return;
+  }
 
   //
   // Suspend the watchdog while handling debug events
@@ -113,6 +153,22 @@ DebuggerExceptionHandler (
       Context->Rflags               &= (UINT64) ~TF_BIT;   // Clear any single step flag
       ExceptionInfo.ExceptionType    = ExceptionDebugStep;
       ExceptionInfo.ExceptionAddress = Context->Rip;
+
+      // The DR6 status bits are sticky, clear them once read. A hit bit can be
+      // set for a disabled register whose condition matched, so check DR7.
+      Dr6 = AsmReadDr6 ();
+      Dr7 = AsmReadDr7 ();
+      AsmWriteDr6 (Dr6 & ~(UINTN)(DR6_HIT_MASK | DR6_SINGLE_STEP));
+      for (Index = 0; Index < MAX_WATCHPOINTS; Index++) {
+        if (((Dr6 & (BIT0 << Index)) != 0) && ((Dr7 & DR7_LOCAL_ENABLE (Index)) != 0)) {
+          ExceptionInfo.ExceptionType = ExceptionWatchpoint;
+          ExceptionInfo.FaultAddress  = mDebugAddressRegisters[Index].Read ();
+          ExceptionInfo.FaultIsWrite  = ((Dr7 >> DR7_CONTROL_SHIFT (Index)) & 0b11) == DR7_WRITE_ONLY;
+          ExceptionInfo.StepComplete  = (Dr6 & DR6_SINGLE_STEP) != 0;
+          break;
+        }
+      }
+
       break;
 
     case EXCEPT_X64_BREAKPOINT:
@@ -127,6 +183,8 @@ DebuggerExceptionHandler (
     case EXCEPT_X64_PAGE_FAULT:
       ExceptionInfo.ExceptionType    = ExceptionAccessViolation;
       ExceptionInfo.ExceptionAddress = Context->Rip;
+      ExceptionInfo.FaultAddress     = AsmReadCr2 ();
+      ExceptionInfo.FaultIsWrite     = (Context->ExceptionData & PF_ERROR_WRITE) != 0;
       break;
 
     case EXCEPT_X64_DOUBLE_FAULT:
@@ -180,16 +238,195 @@ AddSingleStep (
 }
 
 /**
-  Gets the performance counter in milliseconds.
+  Reads the performance counter.
 
-  @retval   Current performance count converted to milliseconds.
+  @retval   The current TSC value.
 **/
 UINT64
-DebugGetTimeMs (
+DebugArchReadTicks (
+  VOID
+  )
+{
+  return AsmReadTsc ();
+}
+
+/**
+  Gets the frequency of the performance counter. The TSC frequency is taken
+  from CPUID when the processor enumerates it, otherwise the frequency measured
+  when the debug configuration was created is used.
+
+  @retval   The TSC frequency in hertz, or 0 if unknown.
+**/
+UINT64
+DebugArchGetTickFrequency (
+  VOID
+  )
+{
+  UINT32  MaxLeaf;
+  UINT32  Denominator;
+  UINT32  Numerator;
+  UINT32  CrystalHz;
+  UINT32  BaseMhz;
+
+  AsmCpuid (CPUID_SIGNATURE, &MaxLeaf, NULL, NULL, NULL);
+  if (MaxLeaf >= CPUID_TIME_STAMP_COUNTER) {
+    AsmCpuid (CPUID_TIME_STAMP_COUNTER, &Denominator, &Numerator, &CrystalHz, NULL);
+    if ((Denominator != 0) && (Numerator != 0)) {
+      if (CrystalHz != 0) {
+        return DivU64x32 (MultU64x32 (CrystalHz, Numerator), Denominator);
+      }
+
+      // The crystal frequency is not enumerated, the processor base frequency
+      // is the nominal TSC frequency on these processors.
+      if (MaxLeaf >= CPUID_PROCESSOR_FREQUENCY) {
+        AsmCpuid (CPUID_PROCESSOR_FREQUENCY, &BaseMhz, NULL, NULL, NULL);
+        if ((BaseMhz & MAX_UINT16) != 0) {
+          return MultU64x32 (BaseMhz & MAX_UINT16, 1000000);
+        }
+      }
+    }
+  }
+
+  // The stashed frequency is in ticks per millisecond.
+  return MultU64x32 (mPerformanceCounterFreq, 1000);
+}
+
+/**
+  Finds the context interrupted by the timer that is dispatching the current
+  event notification. Events are dispatched on the interrupted stack, so the
+  stack is scanned upwards for the RIP, CS, RFLAGS, RSP, SS frame pushed by the
+  processor. The frame is only accepted if the selectors match, interrupts were
+  enabled, and the saved RSP is the one the processor aligned to build it.
+
+  @param[out]  Pc             The interrupted instruction pointer.
+  @param[out]  FramePointer   The interrupted RBP, or 0 if not found.
+
+  @retval   TRUE    An interrupt frame was found.
+  @retval   FALSE   The notification was not dispatched from an interrupt.
+**/
+BOOLEAN
+DebugArchGetInterruptedFrame (
+  OUT UINTN  *Pc,
+  OUT UINTN  *FramePointer
+  )
+{
+  UINT64  Cs;
+  UINT64  Ss;
+  UINT64  *Slot;
+  UINT64  *Limit;
+  UINTN   Page;
+
+  Cs    = AsmReadCs ();
+  Ss    = AsmReadSs ();
+  Slot  = &Cs;
+  Limit = Slot + (PROFILE_STACK_SCAN / sizeof (UINT64));
+
+  // Stop the scan at the first page that cannot be read.
+  for (Page = (UINTN)Slot & ~EFI_PAGE_MASK; Page < (UINTN)Limit; Page += EFI_PAGE_SIZE) {
+    if (!IsPageReadable (Page)) {
+      Limit = (UINT64 *)MAX (Page, (UINTN)Slot);
+      break;
+    }
+  }
+
+  // Leave room for the exception handler library state below the frame.
+  for (Slot += 3; Slot + 5 <= Limit; Slot++) {
+    if ((Slot[1] != Cs) || (Slot[4] != Ss)) {
+      continue;
+    }
+
+    if ((Slot[2] & (RFLAGS_RESERVED | RFLAGS_IF)) != (RFLAGS_RESERVED | RFLAGS_IF)) {
+      continue;
+    }
+
+    if ((Slot[3] < (UINTN)&Slot[5]) || (Slot[3] >= (UINTN)&Slot[5] + 16)) {
+      continue;
+    }
+
+    //
+    // CpuExceptionHandlerLib pushes an error code, the vector and RBP below the
+    // frame. Interrupts have no error code so a zero is pushed in its place.
+    //
+
+    *Pc           = (UINTN)Slot[0];
+    *FramePointer = (Slot[-1] == 0) ? (UINTN)Slot[-3] : 0;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/**
+  Gets the ID of the current processor, the initial x2APIC ID if the processor
+  enumerates it and the initial APIC ID otherwise. This matches the processor
+  ID reported by the MP services.
+
+  @retval   The APIC ID of the current processor.
+**/
+UINT64
+DebugArchGetProcessorId (
+  VOID
+  )
+{
+  UINT32                       MaxLeaf;
+  UINT32                       X2ApicId;
+  CPUID_EXTENDED_TOPOLOGY_EBX  TopologyEbx;
+  CPUID_VERSION_INFO_EBX       VersionEbx;
+
+  AsmCpuid (CPUID_SIGNATURE, &MaxLeaf, NULL, NULL, NULL);
+  if (MaxLeaf >= CPUID_EXTENDED_TOPOLOGY) {
+    AsmCpuidEx (CPUID_EXTENDED_TOPOLOGY, 0, NULL, &TopologyEbx.Uint32, NULL, &X2ApicId);
+    if (TopologyEbx.Bits.LogicalProcessors != 0) {
+      return X2ApicId;
+    }
+  }
+
+  AsmCpuid (CPUID_VERSION_INFO, NULL, &VersionEbx.Uint32, NULL, NULL);
+  return VersionEbx.Bits.InitialLocalApicId;
+}
+
+/**
+  Sends an NMI to all other processors through the local APIC, in either xAPIC
+  or x2APIC mode.
+
+  @retval   TRUE    The NMI was sent.
+  @retval   FALSE   The local APIC is disabled.
+**/
+BOOLEAN
+DebugArchHaltProcessors (
   VOID
   )
 {
-  return AsmReadTsc () / mPerformanceCounterFreq;
+  MSR_IA32_APIC_BASE_REGISTER  ApicBase;
+  LOCAL_APIC_ICR_LOW           Icr;
+  volatile UINT32              *IcrLow;
+
+  ApicBase.Uint64 = AsmReadMsr64 (MSR_IA32_APIC_BASE);
+  if (ApicBase.Bits.EN == 0) {
+    return FALSE;
+  }
+
+  Icr.Uint32                    = 0;
+  Icr.Bits.DeliveryMode         = LOCAL_APIC_DELIVERY_MODE_NMI;
+  Icr.Bits.Level                = 1;
+  Icr.Bits.DestinationShorthand = LOCAL_APIC_DESTINATION_SHORTHAND_ALL_EXCLUDING_SELF;
+
+  if (ApicBase.Bits.EXTD != 0) {
+    AsmWriteMsr64 (X2APIC_MSR_ICR_ADDRESS, Icr.Uint32);
+  } else {
+    IcrLow = (volatile UINT32 *)(UINTN)(LShiftU64 (ApicBase.Bits.ApicBaseHi, 32) +
+                                        LShiftU64 (ApicBase.Bits.ApicBase, 12) +
+                                        XAPIC_ICR_LOW_OFFSET);
+
+    // Wait for the delivery status of any previous IPI to go idle.
+    while ((*IcrLow & BIT12) != 0) {
+      CpuPause ();
+    }
+
+    *IcrLow = Icr.Uint32;
+  }
+
+  return TRUE;
 }
 
 /**
@@ -212,15 +449,16 @@ DebugArchInit (
 
   // Set stashed TSC frequency
   mPerformanceCounterFreq = DebugConfig->PerformanceCounterFreq;
+  DebugTimeBaseInit ();
 }
 
 /**
-  Converts a byte count length to the x64 debug register representation. Unsupported
-  sizes will default to 1 byte.
+  Converts a byte count length to the x64 debug register representation.
 
   @param[in]  Length    The byte count length.
 
-  @retval   UINTN the x64 debug register representation.
+  @retval   UINTN the x64 debug register representation, or MAX_UINTN if the
+            length is not supported.
 **/
 UINTN
 LengthToDebugRegLen (
@@ -235,13 +473,46 @@ LengthToDebugRegLen (
     case 2:
       return 0b01;
     case 1:
-    default:
       return 0b00;
+    default:
+      return MAX_UINTN;
   }
 }
 
 /**
-  Adds a X64 hardware watch point.
+  Finds the debug register programmed for a watchpoint slot.
+
+  @param[in]  Dr7       The current DR7 value.
+  @param[in]  Address   The address of the slot.
+  @param[in]  Control   The RW and LEN fields of the slot.
+
+  @retval   The index of the debug register, or MAX_WATCHPOINTS if not found.
+**/
+STATIC
+UINTN
+FindDebugRegister (
+  IN UINTN  Dr7,
+  IN UINTN  Address,
+  IN UINTN  Control
+  )
+{
+  UINTN  Index;
+
+  for (Index = 0; Index < MAX_WATCHPOINTS; Index++) {
+    if (((Dr7 & DR7_LOCAL_ENABLE (Index)) != 0) &&
+        (((Dr7 >> DR7_CONTROL_SHIFT (Index)) & DR7_CONTROL_MASK) == Control) &&
+        (mDebugAddressRegisters[Index].Read () == Address))
+    {
+      return Index;
+    }
+  }
+
+  return MAX_WATCHPOINTS;
+}
+
+/**
+  Adds a X64 hardware watch point. Ranges that are not a naturally aligned 1,
+  2, 4 or 8 bytes are split across several debug registers.
 
   @param[in]  Address   The address of the data watch point.
   @param[in]  Length    The length of the data watch point.
@@ -259,57 +530,79 @@ AddWatchpoint (
   IN BOOLEAN  Write
   )
 {
-  X64_DR7  Dr7;
-  UINTN    Rw;
-  UINTN    Len;
+  WATCH_SLOT  Slots[MAX_WATCHPOINTS];
+  UINTN       Controls[MAX_WATCHPOINTS];
+  UINTN       Count;
+  UINTN       Slot;
+  UINTN       Index;
+  UINTN       Needed;
+  UINTN       Free;
+  UINTN       Dr7;
+  UINTN       Rw;
+  UINTN       Len;
+
+  Count = DbgPlanWatchpoint (Address, Length, 8, FALSE, Slots, MAX_WATCHPOINTS);
+  if (Count == 0) {
+    return FALSE;
+  }
 
   // Only READ is not supported, so only check only write condition
-  Rw        = Read ? DR7_READ_WRITE : DR7_WRITE_ONLY;
-  Len       = LengthToDebugRegLen (Length);
-  Dr7.UintN = AsmReadDr7 ();
+  Rw  = Read ? DR7_READ_WRITE : DR7_WRITE_ONLY;
+  Dr7 = AsmReadDr7 ();
 
-  // Check for duplicate.
-  if (Dr7.Bits.L0 && (Dr7.Bits.RW0 == Rw) && (Dr7.Bits.LEN0 == Len) && (AsmReadDr0 () == Address)) {
-    return TRUE;
-  } else if (Dr7.Bits.L1 && (Dr7.Bits.RW1 == Rw) && (Dr7.Bits.LEN1 == Len) && (AsmReadDr1 () == Address)) {
-    return TRUE;
-  } else if (Dr7.Bits.L2 && (Dr7.Bits.RW2 == Rw) && (Dr7.Bits.LEN2 == Len) && (AsmReadDr2 () == Address)) {
-    return TRUE;
-  } else if (Dr7.Bits.L3 && (Dr7.Bits.RW3 == Rw) && (Dr7.Bits.LEN3 == Len) && (AsmReadDr3 () == Address)) {
-    return TRUE;
+  // Skip the slots that are already set and make sure the rest fit before
+  // programming any of them.
+  Needed = 0;
+  for (Slot = 0; Slot < Count; Slot++) {
+    // The plan only holds naturally aligned slots of a supported size.
+    Len = LengthToDebugRegLen (Slots[Slot].Size);
+    ASSERT (Len != MAX_UINTN);
+    if (Len == MAX_UINTN) {
+      return FALSE;
+    }
+
+    Controls[Slot] = Rw | (Len << 2);
+    if (FindDebugRegister (Dr7, Slots[Slot].Address, Controls[Slot]) == MAX_WATCHPOINTS) {
+      Needed++;
+    }
   }
 
-  // find a free breakpoint.
-  if (!Dr7.Bits.L0) {
-    AsmWriteDr0 (Address);
-    Dr7.Bits.L0   = 1;
-    Dr7.Bits.RW0  = Rw;
-    Dr7.Bits.LEN0 = Len;
-  } else if (!Dr7.Bits.L1) {
-    AsmWriteDr1 (Address);
-    Dr7.Bits.L1   = 1;
-    Dr7.Bits.RW1  = Rw;
-    Dr7.Bits.LEN1 = Len;
-  } else if (!Dr7.Bits.L2) {
-    AsmWriteDr2 (Address);
-    Dr7.Bits.L2   = 1;
-    Dr7.Bits.RW2  = Rw;
-    Dr7.Bits.LEN2 = Len;
-  } else if (!Dr7.Bits.L3) {
-    AsmWriteDr3 (Address);
-    Dr7.Bits.L3   = 1;
-    Dr7.Bits.RW3  = Rw;
-    Dr7.Bits.LEN3 = Len;
-  } else {
+  Free = 0;
+  for (Index = 0; Index < MAX_WATCHPOINTS; Index++) {
+    if ((Dr7 & DR7_LOCAL_ENABLE (Index)) == 0) {
+      Free++;
+    }
+  }
+
+  if (Needed > Free) {
     return FALSE;
   }
 
-  AsmWriteDr7 (Dr7.UintN);
+  for (Slot = 0; Slot < Count; Slot++) {
+    Index = FindDebugRegister (Dr7, Slots[Slot].Address, Controls[Slot]);
+    if (Index != MAX_WATCHPOINTS) {
+      mDebugRegisterRefs[Index]++;
+      continue;
+    }
+
+    Index = 0;
+    while ((Dr7 & DR7_LOCAL_ENABLE (Index)) != 0) {
+      Index++;
+    }
+
+    mDebugRegisterRefs[Index] = 1;
+    mDebugAddressRegisters[Index].Write (Slots[Slot].Address);
+    Dr7 &= ~(DR7_CONTROL_MASK << DR7_CONTROL_SHIFT (Index));
+    Dr7 |= (Controls[Slot] << DR7_CONTROL_SHIFT (Index)) | DR7_LOCAL_ENABLE (Index);
+  }
+
+  AsmWriteDr7 (Dr7);
   return TRUE;
 }
 
 /**
-  Removes a X64 hardware watch point.
+  Removes a X64 hardware watch point. Debug registers shared with another
+  watchpoint stay enabled.
 
   @param[in]  Address   The address of the data watch point.
   @param[in]  Length    The length of the data watch point.
@@ -327,28 +620,92 @@ RemoveWatchpoint (
   IN BOOLEAN  Write
   )
 {
-  X64_DR7  Dr7;
-  UINT8    Rw;
-  UINTN    Len;
+  WATCH_SLOT  Slots[MAX_WATCHPOINTS];
+  UINTN       Indices[MAX_WATCHPOINTS];
+  UINTN       Count;
+  UINTN       Slot;
+  UINTN       Dr7;
+  UINTN       Rw;
+  UINTN       Len;
+
+  Count = DbgPlanWatchpoint (Address, Length, 8, FALSE, Slots, MAX_WATCHPOINTS);
+  if (Count == 0) {
+    return FALSE;
+  }
 
   // Only READ is not supported, so only check only write condition
-  Rw        = Read ? DR7_READ_WRITE : DR7_WRITE_ONLY;
-  Len       = LengthToDebugRegLen (Length);
-  Dr7.UintN = AsmReadDr7 ();
-
-  // Check for duplicate.
-  if (Dr7.Bits.L0 && (Dr7.Bits.RW0 == Rw) && (Dr7.Bits.LEN0 == Len) && (AsmReadDr0 () == Address)) {
-    Dr7.Bits.L0 = 0;
-  } else if (Dr7.Bits.L1 && (Dr7.Bits.RW1 == Rw) && (Dr7.Bits.LEN1 == Len) && (AsmReadDr1 () == Address)) {
-    Dr7.Bits.L1 = 0;
-  } else if (Dr7.Bits.L2 && (Dr7.Bits.RW2 == Rw) && (Dr7.Bits.LEN2 == Len) && (AsmReadDr2 () == Address)) {
-    Dr7.Bits.L2 = 0;
-  } else if (Dr7.Bits.L3 && (Dr7.Bits.RW3 == Rw) && (Dr7.Bits.LEN3 == Len) && (AsmReadDr3 () == Address)) {
-    Dr7.Bits.L3 = 0;
-  } else {
-    return FALSE;
+  Rw  = Read ? DR7_READ_WRITE : DR7_WRITE_ONLY;
+  Dr7 = AsmReadDr7 ();
+
+  for (Slot = 0; Slot < Count; Slot++) {
+    Len = LengthToDebugRegLen (Slots[Slot].Size);
+    ASSERT (Len != MAX_UINTN);
+    if (Len == MAX_UINTN) {
+      return FALSE;
+    }
+
+    Indices[Slot] = FindDebugRegister (Dr7, Slots[Slot].Address, Rw | (Len << 2));
+    if (Indices[Slot] == MAX_WATCHPOINTS) {
+      return FALSE;
+    }
+  }
+
+  for (Slot = 0; Slot < Count; Slot++) {
+    if (mDebugRegisterRefs[Indices[Slot]] > 0) {
+      mDebugRegisterRefs[Indices[Slot]]--;
+    }
+
+    if (mDebugRegisterRefs[Indices[Slot]] == 0) {
+      Dr7 &= ~DR7_LOCAL_ENABLE (Indices[Slot]);
+    }
   }
 
-  AsmWriteDr7 (Dr7.UintN);
+  AsmWriteDr7 (Dr7);
   return TRUE;
 }
+
+/**
+  Checks if a X64 hardware watch point shares a debug register with another.
+
+  @param[in]  Address   The address of the data watch point.
+  @param[in]  Length    The length of the data watch point.
+  @param[in]  Read      Boolean indicated break on read.
+  @param[in]  Write     Boolean indicated break on write.
+
+  @retval  TRUE   A debug register of the watch point is also used by another.
+  @retval  FALSE  The watch point is not shared or does not exist.
+**/
+BOOLEAN
+IsWatchpointShared (
+  IN UINTN    Address,
+  IN UINTN    Length,
+  IN BOOLEAN  Read,
+  IN BOOLEAN  Write
+  )
+{
+  WATCH_SLOT  Slots[MAX_WATCHPOINTS];
+  UINTN       Count;
+  UINTN       Slot;
+  UINTN       Index;
+  UINTN       Dr7;
+  UINTN       Rw;
+  UINTN       Len;
+
+  Count = DbgPlanWatchpoint (Address, Length, 8, FALSE, Slots, MAX_WATCHPOINTS);
+  Rw    = Read ? DR7_READ_WRITE : DR7_WRITE_ONLY;
+  Dr7   = AsmReadDr7 ();
+
+  for (Slot = 0; Slot < Count; Slot++) {
+    Len = LengthToDebugRegLen (Slots[Slot].Size);
+    if (Len == MAX_UINTN) {
+      return FALSE;
+    }
+
+    Index = FindDebugRegister (Dr7, Slots[Slot].Address, Rw | (Len << 2));
+    if ((Index != MAX_WATCHPOINTS) && (mDebugRegisterRefs[Index] > 1)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
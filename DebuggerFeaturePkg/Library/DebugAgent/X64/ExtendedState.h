@@ -0,0 +1,26 @@
+/** @file
+  Prototypes for assembly routines for saving the processor extended state.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef DEBUG_EXTENDED_STATE_H__
+#define DEBUG_EXTENDED_STATE_H__
+
+VOID
+EFIAPI
+DebugXSave (
+  OUT VOID   *Buffer,
+  IN UINT64  Mask
+  );
+
+VOID
+EFIAPI
+DebugXRstor (
+  IN VOID    *Buffer,
+  IN UINT64  Mask
+  );
+
+#endif
@@ -0,0 +1,450 @@
+/** @file
+  Unwinds x64 stacks in the debugger so a full backtrace can be returned to the
+  debugger in one response. Images with an exception directory are unwound
+  with the PE/COFF x64 unwind data, otherwise the RBP frame chain is followed.
+  All memory is read through the debugger memory routines.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+#include <Protocol/DebugSupport.h>
+#include <IndustryStandard/PeImage.h>
+
+#include "DebugAgent.h"
+
+// Unwind operation codes.
+#define UWOP_PUSH_NONVOL      0
+#define UWOP_ALLOC_LARGE      1
+#define UWOP_ALLOC_SMALL      2
+#define UWOP_SET_FPREG        3
+#define UWOP_SAVE_NONVOL      4
+#define UWOP_SAVE_NONVOL_FAR  5
+#define UWOP_EPILOG           6
+#define UWOP_SPARE_CODE       7
+#define UWOP_SAVE_XMM128      8
+#define UWOP_SAVE_XMM128_FAR  9
+#define UWOP_PUSH_MACHFRAME   10
+
+#define UNW_FLAG_CHAININFO  0x4
+
+// Limit on chained unwind info, which real images only use a few levels of.
+#define MAX_UNWIND_CHAIN  8
+
+// Register numbers as encoded in the unwind codes.
+#define REG_RSP  4
+#define REG_RBP  5
+
+typedef struct {
+  UINT32    BeginAddress;
+  UINT32    EndAddress;
+  UINT32    UnwindInfoAddress;
+} RUNTIME_FUNCTION;
+
+typedef struct {
+  UINT8     VersionAndFlags;
+  UINT8     SizeOfProlog;
+  UINT8     CountOfCodes;
+  UINT8     FrameRegisterAndOffset;
+  // Codes, rounded up to an even count, then the chained RUNTIME_FUNCTION.
+  UINT16    Codes[256 + (sizeof (RUNTIME_FUNCTION) / sizeof (UINT16))];
+} UNWIND_INFO;
+
+typedef struct {
+  UINT64    Rip;
+  UINT64    Regs[16];   // In unwind code register order, RAX to R15.
+} UNWIND_CONTEXT;
+
+/**
+  Reads a 64-bit value from the stack.
+
+  @param[in]   Address  The address to read.
+  @param[out]  Value    The value read.
+
+  @retval   TRUE if the value was read.
+**/
+STATIC
+BOOLEAN
+ReadStack (
+  IN  UINT64  Address,
+  OUT UINT64  *Value
+  )
+{
+  return DbgReadMemory ((UINTN)Address, Value, sizeof (UINT64));
+}
+
+/**
+  Finds the unwind data entry for an address in an image.
+
+  @param[in]   ImageBase  The base of the image containing the address.
+  @param[in]   Directory  The address of the image exception directory.
+  @param[in]   Size       The size of the image exception directory.
+  @param[in]   Address    The address to find the function for.
+  @param[out]  Function   The function entry.
+
+  @retval   TRUE    The function entry was found.
+  @retval   FALSE   The image has no unwind data for the address, such as for
+                    a leaf function.
+**/
+STATIC
+BOOLEAN
+FindRuntimeFunction (
+  IN  UINTN             ImageBase,
+  IN  UINTN             Directory,
+  IN  UINTN             Size,
+  IN  UINTN             Address,
+  OUT RUNTIME_FUNCTION  *Function
+  )
+{
+  UINTN   Low;
+  UINTN   High;
+  UINTN   Middle;
+  UINT32  Rva;
+
+  // The entries are sorted by address.
+  Rva  = (UINT32)(Address - ImageBase);
+  Low  = 0;
+  High = Size / sizeof (RUNTIME_FUNCTION);
+  while (Low < High) {
+    Middle = (Low + High) / 2;
+    if (!DbgReadMemory (Directory + Middle * sizeof (RUNTIME_FUNCTION), Function, sizeof (RUNTIME_FUNCTION))) {
+      return FALSE;
+    }
+
+    if (Rva < Function->BeginAddress) {
+      High = Middle;
+    } else if (Rva >= Function->EndAddress) {
+      Low = Middle + 1;
+    } else {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/**
+  Checks if the instruction pointer is in a function epilog and if so unwinds
+  it by emulating the remaining instructions. Only the standard epilog of an
+  optional stack adjustment, register pops and a return is recognized.
+
+  @param[in,out]  Context   The context to unwind.
+
+  @retval   TRUE    The context was in an epilog and has been unwound.
+  @retval   FALSE   The context is not in a recognized epilog.
+**/
+STATIC
+BOOLEAN
+UnwindEpilog (
+  IN OUT UNWIND_CONTEXT  *Context
+  )
+{
+  UINT8   Code[32];
+  UINTN   Start;
+  UINTN   Index;
+  INT64   Adjust;
+  UINT64  Rsp;
+  UINT8   Rex;
+
+  if (!DbgReadMemory ((UINTN)Context->Rip, Code, sizeof (Code))) {
+    return FALSE;
+  }
+
+  // First check the whole sequence before modifying the context.
+  Start  = 0;
+  Adjust = 0;
+  if ((Code[0] == 0x48) && (Code[1] == 0x83) && (Code[2] == 0xC4)) {
+    // add rsp, imm8
+    Adjust = (INT8)Code[3];
+    Start  = 4;
+  } else if ((Code[0] == 0x48) && (Code[1] == 0x81) && (Code[2] == 0xC4)) {
+    // add rsp, imm32
+    Adjust = (INT32)(Code[3] | (Code[4] << 8) | (Code[5] << 16) | ((UINT32)Code[6] << 24));
+    Start  = 7;
+  }
+
+  for (Index = Start; Index < sizeof (Code) - 1; Index++) {
+    if ((Code[Index] == 0x41) && ((Code[Index + 1] & 0xF8) == 0x58)) {
+      Index++;
+    } else if ((Code[Index] & 0xF8) != 0x58) {
+      break;
+    }
+  }
+
+  if ((Index >= sizeof (Code)) || (Code[Index] != 0xC3)) {
+    return FALSE;
+  }
+
+  // Emulate the pops and the return.
+  Rsp = Context->Regs[REG_RSP] + Adjust;
+  for (Index = Start; Code[Index] != 0xC3; Index++) {
+    Rex = 0;
+    if (Code[Index] == 0x41) {
+      Rex = 8;
+      Index++;
+    }
+
+    if (!ReadStack (Rsp, &Context->Regs[Rex + (Code[Index] & 0x7)])) {
+      return FALSE;
+    }
+
+    Rsp += sizeof (UINT64);
+  }
+
+  if (!ReadStack (Rsp, &Context->Rip)) {
+    return FALSE;
+  }
+
+  Context->Regs[REG_RSP] = Rsp + sizeof (UINT64);
+  return TRUE;
+}
+
+/**
+  Unwinds a function using its unwind data, following any chained unwind data.
+
+  @param[in]      ImageBase     The base of the image containing the function.
+  @param[in]      Function      The function entry.
+  @param[in,out]  Context       The context to unwind.
+
+  @retval   TRUE    The context was unwound to the caller.
+  @retval   FALSE   The unwind data or stack could not be read.
+**/
+STATIC
+BOOLEAN
+UnwindFunction (
+  IN     UINTN             ImageBase,
+  IN     RUNTIME_FUNCTION  *Function,
+  IN OUT UNWIND_CONTEXT    *Context
+  )
+{
+  UNWIND_INFO  Info;
+  UINTN        Offset;
+  UINTN        Chain;
+  UINTN        Index;
+  UINTN        Slots;
+  UINT8        Op;
+  UINT8        OpInfo;
+  UINT64       Value;
+  BOOLEAN      MachineFrame;
+
+  MachineFrame = FALSE;
+  Offset       = (UINTN)(Context->Rip - ImageBase - Function->BeginAddress);
+  for (Chain = 0; Chain < MAX_UNWIND_CHAIN; Chain++) {
+    if (!DbgReadMemory (ImageBase + Function->UnwindInfoAddress, &Info, OFFSET_OF (UNWIND_INFO, Codes))) {
+      return FALSE;
+    }
+
+    Slots = ALIGN_VALUE (Info.CountOfCodes, 2);
+    if ((Info.VersionAndFlags & (UNW_FLAG_CHAININFO << 3)) != 0) {
+      Slots += sizeof (RUNTIME_FUNCTION) / sizeof (UINT16);
+    }
+
+    if (!DbgReadMemory (
+           ImageBase + Function->UnwindInfoAddress + OFFSET_OF (UNWIND_INFO, Codes),
+           Info.Codes,
+           Slots * sizeof (UINT16)
+           ))
+    {
+      return FALSE;
+    }
+
+    //
+    // The codes are in reverse order of the prolog. Codes for prolog
+    // instructions that have not executed yet are skipped.
+    //
+
+    for (Index = 0; Index < Info.CountOfCodes; Index += Slots) {
+      Op     = (Info.Codes[Index] >> 8) & 0xF;
+      OpInfo = (Info.Codes[Index] >> 12) & 0xF;
+      switch (Op) {
+        case UWOP_ALLOC_LARGE:
+          Slots = (OpInfo == 0) ? 2 : 3;
+          break;
+        case UWOP_SAVE_NONVOL:
+        case UWOP_EPILOG:
+        case UWOP_SAVE_XMM128:
+          Slots = 2;
+          break;
+        case UWOP_SAVE_NONVOL_FAR:
+        case UWOP_SPARE_CODE:
+        case UWOP_SAVE_XMM128_FAR:
+          Slots = 3;
+          break;
+        default:
+          Slots = 1;
+          break;
+      }
+
+      if (((Info.Codes[Index] & 0xFF) > Offset) || (Index + Slots > Info.CountOfCodes)) {
+        continue;
+      }
+
+      switch (Op) {
+        case UWOP_PUSH_NONVOL:
+          if (!ReadStack (Context->Regs[REG_RSP], &Context->Regs[OpInfo])) {
+            return FALSE;
+          }
+
+          Context->Regs[REG_RSP] += sizeof (UINT64);
+          break;
+
+        case UWOP_ALLOC_LARGE:
+          if (OpInfo == 0) {
+            Context->Regs[REG_RSP] += Info.Codes[Index + 1] * 8;
+          } else {
+            Context->Regs[REG_RSP] += Info.Codes[Index + 1] | ((UINT32)Info.Codes[Index + 2] << 16);
+          }
+
+          break;
+
+        case UWOP_ALLOC_SMALL:
+          Context->Regs[REG_RSP] += OpInfo * 8 + 8;
+          break;
+
+        case UWOP_SET_FPREG:
+          Context->Regs[REG_RSP] = Context->Regs[Info.FrameRegisterAndOffset & 0xF] -
+                                   (Info.FrameRegisterAndOffset >> 4) * 16;
+          break;
+
+        case UWOP_SAVE_NONVOL:
+        case UWOP_SAVE_NONVOL_FAR:
+          Value = (Op == UWOP_SAVE_NONVOL) ? Info.Codes[Index + 1] * 8 :
+                  Info.Codes[Index + 1] | ((UINT32)Info.Codes[Index + 2] << 16);
+          if (!ReadStack (Context->Regs[REG_RSP] + Value, &Context->Regs[OpInfo])) {
+            return FALSE;
+          }
+
+          break;
+
+        case UWOP_PUSH_MACHFRAME:
+          // The processor pushed RIP, CS, RFLAGS, RSP and SS, with an error code if OpInfo is 1.
+          Value = Context->Regs[REG_RSP] + OpInfo * sizeof (UINT64);
+          if (!ReadStack (Value, &Context->Rip) || !ReadStack (Value + 3 * sizeof (UINT64), &Context->Regs[REG_RSP])) {
+            return FALSE;
+          }
+
+          MachineFrame = TRUE;
+          break;
+
+        default:
+          break;
+      }
+    }
+
+    if ((Info.VersionAndFlags & (UNW_FLAG_CHAININFO << 3)) == 0) {
+      break;
+    }
+
+    // The prolog of the chained function has completed.
+    CopyMem (Function, &Info.Codes[ALIGN_VALUE (Info.CountOfCodes, 2)], sizeof (RUNTIME_FUNCTION));
+    Offset = MAX_UINTN;
+  }
+
+  if (MachineFrame) {
+    return TRUE;
+  }
+
+  if (!ReadStack (Context->Regs[REG_RSP], &Context->Rip)) {
+    return FALSE;
+  }
+
+  Context->Regs[REG_RSP] += sizeof (UINT64);
+  return TRUE;
+}
+
+/**
+  Unwinds the stack of an x64 context.
+
+  @param[in]   SystemContext  The context to unwind from.
+  @param[out]  Frames         The frames, starting with the context itself.
+  @param[in]   MaxFrames      The maximum number of frames to return.
+
+  @retval   The number of frames returned.
+**/
+UINTN
+DebugArchUnwindStack (
+  IN  EFI_SYSTEM_CONTEXT  SystemContext,
+  OUT STACK_FRAME         *Frames,
+  IN  UINTN               MaxFrames
+  )
+{
+  EFI_SYSTEM_CONTEXT_X64  *X64;
+  UNWIND_CONTEXT          Context;
+  RUNTIME_FUNCTION        Function;
+  UINTN                   Count;
+  UINTN                   ImageBase;
+  UINTN                   ImageSize;
+  UINTN                   Directory;
+  UINTN                   DirectorySize;
+  UINTN                   Address;
+  UINT64                  PreviousRsp;
+  UINT64                  FramePointer;
+  BOOLEAN                 Unwound;
+
+  X64 = SystemContext.SystemContextX64;
+  ZeroMem (&Context, sizeof (Context));
+  Context.Rip      = X64->Rip;
+  Context.Regs[0]  = X64->Rax;
+  Context.Regs[1]  = X64->Rcx;
+  Context.Regs[2]  = X64->Rdx;
+  Context.Regs[3]  = X64->Rbx;
+  Context.Regs[4]  = X64->Rsp;
+  Context.Regs[5]  = X64->Rbp;
+  Context.Regs[6]  = X64->Rsi;
+  Context.Regs[7]  = X64->Rdi;
+  Context.Regs[8]  = X64->R8;
+  Context.Regs[9]  = X64->R9;
+  Context.Regs[10] = X64->R10;
+  Context.Regs[11] = X64->R11;
+  Context.Regs[12] = X64->R12;
+  Context.Regs[13] = X64->R13;
+  Context.Regs[14] = X64->R14;
+  Context.Regs[15] = X64->R15;
+
+  ImageBase = 0;
+  ImageSize = 0;
+  for (Count = 0; (Count < MaxFrames) && (Context.Rip != 0); Count++) {
+    Frames[Count].Pc = Context.Rip;
+    Frames[Count].Sp = Context.Regs[REG_RSP];
+    PreviousRsp      = Context.Regs[REG_RSP];
+
+    // Return addresses may be just past the end of the calling function.
+    Address = (UINTN)((Count == 0) ? Context.Rip : Context.Rip - 1);
+    if ((Address - ImageBase >= ImageSize) && !DbgFindLoadedImage (Address, &ImageBase, &ImageSize)) {
+      ImageBase = 0;
+      ImageSize = 0;
+    }
+
+    if ((ImageSize != 0) &&
+        DbgGetImageDirectory (ImageBase, EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION, &Directory, &DirectorySize))
+    {
+      if ((Count == 0) && UnwindEpilog (&Context)) {
+        Unwound = TRUE;
+      } else if (FindRuntimeFunction (ImageBase, Directory, DirectorySize, Address, &Function)) {
+        Unwound = UnwindFunction (ImageBase, &Function, &Context);
+      } else {
+        // Leaf functions have no unwind data and do not change RSP.
+        Unwound                = ReadStack (Context.Regs[REG_RSP], &Context.Rip);
+        Context.Regs[REG_RSP] += sizeof (UINT64);
+      }
+    } else {
+      // Follow the RBP frame chain.
+      FramePointer = Context.Regs[REG_RBP];
+      Unwound      = (FramePointer >= PreviousRsp) && ((FramePointer & (sizeof (UINT64) - 1)) == 0) &&
+                     ReadStack (FramePointer + sizeof (UINT64), &Context.Rip) &&
+                     ReadStack (FramePointer, &Context.Regs[REG_RBP]);
+
+      Context.Regs[REG_RSP] = FramePointer + 2 * sizeof (UINT64);
+    }
+
+    // The stack only grows down, so each caller must be at a higher address.
+    if (!Unwound || (Context.Regs[REG_RSP] <= PreviousRsp)) {
+      Count++;
+      break;
+    }
+  }
+
+  return Count;
+}
@@ -147,5 +147,6 @@ typedef union {
 
 #define IA32_PG_P   BIT0
 #define IA32_PG_RW  BIT1
+#define IA32_PG_PS  BIT7
 
 #endif
@@ -0,0 +1,26 @@
+/** @file
+  Null implementation of the DebugHostDetectLib for transports that cannot
+  detect an attached debugger host.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi/UefiBaseType.h>
+
+#include <Library/DebugHostDetectLib.h>
+
+/**
+  Checks the debug transport for signs that a debugger host is attached.
+
+  @retval   EFI_UNSUPPORTED   The transport cannot detect an attached host.
+**/
+EFI_STATUS
+EFIAPI
+DebugHostDetect (
+  VOID
+  )
+{
+  return EFI_UNSUPPORTED;
+}
@@ -0,0 +1,43 @@
+/** @file
+  Implementation of the DebugHostDetectLib using the serial port modem status.
+  Can be used with DebugTransportSerialLib or DebugTransportMuxLib.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi/UefiBaseType.h>
+
+#include <Library/DebugHostDetectLib.h>
+#include <Library/PcdLib.h>
+#include <Library/SerialPortLib.h>
+
+/**
+  Checks the transport for signs that a debugger host is attached using the
+  data set ready modem status line, if enabled.
+
+  @retval   EFI_SUCCESS       A host appears to be attached.
+  @retval   EFI_NOT_FOUND     No host is attached.
+  @retval   EFI_UNSUPPORTED   The transport cannot detect an attached host.
+**/
+EFI_STATUS
+EFIAPI
+DebugHostDetect (
+  VOID
+  )
+{
+  EFI_STATUS  Status;
+  UINT32      Control;
+
+  if (!PcdGetBool (PcdDebugTransportSerialUseModemStatus)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Status = SerialPortGetControl (&Control);
+  if (EFI_ERROR (Status)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  return ((Control & EFI_SERIAL_DATA_SET_READY) != 0) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
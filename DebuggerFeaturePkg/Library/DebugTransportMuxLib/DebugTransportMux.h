@@ -0,0 +1,50 @@
+/** @file
+  Definitions for the framing used to share one serial port between the debug
+  transport and the log output.
+
+  Data sent to the host is carried in frames tagged with a channel. A frame is
+  the sync byte, the channel, the payload length as a little endian UINT16, the
+  payload and a checksum byte that makes the 8-bit sum of everything after the
+  sync byte zero. The host treats bytes outside a valid frame as log output, so
+  output written before the framing is in use is not lost. Data from the host is
+  not framed, it is all for the debugger.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#ifndef DEBUG_TRANSPORT_MUX_H_
+#define DEBUG_TRANSPORT_MUX_H_
+
+#define MUX_FRAME_SYNC  0xC5
+
+#define MUX_CHANNEL_DEBUG  0
+#define MUX_CHANNEL_LOG    1
+
+// Sync, channel and length.
+#define MUX_HEADER_SIZE  4
+
+// Longer writes are split into several frames.
+#define MUX_MAX_PAYLOAD  0x400
+
+// Attempts the debugger makes to take the frame lock before writing anyway.
+#define MUX_LOCK_RETRIES  0x10000
+
+/**
+  Writes data to the serial port in frames of the given channel.
+
+  @param[in]  Channel         The channel of the data.
+  @param[in]  Buffer          The data to write.
+  @param[in]  NumberOfBytes   The number of bytes to write.
+
+  @retval   The number of bytes written.
+**/
+UINTN
+MuxWriteFrames (
+  IN UINT8        Channel,
+  IN CONST UINT8  *Buffer,
+  IN UINTN        NumberOfBytes
+  );
+
+#endif
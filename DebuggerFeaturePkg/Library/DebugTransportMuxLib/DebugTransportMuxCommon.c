@@ -0,0 +1,137 @@
+/** @file
+  Writes the frames shared by the debug transport and the log output.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi/UefiBaseType.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/PrintLib.h>
+#include <Library/SerialPortLib.h>
+
+#include "DebugTransportMux.h"
+
+// Serializes the frames written by the debugger and the log writers of this
+// module. The lock is only ever tried, the holder may be the code the debugger
+// interrupted. Each module linking the library has its own lock, so frames from
+// different modules can still interleave. The host then drops the broken frames
+// by their checksum and resynchronizes on the next sync byte.
+STATIC volatile UINT32  mMuxLock = 0;
+
+// Log writes of this module dropped because the lock was held.
+STATIC volatile UINT32  mMuxLostWrites = 0;
+
+/**
+  Tries to take the frame lock. The debug channel retries for a while, then
+  writes anyway, the host drops the interrupted frame and resynchronizes.
+
+  @param[in]  Channel   The channel of the data.
+
+  @retval   TRUE    The lock was taken and must be released.
+  @retval   FALSE   The lock was not taken.
+**/
+STATIC
+BOOLEAN
+MuxTryLock (
+  IN UINT8  Channel
+  )
+{
+  UINTN  Retry;
+
+  for (Retry = 0; Retry < MUX_LOCK_RETRIES; Retry++) {
+    if (InterlockedCompareExchange32 ((UINT32 *)&mMuxLock, 0, 1) == 0) {
+      return TRUE;
+    }
+
+    if (Channel != MUX_CHANNEL_DEBUG) {
+      break;
+    }
+
+    CpuPause ();
+  }
+
+  return FALSE;
+}
+
+/**
+  Builds one frame and writes it to the serial port in a single call.
+
+  @param[in]  Channel   The channel of the data.
+  @param[in]  Buffer    The payload.
+  @param[in]  Length    The length of the payload, at most MUX_MAX_PAYLOAD.
+
+**/
+STATIC
+VOID
+MuxWriteFrame (
+  IN UINT8        Channel,
+  IN CONST UINT8  *Buffer,
+  IN UINTN        Length
+  )
+{
+  UINT8  Frame[MUX_HEADER_SIZE + MUX_MAX_PAYLOAD + 1];
+
+  Frame[0] = MUX_FRAME_SYNC;
+  Frame[1] = Channel;
+  Frame[2] = (UINT8)Length;
+  Frame[3] = (UINT8)(Length >> 8);
+  CopyMem (&Frame[MUX_HEADER_SIZE], Buffer, Length);
+  Frame[MUX_HEADER_SIZE + Length] = CalculateCheckSum8 (&Frame[1], MUX_HEADER_SIZE - 1 + Length);
+  SerialPortWrite (&Frame[0], MUX_HEADER_SIZE + Length + 1);
+}
+
+/**
+  Writes data to the serial port in frames of the given channel. Log output is
+  dropped and counted if another frame is being written.
+
+  @param[in]  Channel         The channel of the data.
+  @param[in]  Buffer          The data to write.
+  @param[in]  NumberOfBytes   The number of bytes to write.
+
+  @retval   The number of bytes written.
+**/
+UINTN
+MuxWriteFrames (
+  IN UINT8        Channel,
+  IN CONST UINT8  *Buffer,
+  IN UINTN        NumberOfBytes
+  )
+{
+  CHAR8    Note[48];
+  UINT32   LostWrites;
+  BOOLEAN  Locked;
+  UINTN    Length;
+  UINTN    Written;
+
+  Locked = MuxTryLock (Channel);
+  if (!Locked && (Channel != MUX_CHANNEL_DEBUG)) {
+    InterlockedIncrement ((UINT32 *)&mMuxLostWrites);
+    return 0;
+  }
+
+  if (Locked && (Channel == MUX_CHANNEL_LOG) && (mMuxLostWrites != 0)) {
+    do {
+      LostWrites = mMuxLostWrites;
+    } while (InterlockedCompareExchange32 ((UINT32 *)&mMuxLostWrites, LostWrites, 0) != LostWrites);
+
+    Length     = AsciiSPrint (&Note[0], sizeof (Note), "\n[%d log writes lost]\n", LostWrites);
+    MuxWriteFrame (MUX_CHANNEL_LOG, (UINT8 *)&Note[0], Length);
+  }
+
+  Written = 0;
+  while (Written < NumberOfBytes) {
+    Length = MIN (NumberOfBytes - Written, MUX_MAX_PAYLOAD);
+    MuxWriteFrame (Channel, Buffer + Written, Length);
+    Written += Length;
+  }
+
+  if (Locked) {
+    InterlockedCompareExchange32 ((UINT32 *)&mMuxLock, 1, 0);
+  }
+
+  return Written;
+}
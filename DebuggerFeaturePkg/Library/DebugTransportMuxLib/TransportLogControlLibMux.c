@@ -0,0 +1,75 @@
+/** @file
+  Implementation of the TransportLogControlLib and TransportLogCaptureLib in
+  DebugTransportMuxLib. Log
+  output is written in log channel frames, so it never needs to be suspended
+  while the debugger is broken in.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+
+#include <Library/TransportLogControlLib.h>
+#include <Library/TransportLogCaptureLib.h>
+
+#include "DebugTransportMux.h"
+
+/**
+  Logging does not need to be suspended, the log output is framed.
+
+**/
+VOID
+TransportLogSuspend (
+  VOID
+  )
+{
+}
+
+/**
+  Logging is never suspended.
+
+**/
+VOID
+TransportLogResume (
+  VOID
+  )
+{
+}
+
+/**
+  Called by the platform log writer before writing log output to the debug
+  transport. The output is written in log channel frames.
+
+  @param[in]  Buffer          The log output.
+  @param[in]  NumberOfBytes   The number of bytes of log output.
+
+  @retval   TRUE    The output was written and must not be written again.
+**/
+BOOLEAN
+TransportLogCapture (
+  IN CONST UINT8  *Buffer,
+  IN UINTN        NumberOfBytes
+  )
+{
+  MuxWriteFrames (MUX_CHANNEL_LOG, Buffer, NumberOfBytes);
+  return TRUE;
+}
+
+/**
+  Reads the log output captured while logging was suspended.
+
+  @param[out] Buffer      The buffer to read the output to.
+  @param[in]  BufferSize  The size of the buffer.
+
+  @retval   0   Output is never captured.
+**/
+UINTN
+TransportLogRead (
+  OUT UINT8  *Buffer,
+  IN  UINTN  BufferSize
+  )
+{
+  return 0;
+}
@@ -8,7 +8,6 @@
 
 #include <Uefi/UefiBaseType.h>
 
-#include <Library/PcdLib.h>
 #include <Library/SerialPortLib.h>
 
 extern BOOLEAN  gDbgDisableLogHwPort;
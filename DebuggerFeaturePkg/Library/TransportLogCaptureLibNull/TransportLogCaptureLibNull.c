@@ -0,0 +1,47 @@
+/**@file TransportLogCaptureLibNull.c
+
+  Null implementation of the TransportLogCaptureLib, log output is never
+  captured.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+#include <Library/TransportLogCaptureLib.h>
+
+/**
+  Called by the platform log writer before writing log output to the debug
+  transport.
+
+  @param[in]  Buffer          The log output.
+  @param[in]  NumberOfBytes   The number of bytes of log output.
+
+  @retval   FALSE   The output should be written.
+**/
+BOOLEAN
+TransportLogCapture (
+  IN CONST UINT8  *Buffer,
+  IN UINTN        NumberOfBytes
+  )
+{
+  return FALSE;
+}
+
+/**
+  Reads the log output captured while logging was suspended.
+
+  @param[out] Buffer      The buffer to read the output to.
+  @param[in]  BufferSize  The size of the buffer.
+
+  @retval   0   No output is captured.
+**/
+UINTN
+TransportLogRead (
+  OUT UINT8  *Buffer,
+  IN  UINTN  BufferSize
+  )
+{
+  return 0;
+}
@@ -0,0 +1,307 @@
+/**@file TransportLogControlLibBuffered.c
+
+  Implementation of the TransportLogControlLib and TransportLogCaptureLib that
+  captures log output to a ring buffer while logging is suspended. The output is read by the debugger to
+  forward to the host, and anything left is written to the serial port when
+  logging resumes.
+
+  The ring buffer is reserved by the platform and shared by every module that
+  uses this library, so the log writers see the suspension made by the debug
+  agent.
+
+  Copyright (c) Microsoft Corporation.
+  SPDX-License-Identifier: BSD-2-Clause-Patent
+
+**/
+
+#include <Uefi.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/PcdLib.h>
+#include <Library/PrintLib.h>
+#include <Library/SerialPortLib.h>
+#include <Library/TransportLogControlLib.h>
+#include <Library/TransportLogCaptureLib.h>
+
+#define TRANSPORT_LOG_SIGNATURE  SIGNATURE_32 ('T', 'L', 'O', 'G')
+
+// Head and Tail count bytes written and read since initialization, so the used
+// space is Head - Tail even after they wrap. The buffer is shared memory, so
+// the size is always taken from the PCD and the offsets are checked against it.
+typedef struct _TRANSPORT_LOG_BUFFER {
+  UINT32    Signature;
+  UINT32    Size;         // Size of the data following this header.
+  UINT32    Lock;
+  UINT32    Suspended;
+  UINT32    Head;
+  UINT32    Tail;
+  UINT32    Lost;         // Bytes dropped since the last read, under the lock.
+  UINT32    LostWrites;   // Writes dropped while the lock was held elsewhere.
+} TRANSPORT_LOG_BUFFER;
+
+/**
+  Gets the shared ring buffer, initializing it on first use.
+
+  @param[out] Size    The size of the data following the header.
+
+  @retval   The ring buffer, or NULL if the platform did not reserve one.
+**/
+STATIC
+TRANSPORT_LOG_BUFFER *
+GetLogBuffer (
+  OUT UINT32  *Size
+  )
+{
+  TRANSPORT_LOG_BUFFER  *Log;
+
+  Log   = (TRANSPORT_LOG_BUFFER *)(UINTN)PcdGet64 (PcdTransportLogBufferAddress);
+  *Size = PcdGet32 (PcdTransportLogBufferSize);
+  if ((Log == NULL) || (*Size <= sizeof (TRANSPORT_LOG_BUFFER))) {
+    return NULL;
+  }
+
+  *Size -= sizeof (TRANSPORT_LOG_BUFFER);
+  if ((Log->Signature != TRANSPORT_LOG_SIGNATURE) || (Log->Size != *Size)) {
+    ZeroMem (Log, sizeof (TRANSPORT_LOG_BUFFER));
+    Log->Size      = *Size;
+    Log->Signature = TRANSPORT_LOG_SIGNATURE;
+  }
+
+  return Log;
+}
+
+/**
+  Gets the number of bytes in the ring buffer. If the buffer claims to hold
+  more than fits, the oldest bytes are counted as lost. Called with the lock
+  held.
+
+  @param[in]  Log     The ring buffer.
+  @param[in]  Size    The size of the data following the header.
+
+  @retval   The number of bytes in the ring buffer.
+**/
+STATIC
+UINT32
+GetUsedSize (
+  IN TRANSPORT_LOG_BUFFER  *Log,
+  IN UINT32                Size
+  )
+{
+  UINT32  Used;
+
+  Used = Log->Head - Log->Tail;
+  if (Used > Size) {
+    Log->Lost += Used - Size;
+    Log->Tail  = Log->Head - Size;
+    Used       = Size;
+  }
+
+  return Used;
+}
+
+/**
+  Tries to take the ring buffer lock. This never waits, a processor halted by
+  the debugger while holding the lock must not hang the others.
+
+  @param[in]  Log   The ring buffer.
+
+  @retval   TRUE    The lock was taken.
+  @retval   FALSE   The lock is held by another processor.
+**/
+STATIC
+BOOLEAN
+TryLock (
+  IN TRANSPORT_LOG_BUFFER  *Log
+  )
+{
+  return InterlockedCompareExchange32 (&Log->Lock, 0, 1) == 0;
+}
+
+/**
+  Releases the ring buffer lock.
+
+  @param[in]  Log   The ring buffer.
+
+**/
+STATIC
+VOID
+Unlock (
+  IN TRANSPORT_LOG_BUFFER  *Log
+  )
+{
+  InterlockedCompareExchange32 (&Log->Lock, 1, 0);
+}
+
+/**
+  Writes the captured output to the serial port.
+
+**/
+STATIC
+VOID
+FlushLogBuffer (
+  VOID
+  )
+{
+  UINT8  Buffer[128];
+  UINTN  Length;
+
+  while ((Length = TransportLogRead (&Buffer[0], sizeof (Buffer))) != 0) {
+    SerialPortWrite (&Buffer[0], Length);
+  }
+}
+
+/**
+  Suspends any logging occurring on the debug transport. Log output is captured
+  until logging is resumed.
+
+**/
+VOID
+TransportLogSuspend (
+  VOID
+  )
+{
+  TRANSPORT_LOG_BUFFER  *Log;
+  UINT32                Size;
+
+  Log = GetLogBuffer (&Size);
+  if (Log != NULL) {
+    Log->Suspended = TRUE;
+  }
+}
+
+/**
+  Resumes logging on the debug transport. Output captured while suspended that
+  the debugger did not read is written first.
+
+**/
+VOID
+TransportLogResume (
+  VOID
+  )
+{
+  TRANSPORT_LOG_BUFFER  *Log;
+  UINT32                Size;
+
+  Log = GetLogBuffer (&Size);
+  if (Log == NULL) {
+    return;
+  }
+
+  // Flush again after resuming to catch output that raced the resume.
+  FlushLogBuffer ();
+  Log->Suspended = FALSE;
+  FlushLogBuffer ();
+}
+
+/**
+  Called by the platform log writer before writing log output to the debug
+  transport. While logging is suspended, the output is captured to be forwarded
+  later instead of being written. Output that does not fit is dropped and
+  counted, the writer is never blocked.
+
+  @param[in]  Buffer          The log output.
+  @param[in]  NumberOfBytes   The number of bytes of log output.
+
+  @retval   TRUE    The output was captured and must not be written.
+  @retval   FALSE   Logging is not suspended, the output should be written.
+**/
+BOOLEAN
+TransportLogCapture (
+  IN CONST UINT8  *Buffer,
+  IN UINTN        NumberOfBytes
+  )
+{
+  TRANSPORT_LOG_BUFFER  *Log;
+  UINT8                 *Data;
+  UINT32                Size;
+  UINTN                 Length;
+  UINTN                 Offset;
+  UINTN                 Chunk;
+
+  Log = GetLogBuffer (&Size);
+  if ((Log == NULL) || !Log->Suspended) {
+    return FALSE;
+  }
+
+  if (!TryLock (Log)) {
+    InterlockedIncrement (&Log->LostWrites);
+    return TRUE;
+  }
+
+  Data   = (UINT8 *)(Log + 1);
+  Length = MIN (NumberOfBytes, Size - GetUsedSize (Log, Size));
+  Offset = Log->Head % Size;
+  Chunk  = MIN (Length, Size - Offset);
+  CopyMem (&Data[Offset], Buffer, Chunk);
+  CopyMem (&Data[0], Buffer + Chunk, Length - Chunk);
+  Log->Head += (UINT32)Length;
+  Log->Lost += (UINT32)(NumberOfBytes - Length);
+
+  Unlock (Log);
+  return TRUE;
+}
+
+/**
+  Reads the log output captured while logging was suspended. Once the captured
+  output is read, a note of the number of bytes dropped is returned, if any.
+
+  @param[out] Buffer      The buffer to read the output to.
+  @param[in]  BufferSize  The size of the buffer.
+
+  @retval   The number of bytes read, 0 if no output is pending.
+**/
+UINTN
+TransportLogRead (
+  OUT UINT8  *Buffer,
+  IN  UINTN  BufferSize
+  )
+{
+  TRANSPORT_LOG_BUFFER  *Log;
+  UINT8                 *Data;
+  UINT32                Size;
+  UINT32                LostWrites;
+  UINT32                Current;
+  UINTN                 Length;
+  UINTN                 Offset;
+  UINTN                 Chunk;
+  CHAR8                 Note[64];
+
+  Log = GetLogBuffer (&Size);
+  if ((Log == NULL) || !TryLock (Log)) {
+    return 0;
+  }
+
+  Data   = (UINT8 *)(Log + 1);
+  Length = MIN (BufferSize, GetUsedSize (Log, Size));
+  if (Length != 0) {
+    Offset = Log->Tail % Size;
+    Chunk  = MIN (Length, Size - Offset);
+    CopyMem (Buffer, &Data[Offset], Chunk);
+    CopyMem (Buffer + Chunk, &Data[0], Length - Chunk);
+    Log->Tail += (UINT32)Length;
+  } else if ((Log->Lost != 0) || (Log->LostWrites != 0)) {
+    LostWrites = Log->LostWrites;
+    Length     = AsciiSPrint (
+                   &Note[0],
+                   sizeof (Note),
+                   "\n[%d log bytes and %d log writes lost]\n",
+                   Log->Lost,
+                   LostWrites
+                   );
+    if (Length <= BufferSize) {
+      CopyMem (Buffer, &Note[0], Length);
+      Log->Lost = 0;
+
+      // Writes dropped since are reported next time.
+      do {
+        Current = Log->LostWrites;
+      } while (InterlockedCompareExchange32 (&Log->LostWrites, Current, Current - LostWrites) != Current);
+    } else {
+      Length = 0;
+    }
+  }
+
+  Unlock (Log);
+  return Length;
+}
@@ -0,0 +1,272 @@
+#!/usr/bin/python3
+'''
+Copyright (c) Microsoft Corporation.
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+Host side demultiplexer for DebugTransportMuxLib.
+
+The target sends the debugger and log output over one serial port in frames
+tagged with a channel, see DebugTransportMux.h. This script splits the frames
+back out: the debugger channel is served as a normal GDB remote endpoint on a
+TCP port, and the log channel is written to the console, a file or a second
+TCP port. Bytes outside a valid frame are treated as log output.
+
+Example usage:
+python3 debug_mux.py --serial COM5 --baud 115200 --port 5555 --log-file boot.log
+python3 debug_mux.py --tcp localhost:4444 --port 5555 --log-port 5556
+
+Then connect with 'target remote localhost:5555' in gdb, or point the Windbg
+EXDI GDB server at the port.
+'''
+
+import argparse
+import os
+import socket
+import sys
+import threading
+
+# Must match DebugTransportMux.h
+MUX_FRAME_SYNC = 0xC5
+MUX_CHANNEL_DEBUG = 0
+MUX_CHANNEL_LOG = 1
+MUX_MAX_PAYLOAD = 0x400
+MUX_HEADER_SIZE = 4
+
+
+class MuxDecoder(object):
+    '''Splits the target output into (channel, data) pieces'''
+
+    def __init__(self):
+        self.buffer = bytearray()
+
+    def feed(self, data):
+        '''Add received bytes, return the complete pieces in order'''
+        self.buffer += data
+        pieces = []
+        log = bytearray()
+        while self.buffer:
+            sync = self.buffer.find(MUX_FRAME_SYNC)
+            if sync < 0:
+                log += self.buffer
+                self.buffer.clear()
+                break
+
+            log += self.buffer[:sync]
+            del self.buffer[:sync]
+            if len(self.buffer) < MUX_HEADER_SIZE:
+                break
+
+            channel = self.buffer[1]
+            length = self.buffer[2] | (self.buffer[3] << 8)
+            if (channel not in (MUX_CHANNEL_DEBUG, MUX_CHANNEL_LOG) or
+                    length > MUX_MAX_PAYLOAD):
+                log.append(self.buffer.pop(0))
+                continue
+
+            end = MUX_HEADER_SIZE + length + 1
+            if len(self.buffer) < end:
+                break
+
+            if (sum(self.buffer[1:end]) & 0xFF) != 0:
+                log.append(self.buffer.pop(0))
+                continue
+
+            if log:
+                pieces.append((MUX_CHANNEL_LOG, bytes(log)))
+                log = bytearray()
+
+            pieces.append((channel, bytes(self.buffer[MUX_HEADER_SIZE:end - 1])))
+            del self.buffer[:end]
+
+        if log:
+            pieces.append((MUX_CHANNEL_LOG, bytes(log)))
+        return pieces
+
+    def flush(self):
+        '''Give up on a partial frame, its sync byte is log output'''
+        pieces = []
+        while self.buffer:
+            # The rest may hold whole frames, such as a stop reply written
+            # while the frame was interrupted.
+            pieces.append((MUX_CHANNEL_LOG, bytes([self.buffer.pop(0)])))
+            pieces += self.feed(b'')
+        return pieces
+
+
+class SerialDevice(object):
+    '''Target connected to a serial port'''
+
+    def __init__(self, port, baud):
+        import serial
+        self.port = serial.Serial(port, baud, timeout=0.1)
+
+    def read(self):
+        return self.port.read(self.port.in_waiting or 1)
+
+    def write(self, data):
+        self.port.write(data)
+
+
+class TcpDevice(object):
+    '''Target serial port exposed over TCP, such as a QEMU serial socket'''
+
+    def __init__(self, address):
+        (host, port) = address.rsplit(':', 1)
+        self.sock = socket.create_connection((host, int(port)))
+        self.sock.settimeout(0.1)
+
+    def read(self):
+        try:
+            data = self.sock.recv(4096)
+        except socket.timeout:
+            return b''
+        if not data:
+            raise EOFError('target connection closed')
+        return data
+
+    def write(self, data):
+        self.sock.sendall(data)
+
+
+class LogSink(object):
+    '''Writes the log channel to the console, a file and TCP clients'''
+
+    def __init__(self, quiet, log_file, log_port):
+        self.console = None if quiet else sys.stdout.buffer
+        self.file = open(log_file, 'ab') if log_file else None
+        self.clients = []
+        self.lock = threading.Lock()
+        if log_port:
+            server = listen(log_port)
+            threading.Thread(target=self.accept, args=(server,),
+                             daemon=True).start()
+
+    def accept(self, server):
+        while True:
+            (client, address) = server.accept()
+            print(f'Log client connected from {address[0]}:{address[1]}',
+                  file=sys.stderr)
+            with self.lock:
+                self.clients.append(client)
+
+    def write(self, data):
+        for output in (self.console, self.file):
+            if output:
+                output.write(data)
+                output.flush()
+
+        with self.lock:
+            for client in list(self.clients):
+                try:
+                    client.sendall(data)
+                except OSError:
+                    self.clients.remove(client)
+
+
+def listen(port):
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(('', port))
+    server.listen(1)
+    return server
+
+
+class Mux(object):
+    '''Connects the target to the GDB client and the log sink'''
+
+    # Reads with no data before a partial frame is given up on.
+    IDLE_READS = 5
+
+    def __init__(self, device, log):
+        self.device = device
+        self.log = log
+        self.decoder = MuxDecoder()
+        self.client = None
+        self.lock = threading.Lock()
+
+    def read_target(self):
+        idle = 0
+        while True:
+            try:
+                data = self.device.read()
+            except (EOFError, OSError) as error:
+                print(f'Target connection lost: {error}', file=sys.stderr)
+                os._exit(1)
+
+            if data:
+                idle = 0
+                pieces = self.decoder.feed(data)
+            else:
+                idle += 1
+                pieces = self.decoder.flush() if idle == self.IDLE_READS else []
+
+            for (channel, payload) in pieces:
+                if channel == MUX_CHANNEL_LOG:
+                    self.log.write(payload)
+                    continue
+
+                with self.lock:
+                    client = self.client
+                if client:
+                    try:
+                        client.sendall(payload)
+                    except OSError:
+                        pass
+
+    def serve(self, port):
+        threading.Thread(target=self.read_target, daemon=True).start()
+        server = listen(port)
+        print(f'Waiting for the debugger on port {port}', file=sys.stderr)
+        while True:
+            (client, address) = server.accept()
+            print(f'Debugger connected from {address[0]}:{address[1]}',
+                  file=sys.stderr)
+            with self.lock:
+                self.client = client
+            while True:
+                try:
+                    data = client.recv(4096)
+                except OSError:
+                    data = b''
+                if not data:
+                    break
+                self.device.write(data)
+
+            with self.lock:
+                self.client = None
+            client.close()
+            print('Debugger disconnected', file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Split the debugger and log channels of a target using '
+                    'DebugTransportMuxLib.')
+    target = parser.add_mutually_exclusive_group(required=True)
+    target.add_argument('-s', '--serial', help='Serial port of the target')
+    target.add_argument('-t', '--tcp', help='HOST:PORT of the target serial port')
+    parser.add_argument('-b', '--baud', type=int, default=115200,
+                        help='Baud rate of the serial port')
+    parser.add_argument('-p', '--port', type=int, default=5555,
+                        help='TCP port for the debugger')
+    parser.add_argument('-l', '--log-port', type=int,
+                        help='TCP port to stream the log to')
+    parser.add_argument('-f', '--log-file', help='File to append the log to')
+    parser.add_argument('-q', '--quiet', action='store_true',
+                        help='Do not print the log to the console')
+    args = parser.parse_args()
+
+    if args.serial:
+        device = SerialDevice(args.serial, args.baud)
+    else:
+        device = TcpDevice(args.tcp)
+
+    log = LogSink(args.quiet, args.log_file, args.log_port)
+    try:
+        Mux(device, log).serve(args.port)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
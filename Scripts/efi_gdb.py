@@ -14,11 +14,16 @@ Commands for debugging EFI. efi <cmd>
 
 List of efi subcommands:
 
+efi backtrace -- Print the backtrace unwound by the UEFI debug agent.
+efi coredump -- Write an ELF core file of the target with the UEFI debug agent.
+efi crash -- Show the crash saved by the UEFI debug agent before gdb connected.
 efi devicepath -- Display an EFI device path.
 efi guid -- Display info about EFI GUID's.
 efi hob -- Dump EFI HOBs. Type 'hob -h' for more info.
+efi profile -- Summarize the UEFI debug agent sampling profile.
 efi symbols -- Load Symbols for EFI. Type 'efi_symbols -h' for more info.
 efi table -- Dump EFI System Tables. Type 'table -h' for more info.
+efi timeline -- Dump the UEFI debug agent boot timeline.
 
 This module is coded against a generic gdb remote serial stub. It should work
 with QEMU, JTAG debugger, or a generic EFI gdb remote serial stub.
@@ -35,7 +40,9 @@ import os
 import sys
 import uuid
 import optparse
+import re
 import shlex
+import struct
 
 # gdb will not import from the same path as this script.
 # so lets fix that for gdb...
@@ -114,6 +121,8 @@ class EfiSymbols:
     stride = None
     range = None
     verbose = False
+    # None until the agent image search monitor command has been tried.
+    agent_search = None
 
     def __init__(self, file=None):
         EfiSymbols.file = file if file else GdbFileObject()
@@ -166,13 +175,63 @@ class EfiSymbols:
             # skip the probe of the remote
             return f'{pecoff} is already loaded'
 
-        pecoff = PeTeImage(cls.file, None)
-        if pecoff.pcToPeCoff(address, cls.stride, cls.range):
+        pecoff = cls.agent_address_to_pecoff(address)
+        if pecoff is None:
+            pecoff = PeTeImage(cls.file, None)
+            if not pecoff.pcToPeCoff(address, cls.stride, cls.range):
+                pecoff = False
+
+        if pecoff:
             res = cls.add_symbols_for_pecoff(pecoff)
             return f'{res}{pecoff}'
         else:
             return f'0x{address:08x} not in a PE/COFF (or TE) image'
 
+    @ classmethod
+    def agent_address_to_pecoff(cls, address):
+        '''
+        Ask the UEFI debug agent to do the backward header search so it does
+        not take a remote memory read per step. Returns the PeTeImage, False
+        if the agent found no image, or None if the agent can not be used.
+        '''
+        if cls.agent_search is False:
+            return None
+
+        step = cls.stride if cls.stride is not None else 0x1000
+        max_range = cls.range if cls.range is not None else 0x200000
+        if address in range(0xFE800000, 0xFFFFFFFF):
+            # The XIP code in the ROM ends up 4 byte aligned.
+            step = 4
+            max_range = min(max_range, 0x100000)
+
+        try:
+            res = gdb.execute(f'monitor f{address:x},{step:x},{max_range:x}',
+                              False, True)
+        except gdb.error:
+            cls.agent_search = False
+            return None
+
+        base = re.search(r'ImageBase: 0x([0-9a-fA-F]+)', res)
+        if base is None:
+            if 'No image found' in res:
+                cls.agent_search = True
+                return False
+
+            # Not the UEFI debug agent, fall back to searching from the host.
+            cls.agent_search = False
+            return None
+
+        cls.agent_search = True
+        pecoff = PeTeImage(cls.file, int(base.group(1), 16))
+        if pecoff.PeHdr is None and pecoff.TeHdr is None:
+            return None
+
+        pdb = re.search(r'Pdb: (.+?)\s*$', res, re.MULTILINE)
+        if pecoff.CodeViewPdb is None and pdb is not None:
+            pecoff.CodeViewPdb = pdb.group(1)
+
+        return pecoff
+
     @ classmethod
     def address_in_loaded_pecoff(cls, address):
         if not isinstance(address, int):
@@ -581,6 +640,581 @@ class EfiTablesCmd (gdb.Command):
             print(table, '\n')
 
 
+def iter_agent_xfer(name, chunk=0x800):
+    '''Read a qXfer object from the UEFI debug agent one reply at a time'''
+    conn = gdb.selected_inferior().connection
+    if conn is None or not hasattr(conn, 'send_packet'):
+        raise gdb.GdbError('Requires a remote connection and gdb 13 or newer')
+
+    offset = 0
+    while True:
+        reply = conn.send_packet(f'qXfer:{name}:read::{offset:x},{chunk:x}')
+        if isinstance(reply, str):
+            reply = reply.encode('latin-1')
+
+        if reply[:1] not in (b'm', b'l'):
+            raise gdb.GdbError(f'qXfer:{name} read failed: {reply!r}')
+
+        # Remove the binary escaping of '#', '$', '}' and '*'.
+        data = bytearray()
+        escaped = False
+        for byte in reply[1:]:
+            if escaped:
+                data.append(byte ^ 0x20)
+                escaped = False
+            elif byte == ord('}'):
+                escaped = True
+            else:
+                data.append(byte)
+
+        if len(data) != 0:
+            yield bytes(data)
+
+        offset += len(data)
+        if reply[:1] == b'l' or len(data) == 0:
+            return
+
+
+def read_agent_xfer(name, chunk=0x800):
+    '''Read a whole qXfer object from the UEFI debug agent'''
+    return b''.join(iter_agent_xfer(name, chunk))
+
+
+def read_agent_stack():
+    '''
+    Return the (pc, sp) frames unwound by the UEFI debug agent, or None if the
+    agent can not unwind the stack.
+    '''
+    try:
+        data = read_agent_xfer('uefi-stack')
+    except (gdb.error, gdb.GdbError):
+        return None
+
+    # Must match STACK_FRAME in DebugAgent.h
+    return list(struct.iter_unpack('<QQ', data[:len(data) & ~0xf]))
+
+
+class EfiBacktraceCmd (gdb.Command):
+    """Print the backtrace unwound by the UEFI debug agent."""
+
+    def __init__(self):
+        super(EfiBacktraceCmd, self).__init__("efi backtrace",
+                                              gdb.COMMAND_NONE)
+
+    def invoke(self, arg, from_tty):
+        '''gdb command to print the agent backtrace'''
+
+        frames = read_agent_stack()
+        if frames is None:
+            print('The agent did not return a backtrace')
+            return
+
+        for (index, (pc, sp)) in enumerate(frames):
+            name = ''
+            try:
+                block = gdb.block_for_pc(pc if index == 0 else pc - 1)
+                while block is not None and block.function is None:
+                    block = block.superblock
+                if block is not None:
+                    name = str(block.function)
+            except RuntimeError:
+                pass
+
+            print(f'#{index:<3} {pc:#018x} sp={sp:#018x} {name}'.rstrip())
+
+
+class EfiCoreDumpCmd (gdb.Command):
+    """Write an ELF core file of the target with the UEFI debug agent."""
+
+    def __init__(self):
+        super(EfiCoreDumpCmd, self).__init__("efi coredump",
+                                             gdb.COMMAND_NONE,
+                                             gdb.COMPLETE_FILENAME)
+
+    def create_options(self, arg, from_tty):
+        usage = "usage: %prog [options] FILE"
+        description = ("Write the system memory and the registers of the "
+                       "stopped processors to an ELF core file. Zero pages "
+                       "are not transferred. Open the file later with "
+                       "'gdb -c FILE'. The agent scans all memory before it "
+                       "replies, so remotetimeout is raised meanwhile.")
+
+        self.parser = optparse.OptionParser(
+            description=description,
+            prog='efi coredump',
+            usage=usage,
+            add_help_option=False)
+
+        self.parser.add_option(
+            '-t',
+            '--timeout',
+            type="int",
+            dest='timeout',
+            help='Seconds to wait for the agent to prepare the dump',
+            default=600)
+
+        self.parser.add_option(
+            '-h',
+            '--help',
+            action='store_true',
+            dest='help',
+            help='Show help for the command',
+            default=False)
+
+        return self.parser.parse_args(shlex.split(arg))
+
+    def invoke(self, arg, from_tty):
+        '''gdb command to write a core file'''
+
+        try:
+            (options, args) = self.create_options(arg, from_tty)
+            if options.help or len(args) != 1:
+                self.parser.print_help()
+                return
+        except ValueError:
+            print('bad arguments!')
+            return
+
+        # The agent collects the memory segments for this stop in one reply,
+        # which takes longer than the usual remote timeout on large systems.
+        timeout = gdb.parameter('remotetimeout')
+        gdb.execute(f'set remotetimeout {max(options.timeout, timeout)}')
+        try:
+            print(gdb.execute('monitor d', False, True), end='')
+        finally:
+            gdb.execute(f'set remotetimeout {timeout}')
+
+        size = 0
+        with open(args[0], 'wb') as core:
+            for data in iter_agent_xfer('uefi-core', 0xffe):
+                core.write(data)
+                size += len(data)
+                if from_tty and (size >> 24) != ((size - len(data)) >> 24):
+                    print(f'{size >> 20} MiB', end='\r', flush=True)
+
+        print(f'Wrote {size:#x} bytes to {args[0]}')
+
+
+class EfiCrashCmd (gdb.Command):
+    """Show the crash saved by the UEFI debug agent before gdb connected."""
+
+    # Must match CRASH_DUMP_HEADER, CRASH_PROCESSOR and CRASH_IMAGE in DebugAgent.h
+    HEADER_FORMAT = '<QIIHBBIQIIQQQIIII'
+    PROCESSOR_FORMAT = '<IIQII'
+    FRAME_COUNT = 16
+    IMAGE_FORMAT = '<QQ48s'
+    SIGNATURE = 0x4853415243474244  # 'DBGCRASH'
+    VERSION = 1
+    EXCEPTIONS = ['DebugStep', 'Breakpoint', 'GenericFault', 'InvalidOp',
+                  'Alignment', 'AccessViolation', 'Watchpoint']
+    # SIGSEGV, SIGILL and SIGBUS for the faults, SIGTRAP otherwise.
+    SIGNALS = {2: 11, 3: 4, 4: 7, 5: 11}
+
+    def __init__(self):
+        super(EfiCrashCmd, self).__init__("efi crash",
+                                          gdb.COMMAND_NONE,
+                                          gdb.COMPLETE_FILENAME)
+
+    def create_options(self, arg, from_tty):
+        usage = "usage: %prog [options] [FILE]"
+        description = ("Show the fault saved by the agent while no debugger "
+                       "was connected, with the backtrace of the faulting "
+                       "processor. If FILE is given, also write an ELF core "
+                       "file with the registers of each processor and the "
+                       "saved top of their stacks.")
+
+        self.parser = optparse.OptionParser(
+            description=description,
+            prog='efi crash',
+            usage=usage,
+            add_help_option=False)
+
+        self.parser.add_option(
+            '-h',
+            '--help',
+            action='store_true',
+            dest='help',
+            help='Show help for the command',
+            default=False)
+
+        return self.parser.parse_args(shlex.split(arg))
+
+    def parse(self, data):
+        '''Split the crash dump into the header, processors and images'''
+        (signature, version, _, machine, _, truncated, register_count, time,
+         exception, is_write, code, address, fault, processor_count,
+         image_count, stack_size, _) = struct.unpack_from(self.HEADER_FORMAT,
+                                                          data)
+        if signature != self.SIGNATURE:
+            raise ValueError('invalid crash dump signature')
+        if version != self.VERSION:
+            raise ValueError(f'unsupported crash dump version {version}')
+
+        offset = struct.calcsize(self.HEADER_FORMAT)
+        processors = []
+        for _ in range(processor_count):
+            (thread, frame_count, sp, stack_length, _) = struct.unpack_from(
+                self.PROCESSOR_FORMAT, data, offset)
+            offset += struct.calcsize(self.PROCESSOR_FORMAT)
+            frames = struct.unpack_from(f'<{self.FRAME_COUNT * 2}Q', data,
+                                        offset)
+            frames = list(zip(frames[0::2], frames[1::2]))[:frame_count]
+            offset += self.FRAME_COUNT * 16
+            stack = data[offset:offset + min(stack_length, stack_size)]
+            offset += stack_size
+            registers = struct.unpack_from(f'<{register_count}Q', data, offset)
+            offset += register_count * 8
+            processors.append((thread, sp, frames, stack, registers))
+
+        images = []
+        for _ in range(image_count):
+            (base, size, name) = struct.unpack_from(self.IMAGE_FORMAT, data,
+                                                    offset)
+            offset += struct.calcsize(self.IMAGE_FORMAT)
+            images.append((base, size, name.split(b'\0')[0].decode()))
+
+        crash = {'machine': machine, 'truncated': truncated, 'time': time,
+                 'exception': exception, 'code': code, 'address': address,
+                 'fault': fault, 'write': is_write}
+        return (crash, processors, images)
+
+    def symbolize(self, pc, images):
+        for (base, size, name) in images:
+            if base <= pc < base + size:
+                return f'{name}+{pc - base:#x}'
+        return ''
+
+    def write_core(self, path, crash, processors):
+        '''Write an ELF core file laid out like the one from efi coredump'''
+        signal = self.SIGNALS.get(crash['exception'], 5)
+        notes = b''
+        for index, (thread, _, _, _, registers) in enumerate(processors):
+            # The start of the Linux elf_prstatus, then the registers and the
+            # FP registers valid flag.
+            current = signal if index == 0 else 0
+            status = struct.pack('<3IHHQQ4I64x', current, 0, 0, current, 0,
+                                 0, 0, thread, 0, 0, 0)
+            desc = status + struct.pack(f'<{len(registers) + 1}Q',
+                                        *registers, 0)
+            notes += struct.pack('<III', 5, len(desc), 1) + b'CORE\0\0\0\0'
+            notes += desc
+
+        loads = [(sp, stack) for (_, sp, _, stack, _) in processors if stack]
+        offset = 64 + 56 * (len(loads) + 1)
+        headers = struct.pack('<IIQQQQQQ', 4, 0, offset, 0, 0, len(notes),
+                              0, 4)
+        offset += len(notes)
+        for (sp, stack) in loads:
+            headers += struct.pack('<IIQQQQQQ', 1, 7, offset, sp, sp,
+                                   len(stack), len(stack), 1)
+            offset += len(stack)
+
+        elf = b'\x7fELF' + bytes([2, 1, 1]) + bytes(9)
+        elf += struct.pack('<HHIQQQIHHHHHH', 4, crash['machine'], 1, 0, 64, 0,
+                           0, 64, 56, len(loads) + 1, 0, 0, 0)
+        with open(path, 'wb') as core:
+            core.write(elf + headers + notes)
+            for (_, stack) in loads:
+                core.write(stack)
+
+    def invoke(self, arg, from_tty):
+        '''gdb command to show the saved crash'''
+
+        try:
+            (options, args) = self.create_options(arg, from_tty)
+            if options.help or len(args) > 1:
+                self.parser.print_help()
+                return
+        except ValueError:
+            print('bad arguments!')
+            return
+
+        try:
+            (crash, processors, images) = self.parse(
+                read_agent_xfer('uefi-crash'))
+        except (gdb.error, ValueError, struct.error) as error:
+            print(f'No crash dump: {error}')
+            return
+
+        exception = crash['exception']
+        name = (self.EXCEPTIONS[exception]
+                if exception < len(self.EXCEPTIONS) else 'Unknown')
+        print(f"{name} at {crash['address']:#x}, code {crash['code']:#x}, "
+              f"{'write to' if crash['write'] else 'read from'} "
+              f"{crash['fault']:#x}, {crash['time'] / 1000000:.3f}s into boot")
+        if crash['truncated']:
+            print('The crash dump buffer was too small, some data is missing.')
+
+        for (thread, _, frames, _, _) in processors:
+            print(f'Thread {thread}:')
+            for index, (pc, sp) in enumerate(frames):
+                print(f'  #{index:<2} {pc:#018x} sp {sp:#018x} '
+                      f'{self.symbolize(pc, images)}')
+
+        if args:
+            self.write_core(args[0], crash, processors)
+            print(f"Wrote {args[0]}, open it with 'gdb -c {args[0]}'")
+
+
+class EfiTimelineCmd (gdb.Command):
+    """Dump the UEFI debug agent boot timeline. Type 'efi timeline -h' for more info."""
+
+    # Must match TIMELINE_EVENT in DebugAgent.h
+    EVENT_FORMAT = '<QQIHH'
+    EVENT_TYPES = {1: 'ImageLoad', 2: 'ProtocolNotify', 3: 'Exception',
+                   4: 'Resume', 5: 'ExitBootServices'}
+    PROTOCOLS = {1: 'CpuArch', 2: 'TimerArch', 3: 'MemoryAttribute', 4: 'MpServices'}
+    EXCEPTIONS = ['DebugStep', 'Breakpoint', 'GenericFault', 'InvalidOp',
+                  'Alignment', 'AccessViolation', 'Watchpoint']
+
+    def __init__(self):
+        super(EfiTimelineCmd, self).__init__("efi timeline", gdb.COMMAND_NONE)
+        self.names = {}
+
+    def create_options(self, arg, from_tty):
+        usage = "usage: %prog [options]"
+        description = ("Dump the boot timeline recorded by the UEFI debug "
+                       "agent with the time since the previous event")
+
+        self.parser = optparse.OptionParser(
+            description=description,
+            prog='efi timeline',
+            usage=usage,
+            add_help_option=False)
+
+        self.parser.add_option(
+            '-n',
+            '--no-names',
+            action='store_true',
+            dest='no_names',
+            help='Do not ask the agent for the names of loaded images',
+            default=False)
+
+        self.parser.add_option(
+            '-h',
+            '--help',
+            action='store_true',
+            dest='help',
+            help='Show help for the command',
+            default=False)
+
+        return self.parser.parse_args(shlex.split(arg))
+
+    def image_name(self, base):
+        '''Ask the agent for the PDB name of the image at base'''
+        if base not in self.names:
+            name = ''
+            try:
+                res = gdb.execute(f'monitor f{base:x}', False, True)
+                pdb = re.search(r'Pdb: (.+?)\s*$', res, re.MULTILINE)
+                if pdb is not None:
+                    name = re.split(r'[\\/]', pdb.group(1))[-1]
+            except gdb.error:
+                pass
+            self.names[base] = name
+
+        return self.names[base]
+
+    def describe(self, event_type, info, data, names):
+        if event_type == 1:
+            name = self.image_name(data) if names else ''
+            return f'{data:#x} {name}'
+        if event_type == 2:
+            return self.PROTOCOLS.get(info, str(info))
+        if event_type == 3:
+            kind = (self.EXCEPTIONS[info] if info < len(self.EXCEPTIONS)
+                    else str(info))
+            return f'{kind} at {data:#x}'
+        return ''
+
+    def invoke(self, arg, from_tty):
+        '''gdb command to dump the boot timeline'''
+
+        try:
+            (options, _) = self.create_options(arg, from_tty)
+            if options.help:
+                self.parser.print_help()
+                return
+        except ValueError:
+            print('bad arguments!')
+            return
+
+        data = read_agent_xfer('uefi-timeline')
+        size = struct.calcsize(self.EVENT_FORMAT)
+        previous = None
+        print(f'{"Time (ms)":>12} {"Delta (ms)":>12}  Event')
+        for offset in range(0, len(data) - size + 1, size):
+            (time, value, sequence, event_type, info) = struct.unpack_from(
+                self.EVENT_FORMAT, data, offset)
+            if previous is None and sequence != 0:
+                print(f'{sequence} earlier events were dropped or cleared')
+
+            delta = 0 if previous is None else time - previous
+            previous = time
+            name = self.EVENT_TYPES.get(event_type, str(event_type))
+            detail = self.describe(event_type, info, value,
+                                   not options.no_names)
+            print(f'{time / 1000:12.3f} {delta / 1000:12.3f}  {name} {detail}'.rstrip())
+
+
+class EfiProfileCmd (gdb.Command):
+    """Summarize the UEFI debug agent sampling profile. Type 'efi profile -h' for more info."""
+
+    # Must match PROFILE_HEADER in DebugAgent.h
+    HEADER_FORMAT = '<IIII'
+
+    def __init__(self):
+        super(EfiProfileCmd, self).__init__("efi profile", gdb.COMMAND_NONE)
+        self.images = []
+
+    def create_options(self, arg, from_tty):
+        usage = "usage: %prog [options]"
+        description = ("Download the samples recorded by the UEFI debug agent "
+                       "profiler and show where the time was spent by image, "
+                       "and by function or call stack if symbols are loaded")
+
+        self.parser = optparse.OptionParser(
+            description=description,
+            prog='efi profile',
+            usage=usage,
+            add_help_option=False)
+
+        self.parser.add_option(
+            '-f',
+            '--functions',
+            action='store_true',
+            dest='functions',
+            help='Show the top functions',
+            default=False)
+
+        self.parser.add_option(
+            '-s',
+            '--stacks',
+            action='store_true',
+            dest='stacks',
+            help='Show the top call stacks',
+            default=False)
+
+        self.parser.add_option(
+            '-t',
+            '--top',
+            type="int",
+            dest='top',
+            help='Number of entries to show in each table',
+            default=20)
+
+        self.parser.add_option(
+            '-h',
+            '--help',
+            action='store_true',
+            dest='help',
+            help='Show help for the command',
+            default=False)
+
+        return self.parser.parse_args(shlex.split(arg))
+
+    def find_image(self, pc):
+        '''Return the (base, size, name) of the image containing pc'''
+        for image in self.images:
+            if image[0] <= pc < image[0] + image[1]:
+                return image
+
+        image = None
+        try:
+            res = gdb.execute(f'monitor f{pc:x}', False, True)
+            base = re.search(r'ImageBase: (0x[0-9a-fA-F]+)', res)
+            size = re.search(r'ImageSize: (0x[0-9a-fA-F]+)', res)
+            pdb = re.search(r'Pdb: (.*?)\s*$', res, re.MULTILINE)
+            if base is not None and size is not None:
+                name = re.split(r'[\\/]', pdb.group(1))[-1] if pdb else ''
+                image = (int(base.group(1), 16), int(size.group(1), 16),
+                         name or f'{int(base.group(1), 16):#x}')
+        except gdb.error:
+            pass
+
+        if image is None:
+            # Cache the page so unknown addresses are not looked up again.
+            image = (pc & ~0xfff, 0x1000, '<unknown>')
+
+        self.images.append(image)
+        return image
+
+    def symbolize(self, pc):
+        '''Return a function name for pc, or the image offset if no symbols'''
+        try:
+            block = gdb.block_for_pc(pc)
+            while block is not None and block.function is None:
+                block = block.superblock
+            if block is not None:
+                return str(block.function)
+        except RuntimeError:
+            pass
+
+        (base, _, name) = self.find_image(pc)
+        return f'{name}+{pc - base:#x}'
+
+    def print_table(self, title, counts, total, top):
+        print(f'\n{"Samples":>8} {"%":>6}  {title}')
+        ranked = sorted(counts.items(), key=lambda item: item[1], reverse=True)
+        for (key, count) in ranked[:top]:
+            print(f'{count:8} {100.0 * count / total:6.2f}  {key}')
+
+    def invoke(self, arg, from_tty):
+        '''gdb command to summarize the sampling profile'''
+
+        try:
+            (options, _) = self.create_options(arg, from_tty)
+            if options.help:
+                self.parser.print_help()
+                return
+        except ValueError:
+            print('bad arguments!')
+            return
+
+        data = read_agent_xfer('uefi-profile')
+        header_size = struct.calcsize(self.HEADER_FORMAT)
+        if len(data) < header_size:
+            print('No profile returned by the agent')
+            return
+
+        (depth, interval, count, missed) = struct.unpack_from(
+            self.HEADER_FORMAT, data, 0)
+        sample_format = f'<{depth}Q'
+        sample_size = struct.calcsize(sample_format)
+        samples = [struct.unpack_from(sample_format, data, offset)
+                   for offset in range(header_size,
+                                       len(data) - sample_size + 1,
+                                       sample_size)]
+
+        print(f'{len(samples)} samples every {interval} us, '
+              f'{missed} missed')
+        if len(samples) == 0:
+            return
+
+        # Image lookups are cached, so images are found with few round trips.
+        self.images = []
+        by_image = {}
+        for sample in samples:
+            name = self.find_image(sample[0])[2]
+            by_image[name] = by_image.get(name, 0) + 1
+        self.print_table('Image', by_image, len(samples), options.top)
+
+        if options.functions:
+            by_function = {}
+            for sample in samples:
+                name = self.symbolize(sample[0])
+                by_function[name] = by_function.get(name, 0) + 1
+            self.print_table('Function', by_function, len(samples),
+                             options.top)
+
+        if options.stacks:
+            by_stack = {}
+            for sample in samples:
+                stack = ' <- '.join(self.symbolize(pc) for pc in sample if pc)
+                by_stack[stack] = by_stack.get(stack, 0) + 1
+            self.print_table('Stack', by_stack, len(samples), options.top)
+
+
 class EfiSymbolsCmd (gdb.Command):
     """Load Symbols for EFI. Type 'efi symbols -h' for more info."""
 
@@ -784,6 +1418,11 @@ class EfiSymbolsCmd (gdb.Command):
             res = self.efi_symbols.address_to_symbols(address)
             print(res)
         else:
+            # The agent can unwind the whole stack in one packet, load those
+            # frames first so gdb does not unwind without symbols.
+            for (pc, _) in read_agent_stack() or []:
+                if self.canonical_address(pc):
+                    print(self.efi_symbols.address_to_symbols(pc))
 
             for thread in thread_list:
                 thread.switch()
@@ -900,6 +1539,11 @@ EfiTablesCmd()
 EfiHobCmd()
 EfiDevicePathCmd()
 EfiGuidCmd()
+EfiTimelineCmd()
+EfiProfileCmd()
+EfiBacktraceCmd()
+EfiCoreDumpCmd()
+EfiCrashCmd()
 
 #
 bp = LoadEmulatorEfiSymbols('SecGdbScriptBreak', internal=True)
@@ -0,0 +1,616 @@
+#!/usr/bin/python3
+'''
+Copyright (c) Microsoft Corporation.
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+Caching GDB remote protocol proxy for slow debug links.
+
+The proxy sits between gdb or Windbg and the target. While the target is
+stopped, register and query replies are cached, so repeated reads do not go
+over the link again. Like the gdb data cache, only stack and code memory is
+cached: the stack above the stack pointer and the code around the program
+counter of the selected thread. A read there that misses the cache reads the
+aligned blocks around it, so the adjacent reads that follow are served from
+the cache. Adjacent missing blocks are coalesced into one read, and the reads
+are pipelined to the target without waiting for each reply. Other memory,
+which may be MMIO, is read exactly as requested and never cached.
+
+The cache is dropped when the target resumes, steps, or when any request that
+may change the target state is sent. Memory writes only drop the blocks and
+memory searches they overlap.
+
+Example usage:
+python3 gdb_cache_proxy.py --serial COM5 --baud 115200 --port 5555
+python3 gdb_cache_proxy.py --tcp localhost:5556 --port 5555 --pipeline 4
+python3 gdb_cache_proxy.py --tcp localhost:5556 --widen all --uncached 0xfe000000-0xffffffff
+
+Then connect with 'target remote localhost:5555' in gdb, or point the Windbg
+EXDI GDB server at the port.
+'''
+
+import argparse
+import queue
+import re
+import socket
+import sys
+import threading
+
+# Requests that leave the target running. The reply comes when it stops.
+RESUME_PATTERN = re.compile(rb'^(c|C|s|S|k|r|R|vCont;)')
+
+# Requests without side effects. Their replies can be cached until the next
+# request that may change the target state.
+QUERY_PATTERN = re.compile(rb'^(\?|qXfer:[^:]+:read:|qf|qs|qC|qSupported|'
+                           rb'qAttached|qOffsets|qSearch:memory:|vCont\?|T)')
+
+# Largest memory read in one request. The agent replies with up to 4 KB of hex.
+MAX_READ = 0x7F0
+
+# Largest block read around a cache miss.
+MAX_BLOCK = 0x400
+
+# Query replies derived from target memory, dropped by any memory write.
+MEMORY_QUERY_PATTERN = re.compile(rb'^qXfer:uefi-(stack|core|crash):read:')
+
+# Stack pointer and program counter numbers in the 'g' reply, by the
+# architecture of the target description. Both are 64-bit registers following
+# 64-bit registers only.
+ARCH_REGISTERS = {
+    'i386:x86-64': (7, 16),
+    'aarch64': (31, 32),
+}
+
+# Memory cached around the stack pointer, frames are above it.
+STACK_BELOW = 0x1000
+STACK_ABOVE = 0x10000
+
+# Memory cached around the program counter.
+CODE_WINDOW = 0x10000
+
+
+def checksum(payload):
+    return sum(payload) & 0xFF
+
+
+def frame(payload):
+    return b'$' + payload + b'#%02x' % checksum(payload)
+
+
+def is_console_output(payload):
+    ''''O' packets are console output sent ahead of the real reply'''
+    return payload.startswith(b'O') and payload != b'OK'
+
+
+def is_stop_reply(payload):
+    return payload[:1] in (b'S', b'T', b'W', b'X')
+
+
+class PacketReader(object):
+    '''Splits a byte stream into packets, acks and interrupts'''
+
+    def __init__(self):
+        self.buffer = bytearray()
+
+    def feed(self, data):
+        '''Return a list of ('packet', payload), ('bad', None), ('ack', b'+')
+        ('nak', b'-') and ('interrupt', None) events'''
+        self.buffer += data
+        events = []
+        while self.buffer:
+            byte = self.buffer[0]
+            if byte == ord('$'):
+                end = self.buffer.find(b'#')
+                if (end < 0) or (len(self.buffer) < end + 3):
+                    break
+
+                payload = bytes(self.buffer[1:end])
+                try:
+                    valid = int(self.buffer[end + 1:end + 3], 16) == checksum(payload)
+                except ValueError:
+                    valid = False
+
+                events.append(('packet', payload) if valid else ('bad', None))
+                del self.buffer[:end + 3]
+                continue
+
+            if byte == ord('+'):
+                events.append(('ack', None))
+            elif byte == ord('-'):
+                events.append(('nak', None))
+            elif byte == 0x03:
+                events.append(('interrupt', None))
+            del self.buffer[0]
+        return events
+
+
+class SerialDevice(object):
+    '''Target connected to a serial port'''
+
+    def __init__(self, port, baud):
+        import serial
+        self.port = serial.Serial(port, baud, timeout=0.1)
+
+    def read(self):
+        return self.port.read(self.port.in_waiting or 1)
+
+    def write(self, data):
+        self.port.write(data)
+
+
+class SocketDevice(object):
+    '''Target reached over TCP, or any connected socket'''
+
+    def __init__(self, sock):
+        self.sock = sock
+
+    @classmethod
+    def connect(cls, address):
+        (host, port) = address.rsplit(':', 1)
+        return cls(socket.create_connection((host, int(port))))
+
+    def read(self):
+        data = self.sock.recv(4096)
+        if not data:
+            raise EOFError('target connection closed')
+        return data
+
+    def write(self, data):
+        self.sock.sendall(data)
+
+
+class TargetLink(object):
+    '''Sends requests to the target and matches its replies to them'''
+
+    def __init__(self, device):
+        self.device = device
+        self.condition = threading.Condition()
+        # Requests waiting for a reply, in the order the target answers them.
+        self.sent = []
+        # Requests the target has not acknowledged yet, in the order sent.
+        self.unacked = []
+        self.replies = {}
+        # Console output and packets that answer no request, such as stops.
+        self.output = []
+        self.error = None
+        self.tickets = 0
+        self.requests = 0
+        self.round_trips = 0
+        self.bytes_sent = 0
+        self.bytes_received = 0
+        threading.Thread(target=self.read_target, daemon=True).start()
+
+    def read_target(self):
+        reader = PacketReader()
+        while True:
+            try:
+                data = self.device.read()
+            except (EOFError, OSError) as error:
+                with self.condition:
+                    self.error = error
+                    self.condition.notify_all()
+                return
+
+            self.bytes_received += len(data)
+            for (event, payload) in reader.feed(data):
+                with self.condition:
+                    self.handle_event(event, payload)
+                    self.condition.notify_all()
+
+    def handle_event(self, event, payload):
+        if event == 'packet':
+            self.device.write(b'+')
+            if self.sent and not is_console_output(payload):
+                (ticket, _) = self.sent.pop(0)
+                self.replies[ticket] = payload
+            else:
+                self.output.append(payload)
+        elif event == 'bad':
+            # A NAK makes the target resend its latest reply, which is not the
+            # damaged one while pipelined reads are outstanding. Take the reply
+            # and read again instead, the answer then comes last.
+            if self.sent and self.sent[0][1].startswith(b'm'):
+                self.device.write(b'+')
+                request = self.sent.pop(0)
+                self.sent.append(request)
+                self.unacked.append(request)
+                self.device.write(frame(request[1]))
+            else:
+                self.device.write(b'-')
+        elif event == 'ack':
+            if self.unacked:
+                self.unacked.pop(0)
+        elif event == 'nak':
+            # The target dropped the oldest request it had not acknowledged
+            # and goes on with the ones sent after it, so the resent request
+            # is now answered last.
+            if self.unacked:
+                request = self.unacked.pop(0)
+                if request in self.sent:
+                    self.sent.remove(request)
+                    self.sent.append(request)
+                self.unacked.append(request)
+                self.device.write(frame(request[1]))
+
+    def send(self, payload, reply=True):
+        '''Send a request, return the ticket to receive its reply with'''
+        data = frame(payload)
+        with self.condition:
+            # Requests sent while others are still waiting share a round trip.
+            if not self.sent:
+                self.round_trips += 1
+            self.tickets += 1
+            request = (self.tickets, payload)
+            if reply:
+                self.sent.append(request)
+            self.unacked.append(request)
+            self.requests += 1
+            self.bytes_sent += len(data)
+            self.device.write(data)
+        return self.tickets
+
+    def interrupt(self):
+        self.device.write(b'\x03')
+
+    def receive(self, ticket=None, timeout=None):
+        '''Wait for the reply to a request, or for output when the ticket is
+        None. Return the reply, or None, and the output received meanwhile'''
+        with self.condition:
+            ready = self.condition.wait_for(
+                lambda: self.error or self.output or ticket in self.replies, timeout)
+            if self.error:
+                raise self.error
+            output = self.output
+            self.output = []
+            if not ready:
+                raise queue.Empty()
+            return (self.replies.pop(ticket, None), output)
+
+
+class MemoryCache(object):
+    '''Aligned blocks of target memory read since the target stopped'''
+
+    def __init__(self, block_size):
+        self.block_size = block_size
+        self.blocks = {}
+
+    def clear(self):
+        self.blocks.clear()
+
+    def invalidate(self, address, length):
+        start = address - (address % self.block_size)
+        for block in range(start, address + length, self.block_size):
+            self.blocks.pop(block, None)
+
+    def read(self, address, length):
+        '''Return the cached bytes, or None if any of them are missing'''
+        data = b''
+        while len(data) < length:
+            offset = (address + len(data)) % self.block_size
+            block = self.blocks.get(address + len(data) - offset)
+            if block is None or len(block) <= offset:
+                return None
+            data += block[offset:offset + length - len(data)]
+        return data
+
+    def missing_runs(self, address, length):
+        '''Return the (address, length) reads that fill the blocks around the
+        request, coalescing adjacent missing blocks. Blocks are a power of two
+        no larger than a page, so they never reach a page the request does not
+        touch.'''
+        first = address - (address % self.block_size)
+        last = address + length
+        runs = []
+        for block in range(first, last, self.block_size):
+            if block in self.blocks:
+                continue
+            if runs and runs[-1][0] + runs[-1][1] == block and runs[-1][1] + self.block_size <= MAX_READ:
+                runs[-1][1] += self.block_size
+            else:
+                runs.append([block, self.block_size])
+        return [tuple(run) for run in runs]
+
+    def store(self, address, data):
+        for offset in range(0, len(data), self.block_size):
+            block = data[offset:offset + self.block_size]
+            if len(block) == self.block_size:
+                self.blocks[address + offset] = block
+
+
+class CachingProxy(object):
+    '''Serves one debugger client against the target'''
+
+    def __init__(self, link, block_size=0x100, pipeline=1, widen='code-stack', uncached=()):
+        self.link = link
+        self.memory = MemoryCache(block_size)
+        self.pipeline = max(1, pipeline)
+        self.widen = widen
+        self.uncached = list(uncached)
+        self.architecture = None
+        self.registers = {}
+        self.queries = {}
+        self.thread = b''
+        self.running = False
+        self.client = None
+        self.last_reply = b''
+        self.requests = 0
+        self.hits = 0
+
+    def clear(self):
+        self.memory.clear()
+        self.registers.clear()
+        self.queries.clear()
+
+    def reply(self, payload):
+        self.last_reply = payload
+        self.client.sendall(frame(payload))
+
+    def transact(self, payload):
+        '''Forward a request and return its reply'''
+        return self.receive(self.link.send(payload))
+
+    def receive(self, ticket):
+        '''Wait for a reply, passing console output to the client as it
+        arrives'''
+        while True:
+            (reply, output) = self.link.receive(ticket)
+            for packet in output:
+                self.client.sendall(frame(packet))
+            if reply is not None:
+                return reply
+
+    def register(self, number):
+        '''Return a 64-bit register of the selected thread from a cached 'g'
+        reply, or None'''
+        registers = self.registers.get((self.thread, b'g'))
+        if registers is None:
+            return None
+        value = registers[number * 16:(number + 1) * 16]
+        if len(value) != 16:
+            return None
+        try:
+            return int.from_bytes(bytes.fromhex(value.decode()), 'little')
+        except ValueError:
+            return None
+
+    def overlaps_uncached(self, address, length):
+        return any(address < end and start < address + length for (start, end) in self.uncached)
+
+    def may_widen(self, address, length):
+        '''Check if a read may be widened and cached'''
+        if self.widen == 'none' or self.overlaps_uncached(address, length):
+            return False
+        if self.widen == 'all':
+            return True
+
+        numbers = ARCH_REGISTERS.get(self.architecture)
+        if numbers is None:
+            return False
+        (sp, pc) = (self.register(number) for number in numbers)
+        if sp is not None and sp - STACK_BELOW <= address and address + length <= sp + STACK_ABOVE:
+            return True
+        return pc is not None and pc - CODE_WINDOW <= address and address + length <= pc + CODE_WINDOW
+
+    def read_memory(self, address, length):
+        if not self.may_widen(address, length):
+            return self.transact(b'm%x,%x' % (address, length))
+
+        data = self.memory.read(address, length)
+        if data is not None:
+            self.hits += 1
+            return data.hex().encode()
+
+        runs = self.memory.missing_runs(address, length)
+        if any(self.overlaps_uncached(*run) for run in runs):
+            return self.transact(b'm%x,%x' % (address, length))
+
+        # Pipeline the block reads, keeping up to self.pipeline outstanding.
+        pending = []
+        for run in runs:
+            pending.append((run, self.link.send(b'm%x,%x' % run)))
+            if len(pending) >= self.pipeline:
+                (run, ticket) = pending.pop(0)
+                self.store_run(run, self.receive(ticket))
+        for (run, ticket) in pending:
+            self.store_run(run, self.receive(ticket))
+
+        data = self.memory.read(address, length)
+        if data is not None:
+            return data.hex().encode()
+
+        # Part of the blocks could not be read, let the target decide.
+        return self.transact(b'm%x,%x' % (address, length))
+
+    def store_run(self, run, reply):
+        try:
+            data = bytes.fromhex(reply.decode())
+        except ValueError:
+            return
+        self.memory.store(run[0], data)
+
+    def handle(self, payload):
+        self.requests += 1
+        if self.running:
+            # Only an interrupt is expected while running, pass it on.
+            self.link.send(payload, reply=False)
+            return
+
+        command = payload[:1]
+        if command == b'm':
+            (address, length) = (int(value, 16) for value in payload[1:].split(b','))
+            self.reply(self.read_memory(address, length))
+        elif command in (b'g', b'p'):
+            key = (self.thread, payload)
+            if key in self.registers:
+                self.hits += 1
+            else:
+                self.registers[key] = self.transact(payload)
+            self.reply(self.registers[key])
+        elif QUERY_PATTERN.match(payload):
+            if payload in self.queries:
+                self.hits += 1
+            else:
+                self.queries[payload] = self.transact(payload)
+                self.find_architecture(payload, self.queries[payload])
+            self.reply(self.queries[payload])
+        elif payload.startswith(b'Hg'):
+            self.thread = payload[2:]
+            self.reply(self.transact(payload))
+        elif command in (b'M', b'X'):
+            (address, length) = (int(value, 16) for value in re.split(rb'[,:]', payload[1:])[:2])
+            self.memory.invalidate(address, length)
+            self.invalidate_queries(address, length)
+            self.reply(self.transact(payload))
+        elif RESUME_PATTERN.match(payload):
+            self.clear()
+            self.running = True
+            self.link.send(payload, reply=False)
+        else:
+            # Anything else may change the target, such as register writes,
+            # breakpoints and monitor commands.
+            self.clear()
+            self.reply(self.transact(payload))
+
+    def find_architecture(self, payload, reply):
+        '''Take the architecture from the target description'''
+        if payload.startswith(b'qXfer:features:read:'):
+            match = re.search(rb'<architecture>([^<]+)</architecture>', reply)
+            if match:
+                self.architecture = match.group(1).decode()
+
+    def invalidate_queries(self, address, length):
+        '''Drop the query replies a memory write may change'''
+        for payload in list(self.queries):
+            if MEMORY_QUERY_PATTERN.match(payload):
+                del self.queries[payload]
+            elif payload.startswith(b'qSearch:memory:'):
+                try:
+                    (start, size) = (int(value, 16) for value in payload[15:].split(b';')[:2])
+                except ValueError:
+                    del self.queries[payload]
+                    continue
+                if start < address + length and address < start + size:
+                    del self.queries[payload]
+
+    def forward_stop(self):
+        '''Pass the output of the running target to the client until it stops'''
+        try:
+            (_, output) = self.link.receive(timeout=0.05)
+        except queue.Empty:
+            return
+        for reply in output:
+            if is_stop_reply(reply):
+                self.clear()
+                self.running = False
+                self.thread = b''
+                self.last_reply = reply
+            self.client.sendall(frame(reply))
+
+    def serve(self, client):
+        '''Serve a connected client until it disconnects'''
+        self.client = client
+        events = queue.Queue()
+
+        def read_client():
+            reader = PacketReader()
+            while True:
+                try:
+                    data = client.recv(4096)
+                except OSError:
+                    data = b''
+                if not data:
+                    events.put(None)
+                    return
+                for event in reader.feed(data):
+                    events.put(event)
+
+        threading.Thread(target=read_client, daemon=True).start()
+        while True:
+            if self.running:
+                self.forward_stop()
+            try:
+                event = events.get(timeout=0.05 if self.running else None)
+            except queue.Empty:
+                continue
+            if event is None:
+                return
+
+            (kind, payload) = event
+            if kind == 'packet':
+                client.sendall(b'+')
+                self.handle(payload)
+            elif kind == 'bad':
+                client.sendall(b'-')
+            elif kind == 'nak':
+                client.sendall(frame(self.last_reply))
+            elif kind == 'interrupt':
+                self.link.interrupt()
+
+    def stats(self):
+        return (f'{self.requests} requests, {self.hits} served from the cache, '
+                f'{self.link.requests} sent to the target in '
+                f'{self.link.round_trips} round trips')
+
+
+def parse_range(value):
+    '''Parse a START-END range, END exclusive'''
+    (start, end) = (int(part, 0) for part in value.split('-'))
+    if end <= start:
+        raise argparse.ArgumentTypeError(f'empty range {value}')
+    return (start, end)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Cache the target state between gdb and a slow debug link.')
+    target = parser.add_mutually_exclusive_group(required=True)
+    target.add_argument('-s', '--serial', help='Serial port of the target')
+    target.add_argument('-t', '--tcp', help='HOST:PORT of the target')
+    parser.add_argument('-b', '--baud', type=int, default=115200,
+                        help='Baud rate of the serial port')
+    parser.add_argument('-p', '--port', type=int, default=5555,
+                        help='TCP port for the debugger')
+    parser.add_argument('--block', type=lambda value: int(value, 0), default=0x100,
+                        help='Size of the memory blocks read around a miss')
+    parser.add_argument('--widen', choices=('code-stack', 'all', 'none'), default='code-stack',
+                        help='Memory read in blocks around a miss and cached. By default only '
+                             'the stack and the code around the selected thread, like the gdb '
+                             'data cache')
+    parser.add_argument('--uncached', type=parse_range, action='append', default=[],
+                        metavar='START-END', help='Memory that is never cached or widened into, '
+                                                  'such as MMIO. May be given more than once')
+    parser.add_argument('--pipeline', type=int,
+                        help='Requests sent before waiting for a reply. Defaults '
+                             'to 1 on serial ports, where a UART FIFO can not '
+                             'hold a second request, and 4 otherwise')
+    args = parser.parse_args()
+    if (args.block & (args.block - 1)) or not (0 < args.block <= MAX_BLOCK):
+        parser.error(f'--block must be a power of two up to {MAX_BLOCK:#x}')
+
+    if args.serial:
+        link = TargetLink(SerialDevice(args.serial, args.baud))
+    else:
+        link = TargetLink(SocketDevice.connect(args.tcp))
+
+    pipeline = args.pipeline or (1 if args.serial else 4)
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(('', args.port))
+    server.listen(1)
+    print(f'Waiting for the debugger on port {args.port}', file=sys.stderr)
+    try:
+        while True:
+            (client, address) = server.accept()
+            print(f'Debugger connected from {address[0]}:{address[1]}', file=sys.stderr)
+            proxy = CachingProxy(link, args.block, pipeline, args.widen, args.uncached)
+            try:
+                proxy.serve(client)
+            except (EOFError, OSError) as error:
+                print(f'Connection lost: {error}', file=sys.stderr)
+            client.close()
+            print(f'Debugger disconnected. {proxy.stats()}', file=sys.stderr)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
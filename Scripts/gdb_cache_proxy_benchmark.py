@@ -0,0 +1,287 @@
+#!/usr/bin/python3
+'''
+Copyright (c) Microsoft Corporation.
+SPDX-License-Identifier: BSD-2-Clause-Patent
+
+Benchmark and self check for gdb_cache_proxy.py.
+
+A scripted fake target answers the GDB remote requests the UEFI debug agent
+supports. The same gdb-like session, stopping several times and reading the
+registers, stack and code around each stop, is run against one fake target
+directly and against another through the proxy. The replies must match, and
+the round trips and estimated link time of both runs are reported. The fake
+targets can also drop requests as if they were corrupted on the link, to check
+that the proxy resends them.
+
+Example usage:
+python3 gdb_cache_proxy_benchmark.py --stops 20 --baud 115200 --pipeline 4
+python3 gdb_cache_proxy_benchmark.py --pipeline 4 --drop-every 7
+'''
+
+import argparse
+import re
+import socket
+import sys
+import threading
+
+from gdb_cache_proxy import (CachingProxy, PacketReader, SocketDevice,
+                             TargetLink, frame, is_console_output)
+
+
+class FakeTarget(object):
+    '''Scripted target with memory, registers and two threads'''
+
+    MEMORY_BASE = 0x100000
+    MEMORY_SIZE = 0x40000
+    REGISTER_COUNT = 24
+
+    def __init__(self, sock, drop_every=0):
+        self.sock = sock
+        self.drop_every = drop_every
+        self.packets = 0
+        self.memory = bytearray((index * 7 + 3) & 0xFF for index in range(self.MEMORY_SIZE))
+        self.registers = {thread: [thread << 32 | index for index in range(self.REGISTER_COUNT)]
+                          for thread in (1, 2)}
+        self.thread = 1
+        self.pc = self.MEMORY_BASE + 0x1000
+        self.sp = self.MEMORY_BASE + 0x8000
+        self.requests = 0
+        self.bytes = 0
+        threading.Thread(target=self.run, daemon=True).start()
+
+    def send(self, payload):
+        data = frame(payload)
+        self.bytes += len(data)
+        self.sock.sendall(data)
+
+    def read(self, address, length):
+        offset = address - self.MEMORY_BASE
+        if offset < 0 or offset + length > self.MEMORY_SIZE:
+            return None
+        return self.memory[offset:offset + length]
+
+    def stop_reply(self):
+        self.registers[1][7] = self.sp
+        self.registers[1][16] = self.pc
+        return b'T05thread:1;'
+
+    def answer(self, payload):
+        if payload == b'?':
+            return self.stop_reply()
+        if payload.startswith(b'Hg'):
+            self.thread = int(payload[2:], 16) or 1
+            return b'OK'
+        if payload == b'g':
+            return b''.join(value.to_bytes(8, 'little').hex().encode()
+                            for value in self.registers[self.thread])
+        if payload[:1] == b'p':
+            index = int(payload[1:], 16)
+            return self.registers[self.thread][index].to_bytes(8, 'little').hex().encode()
+        if payload[:1] == b'P':
+            (index, value) = payload[1:].split(b'=')
+            self.registers[self.thread][int(index, 16)] = int.from_bytes(bytes.fromhex(value.decode()), 'little')
+            return b'OK'
+        if payload[:1] == b'm':
+            (address, length) = (int(value, 16) for value in payload[1:].split(b','))
+            data = self.read(address, length)
+            return b'E03' if data is None else data.hex().encode()
+        if payload[:1] == b'M':
+            (address, length, data) = re.split(rb'[,:]', payload[1:])
+            (address, length) = (int(address, 16), int(length, 16))
+            if self.read(address, length) is None:
+                return b'E03'
+            offset = address - self.MEMORY_BASE
+            self.memory[offset:offset + length] = bytes.fromhex(data.decode())
+            return b'OK'
+        if payload[:1] in (b'Z', b'z'):
+            return b'OK'
+        if payload.startswith(b'qSupported'):
+            return b'PacketSize=1000;qXfer:features:read+;vContSupported+'
+        if payload.startswith(b'qXfer:features:read:'):
+            return b'l<target><architecture>i386:x86-64</architecture></target>'
+        if payload == b'qfThreadInfo':
+            return b'm1,2'
+        if payload == b'qsThreadInfo':
+            return b'l'
+        if payload.startswith(b'qRcmd,'):
+            self.send(b'O' + b'Monitor output\n\r'.hex().encode())
+            return b'OK'
+        if payload == b'vCont?':
+            return b'vCont;c;C;s;S'
+        if payload.startswith(b'vCont;'):
+            # Run to the next stop, logging on the way.
+            self.send(b'O' + b'Running\n'.hex().encode())
+            self.pc += 0x40 if payload.startswith(b'vCont;c') else 4
+            self.sp -= 0x20
+            return self.stop_reply()
+        return b''
+
+    def run(self):
+        reader = PacketReader()
+        while True:
+            try:
+                data = self.sock.recv(4096)
+            except OSError:
+                return
+            if not data:
+                return
+            self.bytes += len(data)
+            for (event, payload) in reader.feed(data):
+                if event == 'packet':
+                    self.packets += 1
+                    if self.drop_every and self.packets % self.drop_every == 0:
+                        self.sock.sendall(b'-')
+                        continue
+                    self.requests += 1
+                    self.sock.sendall(b'+')
+                    self.send(self.answer(payload))
+                elif event == 'interrupt':
+                    self.send(self.stop_reply())
+
+
+class GdbClient(object):
+    '''Minimal gdb side of the protocol, collecting the replies'''
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.reader = PacketReader()
+        self.events = []
+        self.last_request = b''
+
+    def next_packet(self):
+        while True:
+            while self.events:
+                (event, payload) = self.events.pop(0)
+                if event == 'packet':
+                    self.sock.sendall(b'+')
+                    return payload
+                if event == 'nak':
+                    self.sock.sendall(frame(self.last_request))
+            self.events += self.reader.feed(self.sock.recv(4096))
+
+    def request(self, payload):
+        self.last_request = payload
+        self.sock.sendall(frame(payload))
+        while True:
+            reply = self.next_packet()
+            if not is_console_output(reply):
+                return reply
+
+
+def session(client, stops):
+    '''Requests like the ones gdb sends while stepping through code, returning
+    the replies'''
+    replies = []
+
+    def ask(payload):
+        replies.append(client.request(payload))
+        return replies[-1]
+
+    ask(b'qSupported:multiprocess+;swbreak+;hwbreak+;qRelocInsn+')
+    ask(b'qXfer:features:read:target.xml:0,ffb')
+    for stop in range(stops):
+        ask(b'?')
+        ask(b'qfThreadInfo')
+        ask(b'qsThreadInfo')
+        ask(b'Hg1')
+        registers = ask(b'g')
+        sp = int.from_bytes(bytes.fromhex(registers[7 * 16:8 * 16].decode()), 'little')
+        pc = int.from_bytes(bytes.fromhex(registers[16 * 16:17 * 16].decode()), 'little')
+
+        # Unwinding reads the frames one word at a time, more than once.
+        for _ in range(3):
+            for frame_index in range(6):
+                ask(b'm%x,8' % (sp + frame_index * 0x10))
+                ask(b'm%x,8' % (sp + frame_index * 0x10 + 8))
+
+        # x/10i $pc and the source listing read the code in small pieces.
+        for offset in range(0, 0x40, 0x10):
+            ask(b'm%x,10' % (pc + offset))
+        for offset in range(0, 0x40, 0x10):
+            ask(b'm%x,10' % (pc + offset))
+        ask(b'm%x,1' % pc)
+
+        # Locals and a write through a pointer, then reading it back.
+        ask(b'p10')
+        ask(b'p7')
+        ask(b'm%x,20' % (sp + 0x100))
+        ask(b'M%x,4:%08x' % (sp + 0x104, stop))
+        ask(b'm%x,20' % (sp + 0x100))
+        ask(b'Hg2')
+        ask(b'g')
+        ask(b'Hg1')
+        ask(b'g')
+
+        # Memory views of the stack and code around what was already read.
+        # Each needs the blocks on both sides of the cached ones, several
+        # separate reads the proxy can pipeline.
+        ask(b'm%x,%x' % (sp - 0x300, 0x7f0))
+        ask(b'm%x,%x' % (pc - 0x380, 0x7f0))
+
+        # A read that fails.
+        ask(b'm%x,8' % (FakeTarget.MEMORY_BASE + FakeTarget.MEMORY_SIZE - 4))
+
+        if stop % 5 == 4:
+            ask(b'qRcmd,' + b'?'.hex().encode())
+        ask(b'Z0,%x,1' % (pc + 0x40))
+        ask(b'vCont;s:1' if stop % 2 else b'vCont;c')
+        ask(b'z0,%x,1' % (pc + 0x40))
+    return replies
+
+
+def link_time(requests, round_trips, data_bytes, baud, latency_ms):
+    '''Estimated time on the link, with 10 bits per byte on the wire'''
+    return round_trips * latency_ms / 1000 + data_bytes * 10 / baud
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark gdb_cache_proxy.py against a fake target.')
+    parser.add_argument('--stops', type=int, default=20, help='Number of stops in the session')
+    parser.add_argument('--baud', type=int, default=115200, help='Baud rate used to estimate the link time')
+    parser.add_argument('--latency-ms', type=float, default=5.0,
+                        help='Target turnaround per round trip used to estimate the link time')
+    parser.add_argument('--block', type=lambda value: int(value, 0), default=0x100,
+                        help='Size of the memory blocks read around a miss')
+    parser.add_argument('--pipeline', type=int, default=4, help='Requests sent before waiting for a reply')
+    parser.add_argument('--widen', choices=('code-stack', 'all', 'none'), default='code-stack',
+                        help='Memory read in blocks around a miss and cached')
+    parser.add_argument('--drop-every', type=int, default=0,
+                        help='Drop every Nth request at the fake targets, as if it was corrupted')
+    args = parser.parse_args()
+
+    # Directly against the target.
+    (gdb_end, target_end) = socket.socketpair()
+    direct_target = FakeTarget(target_end, args.drop_every)
+    direct = session(GdbClient(gdb_end), args.stops)
+
+    # Through the proxy.
+    (gdb_end, proxy_client_end) = socket.socketpair()
+    (proxy_target_end, target_end) = socket.socketpair()
+    proxy_target = FakeTarget(target_end, args.drop_every)
+    link = TargetLink(SocketDevice(proxy_target_end))
+    proxy = CachingProxy(link, args.block, args.pipeline, args.widen)
+    threading.Thread(target=proxy.serve, args=(proxy_client_end,), daemon=True).start()
+    proxied = session(GdbClient(gdb_end), args.stops)
+
+    mismatches = [index for index, (a, b) in enumerate(zip(direct, proxied)) if a != b]
+    if mismatches or len(direct) != len(proxied):
+        print(f'FAIL: {len(mismatches)} replies differ, first at request {mismatches[:1]}')
+        return 1
+
+    direct_time = link_time(direct_target.requests, direct_target.requests, direct_target.bytes,
+                            args.baud, args.latency_ms)
+    proxy_time = link_time(link.requests, link.round_trips, proxy_target.bytes,
+                           args.baud, args.latency_ms)
+    saved = direct_target.requests - link.round_trips
+    print(f'Session: {len(direct)} requests from gdb over {args.stops} stops, all replies match.')
+    print(f'Direct:  {direct_target.requests} round trips, {direct_target.bytes} bytes, '
+          f'{direct_time:.2f}s on the link')
+    print(f'Proxy:   {link.requests} requests in {link.round_trips} round trips, {proxy_target.bytes} bytes, '
+          f'{proxy_time:.2f}s on the link')
+    print(f'Saved:   {saved} round trips ({100 * saved / direct_target.requests:.0f}%), '
+          f'{proxy.hits} requests served from the cache')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())